@@ -1,5 +1,7 @@
 #include "onebox-common.h"
 #include "util-cli.h"
+#include "util-pool.h"
+#include "util-stats.h"
 
 // vim:sw=4 tw=120 et
 
@@ -95,6 +97,23 @@ int cmd_show_regular(struct cli_def *cli, UNUSED(const char *command), char *arg
     return CLI_OK;
 }
 
+static void cmd_print_line(void *ctx, const char *line)
+{
+    cli_print((struct cli_def *)ctx, "%s", line);
+}
+
+int cmd_show_pools(struct cli_def *cli, UNUSED(const char *command), UNUSED(char *argv[]), UNUSED(int argc))
+{
+    PoolRegistryPrint(cmd_print_line, cli);
+    return CLI_OK;
+}
+
+int cmd_show_counters(struct cli_def *cli, UNUSED(const char *command), UNUSED(char *argv[]), UNUSED(int argc))
+{
+    StatsPrint(cmd_print_line, cli);
+    return CLI_OK;
+}
+
 int cmd_debug_regular(struct cli_def *cli, UNUSED(const char *command), char *argv[], int argc)
 {
     debug_regular = !debug_regular;
@@ -181,8 +200,11 @@ int CliTest(void)
     cli_register_command(cli, c, "regular", cmd_show_regular, PRIVILEGE_UNPRIVILEGED, MODE_EXEC,
                          "Show the how many times cli_regular has run");
 
-    cli_register_command(cli, c, "counters", cmd_test, PRIVILEGE_UNPRIVILEGED, MODE_EXEC,
-                         "Show the counters that the system uses");
+    cli_register_command(cli, c, "counters", cmd_show_counters, PRIVILEGE_UNPRIVILEGED, MODE_EXEC,
+                         "Show the counters that the system uses, as of the last stats snapshot");
+
+    cli_register_command(cli, c, "pools", cmd_show_pools, PRIVILEGE_UNPRIVILEGED, MODE_EXEC,
+                         "Show the counters of the memory pools");
 
     cli_register_command(cli, c, "junk", cmd_test, PRIVILEGE_UNPRIVILEGED, MODE_EXEC, NULL);
 
@@ -0,0 +1,191 @@
+#include "onebox-common.h"
+#include "ds-deque.h"
+#include "util-debug.h"
+#include "util-error.h"
+#include "util-mem.h"
+#include "util-threads.h"
+#include "util-atomic.h"
+#include "util-unittest.h"
+
+#define WSDEQUE_SIZE_MAX    (1U << 30)
+
+/*********** funcs ***********/
+/**
+ *  \brief Create a work-stealing deque
+ *
+ *  \param size slots, rounded up to a power of two
+ *
+ *  \retval the deque or NULL on error
+ */
+WsDeque *WsDequeNew(uint32_t size)
+{
+	WsDeque *d;
+	uint32_t n = 2;
+
+	if (size == 0 || size > WSDEQUE_SIZE_MAX) {
+		OBLogError(OB_ERR_INVALID_ARGUMENT, "invalid deque size");
+		return NULL;
+	}
+	while (n < size)
+		n <<= 1;
+
+	d = OBCallocAligned(OB_CACHE_LINE_SIZE, 1, sizeof(WsDeque) + (size_t)n * sizeof(void *));
+	if (d == NULL)
+		return NULL;
+
+	d->size = n;
+	d->mask = n - 1;
+	return d;
+}
+
+void WsDequeFree(WsDeque *d)
+{
+	if (d != NULL)
+		OBFreeAligned(d);
+}
+
+/*********** unittests ***********/
+/**
+ * \test owner pops newest first, thieves steal oldest first, full and
+ *       empty deques, indexes wrapping
+ */
+static int WsDequeTest(void)
+{
+	WsDeque *d;
+	uintptr_t i, lap;
+	int result = 0;
+
+	if (WsDequeNew(0) != NULL)
+		return 0;
+	d = WsDequeNew(5);
+	if (d == NULL)
+		return 0;
+	if (d->size != 8 || WsDequePop(d) != NULL || WsDequeSteal(d) != NULL)
+		goto end;
+
+	/* start close to the wrap */
+	d->top = d->bottom = UINT32_MAX - 3;
+	for (lap = 0; lap < 3; lap++)
+	{
+		for (i = 1; i <= 8; i++) {
+			if (WsDequePush(d, (void *)i) != 0)
+				goto end;
+		}
+		if (WsDequePush(d, (void *)i) != -1 || WsDequeCount(d) != 8)
+			goto end;
+		if (WsDequeSteal(d) != (void *)1 || WsDequeSteal(d) != (void *)2)
+			goto end;
+		for (i = 8; i >= 3; i--) {
+			if (WsDequePop(d) != (void *)i)
+				goto end;
+		}
+		if (WsDequePop(d) != NULL || WsDequeSteal(d) != NULL || WsDequeCount(d) != 0)
+			goto end;
+	}
+	result = 1;
+end:
+	WsDequeFree(d);
+	return result;
+}
+
+#define WSDEQUE_STRESS_THIEVES  3
+#define WSDEQUE_STRESS_OBJS     (1 << 18)
+
+typedef struct WsDequeStress_ {
+    WsDeque *d;
+    uint64_t sum;               /**< of the values taken */
+    uint64_t n;
+    uint32_t *done;             /**< the owner pushed everything */
+} WsDequeStress;
+
+static void *WsDequeStressThief(void *arg)
+{
+	WsDequeStress *s = (WsDequeStress *)arg;
+	void *obj;
+	int last = 0;
+
+	for (;;)
+	{
+		obj = WsDequeSteal(s->d);
+		if (obj != NULL) {
+			s->sum += (uintptr_t)obj;
+			s->n++;
+			continue;
+		}
+		/* one more round once the owner is done */
+		if (last)
+			break;
+		last = OBAtomicLoadAcquire(s->done);
+		if (WsDequeCount(s->d) == 0)
+			sched_yield();
+	}
+	return NULL;
+}
+
+/**
+ * \test the owner pushes and pops while thieves steal, every object is
+ *       taken exactly once
+ */
+static int WsDequeTestStress(void)
+{
+	WsDequeStress owner, thieves[WSDEQUE_STRESS_THIEVES];
+	pthread_t tids[WSDEQUE_STRESS_THIEVES];
+	uint64_t sum, n, v = 1;
+	uint32_t done = 0;
+	int started = 0, i;
+	void *obj;
+	int result = 0;
+
+	memset(&owner, 0, sizeof(owner));
+	owner.d = WsDequeNew(64);
+	if (owner.d == NULL)
+		return 0;
+	owner.done = &done;
+
+	for (i = 0; i < WSDEQUE_STRESS_THIEVES; i++)
+	{
+		thieves[i] = owner;
+		if (pthread_create(&tids[i], NULL, WsDequeStressThief, &thieves[i]) != 0)
+			break;
+		started++;
+	}
+
+	/* push a few, pop one, the pops often race for the last object */
+	while (v <= WSDEQUE_STRESS_OBJS)
+	{
+		for (i = 0; i < 3 && v <= WSDEQUE_STRESS_OBJS; i++) {
+			if (WsDequePush(owner.d, (void *)(uintptr_t)v) != 0)
+				break;
+			v++;
+		}
+		if ((obj = WsDequePop(owner.d)) != NULL) {
+			owner.sum += (uintptr_t)obj;
+			owner.n++;
+		}
+	}
+	while ((obj = WsDequePop(owner.d)) != NULL) {
+		owner.sum += (uintptr_t)obj;
+		owner.n++;
+	}
+	OBAtomicStoreRelease(&done, 1);
+
+	sum = owner.sum;
+	n = owner.n;
+	for (i = 0; i < started; i++) {
+		pthread_join(tids[i], NULL);
+		sum += thieves[i].sum;
+		n += thieves[i].n;
+	}
+	if (started == WSDEQUE_STRESS_THIEVES && n == WSDEQUE_STRESS_OBJS &&
+		sum == (uint64_t)WSDEQUE_STRESS_OBJS * (WSDEQUE_STRESS_OBJS + 1) / 2)
+		result = 1;
+
+	WsDequeFree(owner.d);
+	return result;
+}
+
+void WsDequeRegisterTests(void)
+{
+	UtRegisterTest("WsDequeTest", WsDequeTest, 1);
+	UtRegisterTest("WsDequeTestStress", WsDequeTestStress, 1);
+}
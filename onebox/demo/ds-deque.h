@@ -0,0 +1,119 @@
+#ifndef __DS_DEQUE_H__
+#define __DS_DEQUE_H__
+
+#include "util-atomic.h"
+#include "util-mem.h"
+
+/* Chase-Lev work-stealing deque of pointers, bounded. The owner thread
+ * pushes and pops at bottom, like a stack, other threads steal the oldest
+ * objects at top. Only taking the last object, and stealing, race on top
+ * with a CAS. The size is a power of two and the indexes run free like in
+ * ds-ring.h. NULL can't be queued. */
+
+typedef struct WsDeque_ {
+    uint32_t size;
+    uint32_t mask;
+
+    uint32_t top OB_CACHE_ALIGNED;      /**< thieves: next object to steal */
+    uint32_t bottom OB_CACHE_ALIGNED;   /**< owner: next slot to push to */
+
+    void *slots[] OB_CACHE_ALIGNED;
+} WsDeque;
+
+WsDeque *WsDequeNew(uint32_t size);
+void WsDequeFree(WsDeque *);
+
+void WsDequeRegisterTests(void);
+
+/**
+ *  \brief Objects in the deque, a hint when called from a thief
+ */
+static inline uint32_t WsDequeCount(WsDeque *d)
+{
+    int32_t n = (int32_t)(OBAtomicLoadRelaxed(&d->bottom) - OBAtomicLoadRelaxed(&d->top));
+
+    /* negative while the owner pops from an empty deque */
+    return n > 0 ? (uint32_t)n : 0;
+}
+
+/**
+ *  \brief Push an object, owner only
+ *
+ *  \retval 0 on success, -1 if the deque is full
+ */
+static inline int WsDequePush(WsDeque *d, void *obj)
+{
+    uint32_t b = OBAtomicLoadRelaxed(&d->bottom);
+    uint32_t t = OBAtomicLoadAcquire(&d->top);
+
+    if (b - t >= d->size)
+        return -1;
+
+    /* atomic, a thief that lost the race for the previous lap's object
+     * may still be reading the slot */
+    OBAtomicStoreRelaxed(&d->slots[b & d->mask], obj);
+    /* release: thieves that see the new bottom see the object */
+    OBAtomicStoreRelease(&d->bottom, b + 1);
+    return 0;
+}
+
+/**
+ *  \brief Pop the newest object, owner only
+ *
+ *  \retval the object or NULL if the deque is empty, or a thief got the
+ *          last object first
+ */
+static inline void *WsDequePop(WsDeque *d)
+{
+    uint32_t b = OBAtomicLoadRelaxed(&d->bottom) - 1;
+    uint32_t t;
+    void *obj;
+
+    OBAtomicStoreRelaxed(&d->bottom, b);
+    /* the claim on slot b is seen before top is read, a thief does the
+     * opposite so one of us sees the other */
+    hw_barrier();
+    t = OBAtomicLoadRelaxed(&d->top);
+
+    if ((int32_t)(b - t) < 0) {
+        OBAtomicStoreRelaxed(&d->bottom, b + 1);
+        return NULL;
+    }
+
+    obj = OBAtomicLoadRelaxed(&d->slots[b & d->mask]);
+    if (b == t) {
+        /* the last one, thieves may be after it too */
+        if (!OBAtomicCompareAndSwap(&d->top, t, t + 1))
+            obj = NULL;
+        OBAtomicStoreRelaxed(&d->bottom, b + 1);
+    }
+    return obj;
+}
+
+/**
+ *  \brief Steal the oldest object, any thread
+ *
+ *  \retval the object or NULL if the deque is empty, or another thread
+ *          took it first
+ */
+static inline void *WsDequeSteal(WsDeque *d)
+{
+    uint32_t t, b;
+    void *obj;
+
+    t = OBAtomicLoadAcquire(&d->top);
+    hw_barrier();
+    /* acquire: pairs with the release of the push */
+    b = OBAtomicLoadAcquire(&d->bottom);
+
+    if ((int32_t)(b - t) <= 0)
+        return NULL;
+
+    obj = OBAtomicLoadRelaxed(&d->slots[t & d->mask]);
+    /* the slot can't be pushed over again before top moves on */
+    if (!OBAtomicCompareAndSwap(&d->top, t, t + 1))
+        return NULL;
+    return obj;
+}
+
+#endif
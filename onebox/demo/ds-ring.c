@@ -0,0 +1,516 @@
+#include "onebox-common.h"
+#include "ds-ring.h"
+#include "ds-queue.h"
+#include "util-debug.h"
+#include "util-error.h"
+#include "util-mem.h"
+#include "util-threads.h"
+#include "util-atomic.h"
+#include "util-cpu.h"
+#include "util-unittest.h"
+
+#define RING_SIZE_MAX       (1U << 31)
+
+/*********** funcs ***********/
+/**
+ *  \brief Round size up to a power of two
+ *
+ *  \retval the size, 0 if it is 0 or bigger than RING_SIZE_MAX
+ */
+static uint32_t RingSize(uint32_t size)
+{
+	uint32_t n = 2;
+
+	if (size == 0 || size > RING_SIZE_MAX)
+		return 0;
+	while (n < size)
+		n <<= 1;
+	return n;
+}
+
+/**
+ *  \brief Create a single producer, single consumer ring
+ *
+ *  \param size slots, rounded up to a power of two
+ *
+ *  \retval the ring or NULL on error
+ */
+RingSPSC *RingSPSCNew(uint32_t size)
+{
+	RingSPSC *r;
+
+	if ((size = RingSize(size)) == 0) {
+		OBLogError(OB_ERR_INVALID_ARGUMENT, "invalid ring size");
+		return NULL;
+	}
+
+	r = OBCallocAligned(OB_CACHE_LINE_SIZE, 1, sizeof(RingSPSC) + (size_t)size * sizeof(void *));
+	if (r == NULL)
+		return NULL;
+
+	r->size = size;
+	r->mask = size - 1;
+	return r;
+}
+
+void RingSPSCFree(RingSPSC *r)
+{
+	if (r != NULL)
+		OBFreeAligned(r);
+}
+
+/**
+ *  \brief Create a multi producer, multi consumer ring
+ *
+ *  \param size cells, rounded up to a power of two
+ *
+ *  \retval the ring or NULL on error
+ */
+RingMPMC *RingMPMCNew(uint32_t size)
+{
+	RingMPMC *r;
+	uint32_t i;
+
+	if ((size = RingSize(size)) == 0) {
+		OBLogError(OB_ERR_INVALID_ARGUMENT, "invalid ring size");
+		return NULL;
+	}
+
+	r = OBCallocAligned(OB_CACHE_LINE_SIZE, 1, sizeof(RingMPMC) + (size_t)size * sizeof(RingCell));
+	if (r == NULL)
+		return NULL;
+
+	r->size = size;
+	r->mask = size - 1;
+	/* every cell free for the first lap */
+	for (i = 0; i < size; i++) {
+		r->cells[i].seq = i;
+	}
+	return r;
+}
+
+void RingMPMCFree(RingMPMC *r)
+{
+	if (r != NULL)
+		OBFreeAligned(r);
+}
+
+/*********** unittests ***********/
+
+static int RingTestSPSC(void)
+{
+	void *objs[8], *out[8];
+	RingSPSC *r = NULL;
+	uintptr_t i, lap;
+	int result = 0;
+
+	if (RingSPSCNew(0) != NULL)
+		goto end;
+	r = RingSPSCNew(5);
+	if (r == NULL || r->size != 8)
+		goto end;
+	if (RingSPSCDequeue(r) != NULL || RingSPSCCount(r) != 0)
+		goto end;
+
+	/* fill, overfill and drain a few times around the ring */
+	for (lap = 0; lap < 5; lap++)
+	{
+		for (i = 0; i < 8; i++) {
+			if (RingSPSCEnqueue(r, (void *)(lap * 100 + i + 1)) != 0)
+				goto end;
+		}
+		if (RingSPSCEnqueue(r, (void *)1) != -1 || RingSPSCCount(r) != 8)
+			goto end;
+		for (i = 0; i < 8; i++) {
+			if (RingSPSCDequeue(r) != (void *)(lap * 100 + i + 1))
+				goto end;
+		}
+		if (RingSPSCDequeue(r) != NULL)
+			goto end;
+		/* move off the slot boundary */
+		if (RingSPSCEnqueue(r, (void *)1) != 0 || RingSPSCDequeue(r) != (void *)1)
+			goto end;
+	}
+
+	/* bulk calls take what fits */
+	for (i = 0; i < 8; i++) {
+		objs[i] = (void *)(i + 1);
+	}
+	if (RingSPSCEnqueueBulk(r, objs, 5) != 5 || RingSPSCEnqueueBulk(r, objs, 5) != 3)
+		goto end;
+	if (RingSPSCDequeueBulk(r, out, 4) != 4 || RingSPSCDequeueBulk(r, out + 4, 8) != 4)
+		goto end;
+	for (i = 0; i < 8; i++) {
+		if (out[i] != objs[i < 5 ? i : i - 5])
+			goto end;
+	}
+	if (RingSPSCDequeueBulk(r, out, 8) != 0)
+		goto end;
+
+	result = 1;
+end:
+	RingSPSCFree(r);
+	return result;
+}
+
+static int RingTestMPMC(void)
+{
+	void *objs[8], *out[8];
+	RingMPMC *r = NULL;
+	uintptr_t i, lap;
+	int result = 0;
+
+	r = RingMPMCNew(8);
+	if (r == NULL || r->size != 8)
+		goto end;
+	if (RingMPMCDequeue(r) != NULL)
+		goto end;
+
+	for (lap = 0; lap < 5; lap++)
+	{
+		for (i = 0; i < 8; i++) {
+			if (RingMPMCEnqueue(r, (void *)(lap * 100 + i + 1)) != 0)
+				goto end;
+		}
+		if (RingMPMCEnqueue(r, (void *)1) != -1)
+			goto end;
+		for (i = 0; i < 8; i++) {
+			if (RingMPMCDequeue(r) != (void *)(lap * 100 + i + 1))
+				goto end;
+		}
+		if (RingMPMCDequeue(r) != NULL)
+			goto end;
+		if (RingMPMCEnqueue(r, (void *)1) != 0 || RingMPMCDequeue(r) != (void *)1)
+			goto end;
+	}
+
+	/* bulk and single calls mixed */
+	for (i = 0; i < 8; i++) {
+		objs[i] = (void *)(i + 1);
+	}
+	if (RingMPMCEnqueueBulk(r, objs, 5) != 5 || RingMPMCEnqueue(r, objs[5]) != 0)
+		goto end;
+	if (RingMPMCEnqueueBulk(r, objs + 6, 5) != 2 || RingMPMCEnqueue(r, objs[0]) != -1)
+		goto end;
+	if (RingMPMCDequeue(r) != objs[0] || RingMPMCDequeueBulk(r, out, 8) != 7)
+		goto end;
+	for (i = 0; i < 7; i++) {
+		if (out[i] != objs[i + 1])
+			goto end;
+	}
+	if (RingMPMCDequeueBulk(r, out, 8) != 0)
+		goto end;
+
+	result = 1;
+end:
+	RingMPMCFree(r);
+	return result;
+}
+
+#define RING_STRESS_THREADS     4       /**< producers, as many consumers */
+#define RING_STRESS_OBJS        (1 << 18)   /**< per producer */
+#define RING_STRESS_BURST       16
+
+typedef struct RingStress_ {
+    RingMPMC *r;
+    uint32_t id;
+    uint32_t burst;             /**< 1: single calls, else bulk up to burst */
+    uint64_t sum;               /**< consumers: of the values taken */
+    uint64_t n;
+    uint64_t *done;             /**< producers finished */
+} RingStress;
+
+static void *RingStressProducer(void *arg)
+{
+	RingStress *s = (RingStress *)arg;
+	void *objs[RING_STRESS_BURST];
+	uintptr_t v = 0;
+	uint32_t n, i, done;
+
+	while (v < RING_STRESS_OBJS)
+	{
+		n = (uint32_t)(v % s->burst) + 1;
+		if (n > RING_STRESS_OBJS - v)
+			n = RING_STRESS_OBJS - v;
+		/* values are id << 32 | seq, 1 based so none is NULL */
+		for (i = 0; i < n; i++) {
+			objs[i] = (void *)(((uintptr_t)s->id << 32) | (v + i + 1));
+		}
+		done = 0;
+		while (done < n) {
+			if (n == 1)
+				done = RingMPMCEnqueue(s->r, objs[0]) == 0;
+			else
+				done += RingMPMCEnqueueBulk(s->r, objs + done, n - done);
+			if (done < n)
+				sched_yield();
+		}
+		v += n;
+	}
+	OBAtomicAddAndFetch(s->done, 1);
+	return NULL;
+}
+
+static void *RingStressConsumer(void *arg)
+{
+	RingStress *s = (RingStress *)arg;
+	void *objs[RING_STRESS_BURST];
+	uint32_t n, i;
+	int last = 0;
+
+	for (;;)
+	{
+		if (s->burst == 1) {
+			objs[0] = RingMPMCDequeue(s->r);
+			n = objs[0] != NULL;
+		} else {
+			n = RingMPMCDequeueBulk(s->r, objs, s->burst);
+		}
+		for (i = 0; i < n; i++) {
+			s->sum += (uintptr_t)objs[i];
+			s->n++;
+		}
+		if (n == 0) {
+			/* one more round once all producers are done */
+			if (last)
+				break;
+			last = OBAtomicLoadAcquire(s->done) == RING_STRESS_THREADS;
+			sched_yield();
+		}
+	}
+	return NULL;
+}
+
+/**
+ * \test producers and consumers, single and bulk, every object taken once
+ */
+static int RingTestMPMCStress(void)
+{
+	RingStress prod[RING_STRESS_THREADS], cons[RING_STRESS_THREADS];
+	pthread_t ptids[RING_STRESS_THREADS], ctids[RING_STRESS_THREADS];
+	uint64_t done = 0, sum = 0, n = 0, want = 0;
+	int nprod = 0, ncons = 0, i;
+	RingMPMC *r;
+	int result = 0;
+
+	r = RingMPMCNew(64);
+	if (r == NULL)
+		return 0;
+
+	for (i = 0; i < RING_STRESS_THREADS; i++)
+	{
+		memset(&cons[i], 0, sizeof(RingStress));
+		cons[i].r = r;
+		cons[i].burst = (i & 1) ? RING_STRESS_BURST : 1;
+		cons[i].done = &done;
+		if (pthread_create(&ctids[i], NULL, RingStressConsumer, &cons[i]) != 0)
+			goto end;
+		ncons++;
+	}
+	for (i = 0; i < RING_STRESS_THREADS; i++)
+	{
+		memset(&prod[i], 0, sizeof(RingStress));
+		prod[i].r = r;
+		prod[i].id = i;
+		prod[i].burst = (i & 1) ? 1 : RING_STRESS_BURST;
+		prod[i].done = &done;
+		if (pthread_create(&ptids[i], NULL, RingStressProducer, &prod[i]) != 0)
+			goto end;
+		nprod++;
+	}
+	result = 1;
+
+end:
+	for (i = 0; i < nprod; i++) {
+		pthread_join(ptids[i], NULL);
+	}
+	/* let the consumers stop if not all producers got started */
+	OBAtomicStoreRelease(&done, RING_STRESS_THREADS);
+	for (i = 0; i < ncons; i++) {
+		pthread_join(ctids[i], NULL);
+		sum += cons[i].sum;
+		n += cons[i].n;
+	}
+	RingMPMCFree(r);
+
+	for (i = 0; i < nprod; i++) {
+		want += ((uint64_t)i << 32) * RING_STRESS_OBJS +
+			(uint64_t)RING_STRESS_OBJS * (RING_STRESS_OBJS + 1) / 2;
+	}
+	if (n != (uint64_t)nprod * RING_STRESS_OBJS || sum != want)
+		result = 0;
+	return result;
+}
+
+#define RING_BENCH_OBJS     (1 << 22)
+#define RING_BENCH_SIZE     1024
+
+typedef struct RingBenchMutexElt_ {
+    void *obj;
+    TAILQ_ENTRY(RingBenchMutexElt_) next;
+} RingBenchMutexElt;
+
+/* what threads share objects with today: a list under a mutex */
+typedef struct RingBenchMutexQueue_ {
+    OBMutex lock;
+    TAILQ_HEAD(, RingBenchMutexElt_) list;
+    RingBenchMutexElt *elts;
+    TAILQ_HEAD(, RingBenchMutexElt_) spare;
+} RingBenchMutexQueue;
+
+typedef struct RingBench_ {
+    int type;                   /**< 0 spsc, 1 mpmc, 2 mutex */
+    uint32_t burst;
+    RingSPSC *spsc;
+    RingMPMC *mpmc;
+    RingBenchMutexQueue *mq;
+} RingBench;
+
+static uint32_t RingBenchPut(RingBench *b, void **objs, uint32_t n)
+{
+	RingBenchMutexElt *e;
+	uint32_t i;
+
+	switch (b->type) {
+		case 0:
+			return RingSPSCEnqueueBulk(b->spsc, objs, n);
+		case 1:
+			if (n == 1)
+				return RingMPMCEnqueue(b->mpmc, objs[0]) == 0;
+			return RingMPMCEnqueueBulk(b->mpmc, objs, n);
+		default:
+			OBMutexLock(&b->mq->lock);
+			for (i = 0; i < n && (e = TAILQ_FIRST(&b->mq->spare)) != NULL; i++) {
+				TAILQ_REMOVE(&b->mq->spare, e, next);
+				e->obj = objs[i];
+				TAILQ_INSERT_TAIL(&b->mq->list, e, next);
+			}
+			OBMutexUnlock(&b->mq->lock);
+			return i;
+	}
+}
+
+static uint32_t RingBenchGet(RingBench *b, void **objs, uint32_t n)
+{
+	RingBenchMutexElt *e;
+	uint32_t i;
+
+	switch (b->type) {
+		case 0:
+			return RingSPSCDequeueBulk(b->spsc, objs, n);
+		case 1:
+			if (n == 1)
+				return (objs[0] = RingMPMCDequeue(b->mpmc)) != NULL;
+			return RingMPMCDequeueBulk(b->mpmc, objs, n);
+		default:
+			OBMutexLock(&b->mq->lock);
+			for (i = 0; i < n && (e = TAILQ_FIRST(&b->mq->list)) != NULL; i++) {
+				TAILQ_REMOVE(&b->mq->list, e, next);
+				objs[i] = e->obj;
+				TAILQ_INSERT_TAIL(&b->mq->spare, e, next);
+			}
+			OBMutexUnlock(&b->mq->lock);
+			return i;
+	}
+}
+
+static void *RingBenchProducer(void *arg)
+{
+	RingBench *b = (RingBench *)arg;
+	void *objs[RING_STRESS_BURST];
+	uintptr_t v = 0;
+	uint32_t i, n;
+
+	for (i = 0; i < b->burst; i++) {
+		objs[i] = (void *)(uintptr_t)(i + 1);
+	}
+	while (v < RING_BENCH_OBJS) {
+		n = RingBenchPut(b, objs, b->burst);
+		if (n == 0)
+			sched_yield();
+		v += n;
+	}
+	return NULL;
+}
+
+/**
+ *  \retval ns per object from one producer thread to one consumer thread
+ */
+static double RingBenchRun(RingBench *b)
+{
+	void *objs[RING_STRESS_BURST];
+	struct timespec t0, t1;
+	uint64_t v = 0;
+	pthread_t tid;
+	uint32_t n;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (pthread_create(&tid, NULL, RingBenchProducer, b) != 0)
+		return 0;
+	while (v < RING_BENCH_OBJS) {
+		n = RingBenchGet(b, objs, b->burst);
+		if (n == 0)
+			sched_yield();
+		v += n;
+	}
+	pthread_join(tid, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	return ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / RING_BENCH_OBJS;
+}
+
+/**
+ * \brief One producer, one consumer: SPSC and MPMC rings against a mutex
+ *        protected TAILQ, single objects and bursts
+ */
+static int RingBenchThroughput(void)
+{
+	static const char *names[] = { "spsc", "mpmc", "mutex" };
+	static const uint32_t bursts[] = { 1, RING_STRESS_BURST };
+	RingBenchMutexQueue mq;
+	RingBench b;
+	int type, i, result = 0;
+
+	memset(&b, 0, sizeof(b));
+	memset(&mq, 0, sizeof(mq));
+	OBMutexInit(&mq.lock, NULL);
+	TAILQ_INIT(&mq.list);
+	TAILQ_INIT(&mq.spare);
+	b.mq = &mq;
+
+	b.spsc = RingSPSCNew(RING_BENCH_SIZE);
+	b.mpmc = RingMPMCNew(RING_BENCH_SIZE);
+	mq.elts = OBCalloc(RING_BENCH_SIZE, sizeof(RingBenchMutexElt));
+	if (b.spsc == NULL || b.mpmc == NULL || mq.elts == NULL)
+		goto end;
+	for (i = 0; i < RING_BENCH_SIZE; i++) {
+		TAILQ_INSERT_TAIL(&mq.spare, &mq.elts[i], next);
+	}
+
+	printf("\n");
+	for (i = 0; i < 2; i++)
+	{
+		printf("    burst %2u:", bursts[i]);
+		for (type = 0; type < 3; type++) {
+			b.type = type;
+			b.burst = bursts[i];
+			printf(" %s %6.1f ns/obj%s", names[type], RingBenchRun(&b), type < 2 ? "," : "\n");
+		}
+	}
+	result = 1;
+end:
+	RingSPSCFree(b.spsc);
+	RingMPMCFree(b.mpmc);
+	if (mq.elts != NULL)
+		OBFree(mq.elts);
+	OBMutexDestroy(&mq.lock);
+	return result;
+}
+
+void RingRegisterTests(void)
+{
+	UtRegisterTest("RingTestSPSC", RingTestSPSC, 1);
+	UtRegisterTest("RingTestMPMC", RingTestMPMC, 1);
+	UtRegisterTest("RingTestMPMCStress", RingTestMPMCStress, 1);
+	UtRegisterTest("RingBenchThroughput", RingBenchThroughput, 1);
+}
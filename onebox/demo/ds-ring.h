@@ -0,0 +1,263 @@
+#ifndef __DS_RING_H__
+#define __DS_RING_H__
+
+#include "util-atomic.h"
+#include "util-mem.h"
+
+/* Bounded rings of pointers for passing objects between threads without a
+ * lock. The size is a power of two and head/tail run free, wrapping at
+ * 2^32, slots are indexed with tail & mask. Producer and consumer state
+ * are on cache lines of their own. NULL can't be queued.
+ *
+ * RingSPSC: one producer thread and one consumer thread. Each side keeps
+ * a copy of the other's index and only rereads it when the copy says the
+ * ring is full (or empty).
+ *
+ * RingMPMC: any number of producers and consumers, Vyukov's bounded queue:
+ * every cell carries a sequence number telling whether it is free for the
+ * lap of the producer at tail or filled for the consumer at head, a CAS on
+ * tail or head claims it. */
+
+typedef struct RingSPSC_ {
+    uint32_t size;
+    uint32_t mask;
+
+    uint32_t tail OB_CACHE_ALIGNED;     /**< producer: next slot to fill */
+    uint32_t head_cache;                /**< producer's copy of head */
+
+    uint32_t head OB_CACHE_ALIGNED;     /**< consumer: next slot to take */
+    uint32_t tail_cache;                /**< consumer's copy of tail */
+
+    void *slots[] OB_CACHE_ALIGNED;
+} RingSPSC;
+
+typedef struct RingCell_ {
+    uint32_t seq;               /**< pos: free for the producer at pos,
+                                 *   pos + 1: filled for the consumer at pos */
+    void *data;
+} RingCell;
+
+typedef struct RingMPMC_ {
+    uint32_t size;
+    uint32_t mask;
+
+    uint32_t tail OB_CACHE_ALIGNED;     /**< next cell producers claim */
+    uint32_t head OB_CACHE_ALIGNED;     /**< next cell consumers claim */
+
+    RingCell cells[] OB_CACHE_ALIGNED;
+} RingMPMC;
+
+RingSPSC *RingSPSCNew(uint32_t size);
+void RingSPSCFree(RingSPSC *);
+RingMPMC *RingMPMCNew(uint32_t size);
+void RingMPMCFree(RingMPMC *);
+
+void RingRegisterTests(void);
+
+/**
+ *  \brief Objects in a ring, exact only when called from the producer or
+ *         the consumer with the other side idle
+ */
+static inline uint32_t RingSPSCCount(RingSPSC *r)
+{
+    return OBAtomicLoadRelaxed(&r->tail) - OBAtomicLoadRelaxed(&r->head);
+}
+
+/**
+ *  \brief Enqueue up to n objects, producer only
+ *
+ *  \retval number of objects enqueued, from the start of objs
+ */
+static inline uint32_t RingSPSCEnqueueBulk(RingSPSC *r, void **objs, uint32_t n)
+{
+    uint32_t tail = r->tail;
+    uint32_t room = r->size - (tail - r->head_cache);
+    uint32_t i;
+
+    if (room < n) {
+        /* the consumer is done with the slots up to head */
+        r->head_cache = OBAtomicLoadAcquire(&r->head);
+        room = r->size - (tail - r->head_cache);
+        if (room < n)
+            n = room;
+    }
+
+    for (i = 0; i < n; i++) {
+        r->slots[(tail + i) & r->mask] = objs[i];
+    }
+    OBAtomicStoreRelease(&r->tail, tail + n);
+    return n;
+}
+
+/**
+ *  \brief Dequeue up to n objects, consumer only
+ *
+ *  \retval number of objects stored in objs
+ */
+static inline uint32_t RingSPSCDequeueBulk(RingSPSC *r, void **objs, uint32_t n)
+{
+    uint32_t head = r->head;
+    uint32_t avail = r->tail_cache - head;
+    uint32_t i;
+
+    if (avail < n) {
+        r->tail_cache = OBAtomicLoadAcquire(&r->tail);
+        avail = r->tail_cache - head;
+        if (avail < n)
+            n = avail;
+    }
+
+    for (i = 0; i < n; i++) {
+        objs[i] = r->slots[(head + i) & r->mask];
+    }
+    /* the slots are read before the producer may reuse them */
+    OBAtomicStoreRelease(&r->head, head + n);
+    return n;
+}
+
+/**
+ *  \retval 0 on success, -1 if the ring is full
+ */
+static inline int RingSPSCEnqueue(RingSPSC *r, void *obj)
+{
+    return RingSPSCEnqueueBulk(r, &obj, 1) ? 0 : -1;
+}
+
+/**
+ *  \retval the object or NULL if the ring is empty
+ */
+static inline void *RingSPSCDequeue(RingSPSC *r)
+{
+    void *obj = NULL;
+
+    return RingSPSCDequeueBulk(r, &obj, 1) ? obj : NULL;
+}
+
+/**
+ *  \retval 0 on success, -1 if the ring is full
+ */
+static inline int RingMPMCEnqueue(RingMPMC *r, void *obj)
+{
+    uint32_t pos = OBAtomicLoadRelaxed(&r->tail);
+    RingCell *cell;
+    int32_t diff;
+
+    for (;;) {
+        cell = &r->cells[pos & r->mask];
+        /* acquire: the consumer of the last lap is done with data */
+        diff = (int32_t)(OBAtomicLoadAcquire(&cell->seq) - pos);
+        if (diff == 0) {
+            if (OBAtomicCompareAndSwap(&r->tail, pos, pos + 1))
+                break;
+        } else if (diff < 0) {
+            /* the cell still holds an object of the previous lap */
+            return -1;
+        }
+        pos = OBAtomicLoadRelaxed(&r->tail);
+    }
+
+    cell->data = obj;
+    OBAtomicStoreRelease(&cell->seq, pos + 1);
+    return 0;
+}
+
+/**
+ *  \retval the object or NULL if the ring is empty
+ */
+static inline void *RingMPMCDequeue(RingMPMC *r)
+{
+    uint32_t pos = OBAtomicLoadRelaxed(&r->head);
+    RingCell *cell;
+    int32_t diff;
+    void *obj;
+
+    for (;;) {
+        cell = &r->cells[pos & r->mask];
+        /* acquire: data is written */
+        diff = (int32_t)(OBAtomicLoadAcquire(&cell->seq) - (pos + 1));
+        if (diff == 0) {
+            if (OBAtomicCompareAndSwap(&r->head, pos, pos + 1))
+                break;
+        } else if (diff < 0) {
+            return NULL;
+        }
+        pos = OBAtomicLoadRelaxed(&r->head);
+    }
+
+    obj = cell->data;
+    OBAtomicStoreRelease(&cell->seq, pos + r->mask + 1);
+    return obj;
+}
+
+/**
+ *  \brief Enqueue up to n objects with a single CAS on tail
+ *
+ *  The cells are claimed while the consumers that took them last lap may
+ *  still be reading them, each is waited for before it is written. That
+ *  wait is on a consumer between its CAS and its seq store.
+ *
+ *  \retval number of objects enqueued, from the start of objs
+ */
+static inline uint32_t RingMPMCEnqueueBulk(RingMPMC *r, void **objs, uint32_t n)
+{
+    uint32_t pos, head, i;
+    RingCell *cell;
+
+    for (;;) {
+        /* head is read after tail, so it is not behind it */
+        pos = OBAtomicLoadAcquire(&r->tail);
+        head = OBAtomicLoadRelaxed(&r->head);
+        /* else tail moved on since we read it */
+        if ((int32_t)(pos - head) >= 0) {
+            if (n > r->size - (pos - head))
+                n = r->size - (pos - head);
+            if (n == 0)
+                return 0;
+            if (OBAtomicCompareAndSwap(&r->tail, pos, pos + n))
+                break;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        cell = &r->cells[(pos + i) & r->mask];
+        while (OBAtomicLoadAcquire(&cell->seq) != pos + i)
+            ob_cpu_pause();
+        cell->data = objs[i];
+        OBAtomicStoreRelease(&cell->seq, pos + i + 1);
+    }
+    return n;
+}
+
+/**
+ *  \brief Dequeue up to n objects with a single CAS on head, the claimed
+ *         cells producers are still writing are waited for
+ *
+ *  \retval number of objects stored in objs
+ */
+static inline uint32_t RingMPMCDequeueBulk(RingMPMC *r, void **objs, uint32_t n)
+{
+    uint32_t pos, tail, i;
+    RingCell *cell;
+
+    for (;;) {
+        pos = OBAtomicLoadAcquire(&r->head);
+        tail = OBAtomicLoadRelaxed(&r->tail);
+        if (n > tail - pos)
+            n = tail - pos;
+        if (n == 0)
+            return 0;
+        if (OBAtomicCompareAndSwap(&r->head, pos, pos + n))
+            break;
+    }
+
+    for (i = 0; i < n; i++) {
+        cell = &r->cells[(pos + i) & r->mask];
+        while (OBAtomicLoadAcquire(&cell->seq) != pos + i + 1)
+            ob_cpu_pause();
+        objs[i] = cell->data;
+        OBAtomicStoreRelease(&cell->seq, pos + i + r->mask + 1);
+    }
+    return n;
+}
+
+#endif
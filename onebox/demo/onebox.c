@@ -10,6 +10,19 @@
 #include "util-threads.h"
 #include "test-config.h"
 #include "util-pool.h"
+#include "util-mem.h"
+#include "util-hugepage.h"
+#include "util-slab.h"
+#include "ds-ring.h"
+#include "ds-deque.h"
+#include "tm-threads.h"
+#include "tm-modules.h"
+#include "util-affinity.h"
+#include "util-sched.h"
+#include "util-stats.h"
+#include "util-rcu.h"
+#include "util-reclaim.h"
+#include "util-unittest.h"
 #include "cli/util-cli.h"
 #include "cli/cli.h"
 
@@ -29,6 +42,7 @@ static void OBInstanceInit(OBInstance *onebox)
 	onebox->pid_filename = NULL;
 	onebox->daemon = 0;
 	onebox->unittest = 0;
+	onebox->unittest_faults = 0;
 }
 
 void EngineStop(void)
@@ -57,6 +71,7 @@ static void PrintUsgae(const char *progname)
 	printf("USAGE: %s [OPTIONS]\n\n", progname);
 	printf("\t-c <path>                            : path to configuration file\n");
 	printf("\t-T                                   : unittest\n");
+	printf("\t--unittest-faults                    : unittest, then again with allocations failing\n");
 	printf("\t-D                                   : run in daemonizae\n");
 	printf("\t-i <dev or ip>                       : run in pcap live mode\n");
 	printf("\t-r <path>                            : run in pcap file/offline mode\n");
@@ -74,6 +89,7 @@ static void ParseCommandLine(int argc, char** argv, OBInstance *onebox)
         {"dump-config", 0, &dump_config, 1},
         {"pcap", optional_argument, 0, 0},
         {"pidfile", required_argument, 0, 0},
+        {"unittest-faults", 0, 0, 0},
         {NULL, 0, NULL, 0}
 	};
 
@@ -91,6 +107,10 @@ static void ParseCommandLine(int argc, char** argv, OBInstance *onebox)
 				onebox->pid_filename = optarg;
 			}
 		    }
+		    else if (strcmp((long_opts[option_index]).name , "unittest-faults") == 0){
+			onebox->unittest = 1;
+			onebox->unittest_faults = 1;
+		    }
                 break;
 
 		//short options
@@ -131,6 +151,40 @@ void RegisterAllModules(void)
 
 }
 
+static void RegisterAllTests(void)
+{
+	PoolRegisterTests();
+	OBMemRegisterTests();
+	HugePageRegisterTests();
+	OBSlabRegisterTests();
+	RingRegisterTests();
+	TmThreadsRegisterTests();
+	TmModuleRegisterTests();
+	AffinityRegisterTests();
+	OBAtomicRegisterTests();
+	UtilThreadsRegisterTests();
+	WsDequeRegisterTests();
+	OBSchedRegisterTests();
+	StatsRegisterTests();
+	OBRcuRegisterTests();
+	OBReclaimRegisterTests();
+	ConfYamlRegisterTests();
+}
+
+static int RunUnittests(OBInstance *onebox)
+{
+	int failed;
+
+	UtInitialize();
+	RegisterAllTests();
+	failed = UtRunTests();
+	if (onebox->unittest_faults)
+		failed += UtRunTestsFaults(UT_FAULT_EVERY_MAX, UT_FAULT_SEEDS) != 0;
+	UtCleanup();
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
 OBError LoadConfig(char *conf_filename) 
 {
     if (conf_filename == NULL) return(OB_OK);
@@ -155,13 +209,14 @@ int main(int argc, char **argv)
 	OBInstanceInit(&onebox);
 
 	/*********config init ***********/
-	ConfInit();
+	if (ConfInit() != 0)
+		exit(EXIT_FAILURE);
 
 	/**********parse command line*****/
 	ParseCommandLine(argc, argv, &onebox);
 
 	/***********unit test ************/
-	//if(onebox.unittest == 1) return RunUnittests(0, onebox.regex_arg);
+	if(onebox.unittest == 1) return RunUnittests(&onebox);
 
 	/*********** global vars init******/
 	GlobalInits();
@@ -173,11 +228,24 @@ int main(int argc, char **argv)
 	if (LoadConfig(conf_filename) != OB_OK) {
 		exit(EXIT_FAILURE);
 	}
+	if (AffinitySetupLoadFromConfig() != 0) {
+		exit(EXIT_FAILURE);
+	}
+	if (StatsSetupFromConfig() != 0) {
+		exit(EXIT_FAILURE);
+	}
 
 	ReadConfigTest();
 	OBAtomicTest();
 	UtilThreadTest();
+
+	if (StatsSpawnThreads() != 0 || TmThreadWaitOnThreadInit() != 0) {
+		exit(EXIT_FAILURE);
+	}
+	TmThreadContinueThreads();
+
 	CliTest();
+	TmThreadsShutdown(ONEBOX_STOP);
 
 	/**********daemonize ***********/
 	if(onebox.daemon == 1) Daemonize();
@@ -23,6 +23,7 @@ typedef struct OBInstance_ {
 
     int daemon;
     int unittest;
+    int unittest_faults;        /**< rerun the tests under fault injection */
 
     struct timeval start_time;
 
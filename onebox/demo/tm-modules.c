@@ -0,0 +1,83 @@
+#include "onebox-common.h"
+#include "tm-modules.h"
+#include "util-debug.h"
+#include "util-error.h"
+#include "util-threads.h"
+
+/*********** vars ***********/
+static TmModule *tmm_modules[TM_MODULES_MAX];
+static int tmm_count = 0;
+static OBMutex tmm_lock = OBMUTEX_INITIALIZER;
+
+/*********** funcs ***********/
+/**
+ *  \brief Add a module to the registry, a module registered again under
+ *         the same name replaces the old one
+ *
+ *  \retval the module id or -1 on error
+ */
+int TmModuleRegister(TmModule *tm)
+{
+	int id;
+
+	if (tm == NULL || tm->name == NULL || strlen(tm->name) >= TM_MODULE_NAME_MAX ||
+			(tm->Func == NULL) == (tm->Loop == NULL)) {
+		OBLogError(OB_ERR_INVALID_ARGUMENT, "thread module %s needs a name and "
+				"one of Func or Loop", tm && tm->name ? tm->name : "(null)");
+		return -1;
+	}
+
+	OBMutexLock(&tmm_lock);
+	for (id = 0; id < tmm_count; id++) {
+		if (strcmp(tmm_modules[id]->name, tm->name) == 0)
+			break;
+	}
+	if (id == TM_MODULES_MAX) {
+		OBMutexUnlock(&tmm_lock);
+		OBLogError(OB_ERR_INVALID_ARGUMENT, "no room for thread module %s", tm->name);
+		return -1;
+	}
+	tmm_modules[id] = tm;
+	if (id == tmm_count)
+		tmm_count++;
+	OBMutexUnlock(&tmm_lock);
+
+	return id;
+}
+
+TmModule *TmModuleGetByName(const char *name)
+{
+	TmModule *tm = NULL;
+	int id;
+
+	OBMutexLock(&tmm_lock);
+	for (id = 0; id < tmm_count; id++) {
+		if (strcmp(tmm_modules[id]->name, name) == 0) {
+			tm = tmm_modules[id];
+			break;
+		}
+	}
+	OBMutexUnlock(&tmm_lock);
+
+	return tm;
+}
+
+void TmModuleRegisterTests(void)
+{
+	int id;
+
+	for (id = 0; id < tmm_count; id++) {
+		if (tmm_modules[id]->RegisterTests != NULL)
+			tmm_modules[id]->RegisterTests();
+	}
+}
+
+void TmModuleDebugList(void)
+{
+	int id;
+
+	for (id = 0; id < tmm_count; id++) {
+		OBLogDebug("%d: %s (%s)", id, tmm_modules[id]->name,
+				tmm_modules[id]->Loop ? "loop" : "func");
+	}
+}
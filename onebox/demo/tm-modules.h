@@ -0,0 +1,43 @@
+#ifndef __TM_MODULES_H__
+#define __TM_MODULES_H__
+
+#include "tm-threads.h"
+
+/* thread module return codes */
+typedef enum {
+    TM_ECODE_OK = 0,            /**< carry on */
+    TM_ECODE_FAILED,            /**< the thread fails and exits */
+    TM_ECODE_DONE,              /**< Loop: nothing more to do */
+} TmEcode;
+
+#define TM_MODULE_NAME_MAX      32
+#define TM_MODULES_MAX          32
+
+/* A thread module is what a thread runs. Sources implement Loop, which
+ * runs until it is done or the thread is told to stop. Everything else
+ * implements Func, called for each object taken from the thread's input
+ * queue, and passes objects on with TmThreadsOutput()
+ *
+ * Module threads are RCU readers (the configuration) and a reload waits
+ * for each of them to pass a quiescent state. Func threads pass one
+ * between bursts, a Loop must call OBRcuQuiescentState() itself between
+ * objects and before it sleeps, TmThreadsOutput() counts as one. */
+typedef struct TmModule_ {
+    const char *name;
+
+    /** per thread setup, *data is handed to the other callbacks */
+    TmEcode (*ThreadInit)(ThreadVars *, void *initdata, void **data);
+    TmEcode (*Func)(ThreadVars *, void *obj, void *data);
+    TmEcode (*Loop)(ThreadVars *, void *data);
+    /** called once the thread stopped running, with the output still open */
+    TmEcode (*ThreadDeinit)(ThreadVars *, void *data);
+
+    void (*RegisterTests)(void);
+} TmModule;
+
+int TmModuleRegister(TmModule *);
+TmModule *TmModuleGetByName(const char *name);
+void TmModuleRegisterTests(void);
+void TmModuleDebugList(void);
+
+#endif
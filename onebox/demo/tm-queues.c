@@ -0,0 +1,104 @@
+#include "onebox-common.h"
+#include "tm-queues.h"
+#include "util-debug.h"
+#include "util-error.h"
+#include "util-mem.h"
+#include "util-threads.h"
+
+/*********** vars ***********/
+static TmQueue *tmq_list = NULL;
+static OBMutex tmq_lock = OBMUTEX_INITIALIZER;
+
+/*********** funcs ***********/
+/**
+ *  \brief Create a queue, or get the existing one of that name
+ *
+ *  \param size objects the queue holds, rounded up to a power of two,
+ *              0 for TMQ_DEFAULT_SIZE
+ *  \param Free frees the objects still queued when the queue goes away
+ *              or a reader fails, NULL to leave them to their owner
+ *
+ *  \retval the queue or NULL on error
+ */
+TmQueue *TmqCreateQueue(const char *name, uint32_t size, void (*Free)(void *))
+{
+	TmQueue *q;
+
+	if (strlen(name) >= TMQ_NAME_MAX) {
+		OBLogError(OB_ERR_INVALID_ARGUMENT, "queue name %s too long", name);
+		return NULL;
+	}
+
+	OBMutexLock(&tmq_lock);
+	for (q = tmq_list; q != NULL; q = q->next) {
+		if (strcmp(q->name, name) == 0)
+			goto end;
+	}
+
+	q = OBCalloc(1, sizeof(TmQueue));
+	if (q == NULL)
+		goto end;
+	q->ring = RingMPMCNew(size ? size : TMQ_DEFAULT_SIZE);
+	if (q->ring == NULL) {
+		OBFree(q);
+		q = NULL;
+		goto end;
+	}
+	strlcpy(q->name, name, sizeof(q->name));
+	q->Free = Free;
+	q->next = tmq_list;
+	tmq_list = q;
+end:
+	OBMutexUnlock(&tmq_lock);
+	return q;
+}
+
+TmQueue *TmqGetQueueByName(const char *name)
+{
+	TmQueue *q;
+
+	OBMutexLock(&tmq_lock);
+	for (q = tmq_list; q != NULL; q = q->next) {
+		if (strcmp(q->name, name) == 0)
+			break;
+	}
+	OBMutexUnlock(&tmq_lock);
+
+	return q;
+}
+
+/**
+ *  \brief Free all queues and what is left in them, no thread may use
+ *         them anymore
+ */
+void TmqResetQueues(void)
+{
+	TmQueue *q;
+	void *obj;
+
+	OBMutexLock(&tmq_lock);
+	while ((q = tmq_list) != NULL)
+	{
+		tmq_list = q->next;
+		while ((obj = RingMPMCDequeue(q->ring)) != NULL) {
+			if (q->Free != NULL)
+				q->Free(obj);
+		}
+		RingMPMCFree(q->ring);
+		OBFree(q);
+	}
+	OBMutexUnlock(&tmq_lock);
+}
+
+void TmqDebugList(void)
+{
+	TmQueue *q;
+
+	OBMutexLock(&tmq_lock);
+	for (q = tmq_list; q != NULL; q = q->next) {
+		OBLogDebug("queue %s: %u writers (%u closed), %u readers (%u closed), size %u",
+				q->name, q->writers, q->writers_closed, q->readers, q->readers_closed,
+				q->ring->size);
+	}
+	OBMutexUnlock(&tmq_lock);
+}
@@ -0,0 +1,47 @@
+#ifndef __TM_QUEUES_H__
+#define __TM_QUEUES_H__
+
+#include "ds-ring.h"
+
+#define TMQ_NAME_MAX            32
+#define TMQ_DEFAULT_SIZE        1024
+
+/* named queue between threads, a thread reads at most one and writes at
+ * most one. Readers stopping gracefully drain it once every writer is
+ * closed, writers give up on it once every reader is */
+typedef struct TmQueue_ {
+    char name[TMQ_NAME_MAX];
+    RingMPMC *ring;
+    uint32_t writers;           /**< threads writing to it */
+    uint32_t readers;
+    uint32_t writers_closed;    /**< of the writers, those that exited */
+    uint32_t readers_closed;    /**< of the readers, those that exited */
+    void (*Free)(void *);       /**< for objects left over on kill or
+                                 *   after a failed Func, NULL when the
+                                 *   objects are owned elsewhere */
+    struct TmQueue_ *next;
+} TmQueue;
+
+TmQueue *TmqCreateQueue(const char *name, uint32_t size, void (*Free)(void *));
+TmQueue *TmqGetQueueByName(const char *name);
+void TmqResetQueues(void);
+void TmqDebugList(void);
+
+/**
+ *  \retval 1 if nothing more will be written to the queue
+ */
+static inline int TmqWritersClosed(TmQueue *q)
+{
+    return OBAtomicLoadAcquire(&q->writers_closed) == q->writers;
+}
+
+/**
+ *  \retval 1 if nothing more will be read from the queue, a queue without
+ *          reader thread is read by its owner and never closed
+ */
+static inline int TmqReadersClosed(TmQueue *q)
+{
+    return q->readers != 0 && OBAtomicLoadAcquire(&q->readers_closed) == q->readers;
+}
+
+#endif
@@ -0,0 +1,693 @@
+#include "onebox-common.h"
+#include "onebox.h"
+#include "tm-threads.h"
+#include "tm-modules.h"
+#include "tm-queues.h"
+#include "util-debug.h"
+#include "util-error.h"
+#include "util-mem.h"
+#include "util-threads.h"
+#include "util-atomic.h"
+#include "util-affinity.h"
+#include "util-rcu.h"
+#include "util-unittest.h"
+
+/* idle rounds spent spinning, then yielding, before sleeping */
+#define TM_IDLE_SPIN        64
+#define TM_IDLE_YIELD       128
+#define TM_IDLE_SLEEP_US    100
+
+/*********** vars ***********/
+static ThreadVars *tv_root = NULL;          /**< in creation order */
+static OBMutex tv_root_lock = OBMUTEX_INITIALIZER;
+
+/*********** funcs ***********/
+/**
+ *  \brief Back off while there is nothing to do, idle counts the rounds
+ *         and is reset by the caller when there is work again
+ */
+void TmThreadsWait(uint32_t *idle)
+{
+	if (*idle < TM_IDLE_SPIN) {
+		ob_cpu_pause();
+	} else if (*idle < TM_IDLE_YIELD) {
+		sched_yield();
+	} else {
+		usleep(TM_IDLE_SLEEP_US);
+		return;
+	}
+	(*idle)++;
+}
+
+/**
+ *  \brief Pass an object on to the thread's output queue, waiting while
+ *         it is full
+ *
+ *  A call is an RCU quiescent state, the caller keeps no RCU protected
+ *  pointer across it.
+ *
+ *  \retval 0 on success, -1 if the thread was killed, has no output or
+ *          all the output's readers exited, the object is still the
+ *          caller's then
+ */
+int TmThreadsOutput(ThreadVars *tv, void *obj)
+{
+	uint32_t idle = 0;
+
+	if (tv->outq == NULL)
+		return -1;
+
+	OBRcuQuiescentState();
+	while (RingMPMCEnqueue(tv->outq->ring, obj) != 0) {
+		if (TmThreadsCheckFlag(tv, THV_KILL) || TmqReadersClosed(tv->outq))
+			return -1;
+		TmThreadsWait(&idle);
+		/* the queue may stay full for long, don't hold back the writers */
+		OBRcuQuiescentState();
+	}
+	return 0;
+}
+
+static void TmThreadTestThreadUnPaused(ThreadVars *tv)
+{
+	TmThreadsSetFlag(tv, THV_PAUSED);
+	OBRcuThreadOffline();
+	while (TmThreadsCheckFlag(tv, THV_PAUSE) && !TmThreadsCheckFlag(tv, THV_KILL | THV_STOP)) {
+		usleep(TM_IDLE_SLEEP_US);
+	}
+	OBRcuThreadOnline();
+	TmThreadsUnsetFlag(tv, THV_PAUSED);
+}
+
+/**
+ *  \brief Run Func over the input queue until killed, or stopped with the
+ *         queue empty and all its writers closed
+ */
+static TmEcode TmThreadsRunQueue(ThreadVars *tv)
+{
+	void *objs[TM_THREAD_BURST];
+	uint32_t n, i, idle = 0;
+	int drained;
+
+	for (;;)
+	{
+		/* no object of the last burst holds RCU protected data anymore */
+		OBRcuQuiescentState();
+		if (TmThreadsCheckFlag(tv, THV_KILL))
+			return TM_ECODE_OK;
+		if (TmThreadsCheckFlag(tv, THV_PAUSE))
+			TmThreadTestThreadUnPaused(tv);
+
+		/* checked before looking at the queue: once the writers are closed,
+		 * an empty queue stays empty */
+		drained = TmThreadsCheckFlag(tv, THV_STOP) && TmqWritersClosed(tv->inq);
+
+		n = RingMPMCDequeueBulk(tv->inq->ring, objs, TM_THREAD_BURST);
+		if (n == 0) {
+			if (drained)
+				return TM_ECODE_OK;
+			TmThreadsWait(&idle);
+			continue;
+		}
+		idle = 0;
+
+		for (i = 0; i < n; i++)
+		{
+			if (tv->tm->Func(tv, objs[i], tv->tm_data) == TM_ECODE_FAILED) {
+				/* the rest of the burst is dropped like what is queued when
+				 * the queue goes away: freed with its Free callback, left
+				 * to its owner without one */
+				for (i++; i < n; i++) {
+					if (tv->inq->Free != NULL)
+						tv->inq->Free(objs[i]);
+				}
+				return TM_ECODE_FAILED;
+			}
+		}
+	}
+}
+
+static void *TmThreadsLoop(void *arg)
+{
+	ThreadVars *tv = (ThreadVars *)arg;
+	struct TmModule_ *tm = tv->tm;
+	TmEcode r = TM_ECODE_OK;
+
+	OBSetThreadName(tv->name);
+
+	AffinitySetCurrentThread(tv->name, tv->cpu, tv->set_cpus ? &tv->cpus : NULL,
+			tv->set_prio, tv->prio);
+
+	/* module threads read the configuration, see ConfGetRootNode() */
+	if (OBRcuRegisterThread(tv->name) != 0) {
+		OBLogError(OB_ERR_FATAL, "%s: can't register as an RCU reader", tv->name);
+		TmThreadsSetFlag(tv, THV_FAILED | THV_INIT_DONE);
+		goto close;
+	}
+
+	if (tm->ThreadInit != NULL && tm->ThreadInit(tv, tv->tm_initdata, &tv->tm_data) != TM_ECODE_OK) {
+		OBLogError(OB_ERR_FATAL, "%s: %s thread init failed", tv->name, tm->name);
+		TmThreadsSetFlag(tv, THV_FAILED | THV_INIT_DONE);
+		goto close;
+	}
+	TmThreadsSetFlag(tv, THV_INIT_DONE);
+
+	/* spawned paused, until all threads are up */
+	if (TmThreadsCheckFlag(tv, THV_PAUSE))
+		TmThreadTestThreadUnPaused(tv);
+
+	if (!TmThreadsCheckFlag(tv, THV_KILL | THV_STOP))
+	{
+		if (tm->Loop != NULL)
+			r = tm->Loop(tv, tv->tm_data);
+		else
+			r = TmThreadsRunQueue(tv);
+	}
+	TmThreadsSetFlag(tv, THV_CLOSED | (r == TM_ECODE_FAILED ? THV_FAILED : 0));
+
+	if (tm->ThreadDeinit != NULL)
+		tm->ThreadDeinit(tv, tv->tm_data);
+
+close:
+	OBRcuUnregisterThread();
+	/* readers of the output may drain it now */
+	if (tv->outq != NULL)
+		OBAtomicAddAndFetch(&tv->outq->writers_closed, 1);
+	/* and writers to the input, failed or not, wait on it no more */
+	if (tv->inq != NULL)
+		OBAtomicAddAndFetch(&tv->inq->readers_closed, 1);
+	TmThreadsSetFlag(tv, THV_CLOSED | THV_DEINIT_DONE);
+	return NULL;
+}
+
+/**
+ *  \brief Create a thread running a registered module, to be started
+ *         with TmThreadSpawn()
+ *
+ *  Queues are created by name as needed, see TmqCreateQueue() to create
+ *  them with a size and a Free callback first.
+ *
+ *  \param inq queue read by the thread, NULL for Loop modules
+ *  \param outq queue written with TmThreadsOutput(), NULL for none
+ *
+ *  \retval the thread or NULL on error
+ */
+ThreadVars *TmThreadCreate(const char *name, const char *module, void *initdata,
+		const char *inq, const char *outq)
+{
+	struct TmModule_ *tm;
+	ThreadVars *tv, **ptv;
+
+	tm = TmModuleGetByName(module);
+	if (tm == NULL) {
+		OBLogError(OB_ERR_INVALID_ARGUMENT, "%s: no thread module %s", name, module);
+		return NULL;
+	}
+	if ((tm->Func != NULL) != (inq != NULL)) {
+		OBLogError(OB_ERR_INVALID_ARGUMENT, "%s: module %s %s an input queue", name,
+				module, tm->Func ? "needs" : "can't have");
+		return NULL;
+	}
+
+	tv = OBCalloc(1, sizeof(ThreadVars));
+	if (tv == NULL)
+		return NULL;
+	strlcpy(tv->name, name, sizeof(tv->name));
+	tv->cpu = -1;
+	tv->cpu_set_type = -1;
+	tv->tm = tm;
+	tv->tm_initdata = initdata;
+	tv->flags = THV_PAUSE;
+
+	if (inq != NULL && (tv->inq = TmqCreateQueue(inq, 0, NULL)) == NULL)
+		goto error;
+	if (outq != NULL && (tv->outq = TmqCreateQueue(outq, 0, NULL)) == NULL)
+		goto error;
+
+	/* the queues know their writers before any thread runs */
+	if (tv->inq != NULL)
+		tv->inq->readers++;
+	if (tv->outq != NULL)
+		tv->outq->writers++;
+
+	OBMutexLock(&tv_root_lock);
+	for (ptv = &tv_root; *ptv != NULL; ptv = &(*ptv)->next)
+		;
+	*ptv = tv;
+	OBMutexUnlock(&tv_root_lock);
+
+	return tv;
+
+error:
+	OBFree(tv);
+	return NULL;
+}
+
+void TmThreadSetCPU(ThreadVars *tv, int cpu)
+{
+	tv->cpu = cpu;
+}
+
+/**
+ *  \brief Place the thread by its threading.cpu-affinity set, when
+ *         threading.set-cpu-affinity is on and no cpu was set
+ */
+void TmThreadSetCPUSetType(ThreadVars *tv, int type)
+{
+	tv->cpu_set_type = type;
+}
+
+/**
+ *  \brief Resolve the cpu set of the thread, in spawn order so the
+ *         exclusive sets hand cpus out the same way every run
+ */
+static void TmThreadSetupOptions(ThreadVars *tv)
+{
+	ThreadsAffinityType *taf;
+
+	if (tv->cpu >= 0 || !threading_set_cpu_affinity ||
+			(taf = GetAffinityTypeFromId(tv->cpu_set_type)) == NULL)
+		return;
+
+	if (taf->mode_flag == EXCLUSIVE_AFFINITY) {
+		tv->cpu = AffinityGetNextCPU(taf);
+		tv->prio = AffinityGetCPUPrio(taf, tv->cpu);
+	} else {
+		tv->cpus = taf->cpu_set;
+		tv->set_cpus = 1;
+		tv->prio = taf->prio;
+	}
+	tv->set_prio = 1;
+}
+
+/**
+ *  \retval 0 on success, -1 on error
+ */
+int TmThreadSpawn(ThreadVars *tv)
+{
+	int ret;
+
+	TmThreadSetupOptions(tv);
+	ret = pthread_create(&tv->t, NULL, TmThreadsLoop, tv);
+	if (ret != 0) {
+		OBLogError(OB_ERR_FATAL, "%s: can't create thread: %s", tv->name, strerror(ret));
+		return -1;
+	}
+	tv->spawned = 1;
+	return 0;
+}
+
+/**
+ *  \brief Wait for the spawned threads to be through ThreadInit
+ *
+ *  \retval 0 if all of them are, -1 if one failed
+ */
+int TmThreadWaitOnThreadInit(void)
+{
+	ThreadVars *tv;
+	int failed = 0;
+
+	OBMutexLock(&tv_root_lock);
+	for (tv = tv_root; tv != NULL; tv = tv->next)
+	{
+		if (!tv->spawned)
+			continue;
+		while (!TmThreadsCheckFlag(tv, THV_INIT_DONE)) {
+			usleep(TM_IDLE_SLEEP_US);
+		}
+		if (TmThreadsCheckFlag(tv, THV_FAILED))
+			failed = 1;
+	}
+	OBMutexUnlock(&tv_root_lock);
+
+	return failed ? -1 : 0;
+}
+
+static void TmThreadsSetFlagAll(uint32_t flag)
+{
+	ThreadVars *tv;
+
+	OBMutexLock(&tv_root_lock);
+	for (tv = tv_root; tv != NULL; tv = tv->next) {
+		TmThreadsSetFlag(tv, flag);
+	}
+	OBMutexUnlock(&tv_root_lock);
+}
+
+void TmThreadContinueThreads(void)
+{
+	ThreadVars *tv;
+
+	OBMutexLock(&tv_root_lock);
+	for (tv = tv_root; tv != NULL; tv = tv->next) {
+		TmThreadsUnsetFlag(tv, THV_PAUSE);
+	}
+	OBMutexUnlock(&tv_root_lock);
+}
+
+/**
+ *  \brief Pause the threads running queues, between bursts. Loop modules
+ *         pause only if they check THV_PAUSE themselves
+ */
+void TmThreadPauseThreads(void)
+{
+	TmThreadsSetFlagAll(THV_PAUSE);
+}
+
+static void TmThreadJoinThreads(void)
+{
+	ThreadVars *tv;
+
+	OBMutexLock(&tv_root_lock);
+	for (tv = tv_root; tv != NULL; tv = tv->next)
+	{
+		if (tv->spawned) {
+			pthread_join(tv->t, NULL);
+			tv->spawned = 0;
+		}
+	}
+	OBMutexUnlock(&tv_root_lock);
+}
+
+/**
+ *  \brief Stop all threads gracefully and wait for them
+ *
+ *  Sources stop producing, every other thread finishes what is queued to
+ *  it once the threads writing its input are gone, so the pipeline
+ *  drains front to back.
+ */
+void TmThreadDrainThreads(void)
+{
+	TmThreadsSetFlagAll(THV_STOP);
+	TmThreadJoinThreads();
+}
+
+/**
+ *  \brief Stop all threads asap and wait for them, what is still queued
+ *         is freed with the queues
+ */
+void TmThreadKillThreads(void)
+{
+	TmThreadsSetFlagAll(THV_KILL);
+	TmThreadJoinThreads();
+}
+
+/**
+ *  \brief Stop the threads as the engine control flags say: kill on
+ *         ONEBOX_KILL, drain otherwise
+ */
+void TmThreadsShutdown(uint8_t ctl_flags)
+{
+	if (ctl_flags & ONEBOX_KILL)
+		TmThreadKillThreads();
+	else
+		TmThreadDrainThreads();
+}
+
+/**
+ *  \brief Free all threads and queues, the threads must have been
+ *         stopped
+ */
+void TmThreadClearThreadsFamily(void)
+{
+	ThreadVars *tv;
+
+	OBMutexLock(&tv_root_lock);
+	while ((tv = tv_root) != NULL) {
+		tv_root = tv->next;
+		OBFree(tv);
+	}
+	OBMutexUnlock(&tv_root_lock);
+
+	TmqResetQueues();
+}
+
+/*********** unittests ***********/
+
+#define TM_TEST_OBJS        20000
+
+typedef struct TmTestCtx_ {
+    uint64_t objs;              /**< source: how many, 0 for until stopped */
+    uint64_t sum;               /**< sink: of the values seen */
+    uint64_t seen;
+    uint64_t fail_after;        /**< sink: fails on that object, 0 never */
+    int fail_init;
+} TmTestCtx;
+
+static TmEcode TmTestInit(ThreadVars *tv, void *initdata, void **data)
+{
+	TmTestCtx *ctx = (TmTestCtx *)initdata;
+
+	if (ctx != NULL && ctx->fail_init)
+		return TM_ECODE_FAILED;
+	*data = initdata;
+	return TM_ECODE_OK;
+}
+
+static TmEcode TmTestSourceLoop(ThreadVars *tv, void *data)
+{
+	TmTestCtx *ctx = (TmTestCtx *)data;
+	uint64_t *obj, v;
+
+	for (v = 1; ctx->objs == 0 || v <= ctx->objs; v++)
+	{
+		if (TmThreadsCheckFlag(tv, THV_KILL | THV_STOP))
+			break;
+		obj = OBMalloc(sizeof(uint64_t));
+		if (obj == NULL)
+			return TM_ECODE_FAILED;
+		*obj = v;
+		if (TmThreadsOutput(tv, obj) != 0) {
+			OBFree(obj);
+			break;
+		}
+	}
+	return TM_ECODE_DONE;
+}
+
+/* decode: pass on */
+static TmEcode TmTestPassFunc(ThreadVars *tv, void *obj, void *data)
+{
+	if (TmThreadsOutput(tv, obj) != 0)
+		OBFree(obj);
+	return TM_ECODE_OK;
+}
+
+static TmEcode TmTestSinkFunc(ThreadVars *tv, void *obj, void *data)
+{
+	TmTestCtx *ctx = (TmTestCtx *)data;
+
+	ctx->sum += *(uint64_t *)obj;
+	/* polled by the test while the pipeline runs */
+	OBAtomicAddRelaxed(&ctx->seen, 1);
+	OBFree(obj);
+	return ctx->seen == ctx->fail_after ? TM_ECODE_FAILED : TM_ECODE_OK;
+}
+
+static TmModule tmm_test_source = { "TestSource", TmTestInit, NULL, TmTestSourceLoop, NULL, NULL };
+static TmModule tmm_test_pass = { "TestPass", TmTestInit, TmTestPassFunc, NULL, NULL, NULL };
+static TmModule tmm_test_sink = { "TestSink", TmTestInit, TmTestSinkFunc, NULL, NULL, NULL };
+
+static void TmTestFree(void *obj)
+{
+	OBFree(obj);
+}
+
+/**
+ *  \brief source -> 2 x pass -> sink, queues small enough to fill up
+ */
+static int TmTestPipeline(TmTestCtx *src, TmTestCtx *sink)
+{
+	ThreadVars *tv[4];
+	int i;
+
+	if (TmModuleRegister(&tmm_test_source) < 0 || TmModuleRegister(&tmm_test_pass) < 0 ||
+			TmModuleRegister(&tmm_test_sink) < 0)
+		return -1;
+	if (TmqCreateQueue("test-decode", 64, TmTestFree) == NULL ||
+			TmqCreateQueue("test-output", 64, TmTestFree) == NULL)
+		return -1;
+
+	tv[0] = TmThreadCreate("TestRX", "TestSource", src, NULL, "test-decode");
+	tv[1] = TmThreadCreate("TestW#01", "TestPass", NULL, "test-decode", "test-output");
+	tv[2] = TmThreadCreate("TestW#02", "TestPass", NULL, "test-decode", "test-output");
+	tv[3] = TmThreadCreate("TestTX", "TestSink", sink, "test-output", NULL);
+	for (i = 0; i < 4; i++) {
+		if (tv[i] == NULL || TmThreadSpawn(tv[i]) != 0)
+			return -1;
+	}
+	return TmThreadWaitOnThreadInit();
+}
+
+/**
+ * \test every object makes it through when the pipeline is drained
+ */
+static int TmThreadsTestDrain(void)
+{
+	TmTestCtx src, sink;
+	int result = 0;
+
+	memset(&src, 0, sizeof(src));
+	memset(&sink, 0, sizeof(sink));
+	src.objs = TM_TEST_OBJS;
+
+	if (TmTestPipeline(&src, &sink) != 0) {
+		TmThreadKillThreads();
+		goto end;
+	}
+	TmThreadContinueThreads();
+	/* the source is done on its own, stop only once it is */
+	while (!TmThreadsCheckFlag(tv_root, THV_CLOSED)) {
+		usleep(1000);
+	}
+	TmThreadsShutdown(ONEBOX_STOP);
+
+	if (sink.seen != TM_TEST_OBJS ||
+			sink.sum != (uint64_t)TM_TEST_OBJS * (TM_TEST_OBJS + 1) / 2)
+		goto end;
+	result = 1;
+end:
+	TmThreadClearThreadsFamily();
+	return result;
+}
+
+/**
+ * \test a stopped pipeline drains, a killed one leaves the queues to be
+ *       freed, without leaking either way
+ */
+static int TmThreadsTestStopKill(void)
+{
+	TmTestCtx src, sink;
+	int result = 0, round;
+
+	for (round = 0; round < 2; round++)
+	{
+		memset(&src, 0, sizeof(src));
+		memset(&sink, 0, sizeof(sink));
+
+		if (TmTestPipeline(&src, &sink) != 0) {
+			TmThreadKillThreads();
+			goto end;
+		}
+		TmThreadContinueThreads();
+		while (OBAtomicLoadRelaxed(&sink.seen) < 1000 && !TmThreadsCheckFlag(tv_root, THV_CLOSED)) {
+			usleep(1000);
+		}
+		TmThreadsShutdown(round == 0 ? ONEBOX_STOP : ONEBOX_KILL);
+
+		/* drained: nothing left in between */
+		if (round == 0 && (RingMPMCDequeue(TmqGetQueueByName("test-decode")->ring) != NULL ||
+					RingMPMCDequeue(TmqGetQueueByName("test-output")->ring) != NULL))
+			goto end;
+		TmThreadClearThreadsFamily();
+	}
+	result = 1;
+end:
+	TmThreadClearThreadsFamily();
+	return result;
+}
+
+/**
+ * \test a pipeline whose only sink failed still drains: the writers to
+ *       its queue give up on it instead of waiting for room forever
+ */
+static int TmThreadsTestReaderFail(void)
+{
+	TmTestCtx src, sink;
+	ThreadVars *tv;
+	int result = 0;
+
+	memset(&src, 0, sizeof(src));
+	memset(&sink, 0, sizeof(sink));
+	sink.fail_after = 1000;
+
+	if (TmTestPipeline(&src, &sink) != 0) {
+		TmThreadKillThreads();
+		goto end;
+	}
+	TmThreadContinueThreads();
+	for (tv = tv_root; tv->next != NULL; tv = tv->next);
+	/* or the source failed first, out of memory */
+	while (!TmThreadsCheckFlag(tv, THV_CLOSED) && !TmThreadsCheckFlag(tv_root, THV_CLOSED)) {
+		usleep(1000);
+	}
+	TmThreadsShutdown(ONEBOX_STOP);
+
+	if (!TmThreadsCheckFlag(tv, THV_FAILED) || sink.seen != sink.fail_after)
+		goto end;
+	result = 1;
+end:
+	TmThreadClearThreadsFamily();
+	return result;
+}
+
+/**
+ * \test a source blocked on a full queue doesn't hold back an RCU writer
+ */
+static int TmThreadsTestRcuFull(void)
+{
+	TmTestCtx src;
+	ThreadVars *tv;
+	int result = 0;
+
+	memset(&src, 0, sizeof(src));
+
+	if (TmModuleRegister(&tmm_test_source) < 0)
+		goto end;
+	if (TmqCreateQueue("test-full", 64, TmTestFree) == NULL)
+		goto end;
+	/* nobody reads test-full */
+	tv = TmThreadCreate("TestRX", "TestSource", &src, NULL, "test-full");
+	if (tv == NULL || TmThreadSpawn(tv) != 0 || TmThreadWaitOnThreadInit() != 0)
+		goto end;
+	TmThreadContinueThreads();
+	/* time to fill test-full */
+	usleep(20000);
+
+	/* a configuration reload waits the same way */
+	OBRcuSynchronize();
+	result = 1;
+end:
+	TmThreadKillThreads();
+	TmThreadClearThreadsFamily();
+	return result;
+}
+
+/**
+ * \test a failing ThreadInit is reported
+ */
+static int TmThreadsTestInitFail(void)
+{
+	TmTestCtx ctx;
+	ThreadVars *tv;
+	int result = 0;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.fail_init = 1;
+
+	if (TmModuleRegister(&tmm_test_sink) < 0)
+		goto end;
+	if (TmThreadCreate("TestTX", "TestNoSuchModule", NULL, "test-output", NULL) != NULL)
+		goto end;
+	if (TmThreadCreate("TestTX", "TestSink", &ctx, NULL, NULL) != NULL)
+		goto end;
+	tv = TmThreadCreate("TestTX", "TestSink", &ctx, "test-output", NULL);
+	if (tv == NULL || TmThreadSpawn(tv) != 0)
+		goto end;
+	if (TmThreadWaitOnThreadInit() != -1 || !TmThreadsCheckFlag(tv, THV_FAILED))
+		goto end;
+	result = 1;
+end:
+	TmThreadKillThreads();
+	TmThreadClearThreadsFamily();
+	return result;
+}
+
+void TmThreadsRegisterTests(void)
+{
+	UtRegisterTest("TmThreadsTestDrain", TmThreadsTestDrain, 1);
+	UtRegisterTest("TmThreadsTestStopKill", TmThreadsTestStopKill, 1);
+	UtRegisterTest("TmThreadsTestReaderFail", TmThreadsTestReaderFail, 1);
+	UtRegisterTest("TmThreadsTestRcuFull", TmThreadsTestRcuFull, 1);
+	UtRegisterTest("TmThreadsTestInitFail", TmThreadsTestInitFail, 1);
+}
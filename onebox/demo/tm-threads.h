@@ -0,0 +1,78 @@
+#ifndef __TM_THREADS_H__
+#define __TM_THREADS_H__
+
+#include "util-threads.h"
+#include "util-atomic.h"
+#include "tm-queues.h"
+
+/* ThreadVars flags */
+#define THV_INIT_DONE       (1 << 0)    /**< ThreadInit ran, ok or not */
+#define THV_PAUSE           (1 << 1)    /**< told to pause, set at spawn */
+#define THV_PAUSED          (1 << 2)    /**< pausing */
+#define THV_STOP            (1 << 3)    /**< stop once the input is drained, see ONEBOX_STOP */
+#define THV_KILL            (1 << 4)    /**< stop asap, see ONEBOX_KILL */
+#define THV_FAILED          (1 << 5)    /**< init or a callback failed */
+#define THV_CLOSED          (1 << 6)    /**< left the run loop */
+#define THV_DEINIT_DONE     (1 << 7)    /**< output closed, the thread exits */
+
+#define TM_THREAD_BURST     32          /**< objects taken from the input at once */
+
+struct TmModule_;
+
+typedef struct ThreadVars_ {
+    pthread_t t;
+    char name[THREAD_NAME_LEN + 1];
+    int spawned;
+    int cpu;                    /**< pinned to it, -1 for none */
+    int cpu_set_type;           /**< CpuSetType, -1 for none */
+    int set_cpus;               /**< balanced: runs on cpus */
+    cpu_set_t cpus;
+    int set_prio;               /**< gets nice value prio */
+    int prio;
+
+    uint32_t flags;             /**< THV_*, see TmThreadsSetFlag() */
+
+    struct TmModule_ *tm;
+    void *tm_initdata;
+    void *tm_data;              /**< from ThreadInit */
+
+    TmQueue *inq;               /**< Func modules read it */
+    TmQueue *outq;              /**< TmThreadsOutput() writes it */
+
+    struct ThreadVars_ *next;
+} ThreadVars;
+
+ThreadVars *TmThreadCreate(const char *name, const char *module, void *initdata,
+        const char *inq, const char *outq);
+void TmThreadSetCPU(ThreadVars *, int cpu);
+void TmThreadSetCPUSetType(ThreadVars *, int type);
+int TmThreadSpawn(ThreadVars *);
+int TmThreadWaitOnThreadInit(void);
+void TmThreadContinueThreads(void);
+void TmThreadPauseThreads(void);
+void TmThreadDrainThreads(void);
+void TmThreadKillThreads(void);
+void TmThreadsShutdown(uint8_t ctl_flags);
+void TmThreadClearThreadsFamily(void);
+
+int TmThreadsOutput(ThreadVars *, void *obj);
+void TmThreadsWait(uint32_t *idle);
+
+void TmThreadsRegisterTests(void);
+
+static inline int TmThreadsCheckFlag(ThreadVars *tv, uint32_t flag)
+{
+    return (OBAtomicLoadAcquire(&tv->flags) & flag) != 0;
+}
+
+static inline void TmThreadsSetFlag(ThreadVars *tv, uint32_t flag)
+{
+    OBAtomicFetchAndOr(&tv->flags, flag);
+}
+
+static inline void TmThreadsUnsetFlag(ThreadVars *tv, uint32_t flag)
+{
+    OBAtomicFetchAndAnd(&tv->flags, ~flag);
+}
+
+#endif
@@ -0,0 +1,506 @@
+#include "onebox-common.h"
+#include "util-affinity.h"
+#include "util-conf-node.h"
+#include "util-cpu.h"
+#include "util-debug.h"
+#include "util-error.h"
+#include "util-threads.h"
+#include "tm-threads.h"
+#include "tm-modules.h"
+#include "util-unittest.h"
+#include <sys/resource.h>
+
+/*********** vars ***********/
+int threading_set_cpu_affinity = 0;
+
+static ThreadsAffinityType thread_affinity[MAX_CPUS_SET] = {
+	{ .name = "management-cpu-set", .taf_mutex = OBMUTEX_INITIALIZER },
+	{ .name = "receive-cpu-set", .taf_mutex = OBMUTEX_INITIALIZER },
+	{ .name = "decode-cpu-set", .taf_mutex = OBMUTEX_INITIALIZER },
+	{ .name = "stream-cpu-set", .taf_mutex = OBMUTEX_INITIALIZER },
+	{ .name = "detect-cpu-set", .taf_mutex = OBMUTEX_INITIALIZER },
+	{ .name = "verdict-cpu-set", .taf_mutex = OBMUTEX_INITIALIZER },
+	{ .name = "reject-cpu-set", .taf_mutex = OBMUTEX_INITIALIZER },
+	{ .name = "output-cpu-set", .taf_mutex = OBMUTEX_INITIALIZER },
+};
+
+/*********** funcs ***********/
+ThreadsAffinityType *GetAffinityTypeFromName(const char *name)
+{
+	int i;
+
+	for (i = 0; i < MAX_CPUS_SET; i++) {
+		if (strcmp(thread_affinity[i].name, name) == 0)
+			return &thread_affinity[i];
+	}
+	return NULL;
+}
+
+ThreadsAffinityType *GetAffinityTypeFromId(CpuSetType type)
+{
+	if (type < 0 || type >= MAX_CPUS_SET)
+		return NULL;
+	return &thread_affinity[type];
+}
+
+/**
+ *  \brief Build a cpu set from a list of cpu numbers, "N-M" ranges and
+ *         "all"
+ *
+ *  \param online the cpus the process may run on, the others are left
+ *         out with a warning
+ *
+ *  \retval 0 on success, -1 on a malformed entry
+ */
+static int AffinityBuildCpuset(ConfNode *node, cpu_set_t *cpu, const cpu_set_t *online,
+		const char *name)
+{
+	ConfNode *lnode;
+	unsigned long a, b, skipped;
+	char *end;
+
+	CPU_ZERO(cpu);
+	TAILQ_FOREACH(lnode, &node->head, next)
+	{
+		if (lnode->val == NULL)
+			goto invalid;
+
+		if (strcmp(lnode->val, "all") == 0)
+		{
+			CPU_OR(cpu, cpu, online);
+			continue;
+		}
+		else
+		{
+			if (!isdigit((unsigned char)lnode->val[0]))
+				goto invalid;
+			a = b = strtoul(lnode->val, &end, 10);
+			if (*end == '-') {
+				if (!isdigit((unsigned char)end[1]))
+					goto invalid;
+				b = strtoul(end + 1, &end, 10);
+			}
+			if (*end != '\0' || b < a)
+				goto invalid;
+		}
+
+		for (skipped = 0; a <= b; a++) {
+			if (a < CPU_SETSIZE && CPU_ISSET(a, online))
+				CPU_SET(a, cpu);
+			else
+				skipped++;
+		}
+		if (skipped > 0) {
+			OBLogWarning(OB_ERR_INVALID_ARGUMENT, "%s: %lu of the cpus in %s are not online, left out",
+					name, skipped, lnode->val);
+		}
+	}
+	return 0;
+
+invalid:
+	OBLogError(OB_ERR_INVALID_ARGUMENT, "%s: invalid cpu \"%s\"", name,
+			lnode->val ? lnode->val : "");
+	return -1;
+}
+
+static int AffinityParsePrio(const char *val, int *prio)
+{
+	if (strcmp(val, "low") == 0)
+		*prio = PRIO_LOW;
+	else if (strcmp(val, "medium") == 0)
+		*prio = PRIO_MEDIUM;
+	else if (strcmp(val, "high") == 0)
+		*prio = PRIO_HIGH;
+	else
+		return -1;
+	return 0;
+}
+
+/**
+ *  \brief Fill taf from its "<name>-cpu-set" node
+ */
+static int AffinityParseSet(ThreadsAffinityType *taf, ConfNode *node, const cpu_set_t *online)
+{
+	ConfNode *child, *lnode;
+	const char *val;
+	intmax_t threads;
+
+	if ((child = ConfNodeLookupChild(node, "cpu")) != NULL)
+	{
+		if (AffinityBuildCpuset(child, &taf->cpu_set, online, taf->name) != 0)
+			return -1;
+		if (CPU_COUNT(&taf->cpu_set) == 0) {
+			OBLogWarning(OB_ERR_INVALID_ARGUMENT, "%s: no cpu online, using all", taf->name);
+			CPU_OR(&taf->cpu_set, &taf->cpu_set, online);
+		}
+	}
+
+	if ((val = ConfNodeLookupChildValue(node, "mode")) != NULL)
+	{
+		if (strcmp(val, "balanced") == 0) {
+			taf->mode_flag = BALANCED_AFFINITY;
+		} else if (strcmp(val, "exclusive") == 0) {
+			taf->mode_flag = EXCLUSIVE_AFFINITY;
+		} else {
+			OBLogError(OB_ERR_INVALID_ARGUMENT, "%s: unknown mode \"%s\"", taf->name, val);
+			return -1;
+		}
+	}
+
+	if ((child = ConfNodeLookupChild(node, "prio")) != NULL)
+	{
+		if (((lnode = ConfNodeLookupChild(child, "low")) != NULL &&
+					AffinityBuildCpuset(lnode, &taf->lowprio_cpu, online, taf->name) != 0) ||
+				((lnode = ConfNodeLookupChild(child, "medium")) != NULL &&
+				 AffinityBuildCpuset(lnode, &taf->medprio_cpu, online, taf->name) != 0) ||
+				((lnode = ConfNodeLookupChild(child, "high")) != NULL &&
+				 AffinityBuildCpuset(lnode, &taf->hiprio_cpu, online, taf->name) != 0))
+			return -1;
+
+		val = ConfNodeLookupChildValue(child, "default");
+		if (val != NULL && AffinityParsePrio(val, &taf->prio) != 0) {
+			OBLogError(OB_ERR_INVALID_ARGUMENT, "%s: unknown default prio \"%s\"", taf->name, val);
+			return -1;
+		}
+	}
+
+	if ((val = ConfNodeLookupChildValue(node, "threads")) != NULL)
+	{
+		if (!ConfGetChildValueInt(node, "threads", &threads) || threads <= 0 || threads > UINT32_MAX) {
+			OBLogError(OB_ERR_INVALID_ARGUMENT, "%s: invalid threads \"%s\"", taf->name, val);
+			return -1;
+		}
+		taf->nb_threads = threads;
+	}
+	return 0;
+}
+
+/**
+ *  \brief Load threading.cpu-affinity as if the cpus of online were the
+ *         ones online
+ */
+static int AffinitySetupLoad(const cpu_set_t *online)
+{
+	ThreadsAffinityType *taf;
+	ConfNode *root, *affinity, *node;
+	int i;
+
+	/* defaults: every set is all cpus, balanced */
+	for (i = 0; i < MAX_CPUS_SET; i++)
+	{
+		taf = &thread_affinity[i];
+		OBMutexLock(&taf->taf_mutex);
+		taf->mode_flag = BALANCED_AFFINITY;
+		taf->prio = PRIO_MEDIUM;
+		taf->nb_threads = 0;
+		taf->lcpu = -1;
+		CPU_ZERO(&taf->cpu_set);
+		CPU_ZERO(&taf->lowprio_cpu);
+		CPU_ZERO(&taf->medprio_cpu);
+		CPU_ZERO(&taf->hiprio_cpu);
+		CPU_OR(&taf->cpu_set, &taf->cpu_set, online);
+		OBMutexUnlock(&taf->taf_mutex);
+	}
+
+	node = ConfGetNode("threading.set-cpu-affinity");
+	threading_set_cpu_affinity = node != NULL && node->val != NULL && ConfValIsTrue(node->val);
+
+	root = ConfGetNode("threading.cpu-affinity");
+	if (root == NULL)
+		return 0;
+
+	/* a sequence of single key maps: - <name>-cpu-set: { ... } */
+	TAILQ_FOREACH(affinity, &root->head, next)
+	{
+		node = TAILQ_FIRST(&affinity->head);
+		if (node == NULL || node->name == NULL)
+			continue;
+		taf = GetAffinityTypeFromName(node->name);
+		if (taf == NULL) {
+			OBLogWarning(OB_ERR_INVALID_ARGUMENT, "unknown cpu set %s", node->name);
+			continue;
+		}
+
+		OBMutexLock(&taf->taf_mutex);
+		i = AffinityParseSet(taf, node, online);
+		OBMutexUnlock(&taf->taf_mutex);
+		if (i != 0)
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ *  \brief Load the cpu sets of threading.cpu-affinity, applied to the
+ *         threads spawned after when threading.set-cpu-affinity is set
+ *
+ *  \retval 0 on success, -1 on an invalid setting
+ */
+int AffinitySetupLoadFromConfig(void)
+{
+	cpu_set_t online;
+	int c, ncpu;
+
+	/* the cpus online and allowed to us, not necessarily 0..n-1 */
+	if (sched_getaffinity(0, sizeof(online), &online) != 0)
+	{
+		OBLogWarning(OB_ERR_INVALID_ARGUMENT, "can't get the cpus online: %s", strerror(errno));
+		CPU_ZERO(&online);
+		ncpu = UtilCpuGetNumProcessorsOnline();
+		for (c = 0; c < ncpu; c++) {
+			CPU_SET(c, &online);
+		}
+	}
+	return AffinitySetupLoad(&online);
+}
+
+/**
+ *  \brief Hand out the cpus of the set round robin
+ *
+ *  \retval the cpu
+ */
+int AffinityGetNextCPU(ThreadsAffinityType *taf)
+{
+	int cpu = 0, n;
+
+	OBMutexLock(&taf->taf_mutex);
+	for (n = 1; n <= CPU_SETSIZE; n++)
+	{
+		cpu = (taf->lcpu + n) % CPU_SETSIZE;
+		if (CPU_ISSET(cpu, &taf->cpu_set))
+			break;
+	}
+	taf->lcpu = cpu;
+	OBMutexUnlock(&taf->taf_mutex);
+
+	return cpu;
+}
+
+/**
+ *  \retval the PRIO_* of a thread on cpu
+ */
+int AffinityGetCPUPrio(ThreadsAffinityType *taf, int cpu)
+{
+	if (CPU_ISSET(cpu, &taf->hiprio_cpu))
+		return PRIO_HIGH;
+	if (CPU_ISSET(cpu, &taf->medprio_cpu))
+		return PRIO_MEDIUM;
+	if (CPU_ISSET(cpu, &taf->lowprio_cpu))
+		return PRIO_LOW;
+	return taf->prio;
+}
+
+/**
+ *  \brief Place the calling thread, failures are only warned about
+ *
+ *  \param cpu pin to it, -1 for none
+ *  \param cpus run on them if not pinned, NULL to leave it as is
+ *  \param set_prio set the nice value of the thread to prio
+ */
+void AffinitySetCurrentThread(const char *name, int cpu, const cpu_set_t *cpus,
+		int set_prio, int prio)
+{
+	cpu_set_t cs;
+
+	if (cpu >= 0)
+	{
+		CPU_ZERO(&cs);
+		CPU_SET(cpu, &cs);
+		if (sched_setaffinity(0, sizeof(cs), &cs) != 0) {
+			OBLogWarning(OB_ERR_INVALID_ARGUMENT, "%s: can't pin to cpu %d: %s",
+					name, cpu, strerror(errno));
+		}
+	}
+	else if (cpus != NULL)
+	{
+		if (sched_setaffinity(0, sizeof(*cpus), cpus) != 0) {
+			OBLogWarning(OB_ERR_INVALID_ARGUMENT, "%s: can't set cpu affinity: %s",
+					name, strerror(errno));
+		}
+	}
+	/* nice is per thread on linux, raising it takes CAP_SYS_NICE */
+	if (set_prio && setpriority(PRIO_PROCESS, OBGetThreadIdLong(), prio) != 0) {
+		OBLogWarning(OB_ERR_INVALID_ARGUMENT, "%s: can't set priority %d: %s",
+				name, prio, strerror(errno));
+	}
+}
+
+/*********** unittests ***********/
+
+static void AffinityTestMakeSet(cpu_set_t *set, const char *cpus)
+{
+	CPU_ZERO(set);
+	for (; *cpus != '\0'; cpus++) {
+		CPU_SET(*cpus - '0', set);
+	}
+}
+
+static int AffinityTestCpuSet(cpu_set_t *set, const char *cpus)
+{
+	cpu_set_t want;
+
+	AffinityTestMakeSet(&want, cpus);
+	return CPU_EQUAL(set, &want);
+}
+
+/**
+ * \test cpu lists, modes and priorities, as on a 4 cpu box and with a
+ *       cpu of it offline
+ */
+static int AffinityTestConfig(void)
+{
+	ThreadsAffinityType *taf;
+	cpu_set_t online;
+	int result = 0;
+
+	AffinityTestMakeSet(&online, "0123");
+	ConfCreateContextBackup();
+	if (ConfInit() != 0)
+		goto end;
+
+	ConfSet("threading.set-cpu-affinity", "yes");
+	ConfSet("threading.cpu-affinity.0.management-cpu-set.cpu.0", "0");
+	ConfSet("threading.cpu-affinity.1.decode-cpu-set.cpu.0", "0-1");
+	ConfSet("threading.cpu-affinity.1.decode-cpu-set.cpu.1", "3");
+	ConfSet("threading.cpu-affinity.1.decode-cpu-set.cpu.2", "7");
+	ConfSet("threading.cpu-affinity.1.decode-cpu-set.mode", "exclusive");
+	ConfSet("threading.cpu-affinity.1.decode-cpu-set.prio.high.0", "3");
+	ConfSet("threading.cpu-affinity.1.decode-cpu-set.prio.medium.0", "1-2");
+	ConfSet("threading.cpu-affinity.1.decode-cpu-set.prio.default", "low");
+	ConfSet("threading.cpu-affinity.2.detect-cpu-set.cpu.0", "all");
+	ConfSet("threading.cpu-affinity.2.detect-cpu-set.threads", "3");
+	if (AffinitySetupLoad(&online) != 0 || !threading_set_cpu_affinity)
+		goto end;
+
+	taf = GetAffinityTypeFromName("management-cpu-set");
+	if (taf == NULL || !AffinityTestCpuSet(&taf->cpu_set, "0") || taf->mode_flag != BALANCED_AFFINITY)
+		goto end;
+
+	/* cpu 7 isn't online */
+	taf = GetAffinityTypeFromId(DECODE_CPU_SET);
+	if (!AffinityTestCpuSet(&taf->cpu_set, "013") || taf->mode_flag != EXCLUSIVE_AFFINITY)
+		goto end;
+	if (AffinityGetNextCPU(taf) != 0 || AffinityGetNextCPU(taf) != 1 ||
+			AffinityGetNextCPU(taf) != 3 || AffinityGetNextCPU(taf) != 0)
+		goto end;
+	if (AffinityGetCPUPrio(taf, 3) != PRIO_HIGH || AffinityGetCPUPrio(taf, 1) != PRIO_MEDIUM ||
+			AffinityGetCPUPrio(taf, 0) != PRIO_LOW)
+		goto end;
+
+	taf = GetAffinityTypeFromId(DETECT_CPU_SET);
+	if (!AffinityTestCpuSet(&taf->cpu_set, "0123") || taf->nb_threads != 3)
+		goto end;
+	/* not configured: everything */
+	taf = GetAffinityTypeFromId(OUTPUT_CPU_SET);
+	if (!AffinityTestCpuSet(&taf->cpu_set, "0123") || taf->prio != PRIO_MEDIUM)
+		goto end;
+
+	/* cpu 1 offline, the online cpus aren't 0..n-1 */
+	AffinityTestMakeSet(&online, "023");
+	if (AffinitySetupLoad(&online) != 0)
+		goto end;
+	taf = GetAffinityTypeFromId(DECODE_CPU_SET);
+	if (!AffinityTestCpuSet(&taf->cpu_set, "03"))
+		goto end;
+	taf = GetAffinityTypeFromId(DETECT_CPU_SET);
+	if (!AffinityTestCpuSet(&taf->cpu_set, "023"))
+		goto end;
+	taf = GetAffinityTypeFromId(OUTPUT_CPU_SET);
+	if (!AffinityTestCpuSet(&taf->cpu_set, "023"))
+		goto end;
+
+	/* broken settings */
+	ConfSet("threading.cpu-affinity.1.decode-cpu-set.cpu.2", "3-1");
+	if (AffinitySetupLoad(&online) != -1)
+		goto end;
+	ConfSet("threading.cpu-affinity.1.decode-cpu-set.cpu.2", "-1");
+	if (AffinitySetupLoad(&online) != -1)
+		goto end;
+	ConfSet("threading.cpu-affinity.1.decode-cpu-set.cpu.2", "2x");
+	if (AffinitySetupLoad(&online) != -1)
+		goto end;
+	ConfSet("threading.cpu-affinity.1.decode-cpu-set.cpu.2", "2");
+	ConfSet("threading.cpu-affinity.1.decode-cpu-set.mode", "pinned");
+	if (AffinitySetupLoad(&online) != -1)
+		goto end;
+
+	result = 1;
+end:
+	ConfDeInit();
+	ConfRestoreContextBackup();
+	/* back to what the real config says */
+	AffinitySetupLoadFromConfig();
+	return result;
+}
+
+typedef struct AffinityTestThreadInfo_ {
+    cpu_set_t cpus;
+    int nice;
+} AffinityTestThreadInfo;
+
+static TmEcode AffinityTestThreadInit(ThreadVars *tv, void *initdata, void **data)
+{
+	AffinityTestThreadInfo *info = (AffinityTestThreadInfo *)initdata;
+
+	sched_getaffinity(0, sizeof(info->cpus), &info->cpus);
+	errno = 0;
+	info->nice = getpriority(PRIO_PROCESS, OBGetThreadIdLong());
+	return TM_ECODE_OK;
+}
+
+static TmEcode AffinityTestThreadLoop(ThreadVars *tv, void *data)
+{
+	return TM_ECODE_DONE;
+}
+
+static TmModule tmm_affinity_test = { "AffinityTest", AffinityTestThreadInit, NULL,
+	AffinityTestThreadLoop, NULL, NULL };
+
+/**
+ * \test a spawned thread is placed and reniced by its cpu set
+ */
+static int AffinityTestThread(void)
+{
+	AffinityTestThreadInfo info;
+	ThreadVars *tv;
+	int result = 0;
+
+	memset(&info, 0, sizeof(info));
+	ConfCreateContextBackup();
+	if (ConfInit() != 0)
+		goto end;
+
+	ConfSet("threading.set-cpu-affinity", "yes");
+	ConfSet("threading.cpu-affinity.0.management-cpu-set.cpu.0", "0");
+	ConfSet("threading.cpu-affinity.0.management-cpu-set.mode", "exclusive");
+	ConfSet("threading.cpu-affinity.0.management-cpu-set.prio.default", "low");
+	if (AffinitySetupLoadFromConfig() != 0)
+		goto end;
+
+	if (TmModuleRegister(&tmm_affinity_test) < 0)
+		goto end;
+	tv = TmThreadCreate("TestMgmt", "AffinityTest", &info, NULL, NULL);
+	if (tv == NULL)
+		goto end;
+	TmThreadSetCPUSetType(tv, MANAGEMENT_CPU_SET);
+	if (TmThreadSpawn(tv) != 0 || TmThreadWaitOnThreadInit() != 0)
+		goto end;
+	if (tv->cpu != 0 || CPU_COUNT(&info.cpus) != 1 || !CPU_ISSET(0, &info.cpus) ||
+			info.nice != getpriority(PRIO_PROCESS, 0) + PRIO_LOW)
+		goto end;
+
+	result = 1;
+end:
+	TmThreadKillThreads();
+	TmThreadClearThreadsFamily();
+	ConfDeInit();
+	ConfRestoreContextBackup();
+	AffinitySetupLoadFromConfig();
+	return result;
+}
+
+void AffinityRegisterTests(void)
+{
+	UtRegisterTest("AffinityTestConfig", AffinityTestConfig, 1);
+	UtRegisterTest("AffinityTestThread", AffinityTestThread, 1);
+}
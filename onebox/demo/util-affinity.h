@@ -0,0 +1,52 @@
+#ifndef __UTIL_AFFINITY_H__
+#define __UTIL_AFFINITY_H__
+
+#include "util-threads.h"
+
+/* thread families of threading.cpu-affinity, see TmThreadSetCPUSetType() */
+typedef enum {
+    MANAGEMENT_CPU_SET,
+    RECEIVE_CPU_SET,
+    DECODE_CPU_SET,
+    STREAM_CPU_SET,
+    DETECT_CPU_SET,
+    VERDICT_CPU_SET,
+    REJECT_CPU_SET,
+    OUTPUT_CPU_SET,
+    MAX_CPUS_SET
+} CpuSetType;
+
+enum {
+    BALANCED_AFFINITY,          /**< threads float over the set */
+    EXCLUSIVE_AFFINITY,         /**< each thread pinned to a cpu of the set,
+                                 *   round robin */
+    MAX_AFFINITY
+};
+
+typedef struct ThreadsAffinityType_ {
+    const char *name;           /**< "<name>-cpu-set" in the config */
+    uint8_t mode_flag;
+    int prio;                   /**< PRIO_*, of cpus in none of the lists */
+    uint32_t nb_threads;        /**< "threads", 0 if not set */
+    OBMutex taf_mutex;
+    int lcpu;                   /**< last cpu handed out */
+
+    cpu_set_t cpu_set;
+    cpu_set_t lowprio_cpu;
+    cpu_set_t medprio_cpu;
+    cpu_set_t hiprio_cpu;
+} ThreadsAffinityType;
+
+/* threading.set-cpu-affinity */
+extern int threading_set_cpu_affinity;
+
+int AffinitySetupLoadFromConfig(void);
+ThreadsAffinityType *GetAffinityTypeFromName(const char *name);
+ThreadsAffinityType *GetAffinityTypeFromId(CpuSetType type);
+int AffinityGetNextCPU(ThreadsAffinityType *taf);
+int AffinityGetCPUPrio(ThreadsAffinityType *taf, int cpu);
+void AffinitySetCurrentThread(const char *name, int cpu, const cpu_set_t *cpus,
+        int set_prio, int prio);
+void AffinityRegisterTests(void);
+
+#endif
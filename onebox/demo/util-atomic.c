@@ -1,5 +1,7 @@
 #include "onebox-common.h"
 #include "util-atomic.h"
+#include "util-threads.h"
+#include "util-unittest.h"
 
 int OBAtomicTest(void)
 {
@@ -34,3 +36,157 @@ int OBAtomicTest(void)
     return result;
 }
 
+
+/*********** unittests ***********/
+/**
+ * \test the explicit order operations give the values of the seq_cst ones
+ */
+static int OBAtomicTestOrders(void)
+{
+    uint64_t u64 = 0;
+    uint32_t u32 = 0;
+    int a = 1, b = 2;
+    int *p = &a;
+
+    OBAtomicStoreRelaxed(&u64, UINT64_MAX - 1);
+    OBAtomicAddRelaxed(&u64, 1);
+    if (OBAtomicLoadRelaxed(&u64) != UINT64_MAX)
+        return 0;
+    OBAtomicAddRelaxed(&u64, 1);
+    if (OBAtomicLoadAcquire(&u64) != 0)
+        return 0;
+
+    OBAtomicStoreRelease(&u32, 5);
+    OBAtomicAddRelaxed(&u32, -1);
+    if (OBAtomicLoadAcquire(&u32) != 4 || OBAtomicAddAndFetch(&u32, 1) != 5)
+        return 0;
+    if (OBAtomicCompareAndSwap(&u32, 4, 6) || !OBAtomicCompareAndSwap(&u32, 5, 6) || u32 != 6)
+        return 0;
+
+    if (OBAtomicExchange(&p, &b) != &a || OBAtomicLoadAcquire(&p) != &b)
+        return 0;
+    if (OBAtomicExchangeAcqRel(&p, &a) != &b || OBAtomicLoadRelaxed(&p) != &a)
+        return 0;
+    OBAtomicStoreRelease(&p, NULL);
+    if (OBAtomicLoadRelaxed(&p) != NULL)
+        return 0;
+    return 1;
+}
+
+#define OB_ATOMIC_MP_ROUNDS     (1 << 16)
+
+typedef struct OBAtomicMP_ {
+    uint32_t seq;               /**< round published, odd: data is set */
+    uint64_t data[4];
+} OBAtomicMP;
+
+static void *OBAtomicMPConsumer(void *arg)
+{
+    OBAtomicMP *mp = (OBAtomicMP *)arg;
+    uintptr_t bad = 0;
+    uint32_t round, seq;
+    int i;
+
+    for (round = 0; round < OB_ATOMIC_MP_ROUNDS; round++)
+    {
+        while ((seq = OBAtomicLoadAcquire(&mp->seq)) != 2 * round + 1)
+            sched_yield();
+        for (i = 0; i < 4; i++) {
+            if (mp->data[i] != (uint64_t)round * 4 + i)
+                bad++;
+        }
+        OBAtomicStoreRelease(&mp->seq, seq + 1);
+    }
+    return (void *)bad;
+}
+
+/**
+ * \test data stored before a release store is seen by the thread that
+ *       acquire loaded it, one round after the other
+ */
+static int OBAtomicTestMessagePassing(void)
+{
+    OBAtomicMP mp;
+    pthread_t t;
+    void *bad = NULL;
+    uint32_t round;
+    int i;
+
+    memset(&mp, 0, sizeof(mp));
+    if (pthread_create(&t, NULL, OBAtomicMPConsumer, &mp) != 0)
+        return 0;
+
+    for (round = 0; round < OB_ATOMIC_MP_ROUNDS; round++)
+    {
+        while (OBAtomicLoadAcquire(&mp.seq) != 2 * round)
+            sched_yield();
+        for (i = 0; i < 4; i++) {
+            mp.data[i] = (uint64_t)round * 4 + i;
+        }
+        OBAtomicStoreRelease(&mp.seq, 2 * round + 1);
+    }
+    pthread_join(t, &bad);
+    return bad == NULL && mp.seq == 2 * OB_ATOMIC_MP_ROUNDS;
+}
+
+#define OB_ATOMIC_BENCH_OPS     (1 << 24)
+
+static volatile uint32_t ob_atomic_bench_sink;
+
+static inline uint64_t OBAtomicBenchNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#define OB_ATOMIC_BENCH(label, op) do {                                     \
+    uint64_t _t0 = OBAtomicBenchNs();                                       \
+    for (i = 0; i < OB_ATOMIC_BENCH_OPS; i++) {                             \
+        op;                                                                 \
+    }                                                                       \
+    printf("    %-28s %5.2f ns\n", (label),                                 \
+            (double)(OBAtomicBenchNs() - _t0) / OB_ATOMIC_BENCH_OPS);       \
+} while (0)
+
+/**
+ * \brief ns per operation of each memory order, uncontended. On x86 only
+ *        the seq_cst store pays a fence, the read-modify-writes are all
+ *        lock prefixed whatever their order.
+ */
+static int OBAtomicBenchOrders(void)
+{
+    OB_ATOMIC_DECL_AND_INIT(uint32_t, var);
+    uint32_t u32 = 0, sum = 0, old;
+    uint32_t i;
+
+    printf("\n");
+#ifdef OB_ATOMIC_BUILTINS
+    OB_ATOMIC_BENCH("store seq_cst", __atomic_store_n(&u32, i, __ATOMIC_SEQ_CST));
+#endif
+    OB_ATOMIC_BENCH("store release", OBAtomicStoreRelease(&u32, i));
+    OB_ATOMIC_BENCH("store relaxed", OBAtomicStoreRelaxed(&u32, i));
+    OB_ATOMIC_BENCH("load acquire", sum += OBAtomicLoadAcquire(&u32));
+    OB_ATOMIC_BENCH("load relaxed", sum += OBAtomicLoadRelaxed(&u32));
+    OB_ATOMIC_BENCH("add and fetch", OBAtomicAddAndFetch(&u32, 1));
+    OB_ATOMIC_BENCH("add relaxed", OBAtomicAddRelaxed(&u32, 1));
+    /* how OB_ATOMIC_SET was done before it was a release store */
+    OB_ATOMIC_BENCH("set with a CAS loop", do {
+        old = var_ob_atomic__;
+    } while (!OBAtomicCompareAndSwap(&var_ob_atomic__, old, i)));
+    OB_ATOMIC_BENCH("OB_ATOMIC_SET", (void)OB_ATOMIC_SET(var, i));
+    OB_ATOMIC_BENCH("OB_ATOMIC_GET", sum += OB_ATOMIC_GET(var));
+
+    /* keep the loads */
+    ob_atomic_bench_sink = sum;
+    return 1;
+}
+
+void OBAtomicRegisterTests(void)
+{
+    UtRegisterTest("OBAtomicTest", OBAtomicTest, 1);
+    UtRegisterTest("OBAtomicTestOrders", OBAtomicTestOrders, 1);
+    UtRegisterTest("OBAtomicTestMessagePassing", OBAtomicTestMessagePassing, 1);
+    UtRegisterTest("OBAtomicBenchOrders", OBAtomicBenchOrders, 1);
+}
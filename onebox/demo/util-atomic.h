@@ -18,9 +18,36 @@
  */
 #define hw_barrier() __sync_synchronize()
 
+/* gcc >= 4.7 and clang have the __atomic builtins, with the memory order
+ * of each operation explicit. Without them everything falls back to the
+ * __sync builtins, which are full barriers. */
+#if defined(__ATOMIC_RELAXED) && !defined(OB_ATOMIC_SYNC)
+#define OB_ATOMIC_BUILTINS 1
+#endif
+
+/**
+ *  Ordering between threads for lock-free structures. ob_smp_rmb() keeps
+ *  the loads before it ahead of the loads and stores after it (acquire),
+ *  ob_smp_wmb() the loads and stores before it ahead of the stores after
+ *  it (release). x86 only reorders stores after loads, so there it is the
+ *  compiler that must be held back.
+ */
+#ifdef OB_ATOMIC_BUILTINS
+#define ob_smp_rmb()    __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define ob_smp_wmb()    __atomic_thread_fence(__ATOMIC_RELEASE)
+#elif defined(__i386__) || defined(__x86_64__)
+#define ob_smp_rmb()    cc_barrier()
+#define ob_smp_wmb()    cc_barrier()
+#else
+#define ob_smp_rmb()    hw_barrier()
+#define ob_smp_wmb()    hw_barrier()
+#endif
+
 //#if (!defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_8) || !defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_4) || 
 //     !defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_2) || !defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_1)) )
 
+#ifdef OB_ATOMIC_BUILTINS
+
 /**
  *  \brief wrapper for OS/compiler specific atomic compare and swap (CAS)
  *         function.
@@ -32,8 +59,11 @@
  *  \retval 0 CAS failed
  *  \retval 1 CAS succeeded
  */
-#define OBAtomicCompareAndSwap(addr, tv, nv) \
-    __sync_bool_compare_and_swap((addr), (tv), (nv))
+#define OBAtomicCompareAndSwap(addr, tv, nv) ({                             \
+    __typeof__(*(addr)) _ob_tv = (tv);                                      \
+    __atomic_compare_exchange_n((addr), &_ob_tv, (nv), 0,                   \
+            __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);                            \
+})
 
 /**
  *  \brief wrapper for OS/compiler specific atomic fetch and add
@@ -43,7 +73,7 @@
  *  \param value Value to add to the variable at addr
  */
 #define OBAtomicFetchAndAdd(addr, value) \
-    __sync_fetch_and_add((addr), (value))
+    __atomic_fetch_add((addr), (value), __ATOMIC_SEQ_CST)
 
 /**
  *  \brief wrapper for OS/compiler specific atomic fetch and sub
@@ -53,7 +83,7 @@
  *  \param value Value to sub from the variable at addr
  */
 #define OBAtomicFetchAndSub(addr, value) \
-    __sync_fetch_and_sub((addr), (value))
+    __atomic_fetch_sub((addr), (value), __ATOMIC_SEQ_CST)
 
 /**
  *  \brief wrapper for OS/compiler specific atomic fetch and add
@@ -63,7 +93,7 @@
  *  \param value Value to add to the variable at addr
  */
 #define OBAtomicAddAndFetch(addr, value) \
-    __sync_add_and_fetch((addr), (value))
+    __atomic_add_fetch((addr), (value), __ATOMIC_SEQ_CST)
 
 /**
  *  \brief wrapper for OS/compiler specific atomic fetch and sub
@@ -73,7 +103,7 @@
  *  \param value Value to sub from the variable at addr
  */
 #define OBAtomicSubAndFetch(addr, value) \
-    __sync_sub_and_fetch((addr), (value))
+    __atomic_sub_fetch((addr), (value), __ATOMIC_SEQ_CST)
 
 /**
  *  \brief wrapper for OS/compiler specific atomic fetch and "AND"
@@ -83,7 +113,7 @@
  *  \param value Value to add to the variable at addr
  */
 #define OBAtomicFetchAndAnd(addr, value) \
-    __sync_fetch_and_and((addr), (value))
+    __atomic_fetch_and((addr), (value), __ATOMIC_SEQ_CST)
 
 /**
  *  \brief wrapper for OS/compiler specific atomic fetch and "NAND"
@@ -93,7 +123,7 @@
  *  \param value Value to add to the variable at addr
  */
 #define OBAtomicFetchAndNand(addr, value) \
-    __sync_fetch_and_nand((addr), (value))
+    __atomic_fetch_nand((addr), (value), __ATOMIC_SEQ_CST)
 
 /**
  *  \brief wrapper for OS/compiler specific atomic fetch and "XOR"
@@ -103,7 +133,7 @@
  *  \param value Value to add to the variable at addr
  */
 #define OBAtomicFetchAndXor(addr, value) \
-    __sync_fetch_and_xor((addr), (value))
+    __atomic_fetch_xor((addr), (value), __ATOMIC_SEQ_CST)
 
 /**
  *  \brief wrapper for OS/compiler specific atomic fetch and or
@@ -112,8 +142,124 @@
  *  \param addr Address of the variable to or to
  *  \param value Value to add to the variable at addr
  */
+#define OBAtomicFetchAndOr(addr, value) \
+    __atomic_fetch_or((addr), (value), __ATOMIC_SEQ_CST)
+
+/**
+ *  \brief wrapper for OS/compiler specific atomic exchange function.
+ *
+ *  \param addr Address of the variable to swap
+ *  \param value Value to store at addr
+ *
+ *  \retval the previous value at addr
+ *
+ *  \warning this is only an acquire barrier, put ob_smp_wmb() in front of
+ *           it when the stores before it have to be seen first
+ */
+#define OBAtomicExchange(addr, value) \
+    __atomic_exchange_n((addr), (value), __ATOMIC_ACQUIRE)
+
+/**
+ *  \brief Atomic exchange with acquire and release order, publishes the
+ *         stores before it to the thread that next reads or swaps addr
+ *
+ *  \retval the previous value at addr
+ */
+#define OBAtomicExchangeAcqRel(addr, value) \
+    __atomic_exchange_n((addr), (value), __ATOMIC_ACQ_REL)
+
+/**
+ *  \brief Load with acquire order: the loads and stores after it are not
+ *         done before it. Pairs with OBAtomicStoreRelease().
+ *
+ *  \param addr Address of the variable to read
+ *
+ *  \retval the value at addr
+ */
+#define OBAtomicLoadAcquire(addr) \
+    __atomic_load_n((addr), __ATOMIC_ACQUIRE)
+
+/**
+ *  \brief Load without ordering, it is only not torn and not cached in a
+ *         register by the compiler
+ */
+#define OBAtomicLoadRelaxed(addr) \
+    __atomic_load_n((addr), __ATOMIC_RELAXED)
+
+/**
+ *  \brief Store with release order: the loads and stores before it are
+ *         done before it, publishing what they wrote to a thread that
+ *         reads the value with OBAtomicLoadAcquire()
+ *
+ *  \param addr Address of the variable to write
+ *  \param value Value to store at addr
+ */
+#define OBAtomicStoreRelease(addr, value) \
+    __atomic_store_n((addr), (value), __ATOMIC_RELEASE)
+
+/**
+ *  \brief Store without ordering
+ */
+#define OBAtomicStoreRelaxed(addr, value) \
+    __atomic_store_n((addr), (value), __ATOMIC_RELAXED)
+
+/**
+ *  \brief Atomic add without ordering, for counters nothing else depends
+ *         on. Still a locked instruction on x86, but no fence elsewhere
+ *         and the compiler may move other accesses across it.
+ *
+ *  \param addr Address of the variable to add to
+ *  \param value Value to add to the variable at addr
+ *
+ *  \retval the new value
+ */
+#define OBAtomicAddRelaxed(addr, value) \
+    __atomic_add_fetch((addr), (value), __ATOMIC_RELAXED)
+
+#else /* !OB_ATOMIC_BUILTINS: __sync builtins, all full barriers */
+
+#define OBAtomicCompareAndSwap(addr, tv, nv) \
+    __sync_bool_compare_and_swap((addr), (tv), (nv))
+#define OBAtomicFetchAndAdd(addr, value) \
+    __sync_fetch_and_add((addr), (value))
+#define OBAtomicFetchAndSub(addr, value) \
+    __sync_fetch_and_sub((addr), (value))
+#define OBAtomicAddAndFetch(addr, value) \
+    __sync_add_and_fetch((addr), (value))
+#define OBAtomicSubAndFetch(addr, value) \
+    __sync_sub_and_fetch((addr), (value))
+#define OBAtomicFetchAndAnd(addr, value) \
+    __sync_fetch_and_and((addr), (value))
+#define OBAtomicFetchAndNand(addr, value) \
+    __sync_fetch_and_nand((addr), (value))
+#define OBAtomicFetchAndXor(addr, value) \
+    __sync_fetch_and_xor((addr), (value))
 #define OBAtomicFetchAndOr(addr, value) \
     __sync_fetch_and_or((addr), (value))
+#define OBAtomicExchange(addr, value) \
+    __sync_lock_test_and_set((addr), (value))
+#define OBAtomicExchangeAcqRel(addr, value) ({                             \
+    ob_smp_wmb();                                                           \
+    __sync_lock_test_and_set((addr), (value));                              \
+})
+
+#define OBAtomicLoadAcquire(addr) ({                                        \
+    __typeof__(*(addr)) _ob_v = *(volatile __typeof__(*(addr)) *)(addr);   \
+    ob_smp_rmb();                                                           \
+    _ob_v;                                                                  \
+})
+#define OBAtomicLoadRelaxed(addr) \
+    (*(volatile __typeof__(*(addr)) *)(addr))
+#define OBAtomicStoreRelease(addr, value) ({                                 \
+    ob_smp_wmb();                                                           \
+    *(volatile __typeof__(*(addr)) *)(addr) = (value);                      \
+})
+#define OBAtomicStoreRelaxed(addr, value) \
+    (*(volatile __typeof__(*(addr)) *)(addr) = (value))
+#define OBAtomicAddRelaxed(addr, value) \
+    __sync_add_and_fetch((addr), (value))
+
+#endif /* OB_ATOMIC_BUILTINS */
 
 /**
  *  \brief wrapper for declaring atomic variables.
@@ -234,23 +380,21 @@
     OBAtomicCompareAndSwap((name ## _ob_atomic__), cmpval, newval)
 
 /**
- *  \brief Get the value from the atomic variable.
+ *  \brief Get the value from the atomic variable, with acquire order so
+ *         what was published with OB_ATOMIC_SET() is seen
  *
  *  \retval var value
  */
 #define OB_ATOMIC_GET(name) \
-    (name ## _ob_atomic__)
+    OBAtomicLoadAcquire(&(name ## _ob_atomic__))
 
 /**
- *  \brief Set the value for the atomic variable.
- *
- *  \retval var value
+ *  \brief Set the value for the atomic variable, a release store
  */
-#define OB_ATOMIC_SET(name, val) ({       \
-    while (OB_ATOMIC_CAS(&name, OB_ATOMIC_GET(name), val) == 0) \
-        ;                                                       \
-        })
+#define OB_ATOMIC_SET(name, val) \
+    OBAtomicStoreRelease(&(name ## _ob_atomic__), (val))
 
 
 int OBAtomicTest(void);
+void OBAtomicRegisterTests(void);
 #endif
@@ -4,13 +4,18 @@
 #include "util-debug.h"
 #include "util-mem.h"
 #include "util-path.h"
+#include "util-misc.h"
+#include "util-threads.h"
+#include "util-rcu.h"
 
 /************ vars ************/
 /** Maximum size of a complete domain name. */
 #define NODE_NAME_MAX 1024
 
+/* RCU protected, see ConfReplaceRoot() */
 static ConfNode *root = NULL;
 static ConfNode *root_backup = NULL;
+static OBMutex root_lock = OBMUTEX_INITIALIZER;
 
 /************ funcs ************/
 static ConfNode *ConfGetNodeOrCreate(char *name, int final)
@@ -21,6 +26,9 @@ static ConfNode *ConfGetNodeOrCreate(char *name, int final)
 	char *key;
 	char *next;
 
+	if (parent == NULL)
+		return NULL;
+
 	if (strlcpy(node_name, name, sizeof(node_name)) >= sizeof(node_name)) {
 		OBLogError(OB_ERR_CONF_NAME_TOO_LONG,"Configuration name too long: %s", name);
 		return NULL;
@@ -39,7 +47,7 @@ static ConfNode *ConfGetNodeOrCreate(char *name, int final)
 				OBLogWarning(OB_ERR_MEM_ALLOC,"Failed to allocate memory for configuration.");
 				goto end;
 			}
-			node->name = OBStrdup(key);
+			node->name = OBStrdupTag(OB_MEM_TAG_CONF, key);
 			if (unlikely(node->name == NULL)) 
 			{
 				ConfNodeFree(node);
@@ -61,20 +69,23 @@ end:
 
 /**
  * \brief Initialize the configuration system.
+ *
+ * \retval 0 on success, -1 if the root node can't be allocated
  */
-void ConfInit(void)
+int ConfInit(void)
 {
 	if (root != NULL) {
 		OBLogDebug("already initialized");
-		return;
+		return 0;
 	}
 
 	root = ConfNodeNew();
 	if (root == NULL) {
-		OBLogError(OB_ERR_MEM_ALLOC, "ERROR: Failed to allocate memory for root configuration node, aborting.");
-		exit(EXIT_FAILURE);
+		OBLogError(OB_ERR_MEM_ALLOC, "ERROR: Failed to allocate memory for root configuration node.");
+		return -1;
 	}
 	OBLogDebug("configuration module initialized");
+	return 0;
 }
 
 /**
@@ -86,7 +97,7 @@ ConfNode *ConfNodeNew(void)
 {
 	ConfNode *new=NULL;
 
-	new = OBCalloc(1, sizeof(*new));
+	new = OBCallocTag(OB_MEM_TAG_CONF, 1, sizeof(*new));
 	if (unlikely(new == NULL)) {
 		return NULL;
 	}
@@ -128,11 +139,13 @@ void ConfNodeFree(ConfNode *node)
  */
 ConfNode *ConfGetNode(char *name)
 {
-	ConfNode *node = root;
+	ConfNode *node = OBRcuDereference(root);
 	char node_name[NODE_NAME_MAX];
 	char *key;
 	char *next;
 
+	if (node == NULL)
+		return NULL;
 	if (strlcpy(node_name, name, sizeof(node_name)) >= sizeof(node_name)) {
 		OBLogError(OB_ERR_CONF_NAME_TOO_LONG, "Configuration name too long: %s", name);
 		return NULL;
@@ -152,10 +165,38 @@ ConfNode *ConfGetNode(char *name)
 
 /**
  * \brief Get the root configuration node.
+ *
+ * The tree may be replaced by ConfReplaceRoot(), threads registered with
+ * OBRcuRegisterThread() can use it until their next quiescent state.
  */
 ConfNode *ConfGetRootNode(void)
 {
-	return root;
+	return OBRcuDereference(root);
+}
+
+/**
+ * \brief Replace the whole configuration tree, the old one is freed once
+ *        the threads that may still walk it are past a quiescent state.
+ *
+ * ConfSet() changes the live tree in place, it is only safe before the
+ * threads reading the configuration run. Updates after that build a new
+ * tree, see ConfReloadFile().
+ *
+ * \param node The new root configuration node.
+ */
+void ConfReplaceRoot(ConfNode *node)
+{
+	ConfNode *old;
+
+	OBMutexLock(&root_lock);
+	old = root;
+	OBRcuAssignPointer(root, node);
+	if (old != NULL)
+		OBRcuSynchronize();
+	OBMutexUnlock(&root_lock);
+
+	if (old != NULL)
+		ConfNodeFree(old);
 }
 
 /**
@@ -178,7 +219,7 @@ int ConfSet(char *name, char *val)
 	}
 
 	if (node->val != NULL) OBFree(node->val);
-	node->val = OBStrdup(val);
+	node->val = OBStrdupTag(OB_MEM_TAG_CONF, val);
 	if (unlikely(node->val == NULL)) {
 		return 0;
 	}
@@ -207,7 +248,7 @@ int ConfSetFinal(char *name, char *val)
 	}
 
 	if (node->val != NULL) OBFree(node->val);
-	node->val = OBStrdup(val);
+	node->val = OBStrdupTag(OB_MEM_TAG_CONF, val);
 	if (unlikely(node->val == NULL)) {
 		return 0;
 	}
@@ -321,6 +362,43 @@ int ConfGetChildValueInt(ConfNode *base, char *name, intmax_t *val)
 	return 1;
 }
 
+/**
+ * \brief Retrieve a configuration value as a size in bytes.
+ *
+ * Values may carry a kb, mb or gb suffix, e.g. "64mb".
+ *
+ * \param name Name of configuration parameter to get.
+ * \param val Pointer to a uint64_t that will be set the size in bytes.
+ *
+ * \retval 1 will be returned if the name is found and was properly
+ * converted to a size, otherwise 0 will be returned.
+ */
+int ConfGetSize(char *name, uint64_t *val)
+{
+	char *strval;
+
+	if (ConfGet(name, &strval) == 0)
+		return 0;
+
+	if (ParseSizeStringU64(strval, val) < 0)
+		return 0;
+
+	return 1;
+}
+
+int ConfGetChildValueSize(ConfNode *base, char *name, uint64_t *val)
+{
+	char *strval;
+
+	if (ConfGetChildValue(base, name, &strval) == 0)
+		return 0;
+
+	if (ParseSizeStringU64(strval, val) < 0)
+		return 0;
+
+	return 1;
+}
+
 int ConfGetChildValueIntWithDefault(ConfNode *base, ConfNode *dflt, char *name, intmax_t *val)
 {
 	int ret = ConfGetChildValueInt(base, name, val);
@@ -586,7 +664,7 @@ void ConfNodeDump(ConfNode *node, const char *prefix)
 	level++;
 	TAILQ_FOREACH(child, &node->head, next) 
 	{
-		name[level] = OBStrdup(child->name);
+		name[level] = OBStrdupTag(OB_MEM_TAG_CONF, child->name);
 		if (unlikely(name[level] == NULL)) {
 			continue;
 		}
@@ -608,7 +686,7 @@ void ConfNodeDump(ConfNode *node, const char *prefix)
  */
 void ConfDump(void)
 {
-	ConfNodeDump(root, NULL);
+	ConfNodeDump(ConfGetRootNode(), NULL);
 }
 
 /**
@@ -718,7 +796,7 @@ char *ConfLoadCompleteIncludePath(char *file)
 		{
 			OBLogDebug("Default path: %s", defaultpath);
 			size_t path_len = sizeof(char) * (strlen(defaultpath) + strlen(file) + 2);
-			path = OBMalloc(path_len);
+			path = OBMallocTag(OB_MEM_TAG_CONF, path_len);
 			if (unlikely(path == NULL))
 				return NULL;
 
@@ -729,14 +807,14 @@ char *ConfLoadCompleteIncludePath(char *file)
 		}
 		else
 		{
-			path = OBStrdup(file);
+			path = OBStrdupTag(OB_MEM_TAG_CONF, file);
 			if (unlikely(path == NULL))
 				return NULL;
 		}
 	} 
 	else
 	{
-		path = OBStrdup(file);
+		path = OBStrdupTag(OB_MEM_TAG_CONF, file);
 		if (unlikely(path == NULL))
 			return NULL;
 	}
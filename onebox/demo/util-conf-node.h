@@ -20,11 +20,13 @@ typedef struct ConfNode_ {
     TAILQ_ENTRY(ConfNode_) next;
 } ConfNode;
 
-void ConfInit(void);
+int ConfInit(void);
 void ConfDeInit(void);
 ConfNode *ConfGetRootNode(void);
+void ConfReplaceRoot(ConfNode *);
 int ConfGet(char *name, char **vptr);
 int ConfGetInt(char *name, intmax_t *val);
+int ConfGetSize(char *name, uint64_t *val);
 int ConfGetBool(char *name, int *val);
 int ConfGetDouble(char *name, double *val);
 int ConfGetFloat(char *name, float *val);
@@ -49,6 +51,7 @@ void ConfNodePrune(ConfNode *node);
 ConfNode *ConfNodeLookupKeyValue(ConfNode *base, const char *key, const char *value);
 int ConfGetChildValue(ConfNode *base, char *name, char **vptr);
 int ConfGetChildValueInt(ConfNode *base, char *name, intmax_t *val);
+int ConfGetChildValueSize(ConfNode *base, char *name, uint64_t *val);
 int ConfGetChildValueBool(ConfNode *base, char *name, int *val);
 int ConfGetChildValueWithDefault(ConfNode *base, ConfNode *dflt, char *name, char **vptr);
 int ConfGetChildValueIntWithDefault(ConfNode *base, ConfNode *dflt, char *name, intmax_t *val);
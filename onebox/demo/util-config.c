@@ -5,6 +5,10 @@
 #include "util-mem.h"
 #include "util-path.h"
 #include "util-conf-node.h"
+#include "util-threads.h"
+#include "util-atomic.h"
+#include "util-rcu.h"
+#include "util-unittest.h"
 #include <yaml.h>
 
 /************ define *************/
@@ -17,6 +21,7 @@
 /************* vars  *************/
 static int mangle_errors = 0;
 static char *conf_dirname = NULL;
+static ConfNode *conf_load_root = NULL;    /**< the tree being loaded */
 
 /* Configuration processing states. */
 enum conf_state {
@@ -165,17 +170,13 @@ static int ConfYamlParse(yaml_parser_t *parser, ConfNode *parent, int inseq)
 				{
 					seq_node = ConfNodeNew();
 					if (unlikely(seq_node == NULL)) {
-						return -1;
-					}
-					seq_node->name = OBStrdup(sequence_node_name);
-					if (unlikely(seq_node->name == NULL)) {
-						OBFree(seq_node);
-						return -1;
+						goto fail;
 					}
-					seq_node->val = OBStrdup(value);
-					if (unlikely(seq_node->val == NULL)) {
-						OBFree(seq_node->name);
-						return -1;
+					seq_node->name = OBStrdupTag(OB_MEM_TAG_CONF, sequence_node_name);
+					seq_node->val = OBStrdupTag(OB_MEM_TAG_CONF, value);
+					if (unlikely(seq_node->name == NULL || seq_node->val == NULL)) {
+						ConfNodeFree(seq_node);
+						goto fail;
 					}
 				}
 				TAILQ_INSERT_TAIL(&parent->head, seq_node, next);	
@@ -193,7 +194,7 @@ static int ConfYamlParse(yaml_parser_t *parser, ConfNode *parent, int inseq)
 				else if (state == CONF_KEY) 
 				{
 					/* Top level include statements. */
-					if ((strcmp(value, "include") == 0) && (parent == ConfGetRootNode())) 
+					if ((strcmp(value, "include") == 0) && (parent == conf_load_root)) 
 					{
 						state = CONF_INCLUDE;
 						goto next;
@@ -203,7 +204,7 @@ static int ConfYamlParse(yaml_parser_t *parser, ConfNode *parent, int inseq)
 					{
 						if (parent->val == NULL) 
 						{
-							parent->val = OBStrdup(value);
+							parent->val = OBStrdupTag(OB_MEM_TAG_CONF, value);
 							if (parent->val && strchr(parent->val, '_'))
 								Mangle(parent->val);
 						}
@@ -221,8 +222,15 @@ static int ConfYamlParse(yaml_parser_t *parser, ConfNode *parent, int inseq)
 					else 
 					{
 						node = ConfNodeNew();
-						node->name = OBStrdup(value);
-						if (node->name && strchr(node->name, '_')) 
+						if (unlikely(node == NULL)) {
+							goto fail;
+						}
+						node->name = OBStrdupTag(OB_MEM_TAG_CONF, value);
+						if (unlikely(node->name == NULL)) {
+							ConfNodeFree(node);
+							goto fail;
+						}
+						if (strchr(node->name, '_')) 
 						{
 							if (!(parent->name &&
 								((strcmp(parent->name, "address-groups") == 0) ||
@@ -257,7 +265,9 @@ static int ConfYamlParse(yaml_parser_t *parser, ConfNode *parent, int inseq)
 					{
 						if (node->val != NULL)
 							OBFree(node->val);
-						node->val = OBStrdup(value);
+						node->val = OBStrdupTag(OB_MEM_TAG_CONF, value);
+						if (unlikely(node->val == NULL))
+							goto fail;
 					}
 					state = CONF_KEY;
 				}
@@ -296,13 +306,13 @@ static int ConfYamlParse(yaml_parser_t *parser, ConfNode *parent, int inseq)
 					seq_node = ConfNodeNew();
 					if (unlikely(seq_node == NULL)) 
 					{
-						return -1;
+						goto fail;
 					}
-					seq_node->name = OBStrdup(sequence_node_name);
+					seq_node->name = OBStrdupTag(OB_MEM_TAG_CONF, sequence_node_name);
 					if (unlikely(seq_node->name == NULL)) 
 					{
-						OBFree(seq_node);
-						return -1;
+						ConfNodeFree(seq_node);
+						goto fail;
 					}
 				}
 				seq_node->is_seq = 1;
@@ -337,16 +347,13 @@ fail:
 	return 0;
 }
 
-int ConfLoadFile(char *filename)
+static int ConfYamlLoadFile(char *filename, ConfNode *root)
 {
 	int ret = 0; 
 	FILE *infile = NULL;
 	yaml_parser_t parser;
 	struct stat stat_buf;
 
-	//...
-	ConfNode *root = ConfGetRootNode();
-
 	//.....
 	if (yaml_parser_initialize(&parser) != 1) {
 		OBLogError(OB_ERR_FATAL, "failed to initialize yaml parser.");
@@ -374,10 +381,126 @@ int ConfLoadFile(char *filename)
 
 	//...
 	yaml_parser_set_input_file(&parser, infile);
+	conf_load_root = root;
 	ret = ConfYamlParse(&parser, root, 0);
+	conf_load_root = NULL;
 	yaml_parser_delete(&parser);
 	fclose(infile);
 
 	return ret;
 }
 
+int ConfLoadFile(char *filename)
+{
+	return ConfYamlLoadFile(filename, ConfGetRootNode());
+}
+
+/**
+ * \brief Load a configuration file into a new tree and make it the live
+ *        one, the threads reading the old one are waited for before it is
+ *        freed. Nothing is changed if the file doesn't load.
+ *
+ * \retval 0 on success, -1 on failure.
+ */
+int ConfReloadFile(char *filename)
+{
+	ConfNode *root;
+
+	root = ConfNodeNew();
+	if (root == NULL)
+		return -1;
+	if (ConfYamlLoadFile(filename, root) != 0) {
+		ConfNodeFree(root);
+		return -1;
+	}
+	ConfReplaceRoot(root);
+	return 0;
+}
+
+
+/************* unittests *************/
+typedef struct ConfYamlTestReader_ {
+    uint32_t stop;
+    uint64_t reads;
+    uint64_t bad;
+} ConfYamlTestReader;
+
+static void *ConfYamlTestRead(void *arg)
+{
+	ConfYamlTestReader *r = (ConfYamlTestReader *)arg;
+	ConfNode *node;
+
+	if (OBRcuRegisterThread("ConfYamlTest") != 0) {
+		r->bad++;
+		return NULL;
+	}
+	while (!OBAtomicLoadAcquire(&r->stop))
+	{
+		node = ConfGetNode("stats.interval");
+		if (node == NULL || node->val == NULL ||
+			(strcmp(node->val, "8") != 0 && strcmp(node->val, "3") != 0))
+			r->bad++;
+		r->reads++;
+		OBRcuQuiescentState();
+	}
+	OBRcuUnregisterThread();
+	return NULL;
+}
+
+/**
+ * \test a reload swaps the tree under a reader, a file that doesn't load
+ *       leaves the configuration as it is
+ */
+static int ConfYamlTestReload(void)
+{
+	static const char yaml[] = "%YAML 1.1\n---\nstats:\n  interval: 3\n";
+	char filename[] = "/tmp/onebox-conf-XXXXXX";
+	ConfYamlTestReader r;
+	pthread_t t;
+	char *val;
+	int fd, started = 0, i, result = 0;
+
+	memset(&r, 0, sizeof(r));
+	fd = mkstemp(filename);
+	if (fd < 0)
+		return 0;
+	if (write(fd, yaml, sizeof(yaml) - 1) != (ssize_t)sizeof(yaml) - 1) {
+		close(fd);
+		unlink(filename);
+		return 0;
+	}
+	close(fd);
+
+	ConfCreateContextBackup();
+	if (ConfInit() != 0 || ConfSet("stats.interval", "8") != 1)
+		goto end;
+	if (pthread_create(&t, NULL, ConfYamlTestRead, &r) != 0)
+		goto end;
+	started = 1;
+
+	for (i = 0; i < 16; i++) {
+		if (ConfReloadFile(filename) != 0)
+			goto end;
+	}
+	if (ConfReloadFile("/nonexistent/onebox.yaml") != -1)
+		goto end;
+	if (ConfGet("stats.interval", &val) != 1 || strcmp(val, "3") != 0)
+		goto end;
+	result = 1;
+end:
+	if (started) {
+		OBAtomicStoreRelease(&r.stop, 1);
+		pthread_join(t, NULL);
+		if (r.bad != 0)
+			result = 0;
+	}
+	ConfDeInit();
+	ConfRestoreContextBackup();
+	unlink(filename);
+	return result;
+}
+
+void ConfYamlRegisterTests(void)
+{
+	UtRegisterTest("ConfYamlTestReload", ConfYamlTestReload, 1);
+}
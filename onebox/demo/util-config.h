@@ -2,5 +2,8 @@
 #define __UTIL_CONFIG_H__
 
 int ConfLoadFile(char *filename);
+int ConfReloadFile(char *filename);
+
+void ConfYamlRegisterTests(void);
 
 #endif
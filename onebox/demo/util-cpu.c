@@ -1,5 +1,6 @@
 #include "onebox-common.h"
 #include "util-cpu.h"
+#include "util-atomic.h"
 
 /************vars**********/
 uint32_t ob_cacheline_size = 0;
@@ -21,12 +22,16 @@ static void OBCpuid(uint32_t i, uint32_t *buf)
     buf[3] = ecx;
 }
 
-/* auto detect the L2 cache line size of modern and widespread CPUs */
+/* auto detect the L2 cache line size of modern and widespread CPUs,
+ * sysconf() tells the others. Done by main() before the threads start,
+ * pools created earlier detect it themselves: every thread gets the same
+ * size, so it is just stored by whichever finishes first. */
 
 void OBCpuinfo(void)
 {
     u_char    *vendor;
-    uint32_t   vbuf[6], cpu[4], model;
+    uint32_t   vbuf[6], cpu[4], model, size = 0;
+    long       line;
 
     vbuf[0] = 0;
     vbuf[1] = 0;
@@ -39,12 +44,10 @@ void OBCpuinfo(void)
     vendor = (u_char *) &vbuf[1];
 
     if (vbuf[0] == 0) {
-        return;
+        goto fallback;
     }
 
-    printf("vendor 0 %s\r\n", vendor);
     OBCpuid(1, cpu);
-    printf("vendor 1 %s\r\n", (u_char *)vbuf);
 
     if (strcmp((const char *)vendor, "GenuineIntel") == 0) {
 
@@ -52,18 +55,18 @@ void OBCpuinfo(void)
 
         /* Pentium */
         case 5:
-            ob_cacheline_size = 32;
+            size = 32;
             break;
 
         /* Pentium Pro, II, III */
         case 6:
-            ob_cacheline_size = 32;
+            size = 32;
 
             model = ((cpu[0] & 0xf0000) >> 8) | (cpu[0] & 0xf0);
 
             if (model >= 0xd0) {
                 /* Intel Core, Core 2, Atom */
-                ob_cacheline_size = 64;
+                size = 64;
             }
 
             break;
@@ -73,16 +76,40 @@ void OBCpuinfo(void)
          * it prefetches up to two cache lines during memory read
          */
         case 15:
-            ob_cacheline_size = 128;
+            size = 128;
             break;
         }
 
     } else if (strcmp((const char *)vendor, "AuthenticAMD") == 0) {
-        ob_cacheline_size = 64;
+        size = 64;
     }
+
+fallback:
+    if (size == 0) {
+        line = sysconf(_SC_LEVEL1_DCACHE_LINESIZE);
+        size = (line > 0) ? (uint32_t)line : 64;
+    }
+    OBAtomicStoreRelaxed(&ob_cacheline_size, size);
 }
 
 
+/**
+ * \brief Get the cache line size, detecting it on first use
+ *
+ * \retval the size in bytes, 64 if the cpu couldn't tell us
+ */
+uint32_t UtilCpuGetCacheLineSize(void)
+{
+    uint32_t size = OBAtomicLoadRelaxed(&ob_cacheline_size);
+
+    if (size == 0) {
+        OBCpuinfo();
+        size = OBAtomicLoadRelaxed(&ob_cacheline_size);
+    }
+
+    return size;
+}
+
 /**
  * \brief Get the number of cpus configured in the system
  * \retval 0 if the syscall is not available or we have an error;
@@ -190,4 +217,5 @@ void UtilCpuPrintSummary()
 	printf("Couldn't retireve any information of CPU's\r\n");
 
     printf("cpu ticks is %lu\r\n", ticks);
+    printf("cache line size: %u\r\n", UtilCpuGetCacheLineSize());
 }
@@ -11,4 +11,9 @@ void UtilCpuPrintSummary();
 
 uint64_t UtilCpuGetTicks(void);
 
+/* L2 cache line size, detected by OBCpuinfo() */
+extern uint32_t ob_cacheline_size;
+void OBCpuinfo(void);
+uint32_t UtilCpuGetCacheLineSize(void);
+
 #endif
@@ -21,6 +21,8 @@ const char * OBErrorToString(OBError err)
         CASE_CODE (OB_ERR_CONF_LOAD);
         CASE_CODE (OB_ERR_CONF_YAML_ERROR);
         CASE_CODE (OB_ERR_CONF_NAME_TOO_LONG);
+        CASE_CODE (OB_ERR_POOL_MEMCAP);
+        CASE_CODE (OB_ERR_INVALID_ARGUMENT);
         CASE_CODE (OB_ERR_FATAL);
     }
 
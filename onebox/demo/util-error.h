@@ -11,6 +11,8 @@ typedef enum {
     OB_ERR_POOL_INIT,
     OB_ERR_CONF_YAML_ERROR,
     OB_ERR_CONF_NAME_TOO_LONG,
+    OB_ERR_POOL_MEMCAP,
+    OB_ERR_INVALID_ARGUMENT,
     OB_ERR_FATAL
 }OBError;
 
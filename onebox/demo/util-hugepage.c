@@ -0,0 +1,519 @@
+#include "onebox-common.h"
+#include "util-hugepage.h"
+#include "util-debug.h"
+#include "util-error.h"
+#include "util-mem.h"
+#include "util-threads.h"
+#include "util-atomic.h"
+#include "util-unittest.h"
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define HUGEPAGE_THP_SIZE_FILE      "/sys/kernel/mm/transparent_hugepage/hpage_pmd_size"
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT              26
+#endif
+
+/*********** vars ***********/
+static HugePageArea *hugepage_areas = NULL;
+static OBMutex hugepage_lock = OBMUTEX_INITIALIZER;
+
+/*********** funcs ***********/
+/**
+ *  \brief Size of the transparent huge pages, 2MB unless the kernel says
+ *         otherwise
+ */
+size_t HugePageDefaultSize(void)
+{
+	static size_t hpage_size = 0;
+	unsigned long size = 0;
+	size_t found;
+	FILE *fp;
+
+	if ((found = OBAtomicLoadAcquire(&hpage_size)) != 0)
+		return found;
+
+	/* concurrent callers find the same, published once it is known */
+	found = HUGEPAGE_SIZE_2MB;
+	fp = fopen(HUGEPAGE_THP_SIZE_FILE, "r");
+	if (fp != NULL) 
+	{
+		if (fscanf(fp, "%lu", &size) == 1 && size > 0)
+			found = size;
+		fclose(fp);
+	}
+	OBAtomicStoreRelease(&hpage_size, found);
+	return found;
+}
+
+/**
+ *  \brief Size of the pages backing addr
+ *
+ *  Looks the mapping up in /proc/self/smaps: hugetlb mappings show their
+ *  page size, transparent huge pages show as AnonHugePages.
+ */
+size_t HugePageGetPageSize(void *addr)
+{
+	char line[256];
+	unsigned long start, end, kb;
+	int in_map = 0;
+	size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+	FILE *fp;
+
+	fp = fopen("/proc/self/smaps", "r");
+	if (fp == NULL)
+		return page_size;
+
+	while (fgets(line, sizeof(line), fp) != NULL) 
+	{
+		if (sscanf(line, "%lx-%lx ", &start, &end) == 2) 
+		{
+			if (in_map)
+				break;
+			in_map = (start <= (unsigned long)addr && (unsigned long)addr < end);
+		}
+		else if (in_map && sscanf(line, "KernelPageSize: %lu kB", &kb) == 1) 
+		{
+			if (kb * 1024 > page_size)
+				page_size = kb * 1024;
+		}
+		else if (in_map && sscanf(line, "AnonHugePages: %lu kB", &kb) == 1) 
+		{
+			if (kb > 0 && HugePageDefaultSize() > page_size)
+				page_size = HugePageDefaultSize();
+		}
+	}
+	fclose(fp);
+
+	return page_size;
+}
+
+/**
+ *  \brief Map len bytes of reserved huge pages of page_size
+ *
+ *  Fails right away when the pages aren't reserved (vm.nr_hugepages or
+ *  the hugepages-<size> pools in sysfs).
+ */
+static char *HugePageMapHugetlb(size_t len, size_t page_size)
+{
+	int shift = __builtin_ctzl(page_size);
+	char *map;
+
+	map = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (shift << MAP_HUGE_SHIFT), -1, 0);
+	return map == MAP_FAILED ? NULL : map;
+}
+
+/**
+ *  \brief Map len bytes of normal memory aligned on page_size and ask for
+ *         transparent huge pages
+ */
+static char *HugePageMapThp(size_t len, size_t page_size)
+{
+	char *map, *start;
+
+	/* over map so the area can start on a huge page boundary */
+	map = mmap(NULL, len + page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	start = (char *)(((uintptr_t)map + page_size - 1) & ~((uintptr_t)page_size - 1));
+	if (start > map)
+		munmap(map, start - map);
+	if (start + len < map + len + page_size)
+		munmap(start + len, (map + len + page_size) - (start + len));
+
+	if (madvise(start, len, MADV_HUGEPAGE) != 0) {
+		OBLogWarning(OB_ERR_MEM_ALLOC, "madvise(MADV_HUGEPAGE) failed: %s, using normal pages", strerror(errno));
+	}
+	return start;
+}
+
+/**
+ *  \brief Map a new area of at least size bytes
+ *
+ *  \warning hugepage_lock must be held
+ */
+static HugePageArea *HugePageAreaNew(size_t size, uint32_t flags)
+{
+	static int warned = 0;
+	HugePageArea *area;
+	HugePageBlock *b;
+	size_t page_size = 0, len = 0;
+	char *base = NULL;
+	int hugetlb = 1;
+
+	if (flags & HUGEPAGE_FLAG_1GB) 
+	{
+		page_size = HUGEPAGE_SIZE_1GB;
+		len = (size + page_size - 1) & ~(page_size - 1);
+		base = HugePageMapHugetlb(len, page_size);
+	}
+	if (base == NULL) 
+	{
+		page_size = HUGEPAGE_SIZE_2MB;
+		len = (size + page_size - 1) & ~(page_size - 1);
+		base = HugePageMapHugetlb(len, page_size);
+	}
+	if (base == NULL) 
+	{
+		if (flags & HUGEPAGE_FLAG_NOFALLBACK)
+			return NULL;
+		if (!warned) {
+			OBLogWarning(OB_ERR_MEM_ALLOC, "no reserved huge pages: %s, falling back to transparent huge pages",
+					strerror(errno));
+			warned = 1;
+		}
+
+		hugetlb = 0;
+		page_size = HugePageDefaultSize();
+		len = (size + page_size - 1) & ~(page_size - 1);
+		base = HugePageMapThp(len, page_size);
+		if (base == NULL)
+			return NULL;
+	}
+
+	area = OBMalloc(sizeof(HugePageArea));
+	b = OBMalloc(sizeof(HugePageBlock));
+	if (area == NULL || b == NULL) 
+	{
+		if (area) OBFree(area);
+		if (b) OBFree(b);
+		munmap(base, len);
+		return NULL;
+	}
+
+	memset(b, 0, sizeof(HugePageBlock));
+	b->len = len;
+
+	area->base = base;
+	area->len = len;
+	area->page_size = page_size;
+	area->hugetlb = hugetlb;
+	area->blocks = b;
+	area->next = hugepage_areas;
+	hugepage_areas = area;
+
+	return area;
+}
+
+/**
+ *  \brief Carve a region of size bytes out of the first fitting free block
+ *
+ *  \warning hugepage_lock must be held
+ */
+static void *HugePageAreaCarve(HugePageArea *area, size_t size)
+{
+	HugePageBlock *b, *rest;
+
+	for (b = area->blocks; b != NULL; b = b->next) 
+	{
+		if (b->used || b->len < size)
+			continue;
+
+		/* without memory to split the block, hand all of it out */
+		if (b->len > size && (rest = OBMalloc(sizeof(HugePageBlock))) != NULL) 
+		{
+			rest->off = b->off + size;
+			rest->len = b->len - size;
+			rest->used = 0;
+			rest->next = b->next;
+			b->next = rest;
+			b->len = size;
+		}
+		b->used = 1;
+		return area->base + b->off;
+	}
+	return NULL;
+}
+
+/**
+ *  \brief Allocate a region backed by huge pages
+ *
+ *  Regions are carved out of areas of reserved huge pages, mapped with
+ *  MAP_HUGETLB as needed. When no huge pages are reserved, areas are
+ *  mapped from normal memory with madvise(MADV_HUGEPAGE), unless
+ *  HUGEPAGE_FLAG_NOFALLBACK is set. The memory is zeroed the first time
+ *  an area is used only, like a fresh mapping.
+ *
+ *  \param size bytes, rounded up to HUGEPAGE_REGION_ALIGN
+ *  \param flags HUGEPAGE_FLAG_*
+ *
+ *  \retval the region, aligned on HUGEPAGE_REGION_ALIGN, or NULL on error
+ */
+void *HugePageAlloc(size_t size, uint32_t flags)
+{
+	HugePageArea *area;
+	void *ptr = NULL;
+
+	if (size == 0 || size > SIZE_MAX - HUGEPAGE_SIZE_1GB)
+		return NULL;
+	size = (size + HUGEPAGE_REGION_ALIGN - 1) & ~((size_t)HUGEPAGE_REGION_ALIGN - 1);
+
+	OBMutexLock(&hugepage_lock);
+	for (area = hugepage_areas; area != NULL && ptr == NULL; area = area->next) 
+	{
+		if ((flags & HUGEPAGE_FLAG_1GB) && area->page_size != HUGEPAGE_SIZE_1GB)
+			continue;
+		if ((flags & HUGEPAGE_FLAG_NOFALLBACK) && !area->hugetlb)
+			continue;
+		ptr = HugePageAreaCarve(area, size);
+	}
+
+	if (ptr == NULL && (area = HugePageAreaNew(size, flags)) != NULL)
+		ptr = HugePageAreaCarve(area, size);
+	OBMutexUnlock(&hugepage_lock);
+
+	return ptr;
+}
+
+/**
+ *  \brief Give a region back, unmapping its area once it's all free
+ *
+ *  \retval 0 on success, -1 if ptr isn't a region from HugePageAlloc()
+ */
+int HugePageFree(void *ptr)
+{
+	HugePageArea *area, **parea;
+	HugePageBlock *b, *prev = NULL, *next;
+	size_t off;
+
+	OBMutexLock(&hugepage_lock);
+	for (parea = &hugepage_areas; (area = *parea) != NULL; parea = &area->next) 
+	{
+		if ((char *)ptr >= area->base && (char *)ptr < area->base + area->len)
+			break;
+	}
+	if (area == NULL)
+		goto error;
+
+	off = (char *)ptr - area->base;
+	for (b = area->blocks; b != NULL && b->off != off; b = b->next) {
+		prev = b;
+	}
+	if (b == NULL || !b->used)
+		goto error;
+
+	/* merge with the free neighbours */
+	b->used = 0;
+	if ((next = b->next) != NULL && !next->used) 
+	{
+		b->len += next->len;
+		b->next = next->next;
+		OBFree(next);
+	}
+	if (prev != NULL && !prev->used) 
+	{
+		prev->len += b->len;
+		prev->next = b->next;
+		OBFree(b);
+		b = prev;
+	}
+
+	if (b == area->blocks && b->next == NULL) 
+	{
+		*parea = area->next;
+		munmap(area->base, area->len);
+		OBFree(b);
+		OBFree(area);
+	}
+	OBMutexUnlock(&hugepage_lock);
+	return 0;
+
+error:
+	OBMutexUnlock(&hugepage_lock);
+	OBLogError(OB_ERR_MEM_ALLOC, "HugePageFree of %p which HugePageAlloc didn't allocate", ptr);
+	return -1;
+}
+
+void HugePagePrint(void)
+{
+	HugePageArea *area;
+	HugePageBlock *b;
+
+	OBMutexLock(&hugepage_lock);
+	for (area = hugepage_areas; area != NULL; area = area->next) 
+	{
+		size_t used = 0;
+		for (b = area->blocks; b != NULL; b = b->next) {
+			if (b->used)
+				used += b->len;
+		}
+		printf("Huge page area %p: %zu bytes of %zu KB %s pages, %zu in use\n",
+				area->base, area->len, area->page_size / 1024,
+				area->hugetlb ? "reserved" : "transparent", used);
+	}
+	OBMutexUnlock(&hugepage_lock);
+}
+
+/*********** unittests ***********/
+
+static int HugePageTestCarve(void)
+{
+	char *a, *b, *c, *d;
+	int result = 0;
+
+	a = HugePageAlloc(100 * 1024, 0);
+	b = HugePageAlloc(1000 * 1024 + 1, 0);
+	c = HugePageAlloc(300 * 1024, 0);
+	if (a == NULL || b == NULL || c == NULL)
+		goto end;
+
+	/* carved back to back out of one area */
+	if (b != a + 100 * 1024 || c != b + 1000 * 1024 + HUGEPAGE_REGION_ALIGN)
+		goto end;
+	if (((uintptr_t)a & (HUGEPAGE_REGION_ALIGN - 1)) != 0)
+		goto end;
+	memset(a, 1, 100 * 1024);
+	memset(b, 2, 1000 * 1024 + 1);
+	memset(c, 3, 300 * 1024);
+
+	/* the hole left by b is reused */
+	if (HugePageFree(b) != 0)
+		goto end;
+	d = HugePageAlloc(512 * 1024, 0);
+	b = NULL;
+	if (d != a + 100 * 1024 || HugePageFree(d) != 0)
+		goto end;
+
+	if (HugePageFree(a + 64) == 0)
+		goto end;
+
+	result = 1;
+end:
+	if (a) HugePageFree(a);
+	if (b) HugePageFree(b);
+	if (c) HugePageFree(c);
+	return result && hugepage_areas == NULL;
+}
+
+/* big enough to outgrow the TLB reach of 4KB pages, not of 2MB ones.
+ * OB_HUGEPAGE_BENCH_MB=1024 in the environment measures a bigger table */
+#define HUGEPAGE_BENCH_SIZE         (64UL * 1024 * 1024)
+#define HUGEPAGE_BENCH_SIZE_ENV     "OB_HUGEPAGE_BENCH_MB"
+#define HUGEPAGE_BENCH_STEPS        (4 * 1024 * 1024)
+#define HUGEPAGE_BENCH_LINE         64
+
+/**
+ *  \brief Open a counter of the data TLB read misses of this thread
+ *
+ *  \retval the perf fd or -1 when perf events aren't available
+ */
+static int HugePageBenchPerfOpen(void)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		(PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/**
+ *  \brief Time a dependent random walk over the cache lines of table
+ *
+ *  The lines are linked in one random cycle (Sattolo's algorithm), so
+ *  every step is a cache miss and, once the table outgrows the TLB
+ *  reach, a TLB miss as well.
+ */
+static int HugePageBenchRun(const char *what, char *table, size_t size)
+{
+	uint32_t n = size / HUGEPAGE_BENCH_LINE;
+	uint32_t *perm, i, j, tmp;
+	uint64_t x = 0x9e3779b97f4a7c15ULL, misses = 0;
+	volatile uint32_t cur = 0;
+	struct timespec t0, t1;
+	int fd;
+
+	perm = OBMalloc((size_t)n * sizeof(uint32_t));
+	if (perm == NULL)
+		return 0;
+	for (i = 0; i < n; i++) {
+		perm[i] = i;
+	}
+	for (i = n - 1; i > 0; i--) 
+	{
+		x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+		j = x % i;
+		tmp = perm[i]; perm[i] = perm[j]; perm[j] = tmp;
+	}
+	for (i = 0; i < n; i++) {
+		*(uint32_t *)(table + (size_t)i * HUGEPAGE_BENCH_LINE) = perm[i];
+	}
+	OBFree(perm);
+
+	fd = HugePageBenchPerfOpen();
+	if (fd >= 0) {
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < HUGEPAGE_BENCH_STEPS; i++) {
+		cur = *(uint32_t *)(table + (size_t)cur * HUGEPAGE_BENCH_LINE);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if (fd >= 0) 
+	{
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(fd, &misses, sizeof(misses)) != sizeof(misses))
+			misses = 0;
+		close(fd);
+	}
+
+	printf("    %-12s %6zu KB pages: %6.1f ns/access", what, HugePageGetPageSize(table) / 1024,
+			((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / HUGEPAGE_BENCH_STEPS);
+	if (fd >= 0)
+		printf(", %.2f dTLB misses/access\n", (double)misses / HUGEPAGE_BENCH_STEPS);
+	else
+		printf(", dTLB misses n/a (perf_event_open: %s)\n", strerror(errno));
+	return 1;
+}
+
+/**
+ *  \brief Random access latency over a table, normal vs huge pages
+ */
+static int HugePageBench(void)
+{
+	size_t size = HUGEPAGE_BENCH_SIZE;
+	const char *env = getenv(HUGEPAGE_BENCH_SIZE_ENV);
+	char *table;
+
+	if (env != NULL && strtoul(env, NULL, 10) > 0)
+		size = strtoul(env, NULL, 10) << 20;
+
+	printf("\n");
+
+	table = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (table == MAP_FAILED) {
+		printf("    no memory for a %zu MB table, skipped\n", size >> 20);
+		return 1;
+	}
+	madvise(table, size, MADV_NOHUGEPAGE);
+	HugePageBenchRun("normal", table, size);
+	munmap(table, size);
+
+	table = HugePageAlloc(size, 0);
+	if (table == NULL) {
+		printf("    no huge pages for a %zu MB table, skipped\n", size >> 20);
+		return 1;
+	}
+	HugePageBenchRun("huge", table, size);
+	HugePageFree(table);
+
+	return 1;
+}
+
+void HugePageRegisterTests(void)
+{
+	UtRegisterTest("HugePageTestCarve", HugePageTestCarve, 1);
+	UtRegisterTest("HugePageBench", HugePageBench, 1);
+}
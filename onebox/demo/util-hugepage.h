@@ -0,0 +1,42 @@
+#ifndef __UTIL_HUGEPAGE_H__
+#define __UTIL_HUGEPAGE_H__
+
+#define HUGEPAGE_SIZE_2MB           (2UL * 1024 * 1024)
+#define HUGEPAGE_SIZE_1GB           (1024UL * 1024 * 1024)
+
+/* regions are carved on cache line boundaries */
+#define HUGEPAGE_REGION_ALIGN       64
+
+/* HugePageAlloc() flags */
+#define HUGEPAGE_FLAG_1GB           (1 << 0)    /**< try 1GB pages before 2MB ones */
+#define HUGEPAGE_FLAG_NOFALLBACK    (1 << 1)    /**< fail rather than fall back to
+                                                 *   transparent huge pages */
+
+/* a region of an area is either free or handed out, sorted by offset */
+typedef struct HugePageBlock_ {
+    size_t off;
+    size_t len;
+    int used;
+    struct HugePageBlock_ *next;
+} HugePageBlock;
+
+/* a mapping regions are carved from */
+typedef struct HugePageArea_ {
+    char *base;
+    size_t len;
+    size_t page_size;           /**< size of the pages backing the area */
+    int hugetlb;                /**< reserved huge pages (MAP_HUGETLB), or
+                                 *   normal memory madvise()d to THP */
+    HugePageBlock *blocks;
+    struct HugePageArea_ *next;
+} HugePageArea;
+
+size_t HugePageDefaultSize(void);
+size_t HugePageGetPageSize(void *addr);
+void *HugePageAlloc(size_t size, uint32_t flags);
+int HugePageFree(void *ptr);
+void HugePagePrint(void);
+
+void HugePageRegisterTests(void);
+
+#endif
@@ -2,22 +2,413 @@
 #include "util-debug.h"
 #include "util-error.h"
 #include "util-mem.h"
+#include "util-threads.h"
+#include "util-atomic.h"
+#include "util-unittest.h"
+
+#ifdef OB_MEM_SLAB
+#include "util-slab.h"
+
+/* what OBMalloc and friends allocate from */
+#define OBMemSysMalloc(size)            OBSlabAlloc((size))
+#define OBMemSysCalloc(nmemb, size)     OBSlabCalloc((nmemb), (size))
+#define OBMemSysRealloc(ptr, size)      OBSlabRealloc((ptr), (size))
+#define OBMemSysStrdup(astr)            OBSlabStrdup((astr))
+#define OBMemSysFree(ptr)               OBSlabFree((ptr))
+#else
+#define OBMemSysMalloc(size)            malloc((size))
+#define OBMemSysCalloc(nmemb, size)     calloc((nmemb), (size))
+#define OBMemSysRealloc(ptr, size)      realloc((ptr), (size))
+#define OBMemSysStrdup(astr)            strdup((astr))
+#define OBMemSysFree(ptr)               free((ptr))
+#endif
 
 /*********** vars ***********/
-size_t global_mem=0;
-uint8_t print_mem_flag=0;
+static const char *ob_mem_tag_names[OB_MEM_TAG_MAX] = { "other", "conf", "cli", "pool", "aio" };
+
+#ifdef OB_MEM_ACCOUNTING
+#define OB_MEM_MAGIC    0x0b3e3a11
+
+/* in front of every allocation. It takes 16 bytes rather than a word to
+ * keep the alignment malloc gives */
+typedef union OBMemHdr_ {
+    struct {
+        size_t size;
+        uint16_t tag;
+        uint16_t align_shift;   /**< OBMallocAlignedTag: the header is the end
+                                 *   of 1 << align_shift bytes of padding */
+        uint32_t magic;         /**< catches OBFree of memory we didn't hand out */
+    } h;
+    char pad[16];
+} OBMemHdr;
+
+/* counters of a thread, only written by the thread itself, with relaxed
+ * atomic stores as OBMemGetStats() reads them meanwhile */
+typedef struct OBMemThread_ {
+    OBMemStats stats;
+    struct OBMemThread_ *next;
+} OB_CACHE_ALIGNED OBMemThread;
+
+static __thread OBMemThread *ob_mem_thread = NULL;
+static OBMemThread *ob_mem_threads = NULL;      /**< live threads */
+static OBMemStats ob_mem_exited;                /**< threads that exited, atomic
+                                                 *   adds only, see OBMemAccount() */
+static OBMutex ob_mem_lock = OBMUTEX_INITIALIZER;
+static pthread_key_t ob_mem_key;
+static pthread_once_t ob_mem_once = PTHREAD_ONCE_INIT;
+#endif
+
+#ifdef OB_MEM_FAULT_INJECTION
+static uint32_t ob_mem_fault_every = 0;
+static uint32_t ob_mem_fault_rate = 0;
+static uint32_t ob_mem_fault_seed = 0;
+static uint64_t ob_mem_fault_calls = 0;
+static uint64_t ob_mem_fault_injected = 0;
+#endif
 
 /*********** funcs ***********/
+#ifdef OB_MEM_FAULT_INJECTION
+/**
+ *  \brief Make the following allocations fail
+ *
+ *  Allocations are numbered from this call on. With every set, allocation
+ *  every - 1, 2 * every - 1 ... fails, so 1 fails them all. With rate set,
+ *  each allocation fails with a probability of rate / OB_MEM_FAULT_RATE_MAX,
+ *  drawn from a hash of the seed and its number: a seed fails the same
+ *  allocations run after run. 0, 0 turns it off.
+ *
+ *  \retval 0 on success, -1 if not built with OB_MEM_FAULT_INJECTION
+ */
+int OBMemFaultSet(uint32_t every, uint32_t rate, uint32_t seed)
+{
+	/* off while the settings change, allocating threads read them */
+	OBAtomicStoreRelease(&ob_mem_fault_every, 0);
+	OBAtomicStoreRelease(&ob_mem_fault_rate, 0);
+
+	OBAtomicStoreRelaxed(&ob_mem_fault_calls, 0);
+	OBAtomicStoreRelaxed(&ob_mem_fault_injected, 0);
+	OBAtomicStoreRelaxed(&ob_mem_fault_seed, seed);
+	OBAtomicStoreRelease(&ob_mem_fault_rate, rate);
+	OBAtomicStoreRelease(&ob_mem_fault_every, every);
+	return 0;
+}
+
+void OBMemFaultGet(uint64_t *calls, uint64_t *injected)
+{
+	*calls = OBAtomicLoadRelaxed(&ob_mem_fault_calls);
+	*injected = OBAtomicLoadRelaxed(&ob_mem_fault_injected);
+}
+
+/**
+ *  \brief Decide if this allocation fails, sets errno like malloc does
+ */
+static inline int OBMemFault(void)
+{
+	uint32_t every = OBAtomicLoadRelaxed(&ob_mem_fault_every);
+	uint32_t rate = OBAtomicLoadRelaxed(&ob_mem_fault_rate);
+	uint64_t n, x;
+
+	if (likely(every == 0 && rate == 0))
+		return 0;
+
+	n = OBAtomicFetchAndAdd(&ob_mem_fault_calls, 1);
+	if (every != 0) 
+	{
+		if (n % every != every - 1)
+			return 0;
+	}
+	else
+	{
+		/* splitmix64 */
+		x = n + ((uint64_t)OBAtomicLoadRelaxed(&ob_mem_fault_seed) << 32) + 0x9e3779b97f4a7c15ULL;
+		x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+		x ^= x >> 31;
+		if (x % OB_MEM_FAULT_RATE_MAX >= rate)
+			return 0;
+	}
+
+	OBAtomicAddAndFetch(&ob_mem_fault_injected, 1);
+	errno = ENOMEM;
+	return 1;
+}
+#else
+int OBMemFaultSet(uint32_t every, uint32_t rate, uint32_t seed)
+{
+	return -1;
+}
+
+void OBMemFaultGet(uint64_t *calls, uint64_t *injected)
+{
+	*calls = 0;
+	*injected = 0;
+}
+
+#define OBMemFault()    0
+#endif /* OB_MEM_FAULT_INJECTION */
+
+#ifdef OB_MEM_ACCOUNTING
+/**
+ *  \brief Add the counters of a running thread, or of ob_mem_exited, to
+ *         a sum or to ob_mem_exited
+ */
+static void OBMemStatsAdd(OBMemStats *to, OBMemStats *from)
+{
+	int i;
+
+	for (i = 0; i < OB_MEM_TAG_MAX; i++) {
+		OBAtomicAddRelaxed(&to->bytes[i], OBAtomicLoadRelaxed(&from->bytes[i]));
+		OBAtomicAddRelaxed(&to->objs[i], OBAtomicLoadRelaxed(&from->objs[i]));
+		OBAtomicAddRelaxed(&to->allocs[i], OBAtomicLoadRelaxed(&from->allocs[i]));
+	}
+}
+
+/**
+ *  \brief Thread exit destructor, folds the thread's counters into
+ *         ob_mem_exited
+ */
+static void OBMemThreadExit(void *data)
+{
+	OBMemThread *t = (OBMemThread *)data;
+	OBMemThread **pt;
+
+	OBMutexLock(&ob_mem_lock);
+	OBMemStatsAdd(&ob_mem_exited, &t->stats);
+	for (pt = &ob_mem_threads; *pt != NULL; pt = &(*pt)->next) {
+		if (*pt == t) {
+			*pt = t->next;
+			break;
+		}
+	}
+	OBMutexUnlock(&ob_mem_lock);
+
+	/* later destructors may still free, they get a new block */
+	ob_mem_thread = NULL;
+	free(t);
+}
+
+static void OBMemKeyInit(void)
+{
+	pthread_key_create(&ob_mem_key, OBMemThreadExit);
+}
+
+static OBMemThread *OBMemThreadGet(void)
+{
+	OBMemThread *t = ob_mem_thread;
+	void *mem;
+
+	if (likely(t != NULL))
+		return t;
+
+	pthread_once(&ob_mem_once, OBMemKeyInit);
+	if (posix_memalign(&mem, OB_CACHE_LINE_SIZE, sizeof(OBMemThread)) != 0)
+		return NULL;
+	t = mem;
+	memset(t, 0, sizeof(OBMemThread));
+	pthread_setspecific(ob_mem_key, t);
+
+	OBMutexLock(&ob_mem_lock);
+	t->next = ob_mem_threads;
+	ob_mem_threads = t;
+	OBMutexUnlock(&ob_mem_lock);
+
+	ob_mem_thread = t;
+	return t;
+}
+
+static inline void OBMemAccount(OBMemTag tag, int64_t bytes, int64_t objs)
+{
+	OBMemThread *t = OBMemThreadGet();
+
+	if (unlikely(t == NULL)) 
+	{
+		/* no counters for this thread, share the exited ones */
+		OBAtomicAddRelaxed(&ob_mem_exited.bytes[tag], bytes);
+		OBAtomicAddRelaxed(&ob_mem_exited.objs[tag], objs);
+		if (objs > 0)
+			OBAtomicAddRelaxed(&ob_mem_exited.allocs[tag], 1);
+		return;
+	}
+
+	/* only this thread writes them, no locked instruction needed */
+	OBAtomicStoreRelaxed(&t->stats.bytes[tag], OBAtomicLoadRelaxed(&t->stats.bytes[tag]) + bytes);
+	OBAtomicStoreRelaxed(&t->stats.objs[tag], OBAtomicLoadRelaxed(&t->stats.objs[tag]) + objs);
+	if (objs > 0)
+		OBAtomicStoreRelaxed(&t->stats.allocs[tag], OBAtomicLoadRelaxed(&t->stats.allocs[tag]) + 1);
+}
+
+void *OBMallocTag(OBMemTag tag, size_t size)
+{
+	OBMemHdr *hdr;
+
+	if (size > SIZE_MAX - sizeof(OBMemHdr) || OBMemFault())
+		return NULL;
+
+	hdr = OBMemSysMalloc(sizeof(OBMemHdr) + size);
+	if (hdr == NULL)
+		return NULL;
+
+	hdr->h.size = size;
+	hdr->h.tag = tag;
+	hdr->h.align_shift = 0;
+	hdr->h.magic = OB_MEM_MAGIC;
+	OBMemAccount(tag, size, 1);
+	return hdr + 1;
+}
+
+void *OBCallocTag(OBMemTag tag, size_t nmemb, size_t size)
+{
+	OBMemHdr *hdr;
+
+	if (size != 0 && nmemb > (SIZE_MAX - sizeof(OBMemHdr)) / size)
+		return NULL;
+	if (OBMemFault())
+		return NULL;
+
+	hdr = OBMemSysCalloc(1, sizeof(OBMemHdr) + nmemb * size);
+	if (hdr == NULL)
+		return NULL;
+
+	hdr->h.size = nmemb * size;
+	hdr->h.tag = tag;
+	hdr->h.align_shift = 0;
+	hdr->h.magic = OB_MEM_MAGIC;
+	OBMemAccount(tag, nmemb * size, 1);
+	return hdr + 1;
+}
+
+/**
+ *  \brief Realloc, the memory stays accounted to the tag it was
+ *         allocated with
+ */
+void *OBReallocTag(OBMemTag tag, void *ptr, size_t size)
+{
+	OBMemHdr *hdr, *nhdr;
+	size_t old;
+
+	if (ptr == NULL)
+		return OBMallocTag(tag, size);
+	if (size > SIZE_MAX - sizeof(OBMemHdr) || OBMemFault())
+		return NULL;
+
+	hdr = (OBMemHdr *)ptr - 1;
+	if (hdr->h.magic != OB_MEM_MAGIC || hdr->h.align_shift != 0) {
+		OBLogError(OB_ERR_MEM_ALLOC, "OBRealloc of %p which OBMalloc didn't allocate", ptr);
+		return NULL;
+	}
+
+	old = hdr->h.size;
+	nhdr = OBMemSysRealloc(hdr, sizeof(OBMemHdr) + size);
+	if (nhdr == NULL)
+		return NULL;
+
+	nhdr->h.size = size;
+	OBMemAccount(nhdr->h.tag, (int64_t)size - (int64_t)old, 0);
+	return nhdr + 1;
+}
+
+/**
+ *  \brief Strdup through OBMallocTag, strdup() would skip the header
+ */
+char *OBStrdupTag(OBMemTag tag, char *astr)
+{
+	size_t len = strlen(astr) + 1;
+	char *ptrmem;
+
+	ptrmem = OBMallocTag(tag, len);
+	if (ptrmem != NULL)
+		memcpy(ptrmem, astr, len);
+	return ptrmem;
+}
+
+/**
+ *  \brief Aligned malloc, the header goes at the end of align bytes of
+ *         padding so the memory after it keeps the alignment
+ */
+void *OBMallocAlignedTag(OBMemTag tag, size_t align, size_t size)
+{
+	OBMemHdr *hdr;
+	void *base;
+
+	if (align == 0 || (align & (align - 1)) != 0)
+		return NULL;
+	if (align < sizeof(OBMemHdr))
+		align = sizeof(OBMemHdr);
+	if (size > SIZE_MAX - align || OBMemFault())
+		return NULL;
+
+	if (posix_memalign(&base, align, align + size) != 0)
+		return NULL;
+
+	hdr = (OBMemHdr *)((char *)base + align) - 1;
+	hdr->h.size = size;
+	hdr->h.tag = tag;
+	hdr->h.align_shift = __builtin_ctzl(align);
+	hdr->h.magic = OB_MEM_MAGIC;
+	OBMemAccount(tag, size, 1);
+	return hdr + 1;
+}
+
+void *OBCallocAlignedTag(OBMemTag tag, size_t align, size_t nmemb, size_t size)
+{
+	void *ptrmem;
+
+	if (size != 0 && nmemb > SIZE_MAX / size)
+		return NULL;
+
+	ptrmem = OBMallocAlignedTag(tag, align, nmemb * size);
+	if (ptrmem != NULL)
+		memset(ptrmem, 0, nmemb * size);
+	return ptrmem;
+}
+#endif /* OB_MEM_ACCOUNTING */
+
+/**
+ *  \brief Get the live bytes and allocations per tag, summed over all
+ *         threads. All zero unless built with OB_MEM_ACCOUNTING
+ */
+void OBMemGetStats(OBMemStats *stats)
+{
+	memset(stats, 0, sizeof(OBMemStats));
+#ifdef OB_MEM_ACCOUNTING
+	OBMemThread *t;
+
+	OBMutexLock(&ob_mem_lock);
+	OBMemStatsAdd(stats, &ob_mem_exited);
+	for (t = ob_mem_threads; t != NULL; t = t->next) {
+		OBMemStatsAdd(stats, &t->stats);
+	}
+	OBMutexUnlock(&ob_mem_lock);
+#endif
+}
+
 void OBMemGetInfo(void)
 {
+#ifdef OB_MEM_ACCOUNTING
+	OBMemStats stats;
+	int i;
 
+	OBMemGetStats(&stats);
+	for (i = 0; i < OB_MEM_TAG_MAX; i++) {
+		OBLogInfo(OB_OK, "memory %-6s: %"PRId64" bytes live in %"PRId64" allocations, %"PRIu64" allocations made",
+				ob_mem_tag_names[i], stats.bytes[i], stats.objs[i], stats.allocs[i]);
+	}
+#else
+	(void)ob_mem_tag_names;
+	OBLogInfo(OB_OK, "memory accounting is disabled, build with -DOB_MEM_ACCOUNTING");
+#endif
 }
 
 void *OBMalloc(size_t size)
 {
 	void *ptrmem = NULL; 
 
-	ptrmem = malloc(size);
+#ifdef OB_MEM_ACCOUNTING
+	ptrmem = OBMallocTag(OB_MEM_TAG_OTHER, size);
+#else
+	if (!OBMemFault())
+		ptrmem = OBMemSysMalloc(size);
+#endif
 	if (ptrmem == NULL) 
 	{
             //OBLogError(OB_ERR_MEM_ALLOC, "OBMalloc failed: %s, while trying to allocate %d bytes", strerror(errno), size); 
@@ -29,7 +420,12 @@ void *OBCalloc(size_t nmemb, size_t size)
 {
 	void *ptrmem = NULL; 
 
-	ptrmem = calloc(nmemb, size);
+#ifdef OB_MEM_ACCOUNTING
+	ptrmem = OBCallocTag(OB_MEM_TAG_OTHER, nmemb, size);
+#else
+	if (!OBMemFault())
+		ptrmem = OBMemSysCalloc(nmemb, size);
+#endif
 	if (ptrmem == NULL) 
 	{
             //OBLogError(OB_ERR_MEM_ALLOC, "OBCalloc failed: %s, while trying to allocate %d bytes", strerror(errno), size*nmemb); 
@@ -40,7 +436,12 @@ void *OBCalloc(size_t nmemb, size_t size)
 void *OBRealloc(void *ptr, size_t size)
 {
 	void *ptrmem = NULL;
-	ptrmem = realloc(ptr, size);
+#ifdef OB_MEM_ACCOUNTING
+	ptrmem = OBReallocTag(OB_MEM_TAG_OTHER, ptr, size);
+#else
+	if (!OBMemFault())
+		ptrmem = OBMemSysRealloc(ptr, size);
+#endif
 	if (ptrmem == NULL) 
 	{
 		//OBLogError(OB_ERR_MEM_ALLOC, "OBRealloc failed: %s, while trying to allocate %d bytes", strerror(errno), size); 
@@ -52,7 +453,12 @@ char *OBStrdup(char *astr)
 {
 	void *ptrmem = NULL; 
 
-	ptrmem = strdup(astr);
+#ifdef OB_MEM_ACCOUNTING
+	ptrmem = OBStrdupTag(OB_MEM_TAG_OTHER, astr);
+#else
+	if (!OBMemFault())
+		ptrmem = OBMemSysStrdup(astr);
+#endif
 	if (ptrmem == NULL) 
 	{
             //OBLogError(OB_ERR_MEM_ALLOC, "OBMalloc failed: %s, while trying to allocate %d bytes", strerror(errno), size); 
@@ -62,21 +468,376 @@ char *OBStrdup(char *astr)
 
 void  OBFree(void *ptr)
 {
-	free((ptr));
+#ifdef OB_MEM_ACCOUNTING
+	OBMemHdr *hdr;
+
+	if (ptr == NULL)
+		return;
+
+	hdr = (OBMemHdr *)ptr - 1;
+	if (hdr->h.magic != OB_MEM_MAGIC) {
+		OBLogError(OB_ERR_MEM_ALLOC, "OBFree of %p which OBMalloc didn't allocate", ptr);
+		return;
+	}
+	hdr->h.magic = 0;
+	OBMemAccount(hdr->h.tag, -(int64_t)hdr->h.size, -1);
+	if (hdr->h.align_shift != 0)
+		ptr = (char *)ptr - ((size_t)1 << hdr->h.align_shift);
+	else
+		ptr = hdr;
+#endif
+	OBMemSysFree(ptr);
+}
+
+/**
+ *  \brief Allocate size bytes aligned on align, a power of two
+ *
+ *  \retval the memory, to be freed with OBFreeAligned(), or NULL on error
+ */
+void *OBMallocAligned(size_t align, size_t size)
+{
+	void *ptrmem = NULL;
+
+#ifdef OB_MEM_ACCOUNTING
+	ptrmem = OBMallocAlignedTag(OB_MEM_TAG_OTHER, align, size);
+#else
+	if (align == 0 || (align & (align - 1)) != 0)
+		return NULL;
+	if (align < sizeof(void *))
+		align = sizeof(void *);
+	if (OBMemFault() || posix_memalign(&ptrmem, align, size) != 0)
+		ptrmem = NULL;
+#endif
+	return ptrmem;
+}
+
+void *OBCallocAligned(size_t align, size_t nmemb, size_t size)
+{
+	void *ptrmem = NULL;
+
+#ifdef OB_MEM_ACCOUNTING
+	ptrmem = OBCallocAlignedTag(OB_MEM_TAG_OTHER, align, nmemb, size);
+#else
+	if (size != 0 && nmemb > SIZE_MAX / size)
+		return NULL;
+	ptrmem = OBMallocAligned(align, nmemb * size);
+	if (ptrmem != NULL)
+		memset(ptrmem, 0, nmemb * size);
+#endif
+	return ptrmem;
+}
+
+void  OBFreeAligned(void *ptr)
+{
+	/* OBFree finds the padding from the header */
+	OBFree(ptr);
+}
+
+
+
+/*********** arena ***********/
+
+/* chunk header, rounded up so the data after it is aligned */
+#define OB_ARENA_HDR_SIZE \
+	((sizeof(OBArenaChunk) + OB_ARENA_ALIGN - 1) & ~((size_t)OB_ARENA_ALIGN - 1))
+
+#define OB_ARENA_CHUNK_DATA(c)  ((char *)(c) + OB_ARENA_HDR_SIZE)
+
+static OBArenaChunk *OBArenaChunkNew(size_t size)
+{
+	OBArenaChunk *c;
+
+	if (size > SIZE_MAX - OB_ARENA_HDR_SIZE)
+		return NULL;
+
+	c = OBMalloc(OB_ARENA_HDR_SIZE + size);
+	if (c == NULL)
+		return NULL;
+
+	c->next = NULL;
+	c->size = size;
+	c->used = 0;
+	return c;
+}
+
+/**
+ *  \brief Create an arena
+ *
+ *  \param chunk_size bytes allocated from the system at a time, 0 for
+ *         OB_ARENA_CHUNK_SIZE
+ *
+ *  \retval the arena or NULL on error
+ */
+OBArena *OBArenaCreate(size_t chunk_size)
+{
+	OBArena *arena;
+
+	if (chunk_size == 0)
+		chunk_size = OB_ARENA_CHUNK_SIZE;
+
+	arena = OBCalloc(1, sizeof(OBArena));
+	if (arena == NULL)
+		return NULL;
+
+	arena->chunk_size = chunk_size;
+	arena->chunks = OBArenaChunkNew(chunk_size);
+	if (arena->chunks == NULL) {
+		OBFree(arena);
+		return NULL;
+	}
+	arena->current = arena->chunks;
+	return arena;
 }
 
-void *OBMemAlign(size_t alignment, size_t size)
+/**
+ *  \brief Allocate from an arena
+ *
+ *  The memory is aligned on OB_ARENA_ALIGN and not initialized. It can't be
+ *  freed on its own, only with the whole arena.
+ *
+ *  \retval pointer to size bytes or NULL on error
+ */
+void *OBArenaAlloc(OBArena *arena, size_t size)
 {
-    void  *p;
+	OBArenaChunk *c = arena->current;
+	void *ptr;
+
+	if (size > SIZE_MAX - OB_ARENA_ALIGN)
+		return NULL;
+	size = (size + OB_ARENA_ALIGN - 1) & ~((size_t)OB_ARENA_ALIGN - 1);
+
+	/* a quarter chunk or more would waste too much of the chunk it ends */
+	if (size > arena->chunk_size / 4) 
+	{
+		c = OBArenaChunkNew(size);
+		if (c == NULL)
+			return NULL;
+		c->used = size;
+		c->next = arena->large;
+		arena->large = c;
+		arena->used += size;
+		return OB_ARENA_CHUNK_DATA(c);
+	}
 
-    p = memalign(alignment, size);
-    if (p == NULL) {
-        //OBLogError(NGX_LOG_EMERG, log, ngx_errno, "memalign(%uz, %uz) failed", alignment, size);
-    }
+	if (c->size - c->used < size) 
+	{
+		/* chunks after current are left over from before a reset */
+		if (c->next == NULL) {
+			c->next = OBArenaChunkNew(arena->chunk_size);
+			if (c->next == NULL)
+				return NULL;
+		}
+		c = c->next;
+		c->used = 0;
+		arena->current = c;
+	}
+
+	ptr = OB_ARENA_CHUNK_DATA(c) + c->used;
+	c->used += size;
+	arena->used += size;
+	return ptr;
+}
 
-    //OBLogError(NGX_LOG_DEBUG_ALLOC, log, 0, "memalign: %p:%uz @%uz", p, size, alignment);
+/**
+ *  \brief Copy a string into an arena
+ */
+char *OBArenaStrdup(OBArena *arena, const char *astr)
+{
+	size_t len = strlen(astr) + 1;
+	char *ptr;
 
-    return p;
+	ptr = OBArenaAlloc(arena, len);
+	if (ptr != NULL)
+		memcpy(ptr, astr, len);
+	return ptr;
 }
 
+/**
+ *  \brief Release everything allocated from an arena
+ *
+ *  The chunks are kept for reuse, only large allocations are freed.
+ */
+void OBArenaReset(OBArena *arena)
+{
+	OBArenaChunk *c;
 
+	while ((c = arena->large) != NULL) {
+		arena->large = c->next;
+		OBFree(c);
+	}
+
+	arena->current = arena->chunks;
+	arena->current->used = 0;
+	arena->used = 0;
+}
+
+void OBArenaDestroy(OBArena *arena)
+{
+	OBArenaChunk *c;
+
+	if (arena == NULL)
+		return;
+
+	OBArenaReset(arena);
+	while ((c = arena->chunks) != NULL) {
+		arena->chunks = c->next;
+		OBFree(c);
+	}
+	OBFree(arena);
+}
+
+/*********** unittests ***********/
+
+static int OBArenaTest(void)
+{
+	OBArena *arena = OBArenaCreate(1024);
+	char *first, *ptr;
+	int result = 0;
+	int i;
+
+	if (arena == NULL)
+		return 0;
+
+	first = OBArenaAlloc(arena, 1);
+	for (i = 0; i < 200; i++) 
+	{
+		ptr = OBArenaAlloc(arena, i % 40 + 1);
+		if (ptr == NULL || ((uintptr_t)ptr & (OB_ARENA_ALIGN - 1)) != 0)
+			goto end;
+		memset(ptr, 0xa5, i % 40 + 1);
+	}
+	if (arena->current == arena->chunks)
+		goto end;
+
+	ptr = OBArenaStrdup(arena, "flow.memcap");
+	if (ptr == NULL || strcmp(ptr, "flow.memcap") != 0)
+		goto end;
+
+	/* too big for a chunk */
+	ptr = OBArenaAlloc(arena, 4096);
+	if (ptr == NULL || arena->large == NULL)
+		goto end;
+	memset(ptr, 0, 4096);
+
+	/* the chunks are reused after a reset, in the same order */
+	OBArenaReset(arena);
+	if (arena->used != 0 || arena->large != NULL)
+		goto end;
+	if (OBArenaAlloc(arena, 1) != first)
+		goto end;
+
+	result = 1;
+end:
+	OBArenaDestroy(arena);
+	return result;
+}
+
+static int OBMemAlignedTest(void)
+{
+	static const size_t aligns[] = { 1, 16, 64, 4096 };
+	OBMemStats before, stats;
+	char *ptrs[4];
+	int result = 0;
+	size_t i, j;
+
+	OBMemGetStats(&before);
+	memset(ptrs, 0, sizeof(ptrs));
+	for (i = 0; i < sizeof(aligns) / sizeof(aligns[0]); i++) 
+	{
+		ptrs[i] = OBCallocAlignedTag(OB_MEM_TAG_POOL, aligns[i], 3, 100);
+		if (ptrs[i] == NULL || ((uintptr_t)ptrs[i] & (aligns[i] - 1)) != 0)
+			goto end;
+		for (j = 0; j < 300; j++) {
+			if (ptrs[i][j] != 0)
+				goto end;
+		}
+		memset(ptrs[i], 0xa5, 300);
+	}
+
+	if (OBMallocAligned(24, 100) != NULL)
+		goto end;
+	if (OBCallocAligned(64, SIZE_MAX / 2, 4) != NULL)
+		goto end;
+
+	OBMemGetStats(&stats);
+#ifdef OB_MEM_ACCOUNTING
+	if (stats.bytes[OB_MEM_TAG_POOL] - before.bytes[OB_MEM_TAG_POOL] != 4 * 300)
+		goto end;
+#endif
+
+	result = 1;
+end:
+	for (i = 0; i < sizeof(aligns) / sizeof(aligns[0]); i++) {
+		OBFreeAligned(ptrs[i]);
+	}
+	OBMemGetStats(&stats);
+	return result && stats.bytes[OB_MEM_TAG_POOL] == before.bytes[OB_MEM_TAG_POOL];
+}
+
+#ifdef OB_MEM_ACCOUNTING
+static void *OBMemTestThread(void *arg)
+{
+	/* handed to the main thread to free */
+	return OBMallocTag(OB_MEM_TAG_AIO, 1000);
+}
+
+static int OBMemAccountingTest(void)
+{
+	OBMemStats before, stats;
+	pthread_t tid;
+	void *ptr, *str, *thr = NULL, *tmp;
+	int result = 0;
+
+	OBMemGetStats(&before);
+
+	ptr = OBMallocTag(OB_MEM_TAG_CONF, 100);
+	str = OBStrdupTag(OB_MEM_TAG_CONF, "flow.memcap");
+	if (ptr == NULL || str == NULL || ((uintptr_t)ptr & 15) != 0)
+		goto end;
+	tmp = OBReallocTag(OB_MEM_TAG_OTHER, ptr, 300);
+	if (tmp == NULL)
+		goto end;
+	ptr = tmp;
+
+	if (pthread_create(&tid, NULL, OBMemTestThread, NULL) != 0)
+		goto end;
+	pthread_join(tid, &thr);
+	if (thr == NULL)
+		goto end;
+
+	/* realloc keeps the tag, the thread's counters outlive it */
+	OBMemGetStats(&stats);
+	if (stats.bytes[OB_MEM_TAG_CONF] - before.bytes[OB_MEM_TAG_CONF] != 312 ||
+		stats.objs[OB_MEM_TAG_CONF] - before.objs[OB_MEM_TAG_CONF] != 2 ||
+		stats.bytes[OB_MEM_TAG_AIO] - before.bytes[OB_MEM_TAG_AIO] != 1000)
+		goto end;
+
+	OBFree(ptr);
+	OBFree(str);
+	OBFree(thr);
+	ptr = str = thr = NULL;
+
+	OBMemGetStats(&stats);
+	if (stats.bytes[OB_MEM_TAG_CONF] != before.bytes[OB_MEM_TAG_CONF] ||
+		stats.objs[OB_MEM_TAG_CONF] != before.objs[OB_MEM_TAG_CONF] ||
+		stats.bytes[OB_MEM_TAG_AIO] != before.bytes[OB_MEM_TAG_AIO] ||
+		stats.allocs[OB_MEM_TAG_AIO] != before.allocs[OB_MEM_TAG_AIO] + 1)
+		goto end;
+
+	result = 1;
+end:
+	OBFree(ptr);
+	OBFree(str);
+	OBFree(thr);
+	return result;
+}
+#endif
+
+void OBMemRegisterTests(void)
+{
+	UtRegisterTest("OBArenaTest", OBArenaTest, 1);
+	UtRegisterTest("OBMemAlignedTest", OBMemAlignedTest, 1);
+#ifdef OB_MEM_ACCOUNTING
+	UtRegisterTest("OBMemAccountingTest", OBMemAccountingTest, 1);
+#endif
+}
@@ -8,9 +8,100 @@
        void *realloc(void *ptr, size_t size);
 #endif
 
+/* subsystems memory is accounted to, see OBMemGetInfo() */
+typedef enum {
+    OB_MEM_TAG_OTHER,
+    OB_MEM_TAG_CONF,
+    OB_MEM_TAG_CLI,
+    OB_MEM_TAG_POOL,
+    OB_MEM_TAG_AIO,
+    OB_MEM_TAG_MAX
+} OBMemTag;
+
+typedef struct OBMemStats_ {
+    int64_t bytes[OB_MEM_TAG_MAX];      /**< live bytes */
+    int64_t objs[OB_MEM_TAG_MAX];       /**< live allocations */
+    uint64_t allocs[OB_MEM_TAG_MAX];    /**< allocations ever made */
+} OBMemStats;
+
+/* Compile time cache line size for OB_CACHE_ALIGNED. ob_cacheline_size is
+ * only known at runtime, build with -DOB_CACHE_LINE_SIZE=128 for cpus with
+ * bigger lines. Structures written by several threads put their hot fields
+ * on lines of their own with it, and must then come from OBMallocAligned()
+ * or static storage */
+#ifndef OB_CACHE_LINE_SIZE
+#define OB_CACHE_LINE_SIZE      64
+#endif
+#define OB_CACHE_ALIGNED        __attribute__((aligned(OB_CACHE_LINE_SIZE)))
+
 void *OBMalloc(size_t size);
 void *OBCalloc(size_t nmemb, size_t size);
 void *OBRealloc(void *ptr, size_t size);
 void  OBFree(void *ptr);
 char *OBStrdup(char *astr);
+
+/* align is a power of two, memory from these goes back with OBFreeAligned() */
+void *OBMallocAligned(size_t align, size_t size);
+void *OBCallocAligned(size_t align, size_t nmemb, size_t size);
+void  OBFreeAligned(void *ptr);
+
+/* Build with -DOB_MEM_ACCOUNTING to account every allocation to a tag,
+ * at the cost of a header per allocation. Without it the tagged calls
+ * are the plain ones */
+#ifdef OB_MEM_ACCOUNTING
+void *OBMallocTag(OBMemTag tag, size_t size);
+void *OBCallocTag(OBMemTag tag, size_t nmemb, size_t size);
+void *OBReallocTag(OBMemTag tag, void *ptr, size_t size);
+char *OBStrdupTag(OBMemTag tag, char *astr);
+void *OBMallocAlignedTag(OBMemTag tag, size_t align, size_t size);
+void *OBCallocAlignedTag(OBMemTag tag, size_t align, size_t nmemb, size_t size);
+#else
+#define OBMallocTag(tag, size)          OBMalloc(size)
+#define OBCallocTag(tag, nmemb, size)   OBCalloc(nmemb, size)
+#define OBReallocTag(tag, ptr, size)    OBRealloc(ptr, size)
+#define OBStrdupTag(tag, astr)          OBStrdup(astr)
+#define OBMallocAlignedTag(tag, align, size)            OBMallocAligned(align, size)
+#define OBCallocAlignedTag(tag, align, nmemb, size)     OBCallocAligned(align, nmemb, size)
+#endif
+
+void OBMemGetStats(OBMemStats *stats);
+void OBMemGetInfo(void);
+
+/* Build with -DOB_MEM_SLAB to serve OBMalloc and friends from the thread
+ * caching size class allocator of util-slab.h instead of malloc. Memory
+ * from one must not be freed by the other */
+
+/* Build with -DOB_MEM_FAULT_INJECTION to make allocations fail on purpose,
+ * see OBMemFaultSet() and UtRunTestsFaults() */
+#define OB_MEM_FAULT_RATE_MAX   1000000     /**< rate is in parts per million */
+
+int  OBMemFaultSet(uint32_t every, uint32_t rate, uint32_t seed);
+void OBMemFaultGet(uint64_t *calls, uint64_t *injected);
+
+/* arena: bump pointer allocation from large chunks, everything is released
+ * at once by OBArenaReset() or OBArenaDestroy() */
+#define OB_ARENA_ALIGN          16
+#define OB_ARENA_CHUNK_SIZE     (64 * 1024)
+
+typedef struct OBArenaChunk_ {
+    struct OBArenaChunk_ *next;
+    size_t size;                /**< usable bytes after the header */
+    size_t used;
+} OBArenaChunk;
+
+typedef struct OBArena_ {
+    OBArenaChunk *chunks;       /**< chunks of chunk_size, kept over resets */
+    OBArenaChunk *current;      /**< chunk allocations are served from */
+    OBArenaChunk *large;        /**< allocations too big for a chunk */
+    size_t chunk_size;
+    size_t used;                /**< bytes handed out since the last reset */
+} OBArena;
+
+OBArena *OBArenaCreate(size_t chunk_size);
+void *OBArenaAlloc(OBArena *arena, size_t size);
+char *OBArenaStrdup(OBArena *arena, const char *astr);
+void  OBArenaReset(OBArena *arena);
+void  OBArenaDestroy(OBArena *arena);
+
+void OBMemRegisterTests(void);
 #endif
@@ -0,0 +1,57 @@
+#include "onebox-common.h"
+#include "util-misc.h"
+
+/**
+ *  \brief Parse a size string like "64mb" into bytes
+ *
+ *  Accepts an optional fraction and a kb, mb or gb suffix, case
+ *  insensitive and optionally separated by spaces: "128", "32kb",
+ *  "1.5 GB". Units are powers of 1024.
+ *
+ *  \param size string to parse
+ *  \param res pointer to the result
+ *
+ *  \retval 0 on success
+ *  \retval -1 if the string isn't a valid size
+ */
+int ParseSizeStringU64(const char *size, uint64_t *res)
+{
+	double val, mult = 1;
+	char *endptr;
+
+	if (size == NULL || res == NULL)
+		return -1;
+
+	while (isspace((unsigned char)*size))
+		size++;
+	/* strtod accepts a sign, "inf" and hex, we don't */
+	if (!isdigit((unsigned char)*size))
+		return -1;
+
+	errno = 0;
+	val = strtod(size, &endptr);
+	if (errno == ERANGE || endptr == size)
+		return -1;
+
+	while (isspace((unsigned char)*endptr))
+		endptr++;
+
+	if (*endptr != '\0') 
+	{
+		if (strcasecmp(endptr, "kb") == 0)
+			mult = 1024.0;
+		else if (strcasecmp(endptr, "mb") == 0)
+			mult = 1024.0 * 1024;
+		else if (strcasecmp(endptr, "gb") == 0)
+			mult = 1024.0 * 1024 * 1024;
+		else
+			return -1;
+	}
+
+	val *= mult;
+	if (val >= 18446744073709551616.0)
+		return -1;
+
+	*res = (uint64_t)val;
+	return 0;
+}
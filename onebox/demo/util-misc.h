@@ -0,0 +1,6 @@
+#ifndef __UTIL_MISC_H__
+#define __UTIL_MISC_H__
+
+int ParseSizeStringU64(const char *, uint64_t *);
+
+#endif
@@ -3,6 +3,41 @@
 #include "util-debug.h"
 #include "util-error.h"
 #include "util-mem.h"
+#include "util-atomic.h"
+#include "util-unittest.h"
+#include "util-cpu.h"
+#include "util-conf-node.h"
+#include "util-misc.h"
+#include "util-hugepage.h"
+#include <sys/mman.h>
+
+#define POOL_NUMA_SYSFS_DIR         "/sys/devices/system/node"
+#define POOL_NUMA_MAX_NODES         64
+#define POOL_MPOL_PREFERRED         1       /* from numaif.h, we don't need libnuma */
+
+#define POOL_MEMCAP_NAME_MAX        256
+
+PoolMemcap pool_memcap_global = { .name = "global" };
+
+/* every pool made by PoolInitEx, for PoolRegistryPrint */
+static Pool *pool_registry = NULL;
+static OBMutex pool_registry_lock = OBMUTEX_INITIALIZER;
+static uint32_t pool_registry_id = 0;
+
+/* counters are plain in the single threaded and locked modes */
+#define POOL_STAT_ADD(p, name, n) do {                  \
+    if ((p)->flags & POOL_FLAG_LOCKFREE)                 \
+        OBAtomicAddRelaxed(&(p)->stats.name, (n));       \
+    else                                                 \
+        (p)->stats.name += (n);                          \
+} while (0)
+
+static void *PoolGetDirect(Pool *p);
+static void PoolReturnDirect(Pool *p, void *data);
+static void PoolThreadCacheDestroy(void *data);
+static void PoolMagazineDrain(Pool *p);
+static PoolSlab *PoolSlabFind(Pool *p, void *data);
+static uint32_t PoolShrinkLocked(Pool *p, time_t now);
 
 static int PoolMemset(void *pitem, void *initdata)
 {
@@ -13,337 +48,3282 @@ static int PoolMemset(void *pitem, void *initdata)
 }
 
 /**
- * \brief Check if data is preallocated
- * \retval 0 or -1 if not inside */
+ * \brief Check if data is preallocated, either in data_buffer or in one
+ *        of the slabs the pool grew by
+ * \retval 1 if inside, 0 if not */
 static int PoolDataPreAllocated(Pool *p, void *data)
 {
-	int delta = data - p->data_buffer;
-	if ((delta < 0) || (delta > p->data_buffer_size)) {
-		return 0;
+	if ((char *)data >= (char *)p->data_buffer &&
+		(char *)data < (char *)p->data_buffer + p->data_buffer_size) {
+		return 1;
 	}
-	return 1;
+	return PoolSlabFind(p, data) != NULL;
 }
 
-Pool *PoolInit(uint32_t size, uint32_t prealloc_size, uint32_t elt_size,  
-		void *(*Alloc)(), int (*Init)(void *, void *), void *InitData,  void (*Cleanup)(void *), void (*Free)(void *))
+/**
+ * \brief Parse a sysfs cpu/node list like "0-3,8-11"
+ *
+ * \param Set called for every id in the list
+ *
+ * \retval number of ids in the list
+ */
+static uint32_t PoolParseIdList(const char *path, void (*Set)(uint32_t, void *), void *data)
 {
-	Pool *p = NULL;
+	char buf[1024];
+	char *str, *saveptr = NULL;
+	uint32_t a, b, cnt = 0;
+	FILE *fp;
 
-	if (size != 0 && prealloc_size > size) {
-		OBLogError(OB_ERR_POOL_INIT, "size error");
-		goto error;
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return 0;
+	if (fgets(buf, sizeof(buf), fp) == NULL) {
+		fclose(fp);
+		return 0;
 	}
+	fclose(fp);
 
-	if (size != 0 && elt_size == 0) {
-		OBLogError(OB_ERR_POOL_INIT, "size != 0 && elt_size == 0");
-		goto error;
+	for (str = strtok_r(buf, ",\n", &saveptr); str != NULL; str = strtok_r(NULL, ",\n", &saveptr)) 
+	{
+		int n = sscanf(str, "%u-%u", &a, &b);
+		if (n < 1)
+			continue;
+		if (n == 1)
+			b = a;
+		for (; a <= b; a++, cnt++) {
+			if (Set != NULL)
+				Set(a, data);
+		}
 	}
+	return cnt;
+}
 
-	if (elt_size && Free) {
-		OBLogError(OB_ERR_POOL_INIT, "elt_size && Free");
-		goto error;
-	}
+typedef struct PoolNumaCpuMap_ {
+    Pool *p;
+    uint16_t node;
+} PoolNumaCpuMap;
 
-	/* setup the filter */
-	p = OBMalloc(sizeof(Pool));
-	if (unlikely(p == NULL)) {
-		OBLogError(OB_ERR_POOL_INIT, "alloc error");
-		goto error;
-	}
+static void PoolNumaSetCpu(uint32_t cpu, void *data)
+{
+	PoolNumaCpuMap *map = (PoolNumaCpuMap *)data;
 
-	memset(p,0,sizeof(Pool));
+	if (cpu < map->p->nr_cpus)
+		map->p->cpu_to_node[cpu] = map->node;
+}
 
-	p->max_buckets = size;
-	p->preallocated = prealloc_size;
-	p->elt_size = elt_size;
-	p->data_buffer_size = prealloc_size * elt_size;
-	p->Alloc = Alloc;
-	p->Init = Init;
-	p->InitData = InitData;
-	p->Cleanup = Cleanup;
-	p->Free = Free;
-	if (p->Init == NULL) {
-		p->Init = PoolMemset;
-		p->InitData = p;
+typedef struct PoolNumaNodeList_ {
+    uint16_t ids[POOL_NUMA_MAX_NODES];
+    uint32_t nr;
+} PoolNumaNodeList;
+
+static void PoolNumaAddNode(uint32_t node, void *data)
+{
+	PoolNumaNodeList *list = (PoolNumaNodeList *)data;
+
+	/* PoolBufferBind() can't bind above */
+	if (node < POOL_NUMA_MAX_NODES && list->nr < POOL_NUMA_MAX_NODES)
+		list->ids[list->nr++] = node;
+}
+
+/**
+ * \brief Get the ids of the online NUMA nodes, they needn't be contiguous
+ *
+ * \retval number of nodes, 0 if the system doesn't tell
+ */
+static uint32_t PoolNumaNodes(PoolNumaNodeList *list)
+{
+	list->nr = 0;
+	PoolParseIdList(POOL_NUMA_SYSFS_DIR "/online", PoolNumaAddNode, list);
+	return list->nr;
+}
+
+/**
+ * \brief Set the memory policy of a not yet touched range to prefer node
+ *
+ * Preferred rather than bind: when the node runs out of memory the
+ * kernel falls back to another node instead of failing the fault.
+ */
+static void PoolBufferBind(void *addr, size_t len, int node)
+{
+	unsigned long mask[POOL_NUMA_MAX_NODES / (8 * sizeof(unsigned long))];
+
+	memset(mask, 0, sizeof(mask));
+	mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+
+	if (syscall(SYS_mbind, addr, len, POOL_MPOL_PREFERRED, mask, POOL_NUMA_MAX_NODES + 1, 0) != 0) {
+		OBLogWarning(OB_ERR_POOL_INIT, "mbind to node %d failed: %s", node, strerror(errno));
 	}
+}
 
-	/* alloc the buckets and place them in the empty list */
-	uint32_t u32 = 0;
-	if (size > 0) 
-	{
-		PoolBucket *pb = OBCalloc(size, sizeof(PoolBucket));
-		if (unlikely(pb == NULL)) 
-		{
-			OBLogError(OB_ERR_POOL_INIT, "alloc error");
-			goto error;
-		}
+/**
+ * \brief Check if the kernel really gave data_buffer huge pages
+ *
+ * \retval the page size backing data_buffer
+ */
+static size_t PoolBufferPageSize(Pool *p)
+{
+	if (p->data_buffer_mapped == 0)
+		return (size_t)sysconf(_SC_PAGESIZE);
 
-		p->pb_buffer = pb;
-		memset(pb, 0, size * sizeof(PoolBucket));
-		for (u32 = 0; u32 < size; u32++) 
+	return HugePageGetPageSize(p->data_buffer);
+}
+
+/**
+ * \brief Alloc the zeroed data_buffer, honoring the alignment flags
+ *
+ * Huge page backing is best effort: the buffer comes from HugePageAlloc()
+ * and if that fails we fall back to the heap. NUMA bound buffers are
+ * mapped here so mbind() gets a range of their own.
+ *
+ * \retval 0 on success, -1 on error
+ */
+static int PoolBufferAlloc(Pool *p)
+{
+	size_t size = p->data_buffer_size;
+
+	if ((p->flags & POOL_FLAG_HUGEPAGE) && p->numa_node < 0) 
+	{
+		p->data_buffer = HugePageAlloc(size, 0);
+		if (p->data_buffer != NULL) 
 		{
-			/* populate pool */
-			pb->next = p->empty_stack;
-			pb->flags |= POOL_BUCKET_PREALLOCATED;
-			p->empty_stack = pb;
-			p->empty_stack_size++;
-			pb++;
+			/* regions of an area may be reused, the heap path zeroes too */
+			memset(p->data_buffer, 0, size);
+			p->data_buffer_mapped = size;
+			p->data_buffer_huge = 1;
+			return 0;
 		}
 	}
-	
-	if (size > 0) 
+	else if ((p->flags & POOL_FLAG_HUGEPAGE) || p->numa_node >= 0) 
 	{
-		p->data_buffer = OBCalloc(prealloc_size, elt_size);
-		/* FIXME better goto */
-		if (p->data_buffer == NULL) 
+		size_t align = (p->flags & POOL_FLAG_HUGEPAGE) ? HugePageDefaultSize() : (size_t)sysconf(_SC_PAGESIZE);
+		size_t len = (size + align - 1) & ~(align - 1);
+		char *map, *start;
+
+		/* over map so the buffer can start on an aligned boundary */
+		map = mmap(NULL, len + align, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (map != MAP_FAILED) 
 		{
-			OBLogError(OB_ERR_POOL_INIT, "alloc error");
-			goto error;
+			start = (char *)(((uintptr_t)map + align - 1) & ~((uintptr_t)align - 1));
+			if (start > map)
+				munmap(map, start - map);
+			if (start + len < map + len + align)
+				munmap(start + len, (map + len + align) - (start + len));
+
+			if ((p->flags & POOL_FLAG_HUGEPAGE) && madvise(start, len, MADV_HUGEPAGE) != 0) {
+				OBLogWarning(OB_ERR_POOL_INIT, "madvise(MADV_HUGEPAGE) failed: %s, using normal pages", strerror(errno));
+			}
+
+			/* pages are not touched yet, the policy decides where they go */
+			if (p->numa_node >= 0)
+				PoolBufferBind(start, len, p->numa_node);
+
+			p->data_buffer = start;
+			p->data_buffer_mapped = len;
+			return 0;
 		}
 	}
 
-	/* prealloc the buckets and requeue them to the alloc list */
-	for (u32 = 0; u32 < prealloc_size; u32++) 
+	if (p->flags & POOL_FLAG_CACHE_ALIGN) 
 	{
-		if (size == 0) 
-		{ /* unlimited */
-			PoolBucket *pb = OBMalloc(sizeof(PoolBucket));
-			if (unlikely(pb == NULL)) 
-			{
-				OBLogError(OB_ERR_POOL_INIT, "alloc error");
-				goto error;
-			}
+		p->data_buffer = OBCallocAlignedTag(OB_MEM_TAG_POOL, UtilCpuGetCacheLineSize(), 1, size);
+		return p->data_buffer ? 0 : -1;
+	}
 
-			memset(pb, 0, sizeof(PoolBucket));
-			if (p->Alloc) 
-			{
-				pb->data = p->Alloc();
-			}
-			else
-			{
-				pb->data = OBMalloc(p->elt_size);
-			}
-			if (pb->data == NULL)
-			{
-				OBLogError(OB_ERR_POOL_INIT, "alloc error");
-				OBFree(pb);
-				goto error;
-			}
-			if (p->Init(pb->data, p->InitData) != 1) 
-			{
-				OBLogError(OB_ERR_POOL_INIT, "init error");
-				if (p->Cleanup)
-					p->Cleanup(pb->data);
-				if (p->Free)
-					p->Free(pb->data);
-				else
-					OBFree(pb->data);
-				OBFree(pb);
-				goto error;
-			}
+	p->data_buffer = OBCallocTag(OB_MEM_TAG_POOL, p->preallocated, p->elt_size);
+	return p->data_buffer ? 0 : -1;
+}
 
-			p->allocated++;
+static void PoolBufferFree(Pool *p)
+{
+	if (p->data_buffer == NULL)
+		return;
 
-			pb->next = p->alloc_stack;
-			p->alloc_stack = pb;
-			p->alloc_stack_size++;
-		} 
-		else 
-		{
-			PoolBucket *pb = p->empty_stack;
-			if (pb == NULL) 
-			{
-				OBLogError(OB_ERR_POOL_INIT, "alloc error");
-				goto error;
-			}
+	if (p->data_buffer_huge)
+		HugePageFree(p->data_buffer);
+	else if (p->data_buffer_mapped)
+		munmap(p->data_buffer, p->data_buffer_mapped);
+	else if (p->flags & POOL_FLAG_CACHE_ALIGN)
+		OBFreeAligned(p->data_buffer);
+	else
+		OBFree(p->data_buffer);
 
-			pb->data = (char *)p->data_buffer + u32 * elt_size;
-			if (p->Init(pb->data, p->InitData) != 1) 
-			{
-				OBLogError(OB_ERR_POOL_INIT, "init error");
-				if (p->Cleanup) p->Cleanup(pb->data);
-				goto error;
-			}
+	p->data_buffer = NULL;
+	p->data_buffer_mapped = 0;
+	p->data_buffer_huge = 0;
+}
 
-			p->empty_stack = pb->next;
-			p->empty_stack_size--;
+/**
+ * \brief Initialize a memcap
+ *
+ * \param name subsystem name, for logging
+ * \param memcap limit in bytes, 0 for none
+ * \param parent memcap usage is charged to as well, or NULL
+ */
+void PoolMemcapInit(PoolMemcap *mc, const char *name, uint64_t memcap, PoolMemcap *parent)
+{
+	memset(mc, 0, sizeof(PoolMemcap));
+	mc->name = name;
+	mc->memcap = memcap;
+	mc->parent = parent;
+	OB_ATOMIC_INIT(mc->memuse);
+	OB_ATOMIC_INIT(mc->emergency);
+}
 
-			p->allocated++;
+/**
+ * \brief Initialize a memcap from the "<name>.memcap" config value
+ *
+ * "<name>.memcap-high-water" and "<name>.memcap-low-water" optionally set
+ * the water marks, see PoolMemcapSetHighWater(). Sizes take a kb, mb or gb
+ * suffix.
+ *
+ * \retval 0 on success, -1 on an invalid value
+ */
+int PoolMemcapConf(PoolMemcap *mc, const char *name, PoolMemcap *parent)
+{
+	const char *keys[3] = { "memcap", "memcap-high-water", "memcap-low-water" };
+	uint64_t vals[3] = { 0, 0, 0 };
+	char key[POOL_MEMCAP_NAME_MAX];
+	char *strval;
+	int i;
 
-			pb->next = p->alloc_stack;
-			p->alloc_stack = pb;
-			p->alloc_stack_size++;
+	for (i = 0; i < 3; i++) 
+	{
+		snprintf(key, sizeof(key), "%s.%s", name, keys[i]);
+		if (ConfGet(key, &strval) == 0)
+			continue;
+		if (ConfGetSize(key, &vals[i]) == 0) {
+			OBLogError(OB_ERR_POOL_INIT, "invalid %s: \"%s\"", key, strval);
+			return -1;
 		}
 	}
 
-	return p;
+	PoolMemcapInit(mc, name, vals[0], parent);
+	mc->hwm = vals[1];
+	mc->lwm = vals[2] && vals[2] < vals[1] ? vals[2] : vals[1];
+	return 0;
+}
 
-error:
-	if (p != NULL) {
-		PoolFree(p);
+/**
+ * \brief Set the high water callback of a memcap
+ *
+ * \param hwm usage that enters emergency mode, 0 to keep the configured one
+ * \param lwm usage below which emergency mode is left, 0 or above hwm
+ *        for hwm
+ * \param HighWater called with 1 entering and 0 leaving emergency mode
+ */
+void PoolMemcapSetHighWater(PoolMemcap *mc, uint64_t hwm, uint64_t lwm,
+		void (*HighWater)(PoolMemcap *, int, void *), void *data)
+{
+	if (hwm != 0) {
+		mc->hwm = hwm;
+		mc->lwm = lwm && lwm < hwm ? lwm : hwm;
 	}
-	return NULL;
+	mc->HighWater = HighWater;
+	mc->data = data;
 }
 
-void PoolFree(Pool *p) 
+/**
+ * \brief Charge size bytes to a memcap and its parents
+ *
+ * \retval 0 on success, -1 if that would put one of them over its memcap,
+ *         in which case nothing is charged
+ */
+int PoolMemcapAdd(PoolMemcap *mc, uint64_t size)
 {
-	if (p == NULL) return;
+	uint64_t memuse = OB_ATOMIC_ADD(mc->memuse, size);
 
-	while (p->alloc_stack != NULL) 
+	if (mc->memcap != 0 && memuse > mc->memcap) {
+		OB_ATOMIC_SUB(mc->memuse, size);
+		return -1;
+	}
+	if (mc->parent != NULL && PoolMemcapAdd(mc->parent, size) != 0) {
+		OB_ATOMIC_SUB(mc->memuse, size);
+		return -1;
+	}
+
+	if (mc->hwm != 0 && memuse >= mc->hwm && OB_ATOMIC_GET(mc->emergency) == 0 &&
+		OB_ATOMIC_CAS(&mc->emergency, 0, 1)) 
 	{
-		PoolBucket *pb = p->alloc_stack;
-		p->alloc_stack = pb->next;
-		if (p->Cleanup) p->Cleanup(pb->data);
+		OBLogWarning(OB_ERR_POOL_MEMCAP, "%s memcap: usage %"PRIu64" of %"PRIu64" bytes, entering emergency mode",
+				mc->name, memuse, mc->memcap);
+		if (mc->HighWater) mc->HighWater(mc, 1, mc->data);
+	}
+	return 0;
+}
 
-		if (PoolDataPreAllocated(p, pb->data) == 0) 
-		{
-			if (p->Free) p->Free(pb->data);
-			else OBFree(pb->data);
-		}
+/**
+ * \brief Release size bytes from a memcap and its parents
+ */
+void PoolMemcapSub(PoolMemcap *mc, uint64_t size)
+{
+	for (; mc != NULL; mc = mc->parent) 
+	{
+		uint64_t memuse = OB_ATOMIC_SUB(mc->memuse, size);
 
-		pb->data = NULL;
-		if (! pb->flags & POOL_BUCKET_PREALLOCATED) {
-			OBFree(pb);
+		if (OB_ATOMIC_GET(mc->emergency) != 0 && memuse < mc->lwm &&
+			OB_ATOMIC_CAS(&mc->emergency, 1, 0)) 
+		{
+			OBLogNotice(OB_OK, "%s memcap: usage %"PRIu64" bytes, leaving emergency mode",
+					mc->name, memuse);
+			if (mc->HighWater) mc->HighWater(mc, 0, mc->data);
 		}
 	}
-	
-	while (p->empty_stack != NULL) 
+}
+
+static inline int PoolCharge(Pool *p, uint64_t size)
+{
+	if (p->memcap == NULL)
+		return 0;
+	if (PoolMemcapAdd(p->memcap, size) != 0)
+		return -1;
+	OBAtomicAddAndFetch(&p->memuse, size);
+	return 0;
+}
+
+static inline void PoolUncharge(Pool *p, uint64_t size)
+{
+	if (p->memcap == NULL)
+		return;
+	OBAtomicSubAndFetch(&p->memuse, size);
+	PoolMemcapSub(p->memcap, size);
+}
+
+/**
+ * \brief Charge the pool's objects to a memcap
+ *
+ * What the pool already holds is charged right away, objects allocated
+ * past that are charged as they are, and fail to allocate once the memcap
+ * is hit. The pool needs an elt_size to know what its objects cost.
+ *
+ * \param mc the memcap, or NULL to stop charging
+ *
+ * \retval 0 on success, -1 if the pool can't be charged or is already
+ *         over the memcap
+ */
+int PoolSetMemcap(Pool *p, PoolMemcap *mc)
+{
+	if (p->flags & POOL_FLAG_NUMA) 
 	{
-		PoolBucket *pb = p->empty_stack;
-		p->empty_stack = pb->next;
-		if (pb->data!= NULL) 
+		uint32_t u32;
+		for (u32 = 0; u32 < p->nr_nodes; u32++) 
 		{
-			if (p->Cleanup) p->Cleanup(pb->data);
-			if (PoolDataPreAllocated(p, pb->data) == 0) 
-			{
-				if (p->Free) p->Free(pb->data);
-				else OBFree(pb->data);
+			if (PoolSetMemcap(p->node_pools[u32], mc) != 0) {
+				while (u32-- > 0)
+					PoolSetMemcap(p->node_pools[u32], NULL);
+				return -1;
 			}
-			pb->data = NULL;
-		}
-		if (! pb->flags & POOL_BUCKET_PREALLOCATED) 
-		{
-			OBFree(pb);
 		}
+		p->memcap = mc;
+		return 0;
 	}
 
-	if (p->pb_buffer) OBFree(p->pb_buffer);
-	if (p->data_buffer) OBFree(p->data_buffer);
-	OBFree(p);
-}
+	if (mc != NULL && p->elt_size == 0) {
+		OBLogError(OB_ERR_POOL_INIT, "pool %p without elt_size can't have a memcap", p);
+		return -1;
+	}
 
+	if (p->memcap != NULL) {
+		PoolMemcapSub(p->memcap, p->memuse);
+		p->memcap = NULL;
+		p->memuse = 0;
+	}
+	if (mc == NULL)
+		return 0;
 
-void PoolPrint(Pool *p) 
-{
-	printf("\n----------- Hash Table Stats ------------\n");
-	printf("Buckets:               %u\n", p->empty_stack_size + p->alloc_stack_size);
-	printf("-----------------------------------------\n");
+	uint64_t memuse = (uint64_t)p->allocated * p->elt_size;
+	if (PoolMemcapAdd(mc, memuse) != 0) {
+		OBLogError(OB_ERR_POOL_MEMCAP, "pool %p already uses %"PRIu64" bytes, over the %s memcap",
+				p, memuse, mc->name);
+		return -1;
+	}
+	p->memcap = mc;
+	p->memuse = memuse;
+	return 0;
 }
 
-void *PoolGet(Pool *p) 
+/**
+ * \brief Alloc and init an object that is not part of the preallocated buffer
+ *
+ * \retval the object or NULL on error
+ */
+static void *PoolAllocObject(Pool *p)
 {
-	PoolBucket *pb = p->alloc_stack;
+	void *pitem;
 
-	if (pb != NULL) 
-	{
-		/* pull from the alloc list */
-		p->alloc_stack = pb->next;
-		p->alloc_stack_size--;
+	if (PoolCharge(p, p->elt_size) != 0)
+		return NULL;
 
-		/* put in the empty list */
-		pb->next = p->empty_stack;
-		p->empty_stack = pb;
-		p->empty_stack_size++;
-	} 
-	else 
+	if (p->Alloc != NULL) {
+		pitem = p->Alloc();
+	} else {
+		pitem = OBMallocTag(OB_MEM_TAG_POOL, p->elt_size);
+	}
+
+	if (pitem != NULL && p->Init(pitem, p->InitData) != 1) 
 	{
-		if (p->max_buckets == 0 || p->allocated < p->max_buckets) 
-		{
-			void *pitem;
-			OBLogDebug("max_buckets %"PRIu32"", p->max_buckets);
+		if (p->Cleanup) p->Cleanup(pitem);
+		if (p->Free != NULL) p->Free(pitem);
+		else OBFree(pitem);
+		pitem = NULL;
+	}
 
-			if (p->Alloc != NULL) {
-				pitem = p->Alloc();
-			} else {
-				pitem = OBMalloc(p->elt_size);
-			}
+	if (pitem == NULL)
+		PoolUncharge(p, p->elt_size);
+	else
+		POOL_STAT_ADD(p, mallocs, 1);
+	return pitem;
+}
 
-			if (pitem != NULL) 
-			{
-				if (p->Init(pitem, p->InitData) != 1) 
-				{
-					if (p->Cleanup) p->Cleanup(pitem);
-					if (p->Free != NULL) p->Free(pitem);
-					else OBFree(pitem);
-					return NULL;
-				}
+/**
+ * \brief Cleanup an object and free it unless it lives in data_buffer
+ */
+static void PoolFreeObject(Pool *p, void *data)
+{
+	if (p->Cleanup) p->Cleanup(data);
 
-				p->allocated++;
+	if (PoolDataPreAllocated(p, data) == 0) 
+	{
+		if (p->Free) p->Free(data);
+		else OBFree(data);
+		PoolUncharge(p, p->elt_size);
+		POOL_STAT_ADD(p, frees, 1);
+	}
+}
 
-				p->outstanding++;
-				if (p->outstanding > p->max_outstanding)
-					p->max_outstanding = p->outstanding;
-			}
+/**
+ * \brief Find the slab data belongs to
+ *
+ * \retval the slab or NULL if data isn't part of one
+ */
+static PoolSlab *PoolSlabFind(Pool *p, void *data)
+{
+	uint32_t lo = 0, hi = p->nr_slabs;
 
-			return pitem;
+	/* last slab starting at or below data */
+	while (lo < hi) 
+	{
+		uint32_t mid = (lo + hi) / 2;
+		if ((char *)p->slabs[mid].mem <= (char *)data)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return NULL;
+
+	PoolSlab *slab = &p->slabs[lo - 1];
+	if ((char *)data >= (char *)slab->mem + (size_t)slab->nobjs * p->elt_size)
+		return NULL;
+	return slab;
+}
+
+static void *PoolSlabMemAlloc(Pool *p, size_t size)
+{
+	if (p->flags & POOL_FLAG_CACHE_ALIGN)
+		return OBMallocAlignedTag(OB_MEM_TAG_POOL, UtilCpuGetCacheLineSize(), size);
+	return OBMallocTag(OB_MEM_TAG_POOL, size);
+}
+
+static void PoolSlabMemFree(Pool *p, void *mem)
+{
+	if (p->flags & POOL_FLAG_CACHE_ALIGN)
+		OBFreeAligned(mem);
+	else
+		OBFree(mem);
+}
+
+/**
+ * \brief Grow the pool by a slab of slab_objects objects, or less if
+ *        max_buckets is near
+ *
+ * The new objects are put in the pool, ready for a get.
+ *
+ * \retval 0 on success, -1 if we may not or could not grow
+ */
+static int PoolSlabGrow(Pool *p)
+{
+	uint32_t n = p->slab_objects;
+	uint32_t u32, pos;
+	char *mem;
+
+	if (p->max_buckets != 0 && n > p->max_buckets - p->allocated)
+		n = p->max_buckets - p->allocated;
+	if (n == 0)
+		return -1;
+
+	if (p->nr_slabs == p->slabs_size) 
+	{
+		uint32_t size = p->slabs_size ? p->slabs_size * 2 : 8;
+		PoolSlab *slabs = OBReallocTag(OB_MEM_TAG_POOL, p->slabs, size * sizeof(PoolSlab));
+		if (unlikely(slabs == NULL))
+			return -1;
+		p->slabs = slabs;
+		p->slabs_size = size;
+	}
+
+	if (PoolCharge(p, (uint64_t)n * p->elt_size) != 0)
+		return -1;
+
+	mem = PoolSlabMemAlloc(p, (size_t)n * p->elt_size);
+	if (unlikely(mem == NULL)) {
+		PoolUncharge(p, (uint64_t)n * p->elt_size);
+		return -1;
+	}
+
+	for (u32 = 0; u32 < n; u32++) 
+	{
+		if (p->Init(mem + (size_t)u32 * p->elt_size, p->InitData) != 1) 
+		{
+			do {
+				if (p->Cleanup) p->Cleanup(mem + (size_t)u32 * p->elt_size);
+			} while (u32-- > 0);
+			PoolSlabMemFree(p, mem);
+			PoolUncharge(p, (uint64_t)n * p->elt_size);
+			return -1;
+		}
+	}
+
+	/* keep the array sorted for PoolSlabFind */
+	for (pos = p->nr_slabs; pos > 0 && (char *)p->slabs[pos - 1].mem > mem; pos--) {
+		p->slabs[pos] = p->slabs[pos - 1];
+	}
+	memset(&p->slabs[pos], 0, sizeof(PoolSlab));
+	p->slabs[pos].mem = mem;
+	p->slabs[pos].nobjs = n;
+	p->nr_slabs++;
+
+	/* push last to first so gets walk the slab in order */
+	u32 = n;
+	while (u32-- > 0) 
+	{
+		void *data = mem + (size_t)u32 * p->elt_size;
+
+		if (p->flags & POOL_FLAG_INTRUSIVE) 
+		{
+			*(void **)data = p->free_list;
+			p->free_list = data;
 		} 
 		else 
 		{
-			return NULL;
+			/* bounded pool, there is a bucket for every object */
+			PoolBucket *pb = p->empty_stack;
+			p->empty_stack = pb->next;
+			p->empty_stack_size--;
+
+			pb->data = data;
+			pb->next = p->alloc_stack;
+			p->alloc_stack = pb;
 		}
 	}
+	p->alloc_stack_size += n;
+	p->allocated += n;
+	p->stats.slab_grows++;
 
-	void *ptr = pb->data;
-	pb->data = NULL;
-	p->outstanding++;
-	if (p->outstanding > p->max_outstanding)
-		p->max_outstanding = p->outstanding;
+	return 0;
+}
 
-	return ptr;
+/**
+ * \brief Account an object leaving the pool
+ */
+static inline void PoolSlabGet(Pool *p, void *data)
+{
+	PoolSlab *slab;
+
+	if (p->nr_slabs == 0)
+		return;
+
+	if ((slab = PoolSlabFind(p, data)) != NULL)
+		slab->in_use++;
 }
 
+/**
+ * \brief Account an object back in the pool
+ *
+ * When a slab turns idle it's a good time to look for slabs that have
+ * been idle long enough, at most once a second.
+ */
+static inline void PoolSlabPut(Pool *p, void *data)
+{
+	PoolSlab *slab;
 
-void PoolReturn(Pool *p, void *data) 
+	if (p->nr_slabs == 0)
+		return;
+
+	if ((slab = PoolSlabFind(p, data)) == NULL || --slab->in_use > 0)
+		return;
+
+	slab->idle_since = time(NULL);
+	if (p->slab_idle_timeout != 0 && slab->idle_since != p->shrink_last) 
+	{
+		p->shrink_last = slab->idle_since;
+		PoolShrinkLocked(p, slab->idle_since);
+	}
+}
+
+static void PoolSlabAccount(Pool *p, void **objs, uint32_t n, int get)
 {
-	PoolBucket *pb = p->empty_stack;
-	OBLogDebug("pb %p", pb);
+	uint32_t u32;
 
-	if (pb == NULL) 
+	if (p->nr_slabs == 0)
+		return;
+
+	for (u32 = 0; u32 < n; u32++) 
 	{
-		p->allocated--;
-		p->outstanding--;
-		if (p->Cleanup != NULL) {
-			p->Cleanup(data);
+		if (get)
+			PoolSlabGet(p, objs[u32]);
+		else
+			PoolSlabPut(p, objs[u32]);
+	}
+}
+
+/**
+ * \brief Free the slabs that have been idle for slab_idle_timeout
+ *
+ * Their objects are all in the pool: they are taken off the free list
+ * or alloc_stack, cleaned up and the slab memory goes back to the OS.
+ *
+ * \warning in magazine mode depot_lock must be held
+ *
+ * \retval number of slabs freed
+ */
+static uint32_t PoolShrinkLocked(Pool *p, time_t now)
+{
+	uint32_t u32, cnt = 0, objs = 0;
+	PoolSlab *slab;
+
+	if (p->slab_idle_timeout == 0)
+		return 0;
+
+	for (u32 = 0; u32 < p->nr_slabs; u32++) 
+	{
+		slab = &p->slabs[u32];
+		slab->release = (slab->in_use == 0 && now - slab->idle_since >= (time_t)p->slab_idle_timeout);
+		if (slab->release) {
+			cnt++;
+			objs += slab->nobjs;
 		}
+	}
+	if (cnt == 0)
+		return 0;
 
-		if (PoolDataPreAllocated(p, data) == 0) 
+	if (p->flags & POOL_FLAG_INTRUSIVE) 
+	{
+		void **pp = &p->free_list;
+		while (*pp != NULL) 
+		{
+			void *data = *pp;
+			slab = PoolSlabFind(p, data);
+			if (slab != NULL && slab->release) 
+			{
+				*pp = *(void **)data;
+				*(void **)data = NULL;
+				PoolFreeObject(p, data);
+			} 
+			else 
+			{
+				pp = (void **)data;
+			}
+		}
+	} 
+	else 
+	{
+		PoolBucket **ppb = &p->alloc_stack;
+		while (*ppb != NULL) 
 		{
-			if (p->Free) p->Free(data);
-			else OBFree(data);
+			PoolBucket *pb = *ppb;
+			slab = PoolSlabFind(p, pb->data);
+			if (slab != NULL && slab->release) 
+			{
+				*ppb = pb->next;
+				PoolFreeObject(p, pb->data);
+				pb->data = NULL;
+				pb->next = p->empty_stack;
+				p->empty_stack = pb;
+				p->empty_stack_size++;
+			} 
+			else 
+			{
+				ppb = &pb->next;
+			}
 		}
+	}
+	p->alloc_stack_size -= objs;
+	p->allocated -= objs;
+	PoolUncharge(p, (uint64_t)objs * p->elt_size);
 
-		OBLogDebug("tried to return data %p to the pool %p, but no more "
-                   "buckets available. Just freeing the data.", data, p);
-		return;
+	/* compact the slab array, it stays sorted */
+	for (u32 = 0, cnt = 0; u32 < p->nr_slabs; u32++) 
+	{
+		if (p->slabs[u32].release) {
+			PoolSlabMemFree(p, p->slabs[u32].mem);
+			continue;
+		}
+		p->slabs[cnt++] = p->slabs[u32];
 	}
+	u32 = p->nr_slabs - cnt;
+	p->nr_slabs = cnt;
 
-	/* pull from the alloc list */
-	p->empty_stack = pb->next;
-	p->empty_stack_size--;
+	return u32;
+}
 
-	/* put in the alloc list */
-	pb->next = p->alloc_stack;
-	p->alloc_stack = pb;
-	p->alloc_stack_size++;
+/**
+ * \brief Enable growing the pool in slabs once it runs past preallocated
+ *
+ * Only pools that own their objects (no Alloc) can grow in slabs. Bucket
+ * pools also need a max size, so every slab object has a bucket.
+ *
+ * \param slab_objects number of objects per slab, 0 to malloc per object
+ * \param idle_timeout seconds before an idle slab is freed, 0 for never
+ *
+ * \retval 0 on success, -1 if the pool can't grow in slabs
+ */
+int PoolSetGrowth(Pool *p, uint32_t slab_objects, uint32_t idle_timeout)
+{
+	if (p->flags & POOL_FLAG_NUMA) 
+	{
+		uint32_t u32;
+		for (u32 = 0; u32 < p->nr_nodes; u32++) {
+			if (PoolSetGrowth(p->node_pools[u32], slab_objects, idle_timeout) != 0)
+				return -1;
+		}
+		return 0;
+	}
 
-	pb->data = data;
-	p->outstanding--;
+	if (p->Alloc != NULL || p->elt_size == 0 || (p->flags & POOL_FLAG_LOCKFREE) ||
+		(p->max_buckets == 0 && !(p->flags & POOL_FLAG_INTRUSIVE))) 
+	{
+		OBLogError(OB_ERR_POOL_INIT, "pool %p can't grow in slabs", p);
+		return -1;
+	}
+
+	p->slab_objects = slab_objects;
+	p->slab_idle_timeout = idle_timeout;
+	return 0;
 }
 
-void PoolPrintSaturation(Pool *p) 
+/**
+ * \brief Free the slabs that have been idle long enough
+ *
+ * For owners that want memory back on their own schedule, e.g. from a
+ * management thread. Returns also free idle slabs opportunistically.
+ *
+ * \retval number of slabs freed
+ */
+uint32_t PoolShrink(Pool *p)
 {
-	OBLogDebug("pool %p is using %u out of %u items (%02.1f%%), max %u (%02.1f%%): pool struct memory %lu.", 
-		p, p->outstanding, p->max_buckets, (float)(p->outstanding/(float)(p->max_buckets))*100, p->max_outstanding, 
-		(float)(p->max_outstanding/(float)(p->max_buckets))*100, (uint64_t)(p->max_buckets * sizeof(PoolBucket)));
+	uint32_t cnt = 0;
+
+	if (p->flags & POOL_FLAG_NUMA) 
+	{
+		uint32_t u32;
+		for (u32 = 0; u32 < p->nr_nodes; u32++) {
+			cnt += PoolShrink(p->node_pools[u32]);
+		}
+		return cnt;
+	}
+
+	if (p->flags & POOL_FLAG_MAGAZINE)
+		OBMutexLock(&p->depot_lock);
+	cnt = PoolShrinkLocked(p, time(NULL));
+	if (p->flags & POOL_FLAG_MAGAZINE)
+		OBMutexUnlock(&p->depot_lock);
+
+	return cnt;
+}
+
+/**
+ * \brief Fill an intrusive pool
+ *
+ * data_buffer objects are not linked, gets carve them in order once the
+ * free list is empty. Unbounded pools get their objects on the free list.
+ *
+ * \retval 0 on success, -1 on error
+ */
+static int PoolIntrusivePrealloc(Pool *p)
+{
+	uint32_t u32;
+	void *data;
+
+	if (p->max_buckets > 0) 
+	{
+		for (u32 = 0; u32 < p->preallocated; u32++) 
+		{
+			data = (char *)p->data_buffer + (size_t)u32 * p->elt_size;
+			if (p->Init(data, p->InitData) != 1) 
+			{
+				OBLogError(OB_ERR_POOL_INIT, "init error");
+				if (p->Cleanup) p->Cleanup(data);
+				return -1;
+			}
+			p->carve_end++;
+			p->allocated++;
+			p->alloc_stack_size++;
+		}
+		return 0;
+	}
+
+	for (u32 = 0; u32 < p->preallocated; u32++) 
+	{
+		data = PoolAllocObject(p);
+		if (data == NULL) 
+		{
+			OBLogError(OB_ERR_POOL_INIT, "alloc error");
+			return -1;
+		}
+
+		p->allocated++;
+
+		*(void **)data = p->free_list;
+		p->free_list = data;
+		p->alloc_stack_size++;
+	}
+
+	return 0;
+}
+
+#define POOL_LF_IDX(head)   ((uint32_t)(head))
+#define POOL_LF_TAG(head)   ((uint32_t)((head) >> 32))
+
+/**
+ * \brief Build a lock-free stack head pointing to pb
+ */
+static inline uint64_t PoolLockFreeHead(Pool *p, PoolBucket *pb, uint32_t tag)
+{
+	uint32_t idx = pb ? (uint32_t)(pb - p->pb_buffer) + 1 : 0;
+
+	return ((uint64_t)tag << 32) | idx;
+}
+
+static inline PoolBucket *PoolLockFreeBucket(Pool *p, uint64_t head)
+{
+	if (POOL_LF_IDX(head) == 0)
+		return NULL;
+
+	return &p->pb_buffer[POOL_LF_IDX(head) - 1];
+}
+
+/**
+ * \brief Bucket a preallocated object goes out with in lock-free mode
+ *
+ * Preallocation takes the buckets off the top of the empty stack, so
+ * object i of data_buffer got pb_buffer[max_buckets - 1 - i]. It keeps it
+ * while handed out, a return then never waits for another thread to give
+ * a bucket back.
+ *
+ * \retval the bucket, NULL for an object allocated past the prealloc
+ */
+static inline PoolBucket *PoolLockFreeOwnBucket(Pool *p, void *data)
+{
+	if (!PoolDataPreAllocated(p, data))
+		return NULL;
+
+	return &p->pb_buffer[p->max_buckets - 1 -
+		((char *)data - (char *)p->data_buffer) / p->elt_size];
+}
+
+/**
+ * \brief Treiber stack pop
+ *
+ * pb->next may be rewritten by the thread owning pb while we read it, in
+ * that case the head tag moved on and the CAS fails.
+ */
+static PoolBucket *PoolLockFreePop(Pool *p, uint64_t *head)
+{
+	uint64_t old, new;
+	PoolBucket *pb;
+
+	do {
+		old = OBAtomicLoadAcquire(head);
+		pb = PoolLockFreeBucket(p, old);
+		if (pb == NULL)
+			return NULL;
+
+		new = PoolLockFreeHead(p, OBAtomicLoadRelaxed(&pb->next), POOL_LF_TAG(old) + 1);
+	} while (OBAtomicCompareAndSwap(head, old, new) == 0);
+
+	return pb;
+}
+
+/**
+ * \brief Treiber stack push
+ */
+static void PoolLockFreePush(Pool *p, uint64_t *head, PoolBucket *pb)
+{
+	uint64_t old, new;
+
+	do {
+		old = OBAtomicLoadAcquire(head);
+		OBAtomicStoreRelaxed(&pb->next, PoolLockFreeBucket(p, old));
+		new = PoolLockFreeHead(p, pb, POOL_LF_TAG(old) + 1);
+	} while (OBAtomicCompareAndSwap(head, old, new) == 0);
 }
 
+/**
+ * \brief Init a Pool whose data_buffer is bound to a NUMA node
+ *
+ * \param node the node or -1 to leave placement to first touch
+ */
+static Pool *PoolInitNode(uint32_t size, uint32_t prealloc_size, uint32_t elt_size,  
+		void *(*Alloc)(), int (*Init)(void *, void *), void *InitData,  void (*Cleanup)(void *), void (*Free)(void *),
+		uint32_t flags, int node)
+{
+	Pool *p = NULL;
+
+	if (size != 0 && prealloc_size > size) {
+		OBLogError(OB_ERR_POOL_INIT, "size error");
+		goto error;
+	}
+
+	if (size != 0 && elt_size == 0) {
+		OBLogError(OB_ERR_POOL_INIT, "size != 0 && elt_size == 0");
+		goto error;
+	}
+
+	if (elt_size && Free) {
+		OBLogError(OB_ERR_POOL_INIT, "elt_size && Free");
+		goto error;
+	}
+
+	if ((flags & POOL_FLAG_LOCKFREE) && size == 0) {
+		OBLogError(OB_ERR_POOL_INIT, "lock-free pool needs a max size");
+		goto error;
+	}
+
+	if ((flags & POOL_FLAG_INTRUSIVE) && (flags & POOL_FLAG_LOCKFREE)) {
+		OBLogError(OB_ERR_POOL_INIT, "intrusive pool can't be lock-free");
+		goto error;
+	}
+
+	if ((flags & POOL_FLAG_INTRUSIVE) && elt_size < sizeof(void *)) {
+		OBLogError(OB_ERR_POOL_INIT, "intrusive pool needs elt_size >= %u", (uint32_t)sizeof(void *));
+		goto error;
+	}
+
+	if ((flags & POOL_FLAG_CACHE_ALIGN) && elt_size > 0) {
+		uint32_t cls = UtilCpuGetCacheLineSize();
+		elt_size = (elt_size + cls - 1) & ~(cls - 1);
+	}
+
+	/* setup the filter */
+	p = OBCallocAlignedTag(OB_MEM_TAG_POOL, OB_CACHE_LINE_SIZE, 1, sizeof(Pool));
+	if (unlikely(p == NULL)) {
+		OBLogError(OB_ERR_POOL_INIT, "alloc error");
+		goto error;
+	}
+
+	p->numa_node = node;
+	p->max_buckets = size;
+	p->preallocated = prealloc_size;
+	p->elt_size = elt_size;
+	p->data_buffer_size = (size_t)prealloc_size * elt_size;
+	p->Alloc = Alloc;
+	p->Init = Init;
+	p->InitData = InitData;
+	p->Cleanup = Cleanup;
+	p->Free = Free;
+	if (p->Init == NULL) {
+		p->Init = PoolMemset;
+		p->InitData = p;
+	}
+
+	if (flags & POOL_FLAG_MAGAZINE) 
+	{
+		if (pthread_key_create(&p->tc_key, PoolThreadCacheDestroy) != 0) 
+		{
+			OBLogError(OB_ERR_POOL_INIT, "thread cache key error");
+			goto error;
+		}
+		OBMutexInit(&p->depot_lock, NULL);
+	}
+	/* the stacks are plain lists until the lock-free heads are set up at
+	 * the end, so PoolFree can walk them if preallocation fails */
+	p->flags = flags & ~POOL_FLAG_LOCKFREE;
+
+	/* alloc the buckets and place them in the empty list */
+	uint32_t u32 = 0;
+	if (size > 0 && !(flags & POOL_FLAG_INTRUSIVE)) 
+	{
+		PoolBucket *pb = OBCallocTag(OB_MEM_TAG_POOL, size, sizeof(PoolBucket));
+		if (unlikely(pb == NULL)) 
+		{
+			OBLogError(OB_ERR_POOL_INIT, "alloc error");
+			goto error;
+		}
+
+		p->pb_buffer = pb;
+		memset(pb, 0, size * sizeof(PoolBucket));
+		for (u32 = 0; u32 < size; u32++) 
+		{
+			/* populate pool */
+			pb->next = p->empty_stack;
+			pb->flags |= POOL_BUCKET_PREALLOCATED;
+			p->empty_stack = pb;
+			p->empty_stack_size++;
+			pb++;
+		}
+	}
+	
+	if (size > 0) 
+	{
+		if (PoolBufferAlloc(p) != 0) 
+		{
+			OBLogError(OB_ERR_POOL_INIT, "alloc error");
+			goto error;
+		}
+	}
+
+	if (p->flags & POOL_FLAG_INTRUSIVE) 
+	{
+		if (PoolIntrusivePrealloc(p) != 0)
+			goto error;
+		return p;
+	}
+
+	/* prealloc the buckets and requeue them to the alloc list */
+	for (u32 = 0; u32 < prealloc_size; u32++) 
+	{
+		if (size == 0) 
+		{ /* unlimited */
+			PoolBucket *pb = OBMallocTag(OB_MEM_TAG_POOL, sizeof(PoolBucket));
+			if (unlikely(pb == NULL)) 
+			{
+				OBLogError(OB_ERR_POOL_INIT, "alloc error");
+				goto error;
+			}
+
+			memset(pb, 0, sizeof(PoolBucket));
+			if (p->Alloc) 
+			{
+				pb->data = p->Alloc();
+			}
+			else
+			{
+				pb->data = OBMallocTag(OB_MEM_TAG_POOL, p->elt_size);
+			}
+			if (pb->data == NULL)
+			{
+				OBLogError(OB_ERR_POOL_INIT, "alloc error");
+				OBFree(pb);
+				goto error;
+			}
+			if (p->Init(pb->data, p->InitData) != 1) 
+			{
+				OBLogError(OB_ERR_POOL_INIT, "init error");
+				if (p->Cleanup)
+					p->Cleanup(pb->data);
+				if (p->Free)
+					p->Free(pb->data);
+				else
+					OBFree(pb->data);
+				OBFree(pb);
+				goto error;
+			}
+
+			p->allocated++;
+
+			pb->next = p->alloc_stack;
+			p->alloc_stack = pb;
+			p->alloc_stack_size++;
+		} 
+		else 
+		{
+			PoolBucket *pb = p->empty_stack;
+			if (pb == NULL) 
+			{
+				OBLogError(OB_ERR_POOL_INIT, "alloc error");
+				goto error;
+			}
+
+			pb->data = (char *)p->data_buffer + (size_t)u32 * elt_size;
+			if (p->Init(pb->data, p->InitData) != 1) 
+			{
+				OBLogError(OB_ERR_POOL_INIT, "init error");
+				if (p->Cleanup) p->Cleanup(pb->data);
+				/* still on the empty stack, PoolFree mustn't clean it up again */
+				pb->data = NULL;
+				goto error;
+			}
+
+			p->empty_stack = pb->next;
+			p->empty_stack_size--;
+
+			p->allocated++;
+
+			pb->next = p->alloc_stack;
+			p->alloc_stack = pb;
+			p->alloc_stack_size++;
+		}
+	}
+
+	if (flags & POOL_FLAG_LOCKFREE) 
+	{
+		p->lf_alloc_head = PoolLockFreeHead(p, p->alloc_stack, 0);
+		p->lf_empty_head = PoolLockFreeHead(p, p->empty_stack, 0);
+		p->flags |= POOL_FLAG_LOCKFREE;
+	}
+
+	return p;
+
+error:
+	if (p != NULL) {
+		PoolFree(p);
+	}
+	return NULL;
+}
+
+/**
+ * \brief Init the front end of a NUMA pool and one sub-pool per node
+ *
+ * The sub-pools split size between them and preallocate all of it, so
+ * every object lives in a node's data_buffer and PoolReturn can find
+ * its owner by address. cpu_to_node maps a cpu to its node's index in
+ * list, not to the node id.
+ */
+static Pool *PoolNumaInit(const PoolNumaNodeList *list, uint32_t size, uint32_t elt_size,  
+		void *(*Alloc)(), int (*Init)(void *, void *), void *InitData,  void (*Cleanup)(void *), void (*Free)(void *),
+		uint32_t flags)
+{
+	char path[PATH_MAX];
+	PoolNumaCpuMap map;
+	uint32_t nodes = list->nr;
+	uint32_t u32;
+	Pool *p;
+
+	if (size == 0 || Alloc != NULL) {
+		OBLogError(OB_ERR_POOL_INIT, "numa pool needs a max size and no Alloc");
+		return NULL;
+	}
+
+	p = OBCallocAlignedTag(OB_MEM_TAG_POOL, OB_CACHE_LINE_SIZE, 1, sizeof(Pool));
+	if (unlikely(p == NULL)) {
+		OBLogError(OB_ERR_POOL_INIT, "alloc error");
+		return NULL;
+	}
+	p->numa_node = -1;
+	p->max_buckets = size;
+	p->preallocated = size;
+	p->elt_size = elt_size;
+	p->flags = POOL_FLAG_NUMA | (flags & POOL_FLAG_LATENCY);
+
+	p->nr_cpus = UtilCpuGetNumProcessorsConfigured();
+	if (p->nr_cpus == 0)
+		p->nr_cpus = 1;
+	p->cpu_to_node = OBCallocTag(OB_MEM_TAG_POOL, p->nr_cpus, sizeof(uint16_t));
+	p->node_pools = OBCallocTag(OB_MEM_TAG_POOL, nodes, sizeof(Pool *));
+	if (p->cpu_to_node == NULL || p->node_pools == NULL) {
+		OBLogError(OB_ERR_POOL_INIT, "alloc error");
+		goto error;
+	}
+	p->nr_nodes = nodes;
+
+	for (u32 = 0; u32 < nodes; u32++) 
+	{
+		uint32_t node_size = size / nodes + (u32 < size % nodes);
+
+		map.p = p;
+		map.node = u32;
+		snprintf(path, sizeof(path), POOL_NUMA_SYSFS_DIR "/node%u/cpulist", list->ids[u32]);
+		PoolParseIdList(path, PoolNumaSetCpu, &map);
+
+		p->node_pools[u32] = PoolInitNode(node_size, node_size, elt_size, NULL, Init, InitData,
+				Cleanup, Free, flags & ~(POOL_FLAG_NUMA | POOL_FLAG_LATENCY), list->ids[u32]);
+		if (p->node_pools[u32] == NULL)
+			goto error;
+		p->elt_size = p->node_pools[u32]->elt_size;
+	}
+
+	return p;
+
+error:
+	PoolFree(p);
+	return NULL;
+}
+
+/**
+ * \brief Sub-pool of the node the calling thread runs on
+ */
+static inline uint32_t PoolNumaLocalNode(Pool *p)
+{
+	int cpu = sched_getcpu();
+
+	if (cpu < 0 || (uint32_t)cpu >= p->nr_cpus)
+		return 0;
+	return p->cpu_to_node[cpu] < p->nr_nodes ? p->cpu_to_node[cpu] : 0;
+}
+
+static void *PoolNumaGet(Pool *p)
+{
+	uint32_t node = PoolNumaLocalNode(p);
+	uint32_t u32;
+	void *ptr;
+
+	/* local node first, then the others */
+	for (u32 = 0; u32 < p->nr_nodes; u32++) 
+	{
+		ptr = PoolGet(p->node_pools[(node + u32) % p->nr_nodes]);
+		if (ptr != NULL)
+			return ptr;
+	}
+	return NULL;
+}
+
+static void PoolNumaReturn(Pool *p, void *data)
+{
+	uint32_t u32;
+
+	for (u32 = 0; u32 < p->nr_nodes; u32++) 
+	{
+		if (PoolDataPreAllocated(p->node_pools[u32], data)) 
+		{
+			PoolReturn(p->node_pools[u32], data);
+			return;
+		}
+	}
+	OBLogError(OB_ERR_POOL_INIT, "object %p doesn't belong to numa pool %p", data, p);
+}
+
+/**
+ * \brief Add a pool to the registry, under a default name
+ */
+static void PoolRegister(Pool *p)
+{
+	OBMutexLock(&pool_registry_lock);
+	snprintf(p->name, sizeof(p->name), "pool%u", pool_registry_id++);
+	p->registry_next = pool_registry;
+	pool_registry = p;
+	p->registered = 1;
+	OBMutexUnlock(&pool_registry_lock);
+}
+
+static void PoolUnregister(Pool *p)
+{
+	Pool **pp;
+
+	OBMutexLock(&pool_registry_lock);
+	for (pp = &pool_registry; *pp != NULL; pp = &(*pp)->registry_next) 
+	{
+		if (*pp == p) {
+			*pp = p->registry_next;
+			break;
+		}
+	}
+	p->registered = 0;
+	OBMutexUnlock(&pool_registry_lock);
+}
+
+/**
+ * \brief Name a pool in the registry, e.g. after the subsystem owning it
+ */
+void PoolSetName(Pool *p, const char *name)
+{
+	OBMutexLock(&pool_registry_lock);
+	strlcpy(p->name, name, sizeof(p->name));
+	OBMutexUnlock(&pool_registry_lock);
+}
+
+/**
+ * \brief Init a Pool
+ *
+ * \param size max number of elements in the pool, 0 for unlimited
+ * \param prealloc_size number of elements to preallocate
+ * \param elt_size size of an element, used if Alloc is NULL
+ * \param flags POOL_FLAG_* mode selection
+ *
+ * \retval p the pool or NULL on error
+ */
+Pool *PoolInitEx(uint32_t size, uint32_t prealloc_size, uint32_t elt_size,  
+		void *(*Alloc)(), int (*Init)(void *, void *), void *InitData,  void (*Cleanup)(void *), void (*Free)(void *),
+		uint32_t flags)
+{
+	PoolNumaNodeList nodes;
+	Pool *p;
+
+	nodes.nr = 0;
+	if (flags & POOL_FLAG_NUMA) 
+	{
+		/* threads fall back to the sub-pools of the other nodes */
+		if (!(flags & (POOL_FLAG_LOCKFREE | POOL_FLAG_MAGAZINE))) {
+			OBLogError(OB_ERR_POOL_INIT, "numa pool needs POOL_FLAG_LOCKFREE or POOL_FLAG_MAGAZINE");
+			return NULL;
+		}
+		PoolNumaNodes(&nodes);
+	}
+
+	if (nodes.nr > 1) 
+	{
+		p = PoolNumaInit(&nodes, size, elt_size, Alloc, Init, InitData, Cleanup, Free, flags);
+	} 
+	else 
+	{
+		/* a single node, nothing to route */
+		flags &= ~POOL_FLAG_NUMA;
+		p = PoolInitNode(size, prealloc_size, elt_size, Alloc, Init, InitData, Cleanup, Free, flags, -1);
+	}
+
+	if (p != NULL)
+		PoolRegister(p);
+	return p;
+}
+
+Pool *PoolInit(uint32_t size, uint32_t prealloc_size, uint32_t elt_size,  
+		void *(*Alloc)(), int (*Init)(void *, void *), void *InitData,  void (*Cleanup)(void *), void (*Free)(void *))
+{
+	return PoolInitEx(size, prealloc_size, elt_size, Alloc, Init, InitData, Cleanup, Free, 0);
+}
+
+/**
+ * \brief Set the callback that resets an object when it's returned
+ *
+ * Init runs once, when an object is constructed; reused objects come back
+ * as they were returned. Recycle lets the owner reset just what needs it,
+ * e.g. the header fields of a packet, instead of the whole object. It is
+ * called with InitData on every return path, before the object is cached
+ * or linked back in, so it must not rely on the first word of an object
+ * in an intrusive pool staying intact.
+ *
+ * \param Recycle the callback, or NULL for none
+ */
+void PoolSetRecycle(Pool *p, void (*Recycle)(void *, void *))
+{
+	if (p->flags & POOL_FLAG_NUMA) 
+	{
+		uint32_t u32;
+		for (u32 = 0; u32 < p->nr_nodes; u32++) {
+			PoolSetRecycle(p->node_pools[u32], Recycle);
+		}
+		return;
+	}
+
+	p->Recycle = Recycle;
+}
+
+void PoolFree(Pool *p) 
+{
+	if (p == NULL) return;
+
+	if (p->registered)
+		PoolUnregister(p);
+
+	if (p->flags & POOL_FLAG_NUMA) 
+	{
+		uint32_t u32;
+		for (u32 = 0; p->node_pools != NULL && u32 < p->nr_nodes; u32++) {
+			PoolFree(p->node_pools[u32]);
+		}
+		if (p->node_pools) OBFree(p->node_pools);
+		if (p->cpu_to_node) OBFree(p->cpu_to_node);
+		OBFreeAligned(p);
+		return;
+	}
+
+	/* outstanding objects aren't ours to free, release them as well */
+	PoolSetMemcap(p, NULL);
+
+	if (p->flags & POOL_FLAG_MAGAZINE) 
+	{
+		PoolMagazineDrain(p);
+	}
+
+	if (p->flags & POOL_FLAG_LOCKFREE) 
+	{
+		p->alloc_stack = PoolLockFreeBucket(p, p->lf_alloc_head);
+		p->empty_stack = PoolLockFreeBucket(p, p->lf_empty_head);
+	}
+
+	while (p->free_list != NULL) 
+	{
+		void *data = p->free_list;
+		p->free_list = *(void **)data;
+		*(void **)data = NULL;
+		PoolFreeObject(p, data);
+	}
+	while (p->carve_next < p->carve_end) 
+	{
+		PoolFreeObject(p, (char *)p->data_buffer + (size_t)p->carve_next * p->elt_size);
+		p->carve_next++;
+	}
+
+	while (p->alloc_stack != NULL) 
+	{
+		PoolBucket *pb = p->alloc_stack;
+		p->alloc_stack = pb->next;
+		if (p->Cleanup) p->Cleanup(pb->data);
+
+		if (PoolDataPreAllocated(p, pb->data) == 0) 
+		{
+			if (p->Free) p->Free(pb->data);
+			else OBFree(pb->data);
+		}
+
+		pb->data = NULL;
+		if (!(pb->flags & POOL_BUCKET_PREALLOCATED)) {
+			OBFree(pb);
+		}
+	}
+	
+	while (p->empty_stack != NULL) 
+	{
+		PoolBucket *pb = p->empty_stack;
+		p->empty_stack = pb->next;
+		if (pb->data!= NULL) 
+		{
+			if (p->Cleanup) p->Cleanup(pb->data);
+			if (PoolDataPreAllocated(p, pb->data) == 0) 
+			{
+				if (p->Free) p->Free(pb->data);
+				else OBFree(pb->data);
+			}
+			pb->data = NULL;
+		}
+		if (!(pb->flags & POOL_BUCKET_PREALLOCATED)) 
+		{
+			OBFree(pb);
+		}
+	}
+
+	while (p->nr_slabs > 0) {
+		PoolSlabMemFree(p, p->slabs[--p->nr_slabs].mem);
+	}
+	if (p->slabs) OBFree(p->slabs);
+	if (p->pb_buffer) OBFree(p->pb_buffer);
+	PoolBufferFree(p);
+	OBFreeAligned(p);
+}
+
+
+void PoolPrint(Pool *p) 
+{
+	if (p->flags & POOL_FLAG_NUMA) 
+	{
+		uint32_t u32;
+		for (u32 = 0; u32 < p->nr_nodes; u32++) {
+			printf("\nNUMA node %u:", u32);
+			PoolPrint(p->node_pools[u32]);
+		}
+		return;
+	}
+
+	printf("\n----------- Hash Table Stats ------------\n");
+	printf("Buckets:               %u\n", p->empty_stack_size + p->alloc_stack_size);
+	printf("Element size:          %u\n", p->elt_size);
+	printf("Prealloc buffer:       %zu bytes at %p\n", p->data_buffer_size, p->data_buffer);
+	printf("Prealloc page size:    %zu\n", PoolBufferPageSize(p));
+	printf("Slabs:                 %u of %u objects\n", p->nr_slabs, p->slab_objects);
+	if (p->memcap != NULL) {
+		printf("Memcap:                %"PRIu64" bytes charged to %s\n", p->memuse, p->memcap->name);
+	}
+	printf("-----------------------------------------\n");
+}
+
+static void *PoolStackGet(Pool *p) 
+{
+	PoolBucket *pb = p->alloc_stack;
+
+	if (pb != NULL) 
+	{
+		/* pull from the alloc list */
+		p->alloc_stack = pb->next;
+		p->alloc_stack_size--;
+
+		/* put in the empty list */
+		pb->next = p->empty_stack;
+		p->empty_stack = pb;
+		p->empty_stack_size++;
+	} 
+	else 
+	{
+		p->stats.misses++;
+		if (p->slab_objects > 0 && PoolSlabGrow(p) == 0)
+			return PoolStackGet(p);
+
+		if (p->max_buckets == 0 || p->allocated < p->max_buckets) 
+		{
+			void *pitem = PoolAllocObject(p);
+
+			if (pitem != NULL) 
+			{
+				p->allocated++;
+
+				p->outstanding++;
+				if (p->outstanding > p->max_outstanding)
+					p->max_outstanding = p->outstanding;
+			}
+
+			return pitem;
+		} 
+		else 
+		{
+			return NULL;
+		}
+	}
+
+	void *ptr = pb->data;
+	pb->data = NULL;
+	p->outstanding++;
+	if (p->outstanding > p->max_outstanding)
+		p->max_outstanding = p->outstanding;
+
+	PoolSlabGet(p, ptr);
+	return ptr;
+}
+
+
+static void PoolStackReturn(Pool *p, void *data) 
+{
+	PoolBucket *pb = p->empty_stack;
+
+	if (pb == NULL) 
+	{
+		p->allocated--;
+		p->outstanding--;
+		PoolFreeObject(p, data);
+		return;
+	}
+
+	/* pull from the alloc list */
+	p->empty_stack = pb->next;
+	p->empty_stack_size--;
+
+	/* put in the alloc list */
+	pb->next = p->alloc_stack;
+	p->alloc_stack = pb;
+	p->alloc_stack_size++;
+
+	pb->data = data;
+	p->outstanding--;
+
+	PoolSlabPut(p, data);
+}
+
+static void PoolLockFreeUpdateMax(Pool *p, uint32_t outstanding)
+{
+	uint32_t max;
+
+	while ((max = OBAtomicLoadRelaxed(&p->max_outstanding)) < outstanding) {
+		if (OBAtomicCompareAndSwap(&p->max_outstanding, max, outstanding))
+			break;
+	}
+}
+
+static void *PoolLockFreeGet(Pool *p)
+{
+	PoolBucket *pb = PoolLockFreePop(p, &p->lf_alloc_head);
+	void *ptr;
+
+	if (pb != NULL) 
+	{
+		OBAtomicAddRelaxed(&p->alloc_stack_size, -1);
+
+		ptr = pb->data;
+		pb->data = NULL;
+
+		if (PoolLockFreeOwnBucket(p, ptr) != pb) {
+			PoolLockFreePush(p, &p->lf_empty_head, pb);
+			OBAtomicAddRelaxed(&p->empty_stack_size, 1);
+		}
+	} 
+	else 
+	{
+		/* reserve a slot before allocating so concurrent getters can't
+		 * push allocated past max_buckets */
+		uint32_t allocated;
+
+		OBAtomicAddRelaxed(&p->stats.misses, 1);
+		do {
+			allocated = OBAtomicLoadRelaxed(&p->allocated);
+			if (allocated >= p->max_buckets)
+				return NULL;
+		} while (OBAtomicCompareAndSwap(&p->allocated, allocated, allocated + 1) == 0);
+
+		ptr = PoolAllocObject(p);
+		if (ptr == NULL) {
+			OBAtomicSubAndFetch(&p->allocated, 1);
+			return NULL;
+		}
+	}
+
+	PoolLockFreeUpdateMax(p, OBAtomicAddAndFetch(&p->outstanding, 1));
+	return ptr;
+}
+
+static void PoolLockFreeReturn(Pool *p, void *data)
+{
+	PoolBucket *pb;
+
+	/* account before the object becomes visible to other getters, so
+	 * outstanding never overshoots the number of objects really in use */
+	OBAtomicSubAndFetch(&p->outstanding, 1);
+
+	/* the others take a bucket off the empty stack. There is one for each
+	 * of them in use, but the stack is also empty while a getter holds
+	 * the bucket it took an object from: free the object then */
+	if ((pb = PoolLockFreeOwnBucket(p, data)) == NULL)
+	{
+		if ((pb = PoolLockFreePop(p, &p->lf_empty_head)) == NULL) {
+			OBAtomicSubAndFetch(&p->allocated, 1);
+			PoolFreeObject(p, data);
+			return;
+		}
+		OBAtomicAddRelaxed(&p->empty_stack_size, -1);
+	}
+
+	pb->data = data;
+	PoolLockFreePush(p, &p->lf_alloc_head, pb);
+	OBAtomicAddRelaxed(&p->alloc_stack_size, 1);
+}
+
+static void *PoolIntrusiveGet(Pool *p)
+{
+	void *ptr = p->free_list;
+
+	if (ptr != NULL) 
+	{
+		p->free_list = *(void **)ptr;
+		*(void **)ptr = NULL;
+		p->alloc_stack_size--;
+	} 
+	else if (p->carve_next < p->carve_end) 
+	{
+		ptr = (char *)p->data_buffer + (size_t)p->carve_next * p->elt_size;
+		p->carve_next++;
+		p->alloc_stack_size--;
+	} 
+	else 
+	{
+		p->stats.misses++;
+		if (p->slab_objects > 0 && PoolSlabGrow(p) == 0)
+			return PoolIntrusiveGet(p);
+
+		if (p->max_buckets != 0 && p->allocated >= p->max_buckets)
+			return NULL;
+
+		ptr = PoolAllocObject(p);
+		if (ptr == NULL)
+			return NULL;
+
+		p->allocated++;
+	}
+
+	p->outstanding++;
+	if (p->outstanding > p->max_outstanding)
+		p->max_outstanding = p->outstanding;
+
+	PoolSlabGet(p, ptr);
+	return ptr;
+}
+
+static void PoolIntrusiveReturn(Pool *p, void *data)
+{
+	*(void **)data = p->free_list;
+	p->free_list = data;
+	p->alloc_stack_size++;
+	p->outstanding--;
+
+	PoolSlabPut(p, data);
+}
+
+/**
+ * \brief Get an object from the backing stacks, bypassing the magazines
+ */
+static void *PoolGetDirect(Pool *p)
+{
+	if (p->flags & POOL_FLAG_LOCKFREE)
+		return PoolLockFreeGet(p);
+	if (p->flags & POOL_FLAG_INTRUSIVE)
+		return PoolIntrusiveGet(p);
+
+	return PoolStackGet(p);
+}
+
+static void PoolReturnDirect(Pool *p, void *data)
+{
+	if (p->flags & POOL_FLAG_LOCKFREE) 
+	{
+		PoolLockFreeReturn(p, data);
+		return;
+	}
+	if (p->flags & POOL_FLAG_INTRUSIVE) 
+	{
+		PoolIntrusiveReturn(p, data);
+		return;
+	}
+
+	PoolStackReturn(p, data);
+}
+
+/**
+ * \brief Alloc an empty magazine
+ */
+static PoolMagazine *PoolMagazineAlloc(void)
+{
+	PoolMagazine *m = OBMallocTag(OB_MEM_TAG_POOL, sizeof(PoolMagazine));
+	if (unlikely(m == NULL))
+		return NULL;
+
+	m->rounds = 0;
+	m->next = NULL;
+	return m;
+}
+
+/**
+ * \brief Give all objects of a magazine back to the pool and free it
+ *
+ * \warning depot_lock must be held
+ */
+static void PoolMagazineRelease(Pool *p, PoolMagazine *m)
+{
+	if (m == NULL)
+		return;
+
+	while (m->rounds > 0) {
+		PoolReturnDirect(p, m->objs[--m->rounds]);
+	}
+	OBFree(m);
+}
+
+/**
+ * \brief Get the calling thread's cache, creating it on first use
+ *
+ * \retval tc the cache or NULL on alloc error
+ */
+static PoolThreadCache *PoolThreadCacheGet(Pool *p)
+{
+	PoolThreadCache *tc = pthread_getspecific(p->tc_key);
+	if (likely(tc != NULL))
+		return tc;
+
+	tc = OBCallocAlignedTag(OB_MEM_TAG_POOL, OB_CACHE_LINE_SIZE, 1, sizeof(PoolThreadCache));
+	if (unlikely(tc == NULL))
+		return NULL;
+
+	tc->pool = p;
+
+	if (pthread_setspecific(p->tc_key, tc) != 0) {
+		OBFreeAligned(tc);
+		return NULL;
+	}
+
+	OBMutexLock(&p->depot_lock);
+	tc->next = p->tc_list;
+	p->tc_list = tc;
+	OBMutexUnlock(&p->depot_lock);
+
+	return tc;
+}
+
+/**
+ * \brief Flush a thread cache back into the pool
+ *
+ * \warning depot_lock must be held
+ */
+static void PoolThreadCacheFlush(Pool *p, PoolThreadCache *tc)
+{
+	PoolMagazineRelease(p, tc->loaded);
+	PoolMagazineRelease(p, tc->previous);
+	tc->loaded = NULL;
+	tc->previous = NULL;
+
+	p->magazine_hits += tc->hits;
+	p->magazine_misses += tc->misses;
+	p->stats.gets += tc->gets;
+	p->stats.returns += tc->returns;
+}
+
+/**
+ * \brief Thread exit destructor of the per-thread cache
+ */
+static void PoolThreadCacheDestroy(void *data)
+{
+	PoolThreadCache *tc = (PoolThreadCache *)data;
+	Pool *p = tc->pool;
+	PoolThreadCache **ptc;
+
+	OBMutexLock(&p->depot_lock);
+	PoolThreadCacheFlush(p, tc);
+	for (ptc = &p->tc_list; *ptc != NULL; ptc = &(*ptc)->next) {
+		if (*ptc == tc) {
+			*ptc = tc->next;
+			break;
+		}
+	}
+	OBMutexUnlock(&p->depot_lock);
+
+	OBFreeAligned(tc);
+}
+
+/**
+ * \brief Return every cached object to the pool, used by PoolFree
+ */
+static void PoolMagazineDrain(Pool *p)
+{
+	PoolThreadCache *tc;
+	PoolMagazine *m;
+
+	OBMutexLock(&p->depot_lock);
+	while ((tc = p->tc_list) != NULL) 
+	{
+		p->tc_list = tc->next;
+		PoolThreadCacheFlush(p, tc);
+		OBFreeAligned(tc);
+	}
+	while ((m = p->depot_full) != NULL) 
+	{
+		p->depot_full = m->next;
+		PoolMagazineRelease(p, m);
+	}
+	while ((m = p->depot_empty) != NULL) 
+	{
+		p->depot_empty = m->next;
+		OBFree(m);
+	}
+	OBMutexUnlock(&p->depot_lock);
+
+	pthread_key_delete(p->tc_key);
+	OBMutexDestroy(&p->depot_lock);
+}
+
+/* A thread cache and its magazines are written by their thread without
+ * lock, and read by the stats of other threads under depot_lock: the
+ * owner stores with relaxed atomics, the stats load so, nothing torn */
+static inline void PoolTcAdd(uint64_t *counter, uint64_t n)
+{
+	OBAtomicStoreRelaxed(counter, OBAtomicLoadRelaxed(counter) + n);
+}
+
+static inline void *PoolMagazinePop(PoolMagazine *m)
+{
+	uint32_t rounds = m->rounds - 1;
+
+	OBAtomicStoreRelaxed(&m->rounds, rounds);
+	return m->objs[rounds];
+}
+
+static inline void PoolMagazinePush(PoolMagazine *m, void *data)
+{
+	m->objs[m->rounds] = data;
+	OBAtomicStoreRelaxed(&m->rounds, m->rounds + 1);
+}
+
+/**
+ * \brief Swap in m as the loaded magazine, the loaded one as previous
+ */
+static inline void PoolTcLoad(PoolThreadCache *tc, PoolMagazine *m)
+{
+	OBAtomicStoreRelaxed(&tc->previous, tc->loaded);
+	OBAtomicStoreRelaxed(&tc->loaded, m);
+}
+
+static void *PoolMagazineGet(Pool *p)
+{
+	PoolThreadCache *tc = PoolThreadCacheGet(p);
+	PoolMagazine *m;
+	void *ptr;
+
+	if (unlikely(tc == NULL)) 
+	{
+		OBMutexLock(&p->depot_lock);
+		if ((ptr = PoolGetDirect(p)) != NULL)
+			p->stats.gets++;
+		OBMutexUnlock(&p->depot_lock);
+		return ptr;
+	}
+
+	m = tc->loaded;
+	if (likely(m != NULL && m->rounds > 0)) 
+	{
+		PoolTcAdd(&tc->hits, 1);
+		PoolTcAdd(&tc->gets, 1);
+		return PoolMagazinePop(m);
+	}
+
+	/* previous is either full or empty */
+	m = tc->previous;
+	if (m != NULL && m->rounds > 0) 
+	{
+		PoolTcLoad(tc, m);
+		PoolTcAdd(&tc->hits, 1);
+		PoolTcAdd(&tc->gets, 1);
+		return PoolMagazinePop(m);
+	}
+
+	/* both magazines are empty: swap for a full one from the depot or
+	 * fall through to the pool itself */
+	PoolTcAdd(&tc->misses, 1);
+	OBMutexLock(&p->depot_lock);
+	m = p->depot_full;
+	if (m == NULL) 
+	{
+		if ((ptr = PoolGetDirect(p)) != NULL)
+			PoolTcAdd(&tc->gets, 1);
+		OBMutexUnlock(&p->depot_lock);
+		return ptr;
+	}
+
+	p->depot_full = m->next;
+	if (tc->previous != NULL) 
+	{
+		tc->previous->next = p->depot_empty;
+		p->depot_empty = tc->previous;
+	}
+	OBMutexUnlock(&p->depot_lock);
+
+	PoolTcLoad(tc, m);
+	PoolTcAdd(&tc->gets, 1);
+	return PoolMagazinePop(m);
+}
+
+static void PoolMagazineReturn(Pool *p, void *data)
+{
+	PoolThreadCache *tc = PoolThreadCacheGet(p);
+	PoolMagazine *m;
+
+	if (unlikely(tc == NULL)) 
+	{
+		OBMutexLock(&p->depot_lock);
+		PoolReturnDirect(p, data);
+		p->stats.returns++;
+		OBMutexUnlock(&p->depot_lock);
+		return;
+	}
+
+	PoolTcAdd(&tc->returns, 1);
+	m = tc->loaded;
+	if (likely(m != NULL && m->rounds < POOL_MAGAZINE_SIZE)) 
+	{
+		PoolTcAdd(&tc->hits, 1);
+		PoolMagazinePush(m, data);
+		return;
+	}
+
+	/* previous is either full or empty */
+	m = tc->previous;
+	if (m != NULL && m->rounds == 0) 
+	{
+		PoolTcLoad(tc, m);
+		PoolTcAdd(&tc->hits, 1);
+		PoolMagazinePush(m, data);
+		return;
+	}
+
+	/* both magazines are full: hand the spare one to the depot and load
+	 * an empty one */
+	PoolTcAdd(&tc->misses, 1);
+	OBMutexLock(&p->depot_lock);
+	m = p->depot_empty;
+	if (m != NULL) {
+		p->depot_empty = m->next;
+	} else {
+		m = PoolMagazineAlloc();
+	}
+
+	if (unlikely(m == NULL)) 
+	{
+		PoolReturnDirect(p, data);
+		OBMutexUnlock(&p->depot_lock);
+		return;
+	}
+
+	if (tc->previous != NULL) 
+	{
+		tc->previous->next = p->depot_full;
+		p->depot_full = tc->previous;
+	}
+	OBMutexUnlock(&p->depot_lock);
+
+	PoolTcLoad(tc, m);
+	PoolMagazinePush(m, data);
+}
+
+/**
+ * \brief Account a latency sample in a log2 histogram
+ */
+static inline void PoolLatencyAdd(uint64_t *hist, uint64_t ticks)
+{
+	uint32_t bucket = ticks ? 63 - __builtin_clzll(ticks) : 0;
+
+	if (bucket >= POOL_LATENCY_BUCKETS)
+		bucket = POOL_LATENCY_BUCKETS - 1;
+	OBAtomicAddRelaxed(&hist[bucket], 1);
+}
+
+static inline void *PoolGetUntimed(Pool *p)
+{
+	void *ptr;
+
+	if (p->flags & POOL_FLAG_NUMA)
+		return PoolNumaGet(p);
+	if (p->flags & POOL_FLAG_MAGAZINE)
+		return PoolMagazineGet(p);
+
+	if ((ptr = PoolGetDirect(p)) != NULL)
+		POOL_STAT_ADD(p, gets, 1);
+	return ptr;
+}
+
+void *PoolGet(Pool *p) 
+{
+	if (unlikely(p->flags & POOL_FLAG_LATENCY)) 
+	{
+		uint64_t ticks = UtilCpuGetTicks();
+		void *ptr = PoolGetUntimed(p);
+		PoolLatencyAdd(p->get_latency, UtilCpuGetTicks() - ticks);
+		return ptr;
+	}
+
+	return PoolGetUntimed(p);
+}
+
+static inline void PoolReturnUntimed(Pool *p, void *data) 
+{
+	if (p->flags & POOL_FLAG_NUMA) 
+	{
+		PoolNumaReturn(p, data);
+		return;
+	}
+
+	if (p->Recycle != NULL)
+		p->Recycle(data, p->InitData);
+
+	if (p->flags & POOL_FLAG_MAGAZINE) 
+	{
+		PoolMagazineReturn(p, data);
+		return;
+	}
+
+	PoolReturnDirect(p, data);
+	POOL_STAT_ADD(p, returns, 1);
+}
+
+void PoolReturn(Pool *p, void *data) 
+{
+	if (unlikely(p->flags & POOL_FLAG_LATENCY)) 
+	{
+		uint64_t ticks = UtilCpuGetTicks();
+		PoolReturnUntimed(p, data);
+		PoolLatencyAdd(p->return_latency, UtilCpuGetTicks() - ticks);
+		return;
+	}
+
+	PoolReturnUntimed(p, data);
+}
+
+/**
+ * \brief Get up to n objects from a bucket pool
+ *
+ * The run of buckets is unlinked from alloc_stack and spliced onto
+ * empty_stack in one go.
+ */
+static uint32_t PoolStackGetBulk(Pool *p, void **objs, uint32_t n)
+{
+	PoolBucket *first = p->alloc_stack;
+	PoolBucket *last = NULL;
+	PoolBucket *pb;
+	uint32_t cnt = 0;
+
+	for (pb = first; pb != NULL && cnt < n; pb = pb->next) 
+	{
+		objs[cnt++] = pb->data;
+		pb->data = NULL;
+		last = pb;
+	}
+
+	if (cnt > 0) 
+	{
+		p->alloc_stack = last->next;
+		p->alloc_stack_size -= cnt;
+
+		last->next = p->empty_stack;
+		p->empty_stack = first;
+		p->empty_stack_size += cnt;
+
+		p->outstanding += cnt;
+		if (p->outstanding > p->max_outstanding)
+			p->max_outstanding = p->outstanding;
+
+		PoolSlabAccount(p, objs, cnt, 1);
+	}
+
+	/* stack ran dry, PoolStackGet allocates the rest if it may */
+	for (; cnt < n; cnt++) 
+	{
+		if ((objs[cnt] = PoolStackGet(p)) == NULL)
+			break;
+	}
+	return cnt;
+}
+
+static void PoolStackReturnBulk(Pool *p, void **objs, uint32_t n)
+{
+	PoolBucket *first = p->empty_stack;
+	PoolBucket *last = NULL;
+	PoolBucket *pb;
+	uint32_t cnt = 0;
+
+	for (pb = first; pb != NULL && cnt < n; pb = pb->next) 
+	{
+		pb->data = objs[cnt++];
+		last = pb;
+	}
+
+	if (cnt > 0) 
+	{
+		p->empty_stack = last->next;
+		p->empty_stack_size -= cnt;
+
+		last->next = p->alloc_stack;
+		p->alloc_stack = first;
+		p->alloc_stack_size += cnt;
+
+		p->outstanding -= cnt;
+
+		PoolSlabAccount(p, objs, cnt, 0);
+	}
+
+	/* out of buckets, PoolStackReturn frees the rest */
+	for (; cnt < n; cnt++) {
+		PoolStackReturn(p, objs[cnt]);
+	}
+}
+
+/**
+ * \brief Get up to n objects from an intrusive pool
+ *
+ * Never handed out objects of data_buffer are contiguous, those are
+ * taken without touching their memory.
+ */
+static uint32_t PoolIntrusiveGetBulk(Pool *p, void **objs, uint32_t n)
+{
+	uint32_t cnt = 0;
+	void *ptr;
+
+	while (cnt < n && (ptr = p->free_list) != NULL) 
+	{
+		p->free_list = *(void **)ptr;
+		*(void **)ptr = NULL;
+		objs[cnt++] = ptr;
+	}
+
+	if (cnt < n && p->carve_next < p->carve_end) 
+	{
+		uint32_t carve = p->carve_end - p->carve_next;
+		char *data = (char *)p->data_buffer + (size_t)p->carve_next * p->elt_size;
+
+		if (carve > n - cnt)
+			carve = n - cnt;
+		p->carve_next += carve;
+		while (carve-- > 0) 
+		{
+			objs[cnt++] = data;
+			data += p->elt_size;
+		}
+	}
+
+	p->alloc_stack_size -= cnt;
+	p->outstanding += cnt;
+	if (p->outstanding > p->max_outstanding)
+		p->max_outstanding = p->outstanding;
+
+	PoolSlabAccount(p, objs, cnt, 1);
+
+	for (; cnt < n; cnt++) 
+	{
+		if ((objs[cnt] = PoolIntrusiveGet(p)) == NULL)
+			break;
+	}
+	return cnt;
+}
+
+static void PoolIntrusiveReturnBulk(Pool *p, void **objs, uint32_t n)
+{
+	uint32_t u32;
+
+	if (n == 0)
+		return;
+
+	/* link the run, then splice it in front of the free list */
+	for (u32 = 0; u32 < n - 1; u32++) {
+		*(void **)objs[u32] = objs[u32 + 1];
+	}
+	*(void **)objs[n - 1] = p->free_list;
+	p->free_list = objs[0];
+
+	p->alloc_stack_size += n;
+	p->outstanding -= n;
+
+	PoolSlabAccount(p, objs, n, 0);
+}
+
+/**
+ * \brief Get up to n objects from the calling thread's magazines
+ */
+static uint32_t PoolMagazineGetBulk(Pool *p, void **objs, uint32_t n)
+{
+	PoolThreadCache *tc = PoolThreadCacheGet(p);
+	PoolMagazine *m;
+	uint32_t cnt = 0;
+
+	while (cnt < n) 
+	{
+		m = tc ? tc->loaded : NULL;
+		if (m != NULL && m->rounds > 0) 
+		{
+			uint32_t k = m->rounds < n - cnt ? m->rounds : n - cnt;
+
+			memcpy(&objs[cnt], &m->objs[m->rounds - k], k * sizeof(void *));
+			OBAtomicStoreRelaxed(&m->rounds, m->rounds - k);
+			PoolTcAdd(&tc->hits, k);
+			PoolTcAdd(&tc->gets, k);
+			cnt += k;
+			continue;
+		}
+
+		/* swap magazines or go to the depot */
+		if ((objs[cnt] = PoolMagazineGet(p)) == NULL)
+			break;
+		cnt++;
+	}
+	return cnt;
+}
+
+static void PoolMagazineReturnBulk(Pool *p, void **objs, uint32_t n)
+{
+	PoolThreadCache *tc = PoolThreadCacheGet(p);
+	PoolMagazine *m;
+	uint32_t cnt = 0;
+
+	while (cnt < n) 
+	{
+		m = tc ? tc->loaded : NULL;
+		if (m != NULL && m->rounds < POOL_MAGAZINE_SIZE) 
+		{
+			uint32_t k = POOL_MAGAZINE_SIZE - m->rounds;
+
+			if (k > n - cnt)
+				k = n - cnt;
+			memcpy(&m->objs[m->rounds], &objs[cnt], k * sizeof(void *));
+			OBAtomicStoreRelaxed(&m->rounds, m->rounds + k);
+			PoolTcAdd(&tc->hits, k);
+			PoolTcAdd(&tc->returns, k);
+			cnt += k;
+			continue;
+		}
+
+		PoolMagazineReturn(p, objs[cnt++]);
+	}
+}
+
+/**
+ * \brief Get up to n objects from the pool at once
+ *
+ * \param objs array of at least n pointers that receives the objects
+ *
+ * \retval number of objects put in objs, less than n if the pool is
+ *         exhausted
+ */
+uint32_t PoolGetBulk(Pool *p, void **objs, uint32_t n)
+{
+	uint32_t cnt;
+
+	if (p->flags & POOL_FLAG_MAGAZINE)
+		return PoolMagazineGetBulk(p, objs, n);
+	if (p->flags & (POOL_FLAG_LOCKFREE | POOL_FLAG_NUMA)) 
+	{
+		for (cnt = 0; cnt < n; cnt++) 
+		{
+			if ((objs[cnt] = PoolGet(p)) == NULL)
+				break;
+		}
+		return cnt;
+	}
+
+	if (p->flags & POOL_FLAG_INTRUSIVE)
+		cnt = PoolIntrusiveGetBulk(p, objs, n);
+	else
+		cnt = PoolStackGetBulk(p, objs, n);
+	p->stats.gets += cnt;
+	return cnt;
+}
+
+/**
+ * \brief Return n objects to the pool at once
+ */
+void PoolReturnBulk(Pool *p, void **objs, uint32_t n)
+{
+	uint32_t cnt;
+
+	if (p->flags & (POOL_FLAG_LOCKFREE | POOL_FLAG_NUMA)) 
+	{
+		for (cnt = 0; cnt < n; cnt++) {
+			PoolReturn(p, objs[cnt]);
+		}
+		return;
+	}
+
+	if (p->Recycle != NULL) 
+	{
+		for (cnt = 0; cnt < n; cnt++) {
+			p->Recycle(objs[cnt], p->InitData);
+		}
+	}
+
+	if (p->flags & POOL_FLAG_MAGAZINE) 
+	{
+		PoolMagazineReturnBulk(p, objs, n);
+		return;
+	}
+
+	if (p->flags & POOL_FLAG_INTRUSIVE)
+		PoolIntrusiveReturnBulk(p, objs, n);
+	else
+		PoolStackReturnBulk(p, objs, n);
+	p->stats.returns += n;
+}
+
+/**
+ * \brief Sum the magazine counters of a pool
+ *
+ * \param hits gets/returns served from the per-thread magazines
+ * \param misses gets/returns that had to go to the depot
+ * \param cached objects held by the magazines, they are counted as
+ *        outstanding by the pool itself
+ */
+void PoolGetMagazineStats(Pool *p, uint64_t *hits, uint64_t *misses, uint32_t *cached)
+{
+	PoolThreadCache *tc;
+	PoolMagazine *m;
+
+	*hits = 0;
+	*misses = 0;
+	*cached = 0;
+	if (!(p->flags & POOL_FLAG_MAGAZINE))
+		return;
+
+	OBMutexLock(&p->depot_lock);
+	*hits = p->magazine_hits;
+	*misses = p->magazine_misses;
+	for (tc = p->tc_list; tc != NULL; tc = tc->next) 
+	{
+		*hits += OBAtomicLoadRelaxed(&tc->hits);
+		*misses += OBAtomicLoadRelaxed(&tc->misses);
+		/* of a running thread, off by what it moves meanwhile */
+		if ((m = OBAtomicLoadRelaxed(&tc->loaded)) != NULL)
+			*cached += OBAtomicLoadRelaxed(&m->rounds);
+		if ((m = OBAtomicLoadRelaxed(&tc->previous)) != NULL)
+			*cached += OBAtomicLoadRelaxed(&m->rounds);
+	}
+	for (m = p->depot_full; m != NULL; m = m->next) {
+		*cached += m->rounds;
+	}
+	OBMutexUnlock(&p->depot_lock);
+}
+
+/**
+ * \brief Get the counters of a pool, summed over its numa sub-pools and
+ *        thread caches
+ */
+void PoolGetStats(Pool *p, PoolStats *stats)
+{
+	PoolThreadCache *tc;
+
+	memset(stats, 0, sizeof(PoolStats));
+	if (p->flags & POOL_FLAG_NUMA) 
+	{
+		PoolStats node;
+		uint32_t u32;
+
+		for (u32 = 0; u32 < p->nr_nodes; u32++) 
+		{
+			PoolGetStats(p->node_pools[u32], &node);
+			stats->gets += node.gets;
+			stats->returns += node.returns;
+			stats->misses += node.misses;
+			stats->mallocs += node.mallocs;
+			stats->frees += node.frees;
+			stats->slab_grows += node.slab_grows;
+		}
+		return;
+	}
+
+	if (p->flags & POOL_FLAG_MAGAZINE)
+		OBMutexLock(&p->depot_lock);
+	*stats = p->stats;
+	if (p->flags & POOL_FLAG_MAGAZINE) 
+	{
+		for (tc = p->tc_list; tc != NULL; tc = tc->next) {
+			stats->gets += OBAtomicLoadRelaxed(&tc->gets);
+			stats->returns += OBAtomicLoadRelaxed(&tc->returns);
+		}
+		OBMutexUnlock(&p->depot_lock);
+	}
+}
+
+static void PoolPrintLatency(Pool *p, const char *what, uint64_t *hist,
+		void (*Print)(void *, const char *), void *ctx)
+{
+	char line[128];
+	uint32_t u32;
+
+	for (u32 = 0; u32 < POOL_LATENCY_BUCKETS; u32++) 
+	{
+		if (hist[u32] == 0)
+			continue;
+		if (u32 == POOL_LATENCY_BUCKETS - 1)
+			snprintf(line, sizeof(line), "  %s latency >= %"PRIu64" ticks: %"PRIu64,
+					what, (uint64_t)1 << u32, hist[u32]);
+		else
+			snprintf(line, sizeof(line), "  %s latency %"PRIu64"-%"PRIu64" ticks: %"PRIu64,
+					what, (uint64_t)1 << u32, ((uint64_t)2 << u32) - 1, hist[u32]);
+		Print(ctx, line);
+	}
+}
+
+static void PoolPrintStats(Pool *p, void (*Print)(void *, const char *), void *ctx)
+{
+	uint32_t allocated = p->allocated, outstanding = p->outstanding;
+	uint32_t max_outstanding = p->max_outstanding;
+	PoolStats stats;
+	char line[256];
+
+	if (p->flags & POOL_FLAG_NUMA) 
+	{
+		uint32_t u32;
+		for (u32 = 0; u32 < p->nr_nodes; u32++) {
+			allocated += p->node_pools[u32]->allocated;
+			outstanding += p->node_pools[u32]->outstanding;
+			max_outstanding += p->node_pools[u32]->max_outstanding;
+		}
+	}
+
+	snprintf(line, sizeof(line), "%s: %s%s%s%s%s, size %u, prealloc %u, elt_size %u",
+			p->name, (p->flags & POOL_FLAG_INTRUSIVE) ? "intrusive" : "bucket",
+			(p->flags & POOL_FLAG_MAGAZINE) ? " magazine" : "",
+			(p->flags & POOL_FLAG_LOCKFREE) ? " lock-free" : "",
+			(p->flags & POOL_FLAG_NUMA) ? " numa" : "",
+			p->slab_objects ? " slabs" : "",
+			p->max_buckets, p->preallocated, p->elt_size);
+	Print(ctx, line);
+
+	snprintf(line, sizeof(line), "  allocated %u, outstanding %u, max outstanding %u",
+			allocated, outstanding, max_outstanding);
+	Print(ctx, line);
+
+	PoolGetStats(p, &stats);
+	snprintf(line, sizeof(line), "  gets %"PRIu64", returns %"PRIu64", misses %"PRIu64", "
+			"mallocs %"PRIu64", frees %"PRIu64", slab grows %"PRIu64,
+			stats.gets, stats.returns, stats.misses, stats.mallocs, stats.frees, stats.slab_grows);
+	Print(ctx, line);
+
+	if (p->flags & POOL_FLAG_MAGAZINE) 
+	{
+		uint64_t hits, misses;
+		uint32_t cached;
+
+		PoolGetMagazineStats(p, &hits, &misses, &cached);
+		snprintf(line, sizeof(line), "  magazine hits %"PRIu64", misses %"PRIu64", %u cached",
+				hits, misses, cached);
+		Print(ctx, line);
+	}
+	if (p->memcap != NULL) 
+	{
+		snprintf(line, sizeof(line), "  memcap %s: %"PRIu64" bytes, %"PRIu64" of %"PRIu64" in use",
+				p->memcap->name, p->memuse, OB_ATOMIC_GET(p->memcap->memuse), p->memcap->memcap);
+		Print(ctx, line);
+	}
+	if (p->flags & POOL_FLAG_LATENCY) 
+	{
+		PoolPrintLatency(p, "get", p->get_latency, Print, ctx);
+		PoolPrintLatency(p, "return", p->return_latency, Print, ctx);
+	}
+}
+
+/**
+ * \brief Print the counters of every registered pool
+ *
+ * \param Print called for each line of output, e.g. cli_print
+ */
+void PoolRegistryPrint(void (*Print)(void *, const char *), void *ctx)
+{
+	Pool *p;
+
+	OBMutexLock(&pool_registry_lock);
+	for (p = pool_registry; p != NULL; p = p->registry_next) {
+		PoolPrintStats(p, Print, ctx);
+	}
+	OBMutexUnlock(&pool_registry_lock);
+}
+
+void PoolPrintSaturation(Pool *p) 
+{
+	if (p->flags & POOL_FLAG_NUMA) 
+	{
+		uint32_t u32;
+		for (u32 = 0; u32 < p->nr_nodes; u32++) {
+			OBLogDebug("pool %p numa node %u:", p, u32);
+			PoolPrintSaturation(p->node_pools[u32]);
+		}
+		return;
+	}
+
+	OBLogDebug("pool %p is using %u out of %u items (%02.1f%%), max %u (%02.1f%%): pool struct memory %lu.", 
+		p, p->outstanding, p->max_buckets, (float)(p->outstanding/(float)(p->max_buckets))*100, p->max_outstanding, 
+		(float)(p->max_outstanding/(float)(p->max_buckets))*100, (uint64_t)(p->pb_buffer ? p->max_buckets * sizeof(PoolBucket) : 0));
+
+	if (p->flags & POOL_FLAG_MAGAZINE) 
+	{
+		PoolThreadCache *tc;
+		uint64_t hits, misses;
+		uint32_t cached;
+
+		PoolGetMagazineStats(p, &hits, &misses, &cached);
+		OBLogDebug("pool %p magazines: hits %"PRIu64", misses %"PRIu64", %u items cached.", p, hits, misses, cached);
+
+		OBMutexLock(&p->depot_lock);
+		for (tc = p->tc_list; tc != NULL; tc = tc->next) {
+			OBLogDebug("pool %p thread cache %p: hits %"PRIu64", misses %"PRIu64".", p, tc,
+					OBAtomicLoadRelaxed(&tc->hits), OBAtomicLoadRelaxed(&tc->misses));
+		}
+		OBMutexUnlock(&p->depot_lock);
+	}
+}
+
+/********************************Unittests*************************************/
+
+#define POOL_TEST_THREADS       8
+#define POOL_TEST_LOOPS         100000
+#define POOL_TEST_BURST         16
+
+typedef struct PoolTestThread_ {
+    Pool *p;
+    uint32_t id;
+    int result;
+} PoolTestThread;
+
+static void *PoolTestLockFreeWorker(void *arg)
+{
+	PoolTestThread *t = (PoolTestThread *)arg;
+	uint32_t *objs[POOL_TEST_BURST];
+	uint32_t seed = t->id;
+	int i, j, n;
+
+	for (i = 0; i < POOL_TEST_LOOPS; i++) 
+	{
+		n = 1 + rand_r(&seed) % POOL_TEST_BURST;
+		for (j = 0; j < n; j++) 
+		{
+			objs[j] = PoolGet(t->p);
+			if (objs[j] == NULL)
+				break;
+			/* the object must be ours alone until we return it */
+			if (*objs[j] != 0)
+				t->result = 0;
+			*objs[j] = t->id;
+		}
+		while (--j >= 0) 
+		{
+			if (*objs[j] != t->id)
+				t->result = 0;
+			*objs[j] = 0;
+			PoolReturn(t->p, objs[j]);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * \test hammer get/return of a lock-free pool from several threads and
+ *       check the counters don't drift
+ */
+static int PoolTestLockFreeStress(void)
+{
+	PoolTestThread t[POOL_TEST_THREADS];
+	pthread_t tid[POOL_TEST_THREADS];
+	PoolBucket *pb;
+	uint32_t prealloc = 0;
+	int result = 0;
+	int i;
+
+	/* smaller than the worst case demand so the overflow alloc/free
+	 * paths get their share of the races */
+	Pool *p = PoolInitEx(POOL_TEST_THREADS * POOL_TEST_BURST / 2, 32, sizeof(uint32_t),
+			NULL, NULL, NULL, NULL, NULL, POOL_FLAG_LOCKFREE);
+	if (p == NULL)
+		return 0;
+
+	for (i = 0; i < POOL_TEST_THREADS; i++) 
+	{
+		t[i].p = p;
+		t[i].id = i + 1;
+		t[i].result = 1;
+		if (pthread_create(&tid[i], NULL, PoolTestLockFreeWorker, &t[i]) != 0)
+			goto end;
+	}
+	for (i = 0; i < POOL_TEST_THREADS; i++) 
+	{
+		pthread_join(tid[i], NULL);
+		if (t[i].result != 1)
+			goto end;
+	}
+
+	if (p->outstanding != 0)
+		goto end;
+	if (p->allocated != p->alloc_stack_size)
+		goto end;
+	if (p->alloc_stack_size + p->empty_stack_size != p->max_buckets)
+		goto end;
+	if (p->max_outstanding > p->max_buckets)
+		goto end;
+
+	/* no preallocated object got lost, each is back in its own bucket */
+	for (pb = PoolLockFreeBucket(p, p->lf_alloc_head); pb != NULL; pb = pb->next) 
+	{
+		if (!PoolDataPreAllocated(p, pb->data))
+			continue;
+		prealloc++;
+		if (PoolLockFreeOwnBucket(p, pb->data) != pb)
+			goto end;
+	}
+	if (prealloc != p->preallocated)
+		goto end;
+
+	result = 1;
+end:
+	PoolFree(p);
+	return result;
+}
+
+/* objects in flight between the threads of the magazine test */
+typedef struct PoolTestMailbox_ {
+    OBMutex lock;
+    uint32_t *objs[POOL_TEST_THREADS * POOL_TEST_BURST];
+    uint32_t n;
+} PoolTestMailbox;
+
+typedef struct PoolTestMagazineThread_ {
+    Pool *p;
+    PoolTestMailbox *mb;
+    uint32_t id;
+    uint64_t gets;          /**< PoolGet calls, failed or not */
+    uint64_t returns;
+    int result;
+} PoolTestMagazineThread;
+
+static void *PoolTestMagazineWorker(void *arg)
+{
+	PoolTestMagazineThread *t = (PoolTestMagazineThread *)arg;
+	PoolTestMailbox *mb = t->mb;
+	uint32_t *objs[POOL_TEST_BURST];
+	uint32_t seed = t->id;
+	int i, j, n;
+
+	for (i = 0; i < POOL_TEST_LOOPS; i++)
+	{
+		n = 1 + rand_r(&seed) % POOL_TEST_BURST;
+		for (j = 0; j < n; j++)
+		{
+			t->gets++;
+			objs[j] = PoolGet(t->p);
+			if (objs[j] == NULL)
+				break;
+			if (*objs[j] != 0)
+				t->result = 0;
+			*objs[j] = t->id;
+		}
+
+		/* post what we got and take as many back, mostly objects of the
+		 * other threads, so they are returned into another thread's
+		 * magazines than the one they came from */
+		OBMutexLock(&mb->lock);
+		n = j;
+		for (j = 0; j < n; j++)
+		{
+			if (*objs[j] != t->id)
+				t->result = 0;
+			mb->objs[mb->n++] = objs[j];
+		}
+		for (j = 0; j < n; j++)
+		{
+			objs[j] = mb->objs[--mb->n];
+		}
+		OBMutexUnlock(&mb->lock);
+
+		for (j = 0; j < n; j++)
+		{
+			if (*objs[j] == 0)
+				t->result = 0;
+			*objs[j] = 0;
+			PoolReturn(t->p, objs[j]);
+			t->returns++;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * \test get/return of a magazine pool from several threads, with most
+ *       objects returned by another thread than the one that got them
+ */
+static int PoolTestMagazineStress(void)
+{
+	PoolTestMagazineThread t[POOL_TEST_THREADS];
+	pthread_t tid[POOL_TEST_THREADS];
+	PoolTestMailbox mb;
+	uint64_t hits, misses, gets = 0, returns = 0;
+	uint32_t cached;
+	int result = 0;
+	int i, started = 0;
+
+	/* the magazines of the threads hold more than the pool has, so the
+	 * failing get and overflow paths are taken too */
+	Pool *p = PoolInitEx(POOL_TEST_THREADS * POOL_TEST_BURST * 2, 32, sizeof(uint32_t),
+			NULL, NULL, NULL, NULL, NULL, POOL_FLAG_MAGAZINE);
+	if (p == NULL)
+		return 0;
+
+	memset(&mb, 0, sizeof(mb));
+	OBMutexInit(&mb.lock, NULL);
+
+	for (i = 0; i < POOL_TEST_THREADS; i++)
+	{
+		memset(&t[i], 0, sizeof(t[i]));
+		t[i].p = p;
+		t[i].mb = &mb;
+		t[i].id = i + 1;
+		t[i].result = 1;
+		if (pthread_create(&tid[i], NULL, PoolTestMagazineWorker, &t[i]) != 0)
+			break;
+		started++;
+	}
+	for (i = 0; i < started; i++)
+	{
+		pthread_join(tid[i], NULL);
+		if (t[i].result != 1)
+			goto end;
+		gets += t[i].gets;
+		returns += t[i].returns;
+	}
+	if (started != POOL_TEST_THREADS || mb.n != 0)
+		goto end;
+
+	/* the workers exited, their magazines went to the depot */
+	PoolGetMagazineStats(p, &hits, &misses, &cached);
+	if (hits + misses != gets + returns)
+		goto end;
+	if (hits == 0 || misses == 0)
+		goto end;
+	if (p->outstanding != cached)
+		goto end;
+	if (p->allocated != p->alloc_stack_size + cached)
+		goto end;
+	if (p->allocated > p->max_buckets)
+		goto end;
+
+	result = 1;
+end:
+	/* the returns of failed workers are left to PoolFree */
+	PoolFree(p);
+	OBMutexDestroy(&mb.lock);
+	return result;
+}
+
+/**
+ * \test intrusive pool hands out every object once and keeps no buckets
+ */
+static int PoolTestIntrusive(void)
+{
+	void *objs[11];
+	int result = 0;
+	int i, n = 0;
+
+	Pool *p = PoolInitEx(10, 5, 32, NULL, NULL, NULL, NULL, NULL, POOL_FLAG_INTRUSIVE);
+	if (p == NULL)
+		return 0;
+	if (p->pb_buffer != NULL || p->alloc_stack_size != 5)
+		goto end;
+
+	for (n = 0; n < 10; n++) 
+	{
+		objs[n] = PoolGet(p);
+		if (objs[n] == NULL || *(void **)objs[n] != NULL)
+			goto end;
+		if (n > 0 && n < 5 && objs[n] != (char *)objs[n - 1] + 32)
+			goto end;
+	}
+	if (PoolGet(p) != NULL)
+		goto end;
+
+	for (i = 0; i < 10; i++) {
+		PoolReturn(p, objs[i]);
+	}
+	n = 0;
+	if (p->outstanding != 0 || p->alloc_stack_size != 10 || p->allocated != 10)
+		goto end;
+
+	/* last returned comes out first */
+	if (PoolGet(p) != objs[9])
+		goto end;
+	PoolReturn(p, objs[9]);
+
+	result = 1;
+end:
+	/* give back what we hold when bailing out */
+	for (i = 0; i < n; i++) {
+		PoolReturn(p, objs[i]);
+	}
+	PoolFree(p);
+	return result;
+}
+
+/**
+ * \test numa front end falls back to remote nodes and returns objects
+ *       to the node owning them
+ */
+static int PoolTestNuma(void)
+{
+	Pool *p;
+	PoolNumaNodeList nodes = { { 0, 2 }, 2 };
+	void *objs[8];
+	int result = 0;
+	int i;
+
+	/* the sub-pools are shared by the threads of all nodes */
+	if ((p = PoolInitEx(8, 8, 64, NULL, NULL, NULL, NULL, NULL, POOL_FLAG_NUMA)) != NULL) {
+		PoolFree(p);
+		return 0;
+	}
+
+	/* two nodes with a hole in the ids whatever the box has, binding to a
+	 * missing node only warns */
+	p = PoolNumaInit(&nodes, 8, 64, NULL, NULL, NULL, NULL, NULL, POOL_FLAG_NUMA | POOL_FLAG_LOCKFREE);
+	if (p == NULL)
+		return 0;
+	if (p->node_pools[0]->numa_node != 0 || p->node_pools[1]->numa_node != 2)
+		goto end;
+
+	for (i = 0; i < 8; i++) 
+	{
+		objs[i] = PoolGet(p);
+		if (objs[i] == NULL)
+			goto end;
+	}
+	if (PoolGet(p) != NULL)
+		goto end;
+	if (p->node_pools[0]->outstanding != 4 || p->node_pools[1]->outstanding != 4)
+		goto end;
+
+	for (i = 0; i < 8; i++) {
+		PoolReturn(p, objs[i]);
+	}
+	if (p->node_pools[0]->outstanding != 0 || p->node_pools[1]->outstanding != 0)
+		goto end;
+	if (p->node_pools[0]->alloc_stack_size != 4 || p->node_pools[1]->alloc_stack_size != 4)
+		goto end;
+
+	result = 1;
+end:
+	PoolFree(p);
+	return result;
+}
+
+/**
+ * \test bulk get/return keeps the counters in sync with single calls
+ */
+static int PoolTestBulk(void)
+{
+	uint32_t flags[3] = { 0, POOL_FLAG_INTRUSIVE, POOL_FLAG_MAGAZINE };
+	void *objs[40];
+	uint32_t n = 0;
+	int i, f;
+	Pool *p;
+
+	for (f = 0; f < 3; f++) 
+	{
+		p = PoolInitEx(32, 16, 64, NULL, NULL, NULL, NULL, NULL, flags[f]);
+		if (p == NULL)
+			return 0;
+
+		/* magazines cache what they get back, so only the others run dry */
+		n = PoolGetBulk(p, objs, 40);
+		if (n != 32 || (f != 2 && p->outstanding != 32))
+			goto error;
+		for (i = 0; i < 32; i++) {
+			memset(objs[i], 0xff, 64);
+		}
+		PoolReturnBulk(p, objs, 32);
+		n = 0;
+		if (p->outstanding != 0 && f != 2)
+			goto error;
+		n = PoolGetBulk(p, objs, 8);
+		if (n != 8)
+			goto error;
+		PoolReturnBulk(p, objs, 8);
+		PoolFree(p);
+	}
+	return 1;
+
+error:
+	PoolReturnBulk(p, objs, n);
+	PoolFree(p);
+	return 0;
+}
+
+#define POOL_BENCH_OBJECTS      (1 << 20)
+
+/**
+ * \brief Compare single and bulk get/return at several burst sizes
+ *
+ * Prints cpu ticks per object, always succeeds.
+ */
+static int PoolBenchBulk(void)
+{
+	uint32_t flags[2] = { 0, POOL_FLAG_INTRUSIVE };
+	uint32_t bursts[4] = { 1, 8, 32, 64 };
+	void *objs[64];
+	uint64_t t0, single, bulk;
+	uint32_t rounds, r, b, u32;
+	int f;
+
+	printf("\n");
+	for (f = 0; f < 2; f++) 
+	{
+		Pool *p = PoolInitEx(1024, 1024, 256, NULL, NULL, NULL, NULL, NULL, flags[f]);
+		if (p == NULL)
+			return 0;
+
+		for (b = 0; b < 4; b++) 
+		{
+			rounds = POOL_BENCH_OBJECTS / bursts[b];
+
+			t0 = UtilCpuGetTicks();
+			for (r = 0; r < rounds; r++) 
+			{
+				for (u32 = 0; u32 < bursts[b]; u32++) {
+					objs[u32] = PoolGet(p);
+				}
+				for (u32 = 0; u32 < bursts[b]; u32++) {
+					PoolReturn(p, objs[u32]);
+				}
+			}
+			single = UtilCpuGetTicks() - t0;
+
+			t0 = UtilCpuGetTicks();
+			for (r = 0; r < rounds; r++) 
+			{
+				PoolGetBulk(p, objs, bursts[b]);
+				PoolReturnBulk(p, objs, bursts[b]);
+			}
+			bulk = UtilCpuGetTicks() - t0;
+
+			printf("    %-9s burst %2u: single %5.1f ticks/obj, bulk %5.1f ticks/obj\n",
+					flags[f] ? "intrusive" : "bucket", bursts[b],
+					(double)single / POOL_BENCH_OBJECTS, (double)bulk / POOL_BENCH_OBJECTS);
+		}
+		PoolFree(p);
+	}
+	return 1;
+}
+
+static int PoolTestSlabGrowth(void)
+{
+	uint32_t flags[2] = { 0, POOL_FLAG_INTRUSIVE };
+	void *objs[100];
+	int i, n, f;
+
+	for (f = 0; f < 2; f++) 
+	{
+		int result = 0;
+		Pool *p = PoolInitEx(200, 10, 32, NULL, NULL, NULL, NULL, NULL, flags[f]);
+		if (p == NULL)
+			return 0;
+		n = 0;
+		if (PoolSetGrowth(p, 64, 30) != 0)
+			goto end;
+
+		for (n = 0; n < 100; n++) 
+		{
+			objs[n] = PoolGet(p);
+			if (objs[n] == NULL)
+				goto end;
+			/* slab objects are laid out back to back */
+			if (n > 10 && n < 74 && objs[n] != (char *)objs[n - 1] + 32)
+				goto end;
+		}
+		if (p->nr_slabs != 2 || p->allocated != 138)
+			goto end;
+		if (!PoolDataPreAllocated(p, objs[50]) || !PoolDataPreAllocated(p, objs[99]))
+			goto end;
+
+		for (i = 0; i < 100; i++) {
+			PoolReturn(p, objs[i]);
+		}
+		n = 0;
+		/* not idle for long enough */
+		if (PoolShrink(p) != 0 || p->nr_slabs != 2)
+			goto end;
+
+		for (i = 0; i < (int)p->nr_slabs; i++) {
+			p->slabs[i].idle_since -= 30;
+		}
+		if (PoolShrink(p) != 2 || p->nr_slabs != 0 ||
+			p->allocated != 10 || p->alloc_stack_size != 10)
+			goto end;
+
+		/* and it grows again */
+		for (n = 0; n < 20; n++) {
+			if ((objs[n] = PoolGet(p)) == NULL)
+				goto end;
+		}
+		if (p->nr_slabs != 1)
+			goto end;
+
+		result = 1;
+end:
+		for (i = 0; i < n; i++) {
+			PoolReturn(p, objs[i]);
+		}
+		PoolFree(p);
+		if (result == 0)
+			return 0;
+	}
+
+	return 1;
+}
+
+static void PoolTestHighWater(PoolMemcap *mc, int above, void *data)
+{
+	int *state = (int *)data;
+	*state = above ? *state + 1 : -1;
+}
+
+static int PoolTestMemcap(void)
+{
+	PoolMemcap global, flow;
+	void *objs[16];
+	uint64_t size;
+	int state = 0;
+	int result = 0;
+	int i, n = 0;
+	Pool *p = NULL;
+
+	if (ParseSizeStringU64("1.5gb", &size) != 0 || size != 3ULL << 29)
+		return 0;
+	if (ParseSizeStringU64(" 64 MB", &size) != 0 || size != 64 << 20)
+		return 0;
+	if (ParseSizeStringU64("12x", &size) == 0 || ParseSizeStringU64("-1", &size) == 0)
+		return 0;
+
+	ConfCreateContextBackup();
+	if (ConfInit() != 0)
+		goto end;
+	ConfSet("flow.memcap", "4kb");
+	ConfSet("flow.memcap-high-water", "3kb");
+	ConfSet("flow.memcap-low-water", "1kb");
+
+	PoolMemcapInit(&global, "global", 0, NULL);
+	if (PoolMemcapConf(&flow, "flow", &global) != 0 || flow.memcap != 4096 ||
+		flow.hwm != 3072 || flow.lwm != 1024)
+		goto end;
+	PoolMemcapSetHighWater(&flow, 0, 0, PoolTestHighWater, &state);
+
+	p = PoolInit(0, 0, 256, NULL, NULL, NULL, NULL, NULL);
+	if (p == NULL || PoolSetMemcap(p, &flow) != 0)
+		goto end;
+
+	for (n = 0; n < 16; n++) 
+	{
+		if ((objs[n] = PoolGet(p)) == NULL)
+			goto end;
+		/* the 12th object crosses the high water mark, once */
+		if (state != (n >= 11))
+			goto end;
+	}
+	if (PoolGet(p) != NULL)
+		goto end;
+	if (OB_ATOMIC_GET(flow.memuse) != 4096 || OB_ATOMIC_GET(global.memuse) != 4096)
+		goto end;
+
+	for (i = 0; i < 16; i++) {
+		PoolReturn(p, objs[i]);
+	}
+	n = 0;
+	PoolFree(p);
+	p = NULL;
+	if (state != -1 || OB_ATOMIC_GET(flow.memuse) != 0 || OB_ATOMIC_GET(global.memuse) != 0)
+		goto end;
+
+	/* a pool over the memcap can't be charged to it */
+	p = PoolInit(32, 32, 256, NULL, NULL, NULL, NULL, NULL);
+	if (p == NULL || PoolSetMemcap(p, &flow) == 0 || OB_ATOMIC_GET(flow.memuse) != 0)
+		goto end;
+
+	result = 1;
+end:
+	for (i = 0; i < n; i++) {
+		PoolReturn(p, objs[i]);
+	}
+	if (p != NULL) PoolFree(p);
+	ConfDeInit();
+	ConfRestoreContextBackup();
+	return result;
+}
+
+typedef struct PoolTestPrint_ {
+    const char *name;
+    int found;
+    uint32_t lines;
+} PoolTestPrint;
+
+static void PoolTestPrintLine(void *ctx, const char *line)
+{
+	PoolTestPrint *tp = (PoolTestPrint *)ctx;
+
+	if (strncmp(line, tp->name, strlen(tp->name)) == 0)
+		tp->found = 1;
+	else if (tp->found && line[0] == ' ' && strstr(line, "latency") != NULL)
+		tp->lines++;
+}
+
+static int PoolTestStats(void)
+{
+	PoolTestPrint tp = { "test-stats", 0, 0 };
+	uint64_t samples = 0;
+	PoolStats stats;
+	void *objs[8];
+	int result = 0;
+	int i, n = 0;
+
+	Pool *p = PoolInitEx(8, 4, 32, NULL, NULL, NULL, NULL, NULL, POOL_FLAG_LATENCY);
+	if (p == NULL)
+		return 0;
+	PoolSetName(p, tp.name);
+
+	for (n = 0; n < 8; n++) {
+		if ((objs[n] = PoolGet(p)) == NULL)
+			goto end;
+	}
+	if (PoolGet(p) != NULL)
+		goto end;
+	PoolReturnBulk(p, objs, 8);
+	n = PoolGetBulk(p, objs, 8);
+	if (n != 8)
+		goto end;
+	PoolReturnBulk(p, objs, 8);
+	n = 0;
+
+	PoolGetStats(p, &stats);
+	if (stats.gets != 16 || stats.returns != 16 || stats.misses != 5 ||
+		stats.mallocs != 4 || stats.frees != 0 || stats.slab_grows != 0)
+		goto end;
+
+	/* only the single gets are timed, the failed one too */
+	for (i = 0; i < POOL_LATENCY_BUCKETS; i++) {
+		samples += p->get_latency[i];
+	}
+	if (samples != 9)
+		goto end;
+
+	PoolRegistryPrint(PoolTestPrintLine, &tp);
+	if (!tp.found || tp.lines == 0)
+		goto end;
+
+	result = 1;
+end:
+	PoolReturnBulk(p, objs, n);
+	PoolFree(p);
+	return result;
+}
+
+typedef struct PoolTestPacket_ {
+    void *next;                 /**< clobbered by intrusive pools */
+    uint32_t flags;
+    uint32_t init;
+    uint8_t payload[240];
+} PoolTestPacket;
+
+static uint32_t pool_test_inits;
+static uint32_t pool_test_recycles;
+
+static int PoolTestPacketInit(void *data, void *initdata)
+{
+	PoolTestPacket *pkt = (PoolTestPacket *)data;
+
+	memset(pkt, 0, sizeof(PoolTestPacket));
+	pkt->init = ++pool_test_inits;
+	return 1;
+}
+
+static void PoolTestPacketRecycle(void *data, void *initdata)
+{
+	PoolTestPacket *pkt = (PoolTestPacket *)data;
+
+	pkt->flags = 0;
+	pool_test_recycles++;
+}
+
+static int PoolTestRecycle(void)
+{
+	uint32_t flags[4] = { 0, POOL_FLAG_INTRUSIVE, POOL_FLAG_MAGAZINE, POOL_FLAG_LOCKFREE };
+	PoolTestPacket *objs[4];
+	int i, f;
+
+	for (f = 0; f < 4; f++) 
+	{
+		int result = 0;
+		Pool *p;
+
+		pool_test_inits = 0;
+		pool_test_recycles = 0;
+		p = PoolInitEx(4, 4, sizeof(PoolTestPacket), NULL, PoolTestPacketInit, NULL,
+				NULL, NULL, flags[f]);
+		if (p == NULL)
+			return 0;
+		PoolSetRecycle(p, PoolTestPacketRecycle);
+
+		for (i = 0; i < 4; i++) 
+		{
+			if ((objs[i] = PoolGet(p)) == NULL)
+				goto end;
+			objs[i]->flags = 0xff;
+			objs[i]->payload[0] = 0xaa;
+		}
+		PoolReturn(p, objs[0]);
+		PoolReturnBulk(p, (void **)&objs[1], 3);
+		if (pool_test_recycles != 4)
+			goto end;
+
+		for (i = 0; i < 4; i++) 
+		{
+			if ((objs[i] = PoolGet(p)) == NULL)
+				goto end;
+			/* reset by Recycle, the rest as it was left */
+			if (objs[i]->flags != 0 || objs[i]->payload[0] != 0xaa || objs[i]->init == 0)
+				goto end;
+		}
+		PoolReturnBulk(p, (void **)objs, 4);
+
+		/* Init ran once per object, at construction */
+		if (pool_test_inits != 4)
+			goto end;
+
+		result = 1;
+end:
+		PoolFree(p);
+		if (result == 0)
+			return 0;
+	}
+
+	return 1;
+}
+
+void PoolRegisterTests(void)
+{
+	UtRegisterTest("PoolTestLockFreeStress", PoolTestLockFreeStress, 1);
+	UtRegisterTest("PoolTestMagazineStress", PoolTestMagazineStress, 1);
+	UtRegisterTest("PoolTestIntrusive", PoolTestIntrusive, 1);
+	UtRegisterTest("PoolTestNuma", PoolTestNuma, 1);
+	UtRegisterTest("PoolTestBulk", PoolTestBulk, 1);
+	UtRegisterTest("PoolTestSlabGrowth", PoolTestSlabGrowth, 1);
+	UtRegisterTest("PoolTestMemcap", PoolTestMemcap, 1);
+	UtRegisterTest("PoolTestStats", PoolTestStats, 1);
+	UtRegisterTest("PoolTestRecycle", PoolTestRecycle, 1);
+	UtRegisterTest("PoolBenchBulk", PoolBenchBulk, 1);
+}
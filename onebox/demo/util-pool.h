@@ -1,8 +1,46 @@
 #ifndef __UTIL_POOL_H__
 #define __UTIL_POOL_H__
 
+#include "util-threads.h"
+#include "util-atomic.h"
+#include "util-mem.h"
+
 #define POOL_BUCKET_PREALLOCATED    (1 << 0)
 
+/* pool mode flags, see PoolInitEx() */
+#define POOL_FLAG_MAGAZINE          (1 << 0)    /**< thread safe, per-thread magazine
+                                                 *   cache in front of the pool */
+#define POOL_FLAG_LOCKFREE          (1 << 1)    /**< thread safe, lock-free alloc and
+                                                 *   empty stacks. Bounded pools only */
+#define POOL_FLAG_INTRUSIVE         (1 << 2)    /**< free objects are linked through
+                                                 *   their first word, no PoolBucket */
+#define POOL_FLAG_CACHE_ALIGN       (1 << 3)    /**< round elt_size up to the cache line
+                                                 *   size and align data_buffer on it */
+#define POOL_FLAG_HUGEPAGE          (1 << 4)    /**< back data_buffer with huge pages
+                                                 *   when available, see HugePageAlloc() */
+#define POOL_FLAG_NUMA              (1 << 5)    /**< one sub-pool per NUMA node, gets are
+                                                 *   served from the caller's node. With
+                                                 *   POOL_FLAG_LOCKFREE or _MAGAZINE */
+#define POOL_FLAG_LATENCY           (1 << 6)    /**< keep PoolGet/PoolReturn latency
+                                                 *   histograms, costs two rdtsc a call */
+
+#define POOL_NAME_MAX               32
+#define POOL_LATENCY_BUCKETS        32          /**< log2 of ticks, the last one
+                                                 *   also takes everything above */
+
+/* pool counters, see PoolGetStats() */
+typedef struct PoolStats_ {
+    uint64_t gets;              /**< objects handed out */
+    uint64_t returns;           /**< objects given back */
+    uint64_t misses;            /**< gets that found the pool empty */
+    uint64_t mallocs;           /**< objects allocated past the prealloc */
+    uint64_t frees;             /**< of those, objects freed again */
+    uint64_t slab_grows;        /**< slabs the pool grew by */
+} PoolStats;
+
+/* number of objects a per-thread magazine can hold */
+#define POOL_MAGAZINE_SIZE          32
+
 /* pool bucket structure */
 typedef struct PoolBucket_ {
     void *data;
@@ -10,22 +48,87 @@ typedef struct PoolBucket_ {
     struct PoolBucket_ *next;
 } PoolBucket;
 
-/* pool structure */
+/* slab: a chunk of objects the pool grew by once past its preallocation */
+typedef struct PoolSlab_ {
+    void *mem;
+    uint32_t nobjs;
+    uint32_t in_use;            /**< objects of the slab handed out */
+    time_t idle_since;          /**< when in_use last dropped to 0 */
+    int release;                /**< marked for release by PoolShrink */
+} PoolSlab;
+
+/* magazine: a bounded stack of free objects owned by a single thread */
+typedef struct PoolMagazine_ {
+    uint32_t rounds;            /**< number of objects in the magazine */
+    struct PoolMagazine_ *next; /**< link in the depot lists */
+    void *objs[POOL_MAGAZINE_SIZE];
+} PoolMagazine;
+
+/* per-thread state of a magazine pool */
+typedef struct PoolThreadCache_ {
+    struct Pool_ *pool;
+    PoolMagazine *loaded;       /**< magazine we get from and return to */
+    PoolMagazine *previous;     /**< spare magazine, full or empty */
+
+    uint64_t hits;              /**< gets/returns served by the magazines */
+    uint64_t misses;            /**< gets/returns that needed the depot */
+    uint64_t gets;              /**< PoolStats gets/returns of this thread */
+    uint64_t returns;
+
+    struct PoolThreadCache_ *next;
+} OB_CACHE_ALIGNED PoolThreadCache;
+
+/* byte budget shared by the pools of a subsystem, see PoolMemcapInit().
+ * Usage is charged up the parent chain, so subsystems can share a global
+ * memcap as well. Crossing hwm calls HighWater(mc, 1, data) once so the
+ * owner can go into emergency mode and start evicting; dropping below lwm
+ * calls HighWater(mc, 0, data) */
+typedef struct PoolMemcap_ {
+    const char *name;
+    uint64_t memcap;            /**< in bytes, 0 for no limit */
+    uint64_t hwm;               /**< high water mark, 0 for none */
+    uint64_t lwm;               /**< low water mark to leave emergency mode */
+    /* charged by every thread, on a line of its own */
+    OB_ATOMIC_DECLARE(uint64_t, memuse) OB_CACHE_ALIGNED;
+    OB_ATOMIC_DECLARE(int, emergency);
+    void (*HighWater)(struct PoolMemcap_ *, int, void *);
+    void *data;
+    struct PoolMemcap_ *parent; /**< e.g. pool_memcap_global */
+} PoolMemcap;
+
+extern PoolMemcap pool_memcap_global;
+
+/* pool structure. Fields written by several threads at once sit on cache
+ * lines of their own, pools come from OBCallocAligned() */
 typedef struct Pool_ {
+    char name[POOL_NAME_MAX];   /**< name in the pool registry */
+    struct Pool_ *registry_next;
+    int registered;
+
     uint32_t max_buckets;
     uint32_t preallocated;
     uint32_t allocated;         /**< counter of data elements, both currently in
                                  *   the pool and outside of it (outstanding) */
 
-    uint32_t alloc_stack_size;
+    uint32_t alloc_stack_size;  /**< free objects in the pool, also in
+                                 *   intrusive mode */
 
     PoolBucket *alloc_stack;
+    void *free_list;            /**< intrusive mode: free objects, the first
+                                 *   pointer sized word links to the next one */
+    uint32_t carve_next;        /**< intrusive mode: first object of data_buffer
+                                 *   never handed out, the rest is carved in order */
+    uint32_t carve_end;         /**< intrusive mode: objects of data_buffer that
+                                 *   went through Init */
 
     PoolBucket *empty_stack;
     uint32_t empty_stack_size;
 
-    int data_buffer_size;
+    size_t data_buffer_size;
     void *data_buffer;
+    size_t data_buffer_mapped;  /**< length of the mmap()ed data_buffer, 0 if
+                                 *   it came from the heap */
+    int data_buffer_huge;       /**< data_buffer is a HugePageAlloc() region */
     PoolBucket *pb_buffer;
 
     void *(*Alloc)();
@@ -33,19 +136,85 @@ typedef struct Pool_ {
     void *InitData;
     void (*Cleanup)(void *);
     void (*Free)(void *);
+    void (*Recycle)(void *, void *);    /**< partial reset on return, gets
+                                         *   InitData. See PoolSetRecycle() */
 
     uint32_t elt_size;
+    uint32_t flags;             /**< POOL_FLAG_* */
+
+    /* growth past preallocated, see PoolSetGrowth() */
+    uint32_t slab_objects;      /**< objects per slab, 0 to malloc per object */
+    uint32_t slab_idle_timeout; /**< seconds a slab stays idle before it's
+                                 *   freed, 0 for never */
+    PoolSlab *slabs;            /**< sorted by address */
+    uint32_t nr_slabs;
+    uint32_t slabs_size;
+    time_t shrink_last;         /**< last opportunistic PoolShrink */
+
+    PoolMemcap *memcap;         /**< budget objects are charged to, see
+                                 *   PoolSetMemcap() */
+    uint64_t memuse;            /**< bytes charged to memcap by this pool */
+
+    PoolStats stats OB_CACHE_ALIGNED;   /**< updated atomically in lock-free
+                                         *   mode, and gets/returns per thread
+                                         *   in magazine mode */
+    uint64_t get_latency[POOL_LATENCY_BUCKETS];     /**< POOL_FLAG_LATENCY */
+    uint64_t return_latency[POOL_LATENCY_BUCKETS];
+
     uint32_t outstanding;       /**< counter of data items 'in use'. Pretty much
                                  *   the diff between PoolGet and PoolReturn */
     uint32_t max_outstanding;   /**< max value of outstanding we saw */
+
+    /* magazine mode: the stacks above form the backing store and are only
+     * touched with depot_lock held */
+    pthread_key_t tc_key;       /**< this thread's PoolThreadCache */
+    OBMutex depot_lock OB_CACHE_ALIGNED;
+    PoolMagazine *depot_full;   /**< full magazines ready to be loaded */
+    PoolMagazine *depot_empty;  /**< empty magazines ready to be filled */
+    PoolThreadCache *tc_list;   /**< thread caches of live threads */
+
+    /* lock-free mode: stack heads are a bucket index + 1 in the low 32 bits
+     * (0 means empty) and a generation tag in the high 32 bits, making the
+     * CAS on them ABA safe. The buckets are never freed while the pool lives,
+     * a preallocated object keeps its own while handed out */
+    uint64_t lf_alloc_head OB_CACHE_ALIGNED;
+    uint64_t lf_empty_head OB_CACHE_ALIGNED;
+
+    /* numa mode: the pool is only a front end routing to node_pools */
+    int numa_node;              /**< node data_buffer is bound to, -1 for none */
+    uint32_t nr_nodes;
+    struct Pool_ **node_pools;  /**< one sub-pool per node */
+    uint32_t nr_cpus;
+    uint16_t *cpu_to_node;      /**< node of each cpu */
+    uint64_t magazine_hits;     /**< hits of threads that exited */
+    uint64_t magazine_misses;   /**< misses of threads that exited */
 } Pool;
 
 /* prototypes */
 Pool* PoolInit(uint32_t, uint32_t, uint32_t, void *(*Alloc)(), int (*Init)(void *, void *), void *, void (*Cleanup)(void *), void (*Free)(void *));
+Pool* PoolInitEx(uint32_t, uint32_t, uint32_t, void *(*Alloc)(), int (*Init)(void *, void *), void *, void (*Cleanup)(void *), void (*Free)(void *), uint32_t);
 void PoolFree(Pool *);
 void PoolPrint(Pool *);
 void PoolPrintSaturation(Pool *p);
+void PoolGetMagazineStats(Pool *p, uint64_t *hits, uint64_t *misses, uint32_t *cached);
+void PoolSetName(Pool *, const char *);
+void PoolGetStats(Pool *, PoolStats *);
+void PoolRegistryPrint(void (*Print)(void *, const char *), void *);
 
 void *PoolGet(Pool *);
 void PoolReturn(Pool *, void *);
+uint32_t PoolGetBulk(Pool *, void **, uint32_t);
+void PoolReturnBulk(Pool *, void **, uint32_t);
+void PoolSetRecycle(Pool *, void (*Recycle)(void *, void *));
+int PoolSetGrowth(Pool *, uint32_t, uint32_t);
+uint32_t PoolShrink(Pool *);
+
+void PoolMemcapInit(PoolMemcap *, const char *, uint64_t, PoolMemcap *);
+int PoolMemcapConf(PoolMemcap *, const char *, PoolMemcap *);
+void PoolMemcapSetHighWater(PoolMemcap *, uint64_t, uint64_t, void (*HighWater)(PoolMemcap *, int, void *), void *);
+int PoolMemcapAdd(PoolMemcap *, uint64_t);
+void PoolMemcapSub(PoolMemcap *, uint64_t);
+int PoolSetMemcap(Pool *, PoolMemcap *);
+
+void PoolRegisterTests(void);
 #endif
@@ -0,0 +1,467 @@
+#include "onebox-common.h"
+#include "util-rcu.h"
+#include "util-debug.h"
+#include "util-error.h"
+#include "util-mem.h"
+#include "util-threads.h"
+#include "util-atomic.h"
+#include "util-unittest.h"
+
+/* rounds a writer spins, then yields, before it sleeps between checks */
+#define OB_RCU_SPIN         64
+#define OB_RCU_YIELD        128
+#define OB_RCU_SLEEP_US     100
+
+/*********** vars ***********/
+/* grace period, only bumped by writers holding ob_rcu_lock */
+uint64_t ob_rcu_gp = 1;
+__thread OBRcuThread *ob_rcu_self = NULL;
+
+static OBRcuThread *ob_rcu_threads = NULL;  /**< registered readers */
+static OBMutex ob_rcu_lock = OBMUTEX_INITIALIZER;
+static pthread_key_t ob_rcu_key;
+static pthread_once_t ob_rcu_once = PTHREAD_ONCE_INIT;
+
+/*********** funcs ***********/
+static void OBRcuThreadRemove(OBRcuThread *t)
+{
+	OBRcuThread **pt;
+
+	/* a writer waiting on the lock gets the thread out of its way */
+	OBAtomicStoreRelease(&t->ctr, OB_RCU_OFFLINE);
+
+	OBMutexLock(&ob_rcu_lock);
+	for (pt = &ob_rcu_threads; *pt != NULL; pt = &(*pt)->next)
+	{
+		if (*pt == t) {
+			*pt = t->next;
+			break;
+		}
+	}
+	OBMutexUnlock(&ob_rcu_lock);
+
+	OBFreeAligned(t);
+}
+
+/* threads that exit registered leave like OBRcuUnregisterThread() */
+static void OBRcuThreadExit(void *arg)
+{
+	OBRcuThreadRemove((OBRcuThread *)arg);
+	ob_rcu_self = NULL;
+}
+
+static void OBRcuKeyInit(void)
+{
+	pthread_key_create(&ob_rcu_key, OBRcuThreadExit);
+}
+
+/**
+ *  \brief Make the calling thread an RCU reader, online
+ *
+ *  Until it unregisters, the thread must pass a quiescent state now and
+ *  then or go offline, else OBRcuSynchronize() waits for it forever.
+ *
+ *  \retval 0 on success, -1 on error
+ */
+int OBRcuRegisterThread(const char *name)
+{
+	OBRcuThread *t;
+
+	if (ob_rcu_self != NULL)
+		return 0;
+
+	pthread_once(&ob_rcu_once, OBRcuKeyInit);
+	t = OBCallocAligned(OB_CACHE_LINE_SIZE, 1, sizeof(OBRcuThread));
+	if (t == NULL)
+		return -1;
+	strlcpy(t->name, name, sizeof(t->name));
+	if (pthread_setspecific(ob_rcu_key, t) != 0) {
+		OBFreeAligned(t);
+		return -1;
+	}
+
+	OBMutexLock(&ob_rcu_lock);
+	t->next = ob_rcu_threads;
+	ob_rcu_threads = t;
+	OBMutexUnlock(&ob_rcu_lock);
+
+	ob_rcu_self = t;
+	OBRcuThreadOnline();
+	return 0;
+}
+
+void OBRcuUnregisterThread(void)
+{
+	OBRcuThread *t = ob_rcu_self;
+
+	if (t == NULL)
+		return;
+	pthread_setspecific(ob_rcu_key, NULL);
+	OBRcuThreadRemove(t);
+	ob_rcu_self = NULL;
+}
+
+/**
+ *  \brief Stop holding back the writers, before the thread blocks or
+ *         sleeps. It must not use RCU protected pointers until it is
+ *         back online.
+ */
+void OBRcuThreadOffline(void)
+{
+	OBRcuThread *t = ob_rcu_self;
+
+	if (t != NULL)
+		OBAtomicStoreRelease(&t->ctr, OB_RCU_OFFLINE);
+}
+
+void OBRcuThreadOnline(void)
+{
+	OBRcuThread *t = ob_rcu_self;
+
+	if (t == NULL)
+		return;
+	OBAtomicStoreRelaxed(&t->ctr, OBAtomicLoadAcquire(&ob_rcu_gp));
+	/* online before the pointers are loaded, a writer that saw the thread
+	 * offline would not wait for them */
+	hw_barrier();
+}
+
+static uint32_t OBRcuWait(uint32_t spun)
+{
+	if (spun < OB_RCU_SPIN) {
+		ob_cpu_pause();
+	} else if (spun < OB_RCU_YIELD) {
+		sched_yield();
+	} else {
+		usleep(OB_RCU_SLEEP_US);
+		return spun;
+	}
+	return spun + 1;
+}
+
+/**
+ *  \brief Wait for a grace period: every registered thread passed a
+ *         quiescent state or was offline since the call, so none of them
+ *         still holds a pointer unpublished before it
+ *
+ *  The calling thread is offline meanwhile, must not call it with RCU
+ *  protected pointers in use.
+ */
+void OBRcuSynchronize(void)
+{
+	OBRcuThread *t, *self = ob_rcu_self;
+	uint64_t gp, ctr;
+	uint32_t spun;
+
+	/* a writer waiting on the lock must not hold back the one holding it */
+	if (self != NULL)
+		OBRcuThreadOffline();
+
+	OBMutexLock(&ob_rcu_lock);
+	/* full barrier: the unpublishing is seen by readers that see gp */
+	gp = OBAtomicAddAndFetch(&ob_rcu_gp, 1);
+	for (t = ob_rcu_threads; t != NULL; t = t->next)
+	{
+		spun = 0;
+		while ((ctr = OBAtomicLoadAcquire(&t->ctr)) != OB_RCU_OFFLINE && ctr != gp) {
+			spun = OBRcuWait(spun);
+		}
+	}
+	OBMutexUnlock(&ob_rcu_lock);
+
+	if (self != NULL)
+		OBRcuThreadOnline();
+}
+
+/*********** unittests ***********/
+#define RCU_TEST_MAGIC      0x52435521
+#define RCU_TEST_READERS    3
+#define RCU_TEST_UPDATES    2000
+
+typedef struct RcuTestObj_ {
+    uint32_t magic;             /**< cleared before the object is freed */
+    uint64_t a;
+    uint64_t b;                 /**< always 2 * a */
+} RcuTestObj;
+
+typedef struct RcuTest_ {
+    RcuTestObj *obj;            /**< RCU protected */
+    uint32_t stop;
+    uint32_t hold;              /**< the reader keeps its object until cleared */
+    uint32_t holding;
+    uint32_t synced;
+    uint32_t running;           /**< registered readers */
+    uint64_t reads;
+    uint64_t bad;
+} RcuTest;
+
+static void *RcuTestHolder(void *arg)
+{
+	RcuTest *rt = (RcuTest *)arg;
+	RcuTestObj *obj;
+
+	if (OBRcuRegisterThread("RcuTestHolder") != 0) {
+		rt->bad++;
+		OBAtomicStoreRelease(&rt->holding, 1);
+		return NULL;
+	}
+	obj = OBRcuDereference(rt->obj);
+	OBAtomicStoreRelease(&rt->holding, 1);
+	while (OBAtomicLoadAcquire(&rt->hold)) {
+		usleep(1000);
+	}
+	if (obj->magic != RCU_TEST_MAGIC)
+		rt->bad++;
+	while (!OBAtomicLoadAcquire(&rt->stop)) {
+		OBRcuQuiescentState();
+		usleep(1000);
+	}
+	OBRcuUnregisterThread();
+	return NULL;
+}
+
+static void *RcuTestSynchronizer(void *arg)
+{
+	RcuTest *rt = (RcuTest *)arg;
+
+	OBRcuSynchronize();
+	OBAtomicStoreRelease(&rt->synced, 1);
+	return NULL;
+}
+
+/**
+ * \test a grace period lasts until a reader holding the old pointer
+ *       passes a quiescent state, offline and unregistered threads don't
+ *       hold it
+ */
+static int OBRcuTestGracePeriod(void)
+{
+	RcuTestObj a = { RCU_TEST_MAGIC, 1, 2 }, b = { RCU_TEST_MAGIC, 2, 4 };
+	RcuTest rt;
+	pthread_t holder, syncer;
+	int result = 0;
+
+	memset(&rt, 0, sizeof(rt));
+	rt.obj = &a;
+	rt.hold = 1;
+
+	/* no readers */
+	OBRcuSynchronize();
+
+	/* the test thread itself, offline for the grace period */
+	if (OBRcuRegisterThread("OBRcuTest") != 0)
+		return 0;
+	OBRcuSynchronize();
+	OBRcuThreadOffline();
+
+	if (pthread_create(&holder, NULL, RcuTestHolder, &rt) != 0)
+		goto end;
+	while (!OBAtomicLoadAcquire(&rt.holding)) {
+		usleep(1000);
+	}
+
+	OBRcuAssignPointer(rt.obj, &b);
+	if (pthread_create(&syncer, NULL, RcuTestSynchronizer, &rt) != 0) {
+		OBAtomicStoreRelease(&rt.hold, 0);
+		OBAtomicStoreRelease(&rt.stop, 1);
+		pthread_join(holder, NULL);
+		goto end;
+	}
+	usleep(20000);
+	if (!OBAtomicLoadAcquire(&rt.synced))
+		result = 1;
+
+	OBAtomicStoreRelease(&rt.hold, 0);
+	pthread_join(syncer, NULL);
+	OBAtomicStoreRelease(&rt.stop, 1);
+	pthread_join(holder, NULL);
+	if (!rt.synced || rt.bad)
+		result = 0;
+end:
+	OBRcuUnregisterThread();
+	/* left with no reader */
+	OBRcuSynchronize();
+	return result && ob_rcu_self == NULL;
+}
+
+static void *RcuTestReader(void *arg)
+{
+	RcuTest *rt = (RcuTest *)arg;
+	RcuTestObj *obj;
+	uint64_t reads = 0, bad = 0;
+
+	if (OBRcuRegisterThread("RcuTestReader") != 0) {
+		OBAtomicAddAndFetch(&rt->bad, 1);
+		OBAtomicAddAndFetch(&rt->running, 1);
+		return NULL;
+	}
+	OBAtomicAddAndFetch(&rt->running, 1);
+	while (!OBAtomicLoadAcquire(&rt->stop))
+	{
+		obj = OBRcuDereference(rt->obj);
+		if (obj->magic != RCU_TEST_MAGIC || obj->b != 2 * obj->a)
+			bad++;
+		reads++;
+		OBRcuQuiescentState();
+
+		/* now and then block, offline */
+		if ((reads & 1023) == 0) {
+			OBRcuThreadOffline();
+			sched_yield();
+			OBRcuThreadOnline();
+		}
+	}
+	OBRcuUnregisterThread();
+
+	OBAtomicAddAndFetch(&rt->reads, reads);
+	OBAtomicAddAndFetch(&rt->bad, bad);
+	return NULL;
+}
+
+/**
+ * \test readers never see an object replaced and freed under them
+ */
+static int OBRcuTestReaders(void)
+{
+	RcuTest rt;
+	RcuTestObj *obj, *old;
+	pthread_t tids[RCU_TEST_READERS];
+	int started = 0, i, result = 0;
+
+	memset(&rt, 0, sizeof(rt));
+	rt.obj = OBMalloc(sizeof(RcuTestObj));
+	if (rt.obj == NULL)
+		return 0;
+	rt.obj->magic = RCU_TEST_MAGIC;
+	rt.obj->a = 0;
+	rt.obj->b = 0;
+
+	for (i = 0; i < RCU_TEST_READERS; i++) {
+		if (pthread_create(&tids[i], NULL, RcuTestReader, &rt) != 0)
+			break;
+		started++;
+	}
+	while (OBAtomicLoadAcquire(&rt.running) != (uint32_t)started) {
+		usleep(1000);
+	}
+
+	for (i = 1; i <= RCU_TEST_UPDATES; i++)
+	{
+		obj = OBMalloc(sizeof(RcuTestObj));
+		if (obj == NULL)
+			break;
+		obj->magic = RCU_TEST_MAGIC;
+		obj->a = i;
+		obj->b = 2 * i;
+
+		old = rt.obj;
+		OBRcuAssignPointer(rt.obj, obj);
+		OBRcuSynchronize();
+		old->magic = 0;
+		OBFree(old);
+	}
+	if (i > RCU_TEST_UPDATES)
+		result = 1;
+
+	OBAtomicStoreRelease(&rt.stop, 1);
+	for (i = 0; i < started; i++) {
+		pthread_join(tids[i], NULL);
+	}
+	if (started != RCU_TEST_READERS || rt.bad != 0 || rt.reads == 0)
+		result = 0;
+
+	OBFree(rt.obj);
+	return result;
+}
+
+#define RCU_BENCH_THREADS_MAX   4
+#define RCU_BENCH_READS         (1 << 22)
+
+typedef struct RcuBench_ {
+    RcuTestObj *obj;
+    OBRWLock rwl;
+    int use_rcu;
+    uint32_t reads;             /**< per thread */
+    uint64_t sum;
+} RcuBench;
+
+static void *RcuBenchReader(void *arg)
+{
+	RcuBench *rb = (RcuBench *)arg;
+	uint64_t sum = 0;
+	uint32_t i;
+
+	if (rb->use_rcu) {
+		if (OBRcuRegisterThread("RcuBench") != 0)
+			return NULL;
+		for (i = 0; i < rb->reads; i++) {
+			sum += OBRcuDereference(rb->obj)->a;
+			OBRcuQuiescentState();
+		}
+		OBRcuUnregisterThread();
+	} else {
+		for (i = 0; i < rb->reads; i++) {
+			OBRWLockRDLock(&rb->rwl);
+			sum += rb->obj->a;
+			OBRWLockUnlock(&rb->rwl);
+		}
+	}
+	OBAtomicAddAndFetch(&rb->sum, sum);
+	return NULL;
+}
+
+static double RcuBenchRun(RcuBench *rb, int nthreads)
+{
+	pthread_t tids[RCU_BENCH_THREADS_MAX];
+	struct timespec t0, t1;
+	int i, started = 0;
+
+	rb->reads = RCU_BENCH_READS / nthreads;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&tids[i], NULL, RcuBenchReader, rb) != 0)
+			break;
+		started++;
+	}
+	for (i = 0; i < started; i++) {
+		pthread_join(tids[i], NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	return ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) /
+		((double)rb->reads * nthreads);
+}
+
+/**
+ * \brief ns per read of a shared object, under a read lock against an RCU
+ *        dereference and a quiescent state, 1 to 4 threads
+ */
+static int OBRcuBenchRead(void)
+{
+	RcuTestObj obj = { RCU_TEST_MAGIC, 1, 2 };
+	RcuBench rb;
+	int nthreads;
+
+	memset(&rb, 0, sizeof(rb));
+	rb.obj = &obj;
+	OBRWLockInit(&rb.rwl, NULL);
+
+	printf("\n    threads    rwlock       rcu\n");
+	for (nthreads = 1; nthreads <= RCU_BENCH_THREADS_MAX; nthreads <<= 1)
+	{
+		printf("    %7d", nthreads);
+		rb.use_rcu = 0;
+		printf(" %6.2f ns", RcuBenchRun(&rb, nthreads));
+		rb.use_rcu = 1;
+		printf(" %6.2f ns\n", RcuBenchRun(&rb, nthreads));
+	}
+	OBRWLockDestroy(&rb.rwl);
+	return 1;
+}
+
+void OBRcuRegisterTests(void)
+{
+	UtRegisterTest("OBRcuTestGracePeriod", OBRcuTestGracePeriod, 1);
+	UtRegisterTest("OBRcuTestReaders", OBRcuTestReaders, 1);
+	UtRegisterTest("OBRcuBenchRead", OBRcuBenchRead, 1);
+}
@@ -0,0 +1,65 @@
+#ifndef __UTIL_RCU_H__
+#define __UTIL_RCU_H__
+
+#include "util-threads.h"
+#include "util-atomic.h"
+
+/* Quiescent-state-based RCU, for data read by every thread and replaced
+ * rarely. Readers registered with OBRcuRegisterThread() load the pointer
+ * with OBRcuDereference() and use it without lock nor atomic until their
+ * next quiescent state, a point where they hold no such pointer: between
+ * two objects or tasks, or while offline. A writer publishes the new
+ * version with OBRcuAssignPointer(), waits in OBRcuSynchronize() for every
+ * registered thread to pass a quiescent state, then frees the old one.
+ *
+ * A quiescent state costs the reader a load and a store, plain moves on
+ * x86. Threads that are not registered must not keep the pointer across
+ * an update. */
+
+#define OB_RCU_OFFLINE          0   /**< OBRcuThread ctr of a thread holding nothing */
+
+typedef struct OBRcuThread_ {
+    uint64_t ctr;               /**< grace period seen at the last quiescent
+                                 *   state, only written by the thread */
+    char name[THREAD_NAME_LEN + 1];
+    struct OBRcuThread_ *next;
+} OB_CACHE_ALIGNED OBRcuThread;
+
+extern uint64_t ob_rcu_gp;
+extern __thread OBRcuThread *ob_rcu_self;
+
+int OBRcuRegisterThread(const char *name);
+void OBRcuUnregisterThread(void);
+void OBRcuThreadOffline(void);
+void OBRcuThreadOnline(void);
+void OBRcuSynchronize(void);
+
+void OBRcuRegisterTests(void);
+
+/**
+ *  \brief Load an RCU protected pointer, valid until the thread's next
+ *         quiescent state
+ */
+#define OBRcuDereference(p) \
+    OBAtomicLoadAcquire(&(p))
+
+/**
+ *  \brief Publish an RCU protected pointer, what it points to is set up
+ *         before readers can see it
+ */
+#define OBRcuAssignPointer(p, v) \
+    OBAtomicStoreRelease(&(p), (v))
+
+/**
+ *  \brief Tell the writers the thread holds no RCU protected pointer
+ *         anymore, a no-op for threads that aren't registered
+ */
+static inline void OBRcuQuiescentState(void)
+{
+    OBRcuThread *t = ob_rcu_self;
+
+    if (t != NULL)
+        OBAtomicStoreRelease(&t->ctr, OBAtomicLoadAcquire(&ob_rcu_gp));
+}
+
+#endif
@@ -0,0 +1,870 @@
+#include "onebox-common.h"
+#include "util-reclaim.h"
+#include "util-debug.h"
+#include "util-error.h"
+#include "util-mem.h"
+#include "util-threads.h"
+#include "util-atomic.h"
+#include "util-unittest.h"
+
+/* rounds a waiting thread spins, then yields, before it sleeps */
+#define OB_RECLAIM_SPIN         64
+#define OB_RECLAIM_YIELD        128
+#define OB_RECLAIM_SLEEP_US     100
+
+/*********** vars ***********/
+/* global epoch, only moved on by OBEbrTryAdvance() */
+uint64_t ob_ebr_epoch = 1;
+__thread OBEbrThread *ob_ebr_self = NULL;
+__thread OBHazardThread *ob_hazard_self = NULL;
+
+static OBEbrThread *ob_ebr_threads = NULL;
+static OBMutex ob_ebr_lock = OBMUTEX_INITIALIZER;
+
+static OBHazardThread *ob_hazard_threads = NULL;
+static uint32_t ob_hazard_nthreads = 0;
+static OBReclaimNode *ob_hazard_orphans = NULL;    /**< left by threads gone */
+static OBMutex ob_hazard_lock = OBMUTEX_INITIALIZER;
+
+/*********** funcs ***********/
+static uint32_t OBReclaimWait(uint32_t spun)
+{
+	if (spun < OB_RECLAIM_SPIN) {
+		ob_cpu_pause();
+	} else if (spun < OB_RECLAIM_YIELD) {
+		sched_yield();
+	} else {
+		usleep(OB_RECLAIM_SLEEP_US);
+		return spun;
+	}
+	return spun + 1;
+}
+
+static void OBReclaimFreeList(OBReclaimNode *n)
+{
+	OBReclaimNode *next;
+
+	for (; n != NULL; n = next) {
+		next = n->next;
+		n->Free(n);
+	}
+}
+
+/**
+ *  \brief Make the calling thread an epoch-based reclamation user, it
+ *         must unregister before it exits
+ *
+ *  \retval 0 on success, -1 on error
+ */
+int OBEbrRegisterThread(const char *name)
+{
+	OBEbrThread *t;
+
+	if (ob_ebr_self != NULL)
+		return 0;
+
+	t = OBCallocAligned(OB_CACHE_LINE_SIZE, 1, sizeof(OBEbrThread));
+	if (t == NULL)
+		return -1;
+	strlcpy(t->name, name, sizeof(t->name));
+
+	OBMutexLock(&ob_ebr_lock);
+	t->next = ob_ebr_threads;
+	ob_ebr_threads = t;
+	OBMutexUnlock(&ob_ebr_lock);
+
+	ob_ebr_self = t;
+	return 0;
+}
+
+/**
+ *  \brief Free what the thread retired, which waits for the other threads
+ *         to leave their sections, and unregister. Not from inside one.
+ */
+void OBEbrUnregisterThread(void)
+{
+	OBEbrThread *t = ob_ebr_self, **pt;
+
+	if (t == NULL)
+		return;
+	OBEbrBarrier();
+
+	OBMutexLock(&ob_ebr_lock);
+	for (pt = &ob_ebr_threads; *pt != NULL; pt = &(*pt)->next)
+	{
+		if (*pt == t) {
+			*pt = t->next;
+			break;
+		}
+	}
+	OBMutexUnlock(&ob_ebr_lock);
+
+	OBFreeAligned(t);
+	ob_ebr_self = NULL;
+}
+
+/**
+ *  \brief Move the epoch on if every thread inside a section saw it
+ *
+ *  \retval 1 if it moved on, 0 if a thread is behind or another thread
+ *          is advancing it
+ */
+int OBEbrTryAdvance(void)
+{
+	OBEbrThread *t;
+	uint64_t epoch, seen;
+	int advanced = 0;
+
+	if (OBMutexTrylock(&ob_ebr_lock) != 0)
+		return 0;
+	epoch = OBAtomicLoadAcquire(&ob_ebr_epoch);
+	for (t = ob_ebr_threads; t != NULL; t = t->next)
+	{
+		seen = OBAtomicLoadAcquire(&t->epoch);
+		if (seen != OB_EBR_INACTIVE && seen != epoch)
+			break;
+	}
+	if (t == NULL)
+		advanced = OBAtomicCompareAndSwap(&ob_ebr_epoch, epoch, epoch + 1);
+	OBMutexUnlock(&ob_ebr_lock);
+
+	return advanced;
+}
+
+/* a limbo list is done with, its objects are freed a batch at a time */
+static void OBEbrReady(OBEbrThread *t, int i)
+{
+	OBReclaimNode *n = t->limbo[i];
+
+	if (n == NULL)
+		return;
+	while (n->next != NULL) {
+		n = n->next;
+	}
+	n->next = t->ready;
+	t->ready = t->limbo[i];
+	t->limbo[i] = NULL;
+}
+
+/* objects retired two epochs ago no thread can still use */
+static void OBEbrCollect(OBEbrThread *t)
+{
+	uint64_t epoch = OBAtomicLoadAcquire(&ob_ebr_epoch);
+	int i;
+
+	for (i = 0; i < OB_EBR_EPOCHS; i++) {
+		if (t->limbo_epoch[i] + 2 <= epoch)
+			OBEbrReady(t, i);
+	}
+}
+
+static void OBEbrFreeBatch(OBEbrThread *t, uint32_t max)
+{
+	OBReclaimNode *n;
+
+	while (max-- > 0 && (n = t->ready) != NULL) {
+		t->ready = n->next;
+		n->Free(n);
+	}
+}
+
+/**
+ *  \brief Free an object once the threads that may still see it are out
+ *         of their sections
+ *
+ *  \param n the node in the object, already unreachable for the threads
+ *         entering a section
+ *  \param Free called with n
+ */
+void OBEbrRetire(OBReclaimNode *n, void (*Free)(OBReclaimNode *))
+{
+	OBEbrThread *t = ob_ebr_self;
+	uint64_t epoch = OBAtomicLoadAcquire(&ob_ebr_epoch);
+	int i = epoch % OB_EBR_EPOCHS;
+
+	/* the list holds an epoch at least OB_EBR_EPOCHS behind */
+	if (t->limbo_epoch[i] != epoch) {
+		OBEbrReady(t, i);
+		t->limbo_epoch[i] = epoch;
+	}
+	n->Free = Free;
+	n->next = t->limbo[i];
+	t->limbo[i] = n;
+
+	if (++t->retired >= OB_EBR_BATCH) {
+		t->retired = 0;
+		OBEbrTryAdvance();
+		OBEbrCollect(t);
+	}
+	if (t->ready != NULL)
+		OBEbrFreeBatch(t, OB_EBR_FREE_BATCH);
+}
+
+/**
+ *  \brief Free all the thread retired, waiting for the other threads to
+ *         leave their sections. Not from inside one.
+ */
+void OBEbrBarrier(void)
+{
+	OBEbrThread *t = ob_ebr_self;
+	uint32_t spun = 0;
+	int i;
+
+	for (;;)
+	{
+		OBEbrCollect(t);
+		OBEbrFreeBatch(t, UINT32_MAX);
+		for (i = 0; i < OB_EBR_EPOCHS && t->limbo[i] == NULL; i++)
+			;
+		if (i == OB_EBR_EPOCHS)
+			break;
+		if (!OBEbrTryAdvance())
+			spun = OBReclaimWait(spun);
+	}
+	t->retired = 0;
+}
+
+/**
+ *  \brief Make the calling thread a hazard pointer user, it must
+ *         unregister before it exits
+ *
+ *  \retval 0 on success, -1 on error
+ */
+int OBHazardRegisterThread(const char *name)
+{
+	OBHazardThread *t;
+
+	if (ob_hazard_self != NULL)
+		return 0;
+
+	t = OBCallocAligned(OB_CACHE_LINE_SIZE, 1, sizeof(OBHazardThread));
+	if (t == NULL)
+		return -1;
+	strlcpy(t->name, name, sizeof(t->name));
+
+	OBMutexLock(&ob_hazard_lock);
+	t->next = ob_hazard_threads;
+	ob_hazard_threads = t;
+	/* OBHazardRetire() reads it unlocked */
+	OBAtomicAddRelaxed(&ob_hazard_nthreads, 1);
+	OBMutexUnlock(&ob_hazard_lock);
+
+	ob_hazard_self = t;
+	return 0;
+}
+
+/**
+ *  \brief Unregister, what the thread retired and others still protect is
+ *         left to their scans
+ */
+void OBHazardUnregisterThread(void)
+{
+	OBHazardThread *t = ob_hazard_self, **pt;
+	OBReclaimNode *n, *orphans = NULL;
+	int i;
+
+	if (t == NULL)
+		return;
+	for (i = 0; i < OB_HAZARD_SLOTS; i++) {
+		OBHazardClear(i);
+	}
+	OBHazardScan();
+
+	OBMutexLock(&ob_hazard_lock);
+	for (pt = &ob_hazard_threads; *pt != NULL; pt = &(*pt)->next)
+	{
+		if (*pt == t) {
+			*pt = t->next;
+			break;
+		}
+	}
+	OBAtomicAddRelaxed(&ob_hazard_nthreads, -1);
+	if (t->retired != NULL) {
+		for (n = t->retired; n->next != NULL; n = n->next)
+			;
+		n->next = ob_hazard_orphans;
+		ob_hazard_orphans = t->retired;
+	}
+	/* nobody left to protect them */
+	if (ob_hazard_nthreads == 0) {
+		orphans = ob_hazard_orphans;
+		ob_hazard_orphans = NULL;
+	}
+	OBMutexUnlock(&ob_hazard_lock);
+
+	OBReclaimFreeList(orphans);
+	OBFreeAligned(t);
+	ob_hazard_self = NULL;
+}
+
+/* with ob_hazard_lock held */
+static int OBHazardIsProtected(void *ptr)
+{
+	OBHazardThread *t;
+	int i;
+
+	for (t = ob_hazard_threads; t != NULL; t = t->next) {
+		for (i = 0; i < OB_HAZARD_SLOTS; i++) {
+			if (OBAtomicLoadAcquire(&t->slots[i]) == ptr)
+				return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ *  \brief Free the objects the thread retired, and those of the threads
+ *         that left, that no hazard slot holds
+ */
+void OBHazardScan(void)
+{
+	OBHazardThread *t = ob_hazard_self;
+	OBReclaimNode *n, *next, *keep = NULL, *done = NULL;
+	uint32_t kept = 0;
+
+	/* the objects were unlinked before the slots are read */
+	hw_barrier();
+
+	OBMutexLock(&ob_hazard_lock);
+	n = t->retired;
+	if (ob_hazard_orphans != NULL) {
+		/* adopted */
+		OBReclaimNode *o = ob_hazard_orphans;
+
+		while (o->next != NULL) {
+			o = o->next;
+		}
+		o->next = n;
+		n = ob_hazard_orphans;
+		ob_hazard_orphans = NULL;
+	}
+	for (; n != NULL; n = next)
+	{
+		next = n->next;
+		if (OBHazardIsProtected(n)) {
+			n->next = keep;
+			keep = n;
+			kept++;
+		} else {
+			n->next = done;
+			done = n;
+		}
+	}
+	OBMutexUnlock(&ob_hazard_lock);
+
+	t->retired = keep;
+	t->nretired = kept;
+	/* unreachable and unprotected, nobody can protect them anymore */
+	OBReclaimFreeList(done);
+}
+
+/**
+ *  \brief Free an object once no hazard slot holds it
+ *
+ *  \param n the node in the object, already unreachable. The slots hold
+ *         the address of the node: it must be the first member of the
+ *         object, or the object protected through it.
+ *  \param Free called with n
+ */
+void OBHazardRetire(OBReclaimNode *n, void (*Free)(OBReclaimNode *))
+{
+	OBHazardThread *t = ob_hazard_self;
+	uint32_t scan = 2 * OB_HAZARD_SLOTS * OBAtomicLoadRelaxed(&ob_hazard_nthreads);
+
+	n->Free = Free;
+	n->next = t->retired;
+	t->retired = n;
+
+	/* a scan frees at least half of what it looks at */
+	if (++t->nretired >= (scan > OB_HAZARD_SCAN_MIN ? scan : OB_HAZARD_SCAN_MIN))
+		OBHazardScan();
+}
+
+/**
+ *  \brief Free all the thread retired, waiting for the other threads to
+ *         drop their hazard pointers to it
+ */
+void OBHazardBarrier(void)
+{
+	OBHazardThread *t = ob_hazard_self;
+	uint32_t spun = 0;
+
+	for (;;) {
+		OBHazardScan();
+		if (t->retired == NULL)
+			break;
+		spun = OBReclaimWait(spun);
+	}
+}
+
+/*********** unittests ***********/
+#define RECLAIM_TEST_POISON     0xdeadbeefdeadbeefULL
+
+typedef struct ReclaimTestObj_ {
+    OBReclaimNode rn;           /**< first, hazard slots hold the object */
+    uint64_t key;
+    uintptr_t next;             /**< list: next object, bit 0: this one is deleted */
+} ReclaimTestObj;
+
+static uint64_t reclaim_test_freed = 0;
+
+static void ReclaimTestFree(OBReclaimNode *n)
+{
+	ReclaimTestObj *obj = (ReclaimTestObj *)n;
+
+	obj->key = RECLAIM_TEST_POISON;
+	OBFree(obj);
+	OBAtomicAddAndFetch(&reclaim_test_freed, 1);
+}
+
+static ReclaimTestObj *ReclaimTestObjNew(uint64_t key)
+{
+	ReclaimTestObj *obj = OBMalloc(sizeof(ReclaimTestObj));
+
+	if (obj != NULL) {
+		memset(obj, 0, sizeof(*obj));
+		obj->key = key;
+	}
+	return obj;
+}
+
+typedef struct ReclaimTestHold_ {
+    int hazard;
+    void *shared;               /**< protected by the holder */
+    uint32_t holding;
+    uint32_t hold;
+    uint32_t failed;
+} ReclaimTestHold;
+
+static void *ReclaimTestHolder(void *arg)
+{
+	ReclaimTestHold *h = (ReclaimTestHold *)arg;
+
+	if ((h->hazard ? OBHazardRegisterThread("ReclaimHolder") :
+			OBEbrRegisterThread("ReclaimHolder")) != 0)
+	{
+		h->failed = 1;
+		OBAtomicStoreRelease(&h->holding, 1);
+		return NULL;
+	}
+	if (h->hazard)
+		OBHazardProtect(0, &h->shared);
+	else
+		OBEbrEnter();
+	OBAtomicStoreRelease(&h->holding, 1);
+
+	while (OBAtomicLoadAcquire(&h->hold)) {
+		usleep(1000);
+	}
+
+	if (h->hazard) {
+		OBHazardUnregisterThread();
+	} else {
+		OBEbrExit();
+		OBEbrUnregisterThread();
+	}
+	return NULL;
+}
+
+/**
+ * \test objects retired while a thread is inside a section are only freed
+ *       after it left, and a hazard pointer keeps its object only
+ */
+static int OBReclaimTestHold(void)
+{
+	ReclaimTestHold h;
+	ReclaimTestObj *objs[2 * OB_EBR_BATCH];
+	pthread_t t;
+	uint32_t i, n;
+	int hazard, created, result = 1;
+
+	for (hazard = 0; hazard <= 1 && result; hazard++)
+	{
+		memset(&h, 0, sizeof(h));
+		h.hazard = hazard;
+		h.hold = 1;
+		reclaim_test_freed = 0;
+
+		if ((hazard ? OBHazardRegisterThread("ReclaimTest") :
+				OBEbrRegisterThread("ReclaimTest")) != 0)
+			return 0;
+		for (n = 0; n < 2 * OB_EBR_BATCH; n++) {
+			if ((objs[n] = ReclaimTestObjNew(n)) == NULL)
+				break;
+		}
+		h.shared = n > 0 ? objs[0] : NULL;
+
+		created = pthread_create(&t, NULL, ReclaimTestHolder, &h) == 0;
+		if (!created)
+			h.failed = 1;
+		while (created && !OBAtomicLoadAcquire(&h.holding)) {
+			usleep(1000);
+		}
+
+		OBAtomicStoreRelease(&h.shared, NULL);
+		for (i = 0; i < n; i++) {
+			if (hazard)
+				OBHazardRetire(&objs[i]->rn, ReclaimTestFree);
+			else
+				OBEbrRetire(&objs[i]->rn, ReclaimTestFree);
+		}
+		if (hazard)
+			OBHazardScan();
+		else
+			OBEbrTryAdvance();
+		/* the holder keeps objs[0], or everything retired meanwhile */
+		if (h.failed || n != 2 * OB_EBR_BATCH ||
+			OBAtomicLoadAcquire(&reclaim_test_freed) != (hazard ? n - 1 : 0))
+			result = 0;
+
+		if (created) {
+			OBAtomicStoreRelease(&h.hold, 0);
+			pthread_join(t, NULL);
+		}
+		if (hazard) {
+			OBHazardBarrier();
+			OBHazardUnregisterThread();
+		} else {
+			OBEbrBarrier();
+			OBEbrUnregisterThread();
+		}
+		if (reclaim_test_freed != n)
+			result = 0;
+	}
+	return result;
+}
+
+/* Harris-Michael list of unique keys, in order. Deleting marks the next
+ * pointer of the object before it is unlinked, by the deleter or by any
+ * thread walking over it. */
+typedef struct ReclaimTestList_ {
+    uintptr_t head;
+    int hazard;                 /**< hazard pointers, else epochs */
+} ReclaimTestList;
+
+#define LIST_MARK               ((uintptr_t)1)
+#define LIST_PTR(v)             ((ReclaimTestObj *)((v) & ~LIST_MARK))
+
+/* hazard slots of the walk */
+#define LIST_HP_NEXT            0
+#define LIST_HP_CUR             1
+#define LIST_HP_PREV            2
+
+static void ReclaimTestListRetire(ReclaimTestList *l, ReclaimTestObj *obj)
+{
+	if (l->hazard)
+		OBHazardRetire(&obj->rn, ReclaimTestFree);
+	else
+		OBEbrRetire(&obj->rn, ReclaimTestFree);
+}
+
+/**
+ *  \brief Find where key is or would be, unlinking the deleted objects on
+ *         the way
+ *
+ *  \retval 1 if found, cur is the object, else the one after
+ */
+static int ReclaimTestListFind(ReclaimTestList *l, uint64_t key, uintptr_t **pprev,
+		ReclaimTestObj **pcur, uint64_t *bad)
+{
+	uintptr_t *prev, next;
+	ReclaimTestObj *cur;
+	uint64_t ckey;
+
+retry:
+	prev = &l->head;
+	cur = LIST_PTR(OBAtomicLoadAcquire(prev));
+	if (l->hazard) {
+		OBHazardSet(LIST_HP_CUR, cur);
+		if (OBAtomicLoadAcquire(prev) != (uintptr_t)cur)
+			goto retry;
+	}
+	for (;;)
+	{
+		if (cur == NULL)
+			break;
+		next = OBAtomicLoadAcquire(&cur->next);
+		if (l->hazard) {
+			OBHazardSet(LIST_HP_NEXT, LIST_PTR(next));
+			if (OBAtomicLoadAcquire(&cur->next) != next)
+				goto retry;
+		}
+		/* cur is still linked after prev, so it is not freed yet */
+		if (OBAtomicLoadAcquire(prev) != (uintptr_t)cur)
+			goto retry;
+
+		if (next & LIST_MARK) {
+			if (!OBAtomicCompareAndSwap(prev, (uintptr_t)cur, next & ~LIST_MARK))
+				goto retry;
+			ReclaimTestListRetire(l, cur);
+		} else {
+			ckey = cur->key;
+			if (ckey == RECLAIM_TEST_POISON)
+				(*bad)++;
+			if (ckey >= key)
+				break;
+			prev = &cur->next;
+			if (l->hazard)
+				OBHazardSet(LIST_HP_PREV, cur);
+		}
+		cur = LIST_PTR(next);
+		if (l->hazard)
+			OBHazardSet(LIST_HP_CUR, cur);
+	}
+	*pprev = prev;
+	*pcur = cur;
+	return cur != NULL && cur->key == key;
+}
+
+static void ReclaimTestListEnter(ReclaimTestList *l)
+{
+	if (!l->hazard)
+		OBEbrEnter();
+}
+
+static void ReclaimTestListExit(ReclaimTestList *l)
+{
+	if (l->hazard) {
+		OBHazardClear(LIST_HP_NEXT);
+		OBHazardClear(LIST_HP_CUR);
+		OBHazardClear(LIST_HP_PREV);
+	} else {
+		OBEbrExit();
+	}
+}
+
+/**
+ *  \retval 1 if inserted, 0 if the key is there, -1 on error
+ */
+static int ReclaimTestListInsert(ReclaimTestList *l, uint64_t key, uint64_t *bad)
+{
+	ReclaimTestObj *obj, *cur;
+	uintptr_t *prev;
+	int r;
+
+	obj = ReclaimTestObjNew(key);
+	if (obj == NULL)
+		return -1;
+
+	ReclaimTestListEnter(l);
+	for (;;)
+	{
+		if (ReclaimTestListFind(l, key, &prev, &cur, bad)) {
+			r = 0;
+			break;
+		}
+		obj->next = (uintptr_t)cur;
+		if (OBAtomicCompareAndSwap(prev, (uintptr_t)cur, (uintptr_t)obj)) {
+			r = 1;
+			break;
+		}
+	}
+	ReclaimTestListExit(l);
+
+	if (r == 0)
+		OBFree(obj);
+	return r;
+}
+
+/**
+ *  \retval 1 if deleted, 0 if the key isn't there
+ */
+static int ReclaimTestListDelete(ReclaimTestList *l, uint64_t key, uint64_t *bad)
+{
+	ReclaimTestObj *cur;
+	uintptr_t *prev, next;
+	int r;
+
+	ReclaimTestListEnter(l);
+	for (;;)
+	{
+		if (!ReclaimTestListFind(l, key, &prev, &cur, bad)) {
+			r = 0;
+			break;
+		}
+		next = OBAtomicLoadAcquire(&cur->next);
+		if (next & LIST_MARK)
+			continue;
+		/* the winner of the mark deletes the key */
+		if (!OBAtomicCompareAndSwap(&cur->next, next, next | LIST_MARK))
+			continue;
+		if (OBAtomicCompareAndSwap(prev, (uintptr_t)cur, next))
+			ReclaimTestListRetire(l, cur);
+		else
+			ReclaimTestListFind(l, key, &prev, &cur, bad);
+		r = 1;
+		break;
+	}
+	ReclaimTestListExit(l);
+	return r;
+}
+
+static int ReclaimTestListContains(ReclaimTestList *l, uint64_t key, uint64_t *bad)
+{
+	ReclaimTestObj *cur;
+	uintptr_t *prev;
+	int r;
+
+	ReclaimTestListEnter(l);
+	r = ReclaimTestListFind(l, key, &prev, &cur, bad);
+	ReclaimTestListExit(l);
+	return r;
+}
+
+#define RECLAIM_STRESS_THREADS  4
+#define RECLAIM_STRESS_OPS      (1 << 16)
+#define RECLAIM_STRESS_KEYS     64
+
+typedef struct ReclaimStress_ {
+    ReclaimTestList *l;
+    uint32_t ops;
+    uint32_t seed;
+    int64_t count;              /**< inserted - deleted */
+    uint64_t bad;               /**< freed objects seen */
+    int failed;
+} ReclaimStress;
+
+static void *ReclaimStressThread(void *arg)
+{
+	ReclaimStress *s = (ReclaimStress *)arg;
+	uint32_t i, r, rand = s->seed;
+	uint64_t key;
+	int ret;
+
+	if ((s->l->hazard ? OBHazardRegisterThread("ReclaimStress") :
+			OBEbrRegisterThread("ReclaimStress")) != 0)
+	{
+		s->failed = 1;
+		return NULL;
+	}
+	for (i = 0; i < s->ops; i++)
+	{
+		rand = rand * 1103515245 + 12345;
+		r = rand >> 16;
+		key = 1 + (r >> 4) % RECLAIM_STRESS_KEYS;
+		if ((r & 15) < 6) {
+			ret = ReclaimTestListInsert(s->l, key, &s->bad);
+			if (ret < 0)
+				s->failed = 1;
+			else
+				s->count += ret;
+		} else if ((r & 15) < 12) {
+			s->count -= ReclaimTestListDelete(s->l, key, &s->bad);
+		} else {
+			ReclaimTestListContains(s->l, key, &s->bad);
+		}
+	}
+	if (s->l->hazard)
+		OBHazardUnregisterThread();
+	else
+		OBEbrUnregisterThread();
+	return NULL;
+}
+
+/**
+ *  \brief Run threads on a list, then check it and empty it
+ *
+ *  \retval 0 if the list is consistent, -1 if not, or on error
+ */
+static int ReclaimStressRun(ReclaimTestList *l, int nthreads, uint32_t ops, double *ns)
+{
+	ReclaimStress s[RECLAIM_STRESS_THREADS];
+	pthread_t tids[RECLAIM_STRESS_THREADS];
+	struct timespec t0, t1;
+	ReclaimTestObj *obj, *next;
+	int64_t count = 0;
+	uint64_t last = 0;
+	int i, started = 0, result = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < nthreads; i++)
+	{
+		memset(&s[i], 0, sizeof(s[i]));
+		s[i].l = l;
+		s[i].ops = ops;
+		s[i].seed = i + 1;
+		if (pthread_create(&tids[i], NULL, ReclaimStressThread, &s[i]) != 0)
+			break;
+		started++;
+	}
+	for (i = 0; i < started; i++) {
+		pthread_join(tids[i], NULL);
+		if (s[i].failed || s[i].bad)
+			result = -1;
+		count += s[i].count;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if (started != nthreads)
+		result = -1;
+	if (ns != NULL)
+		*ns = ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) /
+			((double)ops * nthreads);
+
+	/* all threads are gone: in order, nothing marked, as many as counted */
+	for (obj = LIST_PTR(l->head); obj != NULL; obj = next)
+	{
+		if ((obj->next & LIST_MARK) || obj->key <= last)
+			result = -1;
+		last = obj->key;
+		next = LIST_PTR(obj->next);
+		OBFree(obj);
+		count--;
+	}
+	l->head = 0;
+	if (count != 0)
+		result = -1;
+	return result;
+}
+
+/**
+ * \test threads insert, delete and look up keys of a lock-free list, the
+ *       objects unlinked are retired with epochs, then hazard pointers.
+ *       Run it in onebox-tsan too, see the Makefile.
+ */
+static int OBReclaimTestListStress(void)
+{
+	ReclaimTestList l;
+	int hazard;
+
+	for (hazard = 0; hazard <= 1; hazard++)
+	{
+		memset(&l, 0, sizeof(l));
+		l.hazard = hazard;
+		if (ReclaimStressRun(&l, RECLAIM_STRESS_THREADS, RECLAIM_STRESS_OPS, NULL) != 0)
+			return 0;
+	}
+	return 1;
+}
+
+/**
+ * \brief ns per list operation with epochs and with hazard pointers, 1 to
+ *        4 threads
+ */
+static int OBReclaimBenchList(void)
+{
+	ReclaimTestList l;
+	double ns;
+	int nthreads, hazard;
+
+	printf("\n    threads    epochs   hazards\n");
+	for (nthreads = 1; nthreads <= RECLAIM_STRESS_THREADS; nthreads <<= 1)
+	{
+		printf("    %7d", nthreads);
+		for (hazard = 0; hazard <= 1; hazard++) {
+			memset(&l, 0, sizeof(l));
+			l.hazard = hazard;
+			if (ReclaimStressRun(&l, nthreads, (RECLAIM_STRESS_OPS * 4) / nthreads, &ns) != 0)
+				return 0;
+			printf(" %6.1f ns", ns);
+		}
+		printf("\n");
+	}
+	return 1;
+}
+
+void OBReclaimRegisterTests(void)
+{
+	UtRegisterTest("OBReclaimTestHold", OBReclaimTestHold, 1);
+	UtRegisterTest("OBReclaimTestListStress", OBReclaimTestListStress, 1);
+	UtRegisterTest("OBReclaimBenchList", OBReclaimBenchList, 1);
+}
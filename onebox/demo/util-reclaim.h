@@ -0,0 +1,140 @@
+#ifndef __UTIL_RECLAIM_H__
+#define __UTIL_RECLAIM_H__
+
+#include "util-threads.h"
+#include "util-atomic.h"
+
+/* Safe memory reclamation for lock-free structures: an object unlinked
+ * with OB_ATOMIC_CAS() may still be read by the threads that loaded its
+ * pointer before, it is retired and freed once none can.
+ *
+ * Epoch-based (OBEbr*): threads access the structure between OBEbrEnter()
+ * and OBEbrExit(). A retired object waits in the limbo list of the global
+ * epoch it was retired in, which advances once every thread inside saw it,
+ * and is freed two epochs later. Reading costs a store and a fence per
+ * section, but a thread that stays inside holds back all frees.
+ *
+ * Hazard pointers (OBHazard*): a thread publishes each pointer it is about
+ * to use in one of its OB_HAZARD_SLOTS slots, retired objects are freed by
+ * scans unless a slot holds them. Every pointer loaded pays a fence, but a
+ * long-running reader only keeps the objects it points to.
+ *
+ * Objects embed an OBReclaimNode, so retiring never allocates, nor blocks.
+ * Threads register with each scheme they use. */
+
+#define OB_EBR_EPOCHS           3       /**< limbo lists per thread */
+#define OB_EBR_INACTIVE         0       /**< OBEbrThread epoch outside of a section */
+#define OB_EBR_BATCH            64      /**< retires between epoch advances */
+#define OB_EBR_FREE_BATCH       64      /**< frees at most per retire */
+
+#define OB_HAZARD_SLOTS         4       /**< hazard pointers per thread */
+#define OB_HAZARD_SCAN_MIN      64      /**< retires between scans */
+
+typedef struct OBReclaimNode_ {
+    struct OBReclaimNode_ *next;
+    void (*Free)(struct OBReclaimNode_ *);  /**< gets the node, first in
+                                             *   the object or not */
+} OBReclaimNode;
+
+typedef struct OBEbrThread_ {
+    uint64_t epoch;             /**< global epoch seen at OBEbrEnter(),
+                                 *   read by the threads advancing it */
+    uint32_t nested;
+    uint32_t retired;           /**< since the last advance */
+    OBReclaimNode *limbo[OB_EBR_EPOCHS];    /**< by epoch % OB_EBR_EPOCHS */
+    uint64_t limbo_epoch[OB_EBR_EPOCHS];
+    OBReclaimNode *ready;       /**< safe to free, a batch at a time */
+    char name[THREAD_NAME_LEN + 1];
+    struct OBEbrThread_ *next;
+} OB_CACHE_ALIGNED OBEbrThread;
+
+typedef struct OBHazardThread_ {
+    void *slots[OB_HAZARD_SLOTS];   /**< read by the scans of other threads */
+    OBReclaimNode *retired;
+    uint32_t nretired;
+    char name[THREAD_NAME_LEN + 1];
+    struct OBHazardThread_ *next;
+} OB_CACHE_ALIGNED OBHazardThread;
+
+extern uint64_t ob_ebr_epoch;
+extern __thread OBEbrThread *ob_ebr_self;
+extern __thread OBHazardThread *ob_hazard_self;
+
+int OBEbrRegisterThread(const char *name);
+void OBEbrUnregisterThread(void);
+void OBEbrRetire(OBReclaimNode *, void (*Free)(OBReclaimNode *));
+int OBEbrTryAdvance(void);
+void OBEbrBarrier(void);
+
+int OBHazardRegisterThread(const char *name);
+void OBHazardUnregisterThread(void);
+void OBHazardRetire(OBReclaimNode *, void (*Free)(OBReclaimNode *));
+void OBHazardScan(void);
+void OBHazardBarrier(void);
+
+void OBReclaimRegisterTests(void);
+
+/**
+ *  \brief Start using the shared structures, sections nest
+ */
+static inline void OBEbrEnter(void)
+{
+    OBEbrThread *t = ob_ebr_self;
+
+    if (t->nested++ == 0) {
+        OBAtomicStoreRelaxed(&t->epoch, OBAtomicLoadAcquire(&ob_ebr_epoch));
+        /* seen inside before the pointers are loaded */
+        hw_barrier();
+    }
+}
+
+/**
+ *  \brief Done with the pointers loaded since OBEbrEnter()
+ */
+static inline void OBEbrExit(void)
+{
+    OBEbrThread *t = ob_ebr_self;
+
+    if (--t->nested == 0)
+        OBAtomicStoreRelease(&t->epoch, OB_EBR_INACTIVE);
+}
+
+/**
+ *  \brief Publish a pointer in a hazard slot before using it
+ *
+ *  The caller then checks that the pointer is still reachable where it
+ *  was loaded from, else the object may be retired already.
+ */
+static inline void OBHazardSet(int slot, void *ptr)
+{
+    OBAtomicStoreRelease(&ob_hazard_self->slots[slot], ptr);
+    /* published before the pointer is checked again */
+    hw_barrier();
+}
+
+static inline void OBHazardClear(int slot)
+{
+    OBAtomicStoreRelease(&ob_hazard_self->slots[slot], NULL);
+}
+
+/**
+ *  \brief Load a pointer and protect it in a hazard slot
+ *
+ *  \param src where the pointer is, an unmarked pointer
+ *
+ *  \retval the pointer, safe to use until the slot is set again
+ */
+static inline void *OBHazardProtect(int slot, void **src)
+{
+    void *ptr = OBAtomicLoadAcquire(src), *again;
+
+    for (;;) {
+        OBHazardSet(slot, ptr);
+        again = OBAtomicLoadAcquire(src);
+        if (again == ptr)
+            return ptr;
+        ptr = again;
+    }
+}
+
+#endif
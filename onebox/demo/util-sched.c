@@ -0,0 +1,695 @@
+#include "onebox-common.h"
+#include "util-sched.h"
+#include "util-affinity.h"
+#include "util-conf-node.h"
+#include "util-cpu.h"
+#include "util-debug.h"
+#include "util-error.h"
+#include "util-mem.h"
+#include "util-threads.h"
+#include "util-atomic.h"
+#include "util-rcu.h"
+#include "util-unittest.h"
+
+#define OB_SCHED_SPIN       64      /**< idle rounds before a worker parks */
+#define OB_SCHED_YIELD      16      /**< waiters yield after as many rounds */
+
+/*********** vars ***********/
+/* the worker the thread is, NULL outside of the pools */
+static __thread OBSchedWorker *ob_sched_self = NULL;
+
+/*********** funcs ***********/
+static inline OBSchedWorker *OBSchedSelf(OBSched *s)
+{
+	return (ob_sched_self != NULL && ob_sched_self->sched == s) ? ob_sched_self : NULL;
+}
+
+static inline uint32_t OBSchedRand(uint32_t *state)
+{
+	uint32_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+static void OBSchedRunTask(OBTask *t)
+{
+	OBTaskGroup *g = t->group;
+
+	/* done with the task before the group says so, the submitter may
+	 * reuse it right away */
+	t->Func(t->arg);
+	if (t->flags & OB_TASK_FREE)
+		OBFree(t);
+	if (g != NULL)
+		OBAtomicSubAndFetch(&g->pending, 1);
+}
+
+/**
+ *  \brief Find a task: our own newest, one submitted from outside, then the
+ *         oldest of another worker, starting at a random one
+ *
+ *  \param w the worker looking, NULL for another thread
+ */
+static OBTask *OBSchedFind(OBSched *s, OBSchedWorker *w, uint32_t *rand)
+{
+	OBTask *t;
+	uint32_t i, v;
+
+	if (w != NULL && (t = WsDequePop(w->deque)) != NULL)
+		return t;
+	if ((t = RingMPMCDequeue(s->inject)) != NULL)
+		return t;
+
+	v = OBSchedRand(rand) % s->nworkers;
+	for (i = 0; i < s->nworkers; i++, v = (v + 1 == s->nworkers) ? 0 : v + 1)
+	{
+		if (&s->workers[v] == w)
+			continue;
+		if ((t = WsDequeSteal(s->workers[v].deque)) != NULL)
+			return t;
+	}
+	return NULL;
+}
+
+static int OBSchedHasWork(OBSched *s)
+{
+	uint32_t i;
+
+	if (OBAtomicLoadRelaxed(&s->inject->tail) != OBAtomicLoadRelaxed(&s->inject->head))
+		return 1;
+	for (i = 0; i < s->nworkers; i++) {
+		if (WsDequeCount(s->workers[i].deque) != 0)
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ *  \brief Sleep until a task is submitted or the pool stops
+ *
+ *  The epoch is read before we count as a sleeper and look for work one
+ *  last time. A submitter queues its task before it looks for sleepers, so
+ *  either we see the task or it sees us and bumps the epoch, which makes
+ *  the futex wait return right away.
+ */
+static void OBSchedPark(OBSched *s)
+{
+	uint32_t epoch = OBAtomicLoadRelaxed(&s->epoch);
+
+	OBAtomicAddAndFetch(&s->sleepers, 1);
+	if (!OBAtomicLoadRelaxed(&s->stop) && !OBSchedHasWork(s)) {
+		OBRcuThreadOffline();
+		OBFutexWait(&s->epoch, epoch);
+		OBRcuThreadOnline();
+	}
+	OBAtomicSubAndFetch(&s->sleepers, 1);
+}
+
+static void OBSchedWake(OBSched *s)
+{
+	/* the task is queued before sleepers is read */
+	hw_barrier();
+	if (OBAtomicLoadRelaxed(&s->sleepers) != 0) {
+		OBAtomicAddAndFetch(&s->epoch, 1);
+		OBFutexWake(&s->epoch, 1);
+	}
+}
+
+static void *OBSchedWorkerLoop(void *arg)
+{
+	OBSchedWorker *w = (OBSchedWorker *)arg;
+	OBSched *s = w->sched;
+	uint32_t idle = 0, stop;
+	OBTask *t;
+
+	ob_sched_self = w;
+	OBSetThreadName(w->name);
+	AffinitySetCurrentThread(w->name, w->cpu, w->set_cpus ? &w->cpus : NULL,
+			w->set_prio, w->prio);
+	if (OBRcuRegisterThread(w->name) != 0) {
+		OBLogWarning(OB_ERR_MEM_ALLOC, "%s: can't register as an RCU reader, "
+				"tasks must not use RCU protected data", w->name);
+	}
+
+	for (;;)
+	{
+		/* tasks hold no RCU protected data between them */
+		OBRcuQuiescentState();
+
+		/* read first: a stopping pool gets no new tasks, so once it is
+		 * stopped and there is nothing left, nothing will come */
+		stop = OBAtomicLoadAcquire(&s->stop);
+
+		if ((t = OBSchedFind(s, w, &w->rand)) != NULL) {
+			OBSchedRunTask(t);
+			idle = 0;
+			continue;
+		}
+		if (stop)
+			break;
+		if (++idle < OB_SCHED_SPIN) {
+			ob_cpu_pause();
+			continue;
+		}
+		OBSchedPark(s);
+		idle = 0;
+	}
+	OBRcuUnregisterThread();
+	return NULL;
+}
+
+/**
+ *  \brief Create a pool of worker threads
+ *
+ *  \param name of the pool, the workers are "<name>#<n>"
+ *  \param nworkers workers, 0 for as many as the cpu set says: its
+ *         "threads" or else its cpus, all online cpus without a set
+ *  \param cpu_set_type CpuSetType the workers are placed by when
+ *         threading.set-cpu-affinity is on, -1 for none
+ *
+ *  \retval the pool or NULL on error
+ */
+OBSched *OBSchedCreate(const char *name, int nworkers, int cpu_set_type)
+{
+	ThreadsAffinityType *taf = NULL;
+	OBSchedWorker *w;
+	OBSched *s;
+	uint32_t i;
+	int ret;
+
+	if (threading_set_cpu_affinity && cpu_set_type >= 0)
+		taf = GetAffinityTypeFromId(cpu_set_type);
+	if (nworkers <= 0) {
+		if (taf != NULL)
+			nworkers = taf->nb_threads ? (int)taf->nb_threads : CPU_COUNT(&taf->cpu_set);
+		else
+			nworkers = UtilCpuGetNumProcessorsOnline();
+	}
+	if (nworkers <= 0 || nworkers > OB_SCHED_WORKERS_MAX) {
+		OBLogError(OB_ERR_INVALID_ARGUMENT, "%s: invalid number of workers %d", name, nworkers);
+		return NULL;
+	}
+
+	s = OBCallocAligned(OB_CACHE_LINE_SIZE, 1, sizeof(OBSched));
+	if (s == NULL)
+		return NULL;
+	strlcpy(s->name, name, sizeof(s->name));
+	s->nworkers = nworkers;
+
+	s->workers = OBCallocAligned(OB_CACHE_LINE_SIZE, nworkers, sizeof(OBSchedWorker));
+	s->inject = RingMPMCNew(OB_SCHED_INJECT_SIZE);
+	if (s->workers == NULL || s->inject == NULL)
+		goto error;
+
+	for (i = 0; i < s->nworkers; i++)
+	{
+		w = &s->workers[i];
+		w->sched = s;
+		w->rand = 0x9e3779b9U * (i + 1);
+		w->cpu = -1;
+		snprintf(w->name, sizeof(w->name), "%s#%02u", name, i + 1);
+		if ((w->deque = WsDequeNew(OB_SCHED_DEQUE_SIZE)) == NULL)
+			goto error;
+
+		/* as TmThreadSpawn() places threads of a set */
+		if (taf != NULL) {
+			if (taf->mode_flag == EXCLUSIVE_AFFINITY) {
+				w->cpu = AffinityGetNextCPU(taf);
+				w->prio = AffinityGetCPUPrio(taf, w->cpu);
+			} else {
+				w->cpus = taf->cpu_set;
+				w->set_cpus = 1;
+				w->prio = taf->prio;
+			}
+			w->set_prio = 1;
+		}
+	}
+
+	for (i = 0; i < s->nworkers; i++)
+	{
+		w = &s->workers[i];
+		ret = pthread_create(&w->t, NULL, OBSchedWorkerLoop, w);
+		if (ret != 0) {
+			OBLogError(OB_ERR_FATAL, "%s: can't create thread: %s", w->name, strerror(ret));
+			goto error;
+		}
+		w->spawned = 1;
+	}
+	return s;
+
+error:
+	OBSchedDestroy(s);
+	return NULL;
+}
+
+/**
+ *  \brief Stop the workers once every queued task ran, and free the pool
+ *
+ *  Nothing may be submitted from outside the pool meanwhile.
+ */
+void OBSchedDestroy(OBSched *s)
+{
+	uint32_t i;
+
+	if (s == NULL)
+		return;
+
+	OBAtomicFetchAndOr(&s->stop, 1);
+	OBAtomicAddAndFetch(&s->epoch, 1);
+	OBFutexWake(&s->epoch, INT_MAX);
+
+	if (s->workers != NULL)
+	{
+		for (i = 0; i < s->nworkers; i++) {
+			if (s->workers[i].spawned)
+				pthread_join(s->workers[i].t, NULL);
+		}
+		for (i = 0; i < s->nworkers; i++) {
+			WsDequeFree(s->workers[i].deque);
+		}
+		OBFreeAligned(s->workers);
+	}
+	RingMPMCFree(s->inject);
+	OBFreeAligned(s);
+}
+
+/**
+ *  \brief Queue a task, on the deque of the worker submitting it or for
+ *         any worker when submitted from outside the pool. When that queue
+ *         is full the task runs right here.
+ */
+void OBSchedSubmit(OBSched *s, OBTask *t)
+{
+	OBSchedWorker *w = OBSchedSelf(s);
+	int ret;
+
+	if (t->group != NULL)
+		OBAtomicAddAndFetch(&t->group->pending, 1);
+
+	if (w != NULL)
+		ret = WsDequePush(w->deque, t);
+	else
+		ret = RingMPMCEnqueue(s->inject, t);
+	if (ret != 0) {
+		OBSchedRunTask(t);
+		return;
+	}
+	OBSchedWake(s);
+}
+
+/**
+ *  \brief Run Func(arg) on the pool, for fire and forget work
+ *
+ *  \retval 0 on success, -1 if the task can't be allocated
+ */
+int OBSchedSubmitFunc(OBSched *s, void (*Func)(void *), void *arg)
+{
+	OBTask *t = OBMalloc(sizeof(OBTask));
+
+	if (t == NULL)
+		return -1;
+	OBTaskInit(t, Func, arg, NULL);
+	t->flags = OB_TASK_FREE;
+	OBSchedSubmit(s, t);
+	return 0;
+}
+
+/**
+ *  \brief Wait for the tasks of a group, running tasks of the pool
+ *         meanwhile, from any thread
+ */
+void OBSchedWait(OBSched *s, OBTaskGroup *g)
+{
+	OBSchedWorker *w = OBSchedSelf(s);
+	uint32_t rand = w != NULL ? w->rand : ((uint32_t)(uintptr_t)g | 1);
+	uint32_t idle = 0;
+	OBTask *t;
+
+	/* acquire: see what the tasks did */
+	while (OBAtomicLoadAcquire(&g->pending) != 0)
+	{
+		if ((t = OBSchedFind(s, w, &rand)) != NULL) {
+			OBSchedRunTask(t);
+			idle = 0;
+			continue;
+		}
+		/* what is left runs on other workers */
+		if (++idle < OB_SCHED_YIELD)
+			ob_cpu_pause();
+		else
+			sched_yield();
+	}
+	if (w != NULL)
+		w->rand = rand;
+}
+
+/*********** unittests ***********/
+#define SCHED_SUM_CUTOFF        (1 << 14)
+#define SCHED_SORT_CUTOFF       (1 << 12)
+#define SCHED_TEST_SUM_N        (1 << 20)
+#define SCHED_TEST_SORT_N       (1 << 16)
+#define SCHED_TEST_FUNCS        1000
+#define SCHED_BENCH_SUM_N       (1 << 23)
+#define SCHED_BENCH_SORT_N      (1 << 21)
+
+typedef struct SchedSumArgs_ {
+    OBSched *s;
+    const uint32_t *v;
+    size_t n;
+    uint64_t sum;
+} SchedSumArgs;
+
+typedef struct SchedSortArgs_ {
+    OBSched *s;
+    uint32_t *v;
+    size_t n;
+} SchedSortArgs;
+
+/**
+ *  \brief Sum the halves in parallel, down to SCHED_SUM_CUTOFF values
+ */
+static void SchedSum(void *arg)
+{
+	SchedSumArgs *a = (SchedSumArgs *)arg;
+	SchedSumArgs l, r;
+	OBTaskGroup g;
+	OBTask t;
+	size_t i;
+
+	if (a->s == NULL || a->n <= SCHED_SUM_CUTOFF) {
+		for (a->sum = 0, i = 0; i < a->n; i++) {
+			a->sum += a->v[i];
+		}
+		return;
+	}
+
+	l.s = r.s = a->s;
+	l.v = a->v;
+	l.n = a->n / 2;
+	r.v = a->v + l.n;
+	r.n = a->n - l.n;
+
+	OBTaskGroupInit(&g);
+	OBTaskInit(&t, SchedSum, &l, &g);
+	OBSchedSubmit(a->s, &t);
+	SchedSum(&r);
+	OBSchedWait(a->s, &g);
+	a->sum = l.sum + r.sum;
+}
+
+static int SchedSortCmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static inline void SchedSortSwap(uint32_t *v, size_t i, size_t j)
+{
+	uint32_t x = v[i];
+
+	v[i] = v[j];
+	v[j] = x;
+}
+
+/**
+ *  \brief Quicksort sorting the two sides in parallel, down to
+ *         SCHED_SORT_CUTOFF values
+ */
+static void SchedSort(void *arg)
+{
+	SchedSortArgs *a = (SchedSortArgs *)arg;
+	SchedSortArgs l, r;
+	uint32_t *v = a->v;
+	size_t n = a->n, i, p, m;
+	OBTaskGroup g;
+	OBTask t;
+
+	if (a->s == NULL || n <= SCHED_SORT_CUTOFF) {
+		qsort(v, n, sizeof(uint32_t), SchedSortCmp);
+		return;
+	}
+
+	/* median of three to the end, Lomuto partition */
+	m = n / 2;
+	if (v[m] < v[0])
+		SchedSortSwap(v, m, 0);
+	if (v[n - 1] < v[0])
+		SchedSortSwap(v, n - 1, 0);
+	if (v[m] < v[n - 1])
+		SchedSortSwap(v, m, n - 1);
+	for (p = 0, i = 0; i < n - 1; i++) {
+		if (v[i] < v[n - 1])
+			SchedSortSwap(v, i, p++);
+	}
+	SchedSortSwap(v, p, n - 1);
+
+	l.s = r.s = a->s;
+	l.v = v;
+	l.n = p;
+	r.v = v + p + 1;
+	r.n = n - p - 1;
+
+	OBTaskGroupInit(&g);
+	OBTaskInit(&t, SchedSort, &l, &g);
+	OBSchedSubmit(a->s, &t);
+	SchedSort(&r);
+	OBSchedWait(a->s, &g);
+}
+
+/**
+ *  \brief Fill v with pseudo random values
+ */
+static void SchedTestFill(uint32_t *v, size_t n, uint32_t seed)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		v[i] = OBSchedRand(&seed);
+	}
+}
+
+static int SchedTestSorted(const uint32_t *v, size_t n)
+{
+	size_t i;
+
+	for (i = 1; i < n; i++) {
+		if (v[i - 1] > v[i])
+			return 0;
+	}
+	return 1;
+}
+
+/**
+ *  \brief Run a sum or sort from outside the pool, NULL for serially
+ */
+static void SchedTestRun(OBSched *s, void (*Func)(void *), void *arg)
+{
+	OBTaskGroup g;
+	OBTask t;
+
+	if (s == NULL) {
+		Func(arg);
+		return;
+	}
+	OBTaskGroupInit(&g);
+	OBTaskInit(&t, Func, arg, &g);
+	OBSchedSubmit(s, &t);
+	OBSchedWait(s, &g);
+}
+
+static void SchedTestCount(void *arg)
+{
+	OBAtomicAddAndFetch((uint32_t *)arg, 1);
+}
+
+/**
+ * \test parallel sum and sort match the serial ones, fire and forget
+ *       tasks all run before the pool is gone
+ */
+static int OBSchedTestForkJoin(void)
+{
+	SchedSumArgs sum;
+	SchedSortArgs sort;
+	uint32_t *v = NULL, count = 0;
+	uint64_t want = 0;
+	OBSched *s;
+	size_t i;
+	int result = 0;
+
+	s = OBSchedCreate("SchedTest", 4, -1);
+	if (s == NULL)
+		return 0;
+	if (s->nworkers != 4)
+		goto end;
+	v = OBMalloc(SCHED_TEST_SUM_N * sizeof(uint32_t));
+	if (v == NULL)
+		goto end;
+
+	SchedTestFill(v, SCHED_TEST_SUM_N, 1);
+	for (i = 0; i < SCHED_TEST_SUM_N; i++) {
+		want += v[i];
+	}
+	sum.s = s;
+	sum.v = v;
+	sum.n = SCHED_TEST_SUM_N;
+	SchedTestRun(s, SchedSum, &sum);
+	if (sum.sum != want)
+		goto end;
+
+	sort.s = s;
+	sort.v = v;
+	sort.n = SCHED_TEST_SORT_N;
+	SchedTestRun(s, SchedSort, &sort);
+	if (!SchedTestSorted(v, SCHED_TEST_SORT_N))
+		goto end;
+
+	for (i = 0; i < SCHED_TEST_FUNCS; i++) {
+		if (OBSchedSubmitFunc(s, SchedTestCount, &count) != 0)
+			goto end;
+	}
+	OBSchedDestroy(s);
+	s = NULL;
+	if (count != SCHED_TEST_FUNCS)
+		goto end;
+
+	result = 1;
+end:
+	OBSchedDestroy(s);
+	if (v != NULL)
+		OBFree(v);
+	return result;
+}
+
+static void SchedTestCpu(void *arg)
+{
+	cpu_set_t *cs = (cpu_set_t *)arg;
+
+	CPU_ZERO(cs);
+	sched_getaffinity(0, sizeof(*cs), cs);
+}
+
+/**
+ * \test workers are as many as the "threads" of their cpu set, and are
+ *       placed by it
+ */
+static int OBSchedTestAffinity(void)
+{
+	OBSched *s = NULL;
+	OBTaskGroup g;
+	OBTask t;
+	cpu_set_t cs;
+	int result = 0;
+
+	ConfCreateContextBackup();
+	if (ConfInit() != 0)
+		goto end;
+
+	ConfSet("threading.set-cpu-affinity", "yes");
+	ConfSet("threading.cpu-affinity.0.management-cpu-set.cpu.0", "0");
+	ConfSet("threading.cpu-affinity.0.management-cpu-set.mode", "exclusive");
+	ConfSet("threading.cpu-affinity.0.management-cpu-set.threads", "2");
+	if (AffinitySetupLoadFromConfig() != 0)
+		goto end;
+
+	s = OBSchedCreate("SchedAff", 0, MANAGEMENT_CPU_SET);
+	if (s == NULL || s->nworkers != 2 || s->workers[0].cpu != 0 || s->workers[1].cpu != 0)
+		goto end;
+	/* not OBSchedWait(), which could run it here */
+	OBTaskGroupInit(&g);
+	OBTaskInit(&t, SchedTestCpu, &cs, &g);
+	OBSchedSubmit(s, &t);
+	while (OBAtomicLoadAcquire(&g.pending) != 0) {
+		sched_yield();
+	}
+	if (CPU_COUNT(&cs) != 1 || !CPU_ISSET(0, &cs))
+		goto end;
+
+	result = 1;
+end:
+	OBSchedDestroy(s);
+	ConfDeInit();
+	ConfRestoreContextBackup();
+	AffinitySetupLoadFromConfig();
+	return result;
+}
+
+static double SchedBenchTime(struct timespec *t0)
+{
+	struct timespec t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) * 1e3 + (t1.tv_nsec - t0->tv_nsec) / 1e6;
+}
+
+/**
+ * \brief Parallel sum and sort, serially and on pools of 1, 2, 4 .. up to
+ *        all online cpus
+ */
+static int OBSchedBenchForkJoin(void)
+{
+	SchedSumArgs sum;
+	SchedSortArgs sort;
+	struct timespec t0;
+	uint32_t *v = NULL;
+	double sum_ms, sort_ms, sum1 = 0, sort1 = 0;
+	int ncpu, n, result = 0;
+	OBSched *s;
+
+	ncpu = UtilCpuGetNumProcessorsOnline();
+	v = OBMalloc(SCHED_BENCH_SUM_N * sizeof(uint32_t));
+	if (v == NULL)
+		return 0;
+	SchedTestFill(v, SCHED_BENCH_SUM_N, 1);
+
+	printf("\n    workers   sum %uM       sort %uM\n",
+			SCHED_BENCH_SUM_N >> 20, SCHED_BENCH_SORT_N >> 20);
+	for (n = 0; n <= ncpu; n = (n == 0) ? 1 : (n * 2 > ncpu && n < ncpu) ? ncpu : n * 2)
+	{
+		s = NULL;
+		if (n > 0 && (s = OBSchedCreate("SchedBench", n, -1)) == NULL)
+			goto end;
+
+		sum.s = s;
+		sum.v = v;
+		sum.n = SCHED_BENCH_SUM_N;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		SchedTestRun(s, SchedSum, &sum);
+		sum_ms = SchedBenchTime(&t0);
+
+		SchedTestFill(v, SCHED_BENCH_SORT_N, 2);
+		sort.s = s;
+		sort.v = v;
+		sort.n = SCHED_BENCH_SORT_N;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		SchedTestRun(s, SchedSort, &sort);
+		sort_ms = SchedBenchTime(&t0);
+		OBSchedDestroy(s);
+
+		if (!SchedTestSorted(v, SCHED_BENCH_SORT_N))
+			goto end;
+		if (n == 1) {
+			sum1 = sum_ms;
+			sort1 = sort_ms;
+		}
+		if (n == 0)
+			printf("     serial %7.1f ms    %7.1f ms\n", sum_ms, sort_ms);
+		else
+			printf("    %7d %7.1f ms %4.1fx %7.1f ms %4.1fx\n", n, sum_ms, sum1 / sum_ms,
+					sort_ms, sort1 / sort_ms);
+	}
+	result = 1;
+end:
+	OBFree(v);
+	return result;
+}
+
+void OBSchedRegisterTests(void)
+{
+	UtRegisterTest("OBSchedTestForkJoin", OBSchedTestForkJoin, 1);
+	UtRegisterTest("OBSchedTestAffinity", OBSchedTestAffinity, 1);
+	UtRegisterTest("OBSchedBenchForkJoin", OBSchedBenchForkJoin, 1);
+}
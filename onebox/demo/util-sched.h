@@ -0,0 +1,87 @@
+#ifndef __UTIL_SCHED_H__
+#define __UTIL_SCHED_H__
+
+#include "util-threads.h"
+#include "ds-deque.h"
+#include "ds-ring.h"
+
+/* Work-stealing task scheduler. Each worker runs the tasks of its own
+ * deque newest first, so fork/join recursion stays depth first and cache
+ * warm. Idle workers take tasks submitted from outside the pool, then
+ * steal the oldest, usually biggest, tasks of random victims, and at last
+ * park on a futex until a task is submitted.
+ *
+ * Tasks are owned by the submitter, which must keep them alive until they
+ * ran: wait for their group with OBSchedWait(), which runs tasks while it
+ * waits, or submit them with OB_TASK_FREE. */
+
+#define OB_SCHED_NAME_LEN       THREAD_NAME_LEN
+#define OB_SCHED_WORKERS_MAX    256
+#define OB_SCHED_DEQUE_SIZE     4096    /**< tasks a worker queues, then
+                                         *   runs them at submit */
+#define OB_SCHED_INJECT_SIZE    4096    /**< same for the other threads */
+
+/* OBTask flags */
+#define OB_TASK_FREE            (1 << 0)    /**< OBFree() the task once it ran */
+
+typedef struct OBTaskGroup_ {
+    uint32_t pending;           /**< tasks submitted, not done yet */
+} OBTaskGroup;
+
+typedef struct OBTask_ {
+    void (*Func)(void *arg);
+    void *arg;
+    OBTaskGroup *group;         /**< counts the task done, may be NULL */
+    uint32_t flags;
+} OBTask;
+
+struct OBSched_;
+
+typedef struct OBSchedWorker_ {
+    struct OBSched_ *sched;
+    WsDeque *deque;
+    uint32_t rand;              /**< victim picking state */
+
+    pthread_t t;
+    int spawned;
+    char name[THREAD_NAME_LEN + 1];
+    int cpu;                    /**< pinned to it, -1 for none */
+    int set_cpus;               /**< runs on cpus */
+    cpu_set_t cpus;
+    int set_prio;               /**< gets nice value prio */
+    int prio;
+} OB_CACHE_ALIGNED OBSchedWorker;
+
+typedef struct OBSched_ {
+    char name[OB_SCHED_NAME_LEN + 1];
+    uint32_t nworkers;
+    OBSchedWorker *workers;
+    RingMPMC *inject;           /**< tasks from outside the pool */
+    uint32_t stop;
+
+    uint32_t sleepers OB_CACHE_ALIGNED;
+    uint32_t epoch;             /**< futex the workers park on */
+} OBSched;
+
+OBSched *OBSchedCreate(const char *name, int nworkers, int cpu_set_type);
+void OBSchedDestroy(OBSched *);
+void OBSchedSubmit(OBSched *, OBTask *);
+int OBSchedSubmitFunc(OBSched *, void (*Func)(void *), void *arg);
+void OBSchedWait(OBSched *, OBTaskGroup *);
+
+void OBSchedRegisterTests(void);
+
+static inline void OBTaskGroupInit(OBTaskGroup *g)
+{
+    g->pending = 0;
+}
+
+static inline void OBTaskInit(OBTask *t, void (*Func)(void *), void *arg, OBTaskGroup *g)
+{
+    t->Func = Func;
+    t->arg = arg;
+    t->group = g;
+    t->flags = 0;
+}
+
+#endif
@@ -0,0 +1,733 @@
+#include "onebox-common.h"
+#include "util-slab.h"
+#include "util-debug.h"
+#include "util-error.h"
+#include "util-mem.h"
+#include "util-threads.h"
+#include "util-atomic.h"
+#include "util-unittest.h"
+#include <sys/mman.h>
+
+/* room for the span header, the objects start on the next cache line */
+#define OB_SLAB_SPAN_HDR \
+	((sizeof(OBSlabSpan) + OB_CACHE_LINE_SIZE - 1) & ~((size_t)OB_CACHE_LINE_SIZE - 1))
+
+#define OB_SLAB_SPAN_OF(ptr) \
+	((OBSlabSpan *)((uintptr_t)(ptr) & ~((uintptr_t)OB_SLAB_SPAN_SIZE - 1)))
+
+/* smallest region we bother with when the full one can't be reserved */
+#define OB_SLAB_REGION_MIN          (256UL << 20)
+
+/*********** vars ***********/
+/* 16 byte steps up to 128, then four classes per power of two */
+static const uint16_t ob_slab_sizes[OB_SLAB_CLASSES] = {
+	16, 32, 48, 64, 80, 96, 112, 128,
+	160, 192, 224, 256, 320, 384, 448, 512,
+	640, 768, 896, 1024, 1280, 1536, 1792, 2048,
+	2560, 3072, 3584, 4096
+};
+static uint8_t ob_slab_class[OB_SLAB_MAX_SIZE / 16 + 1];    /**< by (size + 15) / 16 */
+
+static char *ob_slab_base = NULL;
+static size_t ob_slab_size = 0;
+static char *ob_slab_top = NULL;            /**< spans below were carved */
+static OBSlabSpan *ob_slab_free_spans = NULL;
+static OBSlabHeap *ob_slab_orphans = NULL;  /**< heaps of exited threads */
+static OBSlabStats ob_slab_stats;
+static OBMutex ob_slab_lock = OBMUTEX_INITIALIZER;
+static pthread_key_t ob_slab_key;
+static pthread_once_t ob_slab_once = PTHREAD_ONCE_INIT;
+
+static __thread OBSlabHeap *ob_slab_heap = NULL;
+
+/*********** funcs ***********/
+static inline int OBSlabOwns(void *ptr)
+{
+	return (uintptr_t)ptr - (uintptr_t)ob_slab_base < ob_slab_size;
+}
+
+static inline void OBSlabListRemove(OBSlabHeap *heap, OBSlabSpan *span)
+{
+	if (span->prev != NULL)
+		span->prev->next = span->next;
+	else
+		heap->spans[span->cls] = span->next;
+	if (span->next != NULL)
+		span->next->prev = span->prev;
+	span->prev = span->next = NULL;
+}
+
+static inline void OBSlabListPush(OBSlabHeap *heap, OBSlabSpan *span)
+{
+	span->prev = NULL;
+	span->next = heap->spans[span->cls];
+	if (span->next != NULL)
+		span->next->prev = span;
+	heap->spans[span->cls] = span;
+}
+
+/**
+ *  \brief Take a span for a class of heap, from the free spans or carved
+ *         from the region
+ *
+ *  \retval the span or NULL when the region is used up
+ */
+static OBSlabSpan *OBSlabSpanNew(OBSlabHeap *heap, uint32_t cls)
+{
+	OBSlabSpan *span = NULL;
+	uint32_t size = ob_slab_sizes[cls];
+
+	OBMutexLock(&ob_slab_lock);
+	if ((span = ob_slab_free_spans) != NULL)
+	{
+		ob_slab_free_spans = span->next;
+		ob_slab_stats.spans_free--;
+	}
+	else if (ob_slab_top + OB_SLAB_SPAN_SIZE <= ob_slab_base + ob_slab_size)
+	{
+		span = (OBSlabSpan *)ob_slab_top;
+		ob_slab_top += OB_SLAB_SPAN_SIZE;
+		ob_slab_stats.spans++;
+	}
+	OBMutexUnlock(&ob_slab_lock);
+
+	if (span == NULL)
+		return NULL;
+
+	span->heap = heap;
+	span->cls = cls;
+	span->size = size;
+	span->used = 0;
+	span->free = NULL;
+	span->bump = (char *)span + OB_SLAB_SPAN_HDR;
+	span->end = span->bump + ((OB_SLAB_SPAN_SIZE - OB_SLAB_SPAN_HDR) / size) * size;
+	span->prev = span->next = NULL;
+	span->remote = NULL;
+	return span;
+}
+
+/**
+ *  \brief Give an empty span back, its pages but the header's are
+ *         returned to the kernel
+ */
+static void OBSlabSpanRelease(OBSlabSpan *span)
+{
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+	madvise((char *)span + page, OB_SLAB_SPAN_SIZE - page, MADV_DONTNEED);
+
+	OBMutexLock(&ob_slab_lock);
+	span->next = ob_slab_free_spans;
+	ob_slab_free_spans = span;
+	ob_slab_stats.spans_free++;
+	OBMutexUnlock(&ob_slab_lock);
+}
+
+/**
+ *  \brief Move what other threads freed to the owner's free list
+ *
+ *  \retval number of objects drained
+ */
+static uint32_t OBSlabSpanDrain(OBSlabSpan *span)
+{
+	void *list, *tail;
+	uint32_t n = 1;
+
+	if (OBAtomicLoadRelaxed(&span->remote) == NULL)
+		return 0;
+
+	list = OBAtomicExchange(&span->remote, NULL);
+	if (list == NULL)
+		return 0;
+
+	for (tail = list; *(void **)tail != NULL; tail = *(void **)tail) {
+		n++;
+	}
+	*(void **)tail = span->free;
+	span->free = list;
+	span->used -= n;
+	return n;
+}
+
+static inline void *OBSlabSpanPop(OBSlabSpan *span)
+{
+	void *ptr = span->free;
+
+	if (ptr != NULL) {
+		span->free = *(void **)ptr;
+	} else {
+		ptr = span->bump;
+		span->bump += span->size;
+	}
+	span->used++;
+	return ptr;
+}
+
+/**
+ *  \brief Thread exit destructor: release the empty spans and leave the
+ *         heap for the next thread to adopt
+ */
+static void OBSlabHeapExit(void *data)
+{
+	OBSlabHeap *heap = (OBSlabHeap *)data;
+	OBSlabSpan *span, *next;
+	uint32_t cls;
+
+	for (cls = 0; cls < OB_SLAB_CLASSES; cls++)
+	{
+		for (span = heap->spans[cls]; span != NULL; span = next)
+		{
+			next = span->next;
+			OBSlabSpanDrain(span);
+			if (span->used == 0) {
+				OBSlabListRemove(heap, span);
+				OBSlabSpanRelease(span);
+			}
+		}
+	}
+
+	OBMutexLock(&ob_slab_lock);
+	heap->next = ob_slab_orphans;
+	ob_slab_orphans = heap;
+	OBMutexUnlock(&ob_slab_lock);
+
+	/* later destructors may still allocate, they get a heap again */
+	ob_slab_heap = NULL;
+}
+
+static void OBSlabSetup(void)
+{
+	size_t size = OB_SLAB_REGION_SIZE;
+	char *map = MAP_FAILED, *base;
+	uint32_t cls = 0;
+	size_t i;
+
+	for (i = 0; i <= OB_SLAB_MAX_SIZE / 16; i++)
+	{
+		while (ob_slab_sizes[cls] < i * 16)
+			cls++;
+		ob_slab_class[i] = cls;
+	}
+
+	if (pthread_key_create(&ob_slab_key, OBSlabHeapExit) != 0) {
+		OBLogWarning(OB_ERR_MEM_ALLOC, "slab allocator disabled: no thread key");
+		return;
+	}
+
+	/* only touched pages cost memory, take as much address space as we can */
+	for (; size >= OB_SLAB_REGION_MIN; size >>= 1)
+	{
+		map = mmap(NULL, size + OB_SLAB_SPAN_SIZE, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (map != MAP_FAILED)
+			break;
+	}
+	if (map == MAP_FAILED) {
+		OBLogWarning(OB_ERR_MEM_ALLOC, "slab allocator disabled: can't reserve %"PRIu64" bytes: %s",
+				(uint64_t)OB_SLAB_REGION_MIN, strerror(errno));
+		return;
+	}
+
+	base = (char *)(((uintptr_t)map + OB_SLAB_SPAN_SIZE - 1) & ~((uintptr_t)OB_SLAB_SPAN_SIZE - 1));
+	if (base > map)
+		munmap(map, base - map);
+	if (base + size < map + size + OB_SLAB_SPAN_SIZE)
+		munmap(base + size, (map + size + OB_SLAB_SPAN_SIZE) - (base + size));
+
+	ob_slab_top = base;
+	ob_slab_stats.reserved = size;
+	/* OBSlabOwns() must never see a size without the base */
+	ob_slab_base = base;
+	hw_barrier();
+	ob_slab_size = size;
+}
+
+/**
+ *  \brief Get the calling thread a heap, adopting an orphan if there is
+ *         one
+ *
+ *  \retval the heap, NULL when the allocator is disabled
+ */
+static OBSlabHeap *OBSlabHeapGet(void)
+{
+	OBSlabHeap *heap;
+	void *mem;
+
+	pthread_once(&ob_slab_once, OBSlabSetup);
+	if (ob_slab_size == 0)
+		return NULL;
+
+	OBMutexLock(&ob_slab_lock);
+	if ((heap = ob_slab_orphans) != NULL) {
+		ob_slab_orphans = heap->next;
+		ob_slab_stats.adoptions++;
+	}
+	OBMutexUnlock(&ob_slab_lock);
+
+	if (heap == NULL)
+	{
+		if (posix_memalign(&mem, OB_CACHE_LINE_SIZE, sizeof(OBSlabHeap)) != 0)
+			return NULL;
+		heap = mem;
+		memset(heap, 0, sizeof(OBSlabHeap));
+
+		OBMutexLock(&ob_slab_lock);
+		ob_slab_stats.heaps++;
+		OBMutexUnlock(&ob_slab_lock);
+	}
+	heap->next = NULL;
+
+	pthread_setspecific(ob_slab_key, heap);
+	ob_slab_heap = heap;
+	return heap;
+}
+
+/**
+ *  \brief Refill from the other spans of the class, draining what other
+ *         threads freed, or from a new span
+ */
+static void *OBSlabAllocSlow(OBSlabHeap *heap, uint32_t cls)
+{
+	OBSlabSpan *span;
+
+	for (span = heap->spans[cls]; span != NULL; span = span->next)
+	{
+		OBSlabSpanDrain(span);
+		if (span->free != NULL || span->bump < span->end)
+		{
+			if (span != heap->spans[cls]) {
+				OBSlabListRemove(heap, span);
+				OBSlabListPush(heap, span);
+			}
+			return OBSlabSpanPop(span);
+		}
+	}
+
+	span = OBSlabSpanNew(heap, cls);
+	if (span == NULL)
+		return NULL;
+	OBSlabListPush(heap, span);
+	return OBSlabSpanPop(span);
+}
+
+/**
+ *  \brief Allocate size bytes, 16 byte aligned
+ *
+ *  Sizes up to OB_SLAB_MAX_SIZE come from the calling thread's heap,
+ *  bigger ones, or all of them if the region couldn't be reserved or is
+ *  used up, from malloc.
+ */
+void *OBSlabAlloc(size_t size)
+{
+	OBSlabHeap *heap = ob_slab_heap;
+	OBSlabSpan *span;
+	void *ptr;
+
+	if (unlikely(size > OB_SLAB_MAX_SIZE))
+		return malloc(size);
+	if (unlikely(heap == NULL) && (heap = OBSlabHeapGet()) == NULL)
+		return malloc(size);
+
+	span = heap->spans[ob_slab_class[(size + 15) >> 4]];
+	if (likely(span != NULL) && (span->free != NULL || span->bump < span->end))
+		return OBSlabSpanPop(span);
+
+	ptr = OBSlabAllocSlow(heap, ob_slab_class[(size + 15) >> 4]);
+	return ptr ? ptr : malloc(size);
+}
+
+void *OBSlabCalloc(size_t nmemb, size_t size)
+{
+	void *ptr;
+
+	if (size != 0 && nmemb > SIZE_MAX / size)
+		return NULL;
+	if (nmemb * size > OB_SLAB_MAX_SIZE)
+		return calloc(nmemb, size);
+
+	ptr = OBSlabAlloc(nmemb * size);
+	if (ptr != NULL)
+		memset(ptr, 0, nmemb * size);
+	return ptr;
+}
+
+/**
+ *  \brief Resize, staying in place while the size class still fits well
+ */
+void *OBSlabRealloc(void *ptr, size_t size)
+{
+	size_t old;
+	void *nptr;
+
+	if (ptr == NULL)
+		return OBSlabAlloc(size);
+	if (!OBSlabOwns(ptr))
+		return realloc(ptr, size);
+
+	old = OB_SLAB_SPAN_OF(ptr)->size;
+	if (size <= old && size > old / 2)
+		return ptr;
+
+	nptr = OBSlabAlloc(size);
+	if (nptr == NULL)
+		return NULL;
+	memcpy(nptr, ptr, size < old ? size : old);
+	OBSlabFree(ptr);
+	return nptr;
+}
+
+char *OBSlabStrdup(const char *astr)
+{
+	size_t len = strlen(astr) + 1;
+	char *ptr;
+
+	ptr = OBSlabAlloc(len);
+	if (ptr != NULL)
+		memcpy(ptr, astr, len);
+	return ptr;
+}
+
+/**
+ *  \brief Free memory from OBSlabAlloc() or malloc
+ *
+ *  The owner of the span links the object in its free list, other threads
+ *  push it on the span's remote list.
+ */
+void OBSlabFree(void *ptr)
+{
+	OBSlabHeap *heap = ob_slab_heap;
+	OBSlabSpan *span;
+	void *head;
+
+	if (!OBSlabOwns(ptr)) {
+		free(ptr);
+		return;
+	}
+
+	span = OB_SLAB_SPAN_OF(ptr);
+	if (likely(span->heap == heap))
+	{
+		*(void **)ptr = span->free;
+		span->free = ptr;
+		/* keep the span allocations come from, even empty */
+		if (--span->used == 0 && span != heap->spans[span->cls]) {
+			OBSlabListRemove(heap, span);
+			OBSlabSpanRelease(span);
+		}
+		return;
+	}
+
+	do {
+		head = OBAtomicLoadRelaxed(&span->remote);
+		*(void **)ptr = head;
+	} while (!OBAtomicCompareAndSwap(&span->remote, head, ptr));
+}
+
+size_t OBSlabUsableSize(void *ptr)
+{
+	if (ptr == NULL)
+		return 0;
+	if (!OBSlabOwns(ptr))
+		return malloc_usable_size(ptr);
+	return OB_SLAB_SPAN_OF(ptr)->size;
+}
+
+void OBSlabGetStats(OBSlabStats *stats)
+{
+	OBMutexLock(&ob_slab_lock);
+	*stats = ob_slab_stats;
+	OBMutexUnlock(&ob_slab_lock);
+}
+
+/*********** unittests ***********/
+
+static int OBSlabTest(void)
+{
+	static const size_t sizes[] = { 0, 1, 16, 17, 100, 128, 129, 1000, 2049, 4096, 4097 };
+	void *ptrs[sizeof(sizes) / sizeof(sizes[0])];
+	char *ptr, *grown;
+	size_t i, j;
+	int result = 0;
+
+	memset(ptrs, 0, sizeof(ptrs));
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+	{
+		ptrs[i] = OBSlabAlloc(sizes[i]);
+		if (ptrs[i] == NULL || ((uintptr_t)ptrs[i] & 15) != 0)
+			goto end;
+		if (OBSlabUsableSize(ptrs[i]) < sizes[i])
+			goto end;
+		memset(ptrs[i], (int)i, sizes[i]);
+	}
+	/* too big for a class */
+	if (OBSlabOwns(ptrs[10]) || (ob_slab_size != 0 && !OBSlabOwns(ptrs[9])))
+		goto end;
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+	{
+		for (j = 0; j < sizes[i]; j++) {
+			if (((unsigned char *)ptrs[i])[j] != i)
+				goto end;
+		}
+	}
+
+	/* the last freed comes back first */
+	ptr = ptrs[4];
+	OBSlabFree(ptr);
+	ptrs[4] = OBSlabAlloc(110);
+	if (ptrs[4] != ptr)
+		goto end;
+
+	/* dirty memory is cleared */
+	OBSlabFree(ptrs[4]);
+	ptrs[4] = OBSlabCalloc(10, 11);
+	if (ptrs[4] == NULL)
+		goto end;
+	for (j = 0; j < 110; j++) {
+		if (((char *)ptrs[4])[j] != 0)
+			goto end;
+	}
+
+	/* in place while the class fits, moved with the data otherwise */
+	memset(ptrs[4], 'a', 110);
+	if (OBSlabRealloc(ptrs[4], 100) != ptrs[4])
+		goto end;
+	grown = OBSlabRealloc(ptrs[4], 3000);
+	if (grown == NULL)
+		goto end;
+	ptrs[4] = grown;
+	for (j = 0; j < 100; j++) {
+		if (grown[j] != 'a')
+			goto end;
+	}
+
+	ptr = OBSlabStrdup("flow.memcap");
+	if (ptr == NULL || strcmp(ptr, "flow.memcap") != 0)
+		goto end;
+	OBSlabFree(ptr);
+
+	result = 1;
+end:
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		OBSlabFree(ptrs[i]);
+	}
+	return result;
+}
+
+#define OB_SLAB_TEST_OBJS   1000
+
+static void *OBSlabTestFreeThread(void *arg)
+{
+	void **ptrs = (void **)arg;
+	int i;
+
+	for (i = 0; i < OB_SLAB_TEST_OBJS; i++) {
+		OBSlabFree(ptrs[i]);
+	}
+	return NULL;
+}
+
+static void *OBSlabTestAllocThread(void *arg)
+{
+	void **ptrs = (void **)arg;
+	int i;
+
+	for (i = 0; i < OB_SLAB_TEST_OBJS; i++) {
+		ptrs[i] = OBSlabAlloc(64);
+	}
+	return NULL;
+}
+
+/**
+ * \test objects freed by other threads are reused by the owner, and the
+ *       heap of an exited thread by the next thread
+ */
+static int OBSlabTestRemote(void)
+{
+	static void *ptrs[OB_SLAB_TEST_OBJS];
+	OBSlabStats before, stats;
+	pthread_t tid;
+	void *first;
+	int i;
+
+	first = OBSlabAlloc(64);
+	if (first == NULL || !OBSlabOwns(first)) {
+		OBSlabFree(first);
+		return ob_slab_size == 0;
+	}
+	OBSlabFree(first);
+
+	/* frees from another thread go to the remote lists */
+	for (i = 0; i < OB_SLAB_TEST_OBJS; i++) {
+		if ((ptrs[i] = OBSlabAlloc(64)) == NULL)
+			return 0;
+	}
+	if (pthread_create(&tid, NULL, OBSlabTestFreeThread, ptrs) != 0)
+		return 0;
+	pthread_join(tid, NULL);
+
+	/* and are drained as we run out, without new spans */
+	OBSlabGetStats(&before);
+	for (i = 0; i < OB_SLAB_TEST_OBJS; i++) {
+		if ((ptrs[i] = OBSlabAlloc(64)) == NULL)
+			return 0;
+	}
+	OBSlabGetStats(&stats);
+	for (i = 0; i < OB_SLAB_TEST_OBJS; i++) {
+		OBSlabFree(ptrs[i]);
+	}
+	if (stats.spans - stats.spans_free > before.spans - before.spans_free)
+		return 0;
+
+	/* a thread exits with its objects still in use */
+	if (pthread_create(&tid, NULL, OBSlabTestAllocThread, ptrs) != 0)
+		return 0;
+	pthread_join(tid, NULL);
+	for (i = 0; i < OB_SLAB_TEST_OBJS; i++) {
+		if (ptrs[i] == NULL)
+			return 0;
+		OBSlabFree(ptrs[i]);
+	}
+
+	/* the next thread takes its heap over, objects included */
+	OBSlabGetStats(&before);
+	if (pthread_create(&tid, NULL, OBSlabTestAllocThread, ptrs) != 0)
+		return 0;
+	pthread_join(tid, NULL);
+	OBSlabGetStats(&stats);
+
+	for (i = 0; i < OB_SLAB_TEST_OBJS; i++) {
+		if (ptrs[i] == NULL)
+			return 0;
+		OBSlabFree(ptrs[i]);
+	}
+	if (stats.adoptions != before.adoptions + 1 || stats.heaps != before.heaps)
+		return 0;
+	if (stats.spans - stats.spans_free > before.spans - before.spans_free)
+		return 0;
+	return 1;
+}
+
+#define OB_SLAB_BENCH_THREADS   4
+#define OB_SLAB_BENCH_OPS       (1 << 20)
+#define OB_SLAB_BENCH_SLOTS     1024
+#define OB_SLAB_BENCH_XCHG      256
+
+typedef struct OBSlabBench_ {
+    void *(*Alloc)(size_t);
+    void (*Free)(void *);
+    void **xchg;                /**< objects handed between threads */
+    uint64_t seed;
+} OBSlabBench;
+
+/**
+ *  \brief Churn: free a random slot and fill it again with a random size,
+ *         one in eight objects is swapped with the other threads and freed
+ *         by whoever takes it
+ */
+static void *OBSlabBenchThread(void *arg)
+{
+	OBSlabBench *b = (OBSlabBench *)arg;
+	void *slots[OB_SLAB_BENCH_SLOTS];
+	uint64_t x = b->seed;
+	size_t size;
+	uint32_t i, r;
+	void *ptr;
+
+	memset(slots, 0, sizeof(slots));
+	for (i = 0; i < OB_SLAB_BENCH_OPS; i++)
+	{
+		x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+		r = (uint32_t)(x >> 32);
+
+		/* mostly small, like names and nodes */
+		if (r % 10 < 6)
+			size = 16 + (r >> 8) % 113;
+		else if (r % 10 < 9)
+			size = 128 + (r >> 8) % 897;
+		else
+			size = 1024 + (r >> 8) % 3073;
+
+		ptr = b->Alloc(size);
+		if (ptr == NULL)
+			continue;
+		*(char *)ptr = 1;
+
+		if ((r >> 4) % 8 == 0) {
+			/* release what we wrote to the thread freeing it, acquire what
+			 * the previous owner wrote */
+			ptr = OBAtomicExchangeAcqRel(&b->xchg[(r >> 16) % OB_SLAB_BENCH_XCHG], ptr);
+		} else {
+			void *old = slots[(r >> 16) % OB_SLAB_BENCH_SLOTS];
+			slots[(r >> 16) % OB_SLAB_BENCH_SLOTS] = ptr;
+			ptr = old;
+		}
+		if (ptr != NULL)
+			b->Free(ptr);
+	}
+
+	for (i = 0; i < OB_SLAB_BENCH_SLOTS; i++) {
+		if (slots[i] != NULL)
+			b->Free(slots[i]);
+	}
+	return NULL;
+}
+
+static double OBSlabBenchRun(void *(*Alloc)(size_t), void (*Free)(void *))
+{
+	OBSlabBench b[OB_SLAB_BENCH_THREADS];
+	pthread_t tids[OB_SLAB_BENCH_THREADS];
+	void *xchg[OB_SLAB_BENCH_XCHG];
+	struct timespec t0, t1;
+	int i, n = 0;
+
+	memset(xchg, 0, sizeof(xchg));
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < OB_SLAB_BENCH_THREADS; i++)
+	{
+		b[i].Alloc = Alloc;
+		b[i].Free = Free;
+		b[i].xchg = xchg;
+		b[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+		if (pthread_create(&tids[i], NULL, OBSlabBenchThread, &b[i]) != 0)
+			break;
+		n++;
+	}
+	for (i = 0; i < n; i++) {
+		pthread_join(tids[i], NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	for (i = 0; i < OB_SLAB_BENCH_XCHG; i++) {
+		if (xchg[i] != NULL)
+			Free(xchg[i]);
+	}
+
+	return ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) /
+		((double)OB_SLAB_BENCH_OPS * (n ? n : 1));
+}
+
+/**
+ * \brief Mixed size churn with cross thread frees, slab against glibc
+ */
+static int OBSlabBenchChurn(void)
+{
+	OBSlabStats stats;
+	double slab, libc;
+
+	libc = OBSlabBenchRun(malloc, free);
+	slab = OBSlabBenchRun(OBSlabAlloc, OBSlabFree);
+	OBSlabGetStats(&stats);
+
+	printf("\n    %d threads, %d ops each: glibc %.1f ns/op, slab %.1f ns/op\n",
+			OB_SLAB_BENCH_THREADS, OB_SLAB_BENCH_OPS, libc, slab);
+	printf("    slab: %"PRIu64" spans carved, %"PRIu64" free, %"PRIu64" heaps, %"PRIu64" adopted\n",
+			stats.spans, stats.spans_free, stats.heaps, stats.adoptions);
+	return 1;
+}
+
+void OBSlabRegisterTests(void)
+{
+	UtRegisterTest("OBSlabTest", OBSlabTest, 1);
+	UtRegisterTest("OBSlabTestRemote", OBSlabTestRemote, 1);
+	UtRegisterTest("OBSlabBenchChurn", OBSlabBenchChurn, 1);
+}
@@ -0,0 +1,61 @@
+#ifndef __UTIL_SLAB_H__
+#define __UTIL_SLAB_H__
+
+#include "util-mem.h"
+
+/* Size class allocator for small objects, the OBMalloc backend when built
+ * with -DOB_MEM_SLAB. Spans of one size class are carved out of a reserved
+ * address range and owned by a thread heap: the owner allocates and frees
+ * without atomics, other threads free through a lock-free queue per span
+ * the owner drains when it runs dry. Heaps of exited threads are adopted
+ * by the next thread that needs one. Bigger allocations go to malloc */
+#define OB_SLAB_MIN_SIZE            16
+#define OB_SLAB_MAX_SIZE            4096
+#define OB_SLAB_CLASSES             28
+#define OB_SLAB_SPAN_SIZE           (64 * 1024)
+#define OB_SLAB_REGION_SIZE         (16ULL << 30)   /**< address space reserved,
+                                                     *   touched as spans are used */
+
+/* span: OB_SLAB_SPAN_SIZE aligned, the header is followed by the objects */
+typedef struct OBSlabSpan_ {
+    struct OBSlabHeap_ *heap;   /**< owner, fixed while the span is in use */
+    uint32_t cls;
+    uint32_t size;              /**< object size */
+    uint32_t used;              /**< objects handed out, remote frees are
+                                 *   only counted once drained */
+    void *free;                 /**< owner's free list */
+    char *bump;                 /**< objects never handed out start here */
+    char *end;
+    struct OBSlabSpan_ *prev;   /**< in the heap's list of the class, or */
+    struct OBSlabSpan_ *next;   /**< the list of free spans */
+
+    void *remote OB_CACHE_ALIGNED;  /**< freed by other threads, pushed with
+                                     *   a CAS and taken all at once */
+} OBSlabSpan;
+
+/* heap: the spans of a thread, one list per class with the span being
+ * allocated from first */
+typedef struct OBSlabHeap_ {
+    OBSlabSpan *spans[OB_SLAB_CLASSES];
+    struct OBSlabHeap_ *next;   /**< in the orphan list */
+} OB_CACHE_ALIGNED OBSlabHeap;
+
+typedef struct OBSlabStats_ {
+    uint64_t reserved;          /**< bytes of address space reserved */
+    uint64_t spans;             /**< spans carved so far */
+    uint64_t spans_free;        /**< of those, free for reuse */
+    uint64_t heaps;             /**< heaps created */
+    uint64_t adoptions;         /**< heaps of exited threads taken over */
+} OBSlabStats;
+
+void *OBSlabAlloc(size_t size);
+void *OBSlabCalloc(size_t nmemb, size_t size);
+void *OBSlabRealloc(void *ptr, size_t size);
+char *OBSlabStrdup(const char *astr);
+void  OBSlabFree(void *ptr);
+size_t OBSlabUsableSize(void *ptr);
+void OBSlabGetStats(OBSlabStats *stats);
+
+void OBSlabRegisterTests(void);
+
+#endif
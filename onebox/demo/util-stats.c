@@ -0,0 +1,618 @@
+#include "onebox-common.h"
+#include "util-stats.h"
+#include "util-conf-node.h"
+#include "util-debug.h"
+#include "util-error.h"
+#include "util-mem.h"
+#include "util-path.h"
+#include "util-threads.h"
+#include "util-atomic.h"
+#include "util-affinity.h"
+#include "util-rcu.h"
+#include "tm-threads.h"
+#include "tm-modules.h"
+#include "util-unittest.h"
+
+#define STATS_TICK_US       100000  /**< the management thread checks its flags */
+#define STATS_LINE_LEN      256
+
+typedef struct StatsCounter_ {
+    char name[STATS_NAME_LEN];
+    StatsType type;
+} StatsCounter;
+
+typedef struct StatsSnapshot_ {
+    struct timespec ts;         /**< monotonic, for the rates */
+    time_t when;
+    uint32_t n;                 /**< counters, by gid */
+    uint64_t values[STATS_COUNTERS_MAX];
+} StatsSnapshot;
+
+/*********** vars ***********/
+/* counters by name, the thread contexts, and what the contexts that are
+ * gone counted */
+static StatsCounter stats_counters[STATS_COUNTERS_MAX];
+static uint32_t stats_ncounters = 0;
+static uint64_t stats_retired[STATS_COUNTERS_MAX];
+static StatsThreadCtx *stats_threads = NULL;
+static OBMutex stats_lock = OBMUTEX_INITIALIZER;
+
+/* the latest snapshot and the one before, taken before stats_lock */
+static StatsSnapshot stats_snaps[2];
+static uint64_t stats_nsnaps = 0;
+static OBMutex stats_snap_lock = OBMUTEX_INITIALIZER;
+
+/* stats section of the config */
+static int stats_enabled = 0;
+static uint32_t stats_interval = STATS_INTERVAL_DEFAULT;
+static char stats_filename[PATH_MAX] = STATS_FILENAME_DEFAULT;
+
+/*********** funcs ***********/
+/**
+ *  \brief Create the counter context of a thread, for the thread only
+ *
+ *  \retval the context or NULL on error
+ */
+StatsThreadCtx *StatsThreadCtxNew(const char *name)
+{
+	StatsThreadCtx *ctx;
+
+	ctx = OBCallocAligned(OB_CACHE_LINE_SIZE, 1, sizeof(StatsThreadCtx));
+	if (ctx == NULL)
+		return NULL;
+	strlcpy(ctx->name, name, sizeof(ctx->name));
+
+	OBMutexLock(&stats_lock);
+	ctx->next = stats_threads;
+	stats_threads = ctx;
+	OBMutexUnlock(&stats_lock);
+	return ctx;
+}
+
+/**
+ *  \brief Free a thread's counter context, what it counted stays in the
+ *         totals
+ */
+void StatsThreadCtxFree(StatsThreadCtx *ctx)
+{
+	StatsThreadCtx **pctx;
+	uint32_t i;
+
+	if (ctx == NULL)
+		return;
+
+	OBMutexLock(&stats_lock);
+	for (pctx = &stats_threads; *pctx != NULL; pctx = &(*pctx)->next)
+	{
+		if (*pctx == ctx) {
+			*pctx = ctx->next;
+			break;
+		}
+	}
+	for (i = 0; i < ctx->n; i++) {
+		if (stats_counters[ctx->gid[i]].type == STATS_TYPE_COUNTER)
+			stats_retired[ctx->gid[i]] += OBAtomicLoadRelaxed(&ctx->values[i]);
+	}
+	OBMutexUnlock(&stats_lock);
+
+	OBFreeAligned(ctx);
+}
+
+/**
+ *  \brief Register a counter of the thread, counters of the same name in
+ *         other threads add up to its total
+ *
+ *  \retval the id for StatsIncr() and the like, -1 on error
+ */
+int StatsRegisterCounter(StatsThreadCtx *ctx, const char *name, StatsType type)
+{
+	uint32_t gid, id;
+
+	if (strlen(name) >= STATS_NAME_LEN) {
+		OBLogError(OB_ERR_INVALID_ARGUMENT, "counter name %s is too long", name);
+		return -1;
+	}
+
+	OBMutexLock(&stats_lock);
+	for (gid = 0; gid < stats_ncounters; gid++) {
+		if (strcmp(stats_counters[gid].name, name) == 0)
+			break;
+	}
+	if (gid < stats_ncounters && stats_counters[gid].type != type) {
+		OBMutexUnlock(&stats_lock);
+		OBLogError(OB_ERR_INVALID_ARGUMENT, "counter %s is registered with another type", name);
+		return -1;
+	}
+
+	/* already one of ours */
+	for (id = 0; id < ctx->n; id++) {
+		if (ctx->gid[id] == gid) {
+			OBMutexUnlock(&stats_lock);
+			return id;
+		}
+	}
+
+	if (ctx->n == STATS_THREAD_COUNTERS_MAX ||
+		(gid == stats_ncounters && stats_ncounters == STATS_COUNTERS_MAX))
+	{
+		OBMutexUnlock(&stats_lock);
+		OBLogError(OB_ERR_INVALID_ARGUMENT, "%s: too many counters for %s", ctx->name, name);
+		return -1;
+	}
+	if (gid == stats_ncounters) {
+		strlcpy(stats_counters[gid].name, name, STATS_NAME_LEN);
+		stats_counters[gid].type = type;
+		stats_ncounters++;
+	}
+
+	id = ctx->n;
+	ctx->gid[id] = gid;
+	OBAtomicStoreRelaxed(&ctx->values[id], 0);
+	ctx->n = id + 1;
+	OBMutexUnlock(&stats_lock);
+	return id;
+}
+
+/**
+ *  \brief Sum the counters of all threads into a new snapshot, the
+ *         snapshot lock is held
+ */
+static void StatsSnapshotTakeLocked(void)
+{
+	StatsSnapshot *s = &stats_snaps[stats_nsnaps & 1];
+	StatsThreadCtx *ctx;
+	uint32_t i;
+
+	OBMutexLock(&stats_lock);
+	s->n = stats_ncounters;
+	for (i = 0; i < s->n; i++) {
+		s->values[i] = stats_retired[i];
+	}
+	for (ctx = stats_threads; ctx != NULL; ctx = ctx->next)
+	{
+		/* the owner's stores may be late, atomic so never torn */
+		for (i = 0; i < ctx->n; i++) {
+			s->values[ctx->gid[i]] += OBAtomicLoadRelaxed(&ctx->values[i]);
+		}
+	}
+	OBMutexUnlock(&stats_lock);
+
+	clock_gettime(CLOCK_MONOTONIC, &s->ts);
+	s->when = time(NULL);
+	stats_nsnaps++;
+}
+
+void StatsSnapshotTake(void)
+{
+	OBMutexLock(&stats_snap_lock);
+	StatsSnapshotTakeLocked();
+	OBMutexUnlock(&stats_snap_lock);
+}
+
+/**
+ *  \brief Total of a counter in the latest snapshot
+ *
+ *  \retval 0 on success, -1 if there is no such counter in it
+ */
+int StatsGetTotal(const char *name, uint64_t *total)
+{
+	StatsSnapshot *s;
+	uint32_t gid;
+	int ret = -1;
+
+	OBMutexLock(&stats_snap_lock);
+	if (stats_nsnaps > 0)
+	{
+		s = &stats_snaps[(stats_nsnaps - 1) & 1];
+		for (gid = 0; gid < s->n; gid++) {
+			if (strcmp(stats_counters[gid].name, name) == 0) {
+				*total = s->values[gid];
+				ret = 0;
+				break;
+			}
+		}
+	}
+	OBMutexUnlock(&stats_snap_lock);
+	return ret;
+}
+
+/**
+ *  \brief Print the latest snapshot line by line, with the delta and rate
+ *         of each counter since the snapshot before. One is taken if there
+ *         is none yet.
+ */
+void StatsPrint(void (*Print)(void *, const char *), void *ctx)
+{
+	StatsSnapshot *cur, *prev = NULL;
+	char line[STATS_LINE_LEN], date[64];
+	uint64_t delta;
+	double secs = 0;
+	uint32_t gid;
+	struct tm tm;
+
+	OBMutexLock(&stats_snap_lock);
+	if (stats_nsnaps == 0)
+		StatsSnapshotTakeLocked();
+	cur = &stats_snaps[(stats_nsnaps - 1) & 1];
+	if (stats_nsnaps > 1) {
+		prev = &stats_snaps[stats_nsnaps & 1];
+		secs = (cur->ts.tv_sec - prev->ts.tv_sec) + (cur->ts.tv_nsec - prev->ts.tv_nsec) / 1e9;
+	}
+
+	localtime_r(&cur->when, &tm);
+	strftime(date, sizeof(date), "%m/%d/%Y -- %H:%M:%S", &tm);
+	Print(ctx, "------------------------------------------------------------------------------------");
+	snprintf(line, sizeof(line), "Date: %s (interval: %.1f s)", date, secs);
+	Print(ctx, line);
+	Print(ctx, "------------------------------------------------------------------------------------");
+	snprintf(line, sizeof(line), "%-40s | %16s | %12s | %12s", "Counter", "Total", "Delta", "Rate/s");
+	Print(ctx, line);
+	Print(ctx, "------------------------------------------------------------------------------------");
+
+	for (gid = 0; gid < cur->n; gid++)
+	{
+		if (stats_counters[gid].type == STATS_TYPE_GAUGE) {
+			snprintf(line, sizeof(line), "%-40.*s | %16"PRIu64" | %12s | %12s",
+					STATS_NAME_LEN - 1, stats_counters[gid].name, cur->values[gid], "-", "-");
+		} else {
+			delta = cur->values[gid] - ((prev != NULL && gid < prev->n) ? prev->values[gid] : 0);
+			snprintf(line, sizeof(line), "%-40.*s | %16"PRIu64" | %12"PRIu64" | %12.1f",
+					STATS_NAME_LEN - 1, stats_counters[gid].name, cur->values[gid], delta,
+					secs > 0 ? delta / secs : 0.0);
+		}
+		Print(ctx, line);
+	}
+	OBMutexUnlock(&stats_snap_lock);
+}
+
+/**
+ *  \brief Read the stats section of the config:
+ *
+ *  stats:
+ *    enabled: yes
+ *    interval: 8           # seconds between snapshots
+ *    filename: stats.log   # relative to default-log-dir
+ *
+ *  \retval 0 on success, -1 on a broken setting
+ */
+int StatsSetupFromConfig(void)
+{
+	ConfNode *node, *dir;
+	intmax_t interval;
+	const char *name;
+	size_t len;
+
+	node = ConfGetNode("stats.enabled");
+	stats_enabled = node != NULL && node->val != NULL && ConfValIsTrue(node->val);
+
+	stats_interval = STATS_INTERVAL_DEFAULT;
+	if (ConfGetNode("stats.interval") != NULL)
+	{
+		if (ConfGetInt("stats.interval", &interval) != 1 || interval <= 0 || interval > 86400) {
+			OBLogError(OB_ERR_INVALID_ARGUMENT, "invalid stats.interval");
+			return -1;
+		}
+		stats_interval = (uint32_t)interval;
+	}
+
+	node = ConfGetNode("stats.filename");
+	name = (node != NULL && node->val != NULL) ? node->val : STATS_FILENAME_DEFAULT;
+	dir = ConfGetNode("default-log-dir");
+	if (PathIsRelative(name) && dir != NULL && dir->val != NULL)
+	{
+		/* default-log-dir may end with a / */
+		for (len = strlen(dir->val); len > 1 && dir->val[len - 1] == '/'; len--)
+			;
+		snprintf(stats_filename, sizeof(stats_filename), "%.*s/%s", (int)len, dir->val, name);
+	}
+	else
+		strlcpy(stats_filename, name, sizeof(stats_filename));
+	return 0;
+}
+
+static void StatsLogLine(void *ctx, const char *line)
+{
+	fprintf((FILE *)ctx, "%s\n", line);
+}
+
+static TmEcode StatsMgmtThreadInit(ThreadVars *tv, void *initdata, void **data)
+{
+	FILE *fp = fopen(stats_filename, "a");
+
+	/* the snapshots are still taken, for the cli */
+	if (fp == NULL) {
+		OBLogWarning(OB_ERR_INVALID_ARGUMENT, "%s: can't open %s, stats won't be logged: %s",
+				tv->name, stats_filename, strerror(errno));
+	}
+	*data = fp;
+	return TM_ECODE_OK;
+}
+
+static TmEcode StatsMgmtLoop(ThreadVars *tv, void *data)
+{
+	uint32_t ticks = 0;
+
+	while (!TmThreadsCheckFlag(tv, THV_KILL | THV_STOP))
+	{
+		OBRcuQuiescentState();
+		usleep(STATS_TICK_US);
+		if (++ticks < stats_interval * (1000000 / STATS_TICK_US))
+			continue;
+		ticks = 0;
+
+		StatsSnapshotTake();
+		if (data != NULL) {
+			StatsPrint(StatsLogLine, data);
+			fflush((FILE *)data);
+		}
+	}
+	return TM_ECODE_OK;
+}
+
+static TmEcode StatsMgmtThreadDeinit(ThreadVars *tv, void *data)
+{
+	/* the last word */
+	StatsSnapshotTake();
+	if (data != NULL) {
+		StatsPrint(StatsLogLine, data);
+		fclose((FILE *)data);
+	}
+	return TM_ECODE_OK;
+}
+
+static TmModule tmm_stats_mgmt = { "StatsMgmt", StatsMgmtThreadInit, NULL,
+	StatsMgmtLoop, StatsMgmtThreadDeinit, NULL };
+
+/**
+ *  \brief Create and spawn the thread logging the snapshots, if stats are
+ *         enabled. It runs on the management cpu set.
+ *
+ *  \retval 0 on success, -1 on error
+ */
+int StatsSpawnThreads(void)
+{
+	ThreadVars *tv;
+
+	if (!stats_enabled)
+		return 0;
+
+	if (TmModuleRegister(&tmm_stats_mgmt) < 0)
+		return -1;
+	tv = TmThreadCreate("OBStatsMgmt", "StatsMgmt", NULL, NULL, NULL);
+	if (tv == NULL)
+		return -1;
+	TmThreadSetCPUSetType(tv, MANAGEMENT_CPU_SET);
+	return TmThreadSpawn(tv);
+}
+
+/*********** unittests ***********/
+#define STATS_TEST_THREADS      4
+#define STATS_TEST_INCRS        (1 << 20)   /**< per thread */
+#define STATS_BENCH_INCRS       (1 << 22)   /**< all threads together */
+#define STATS_BENCH_THREADS     4
+
+typedef struct StatsTestLines_ {
+    char name[STATS_NAME_LEN];
+    uint64_t total;
+    uint64_t delta;
+    int found;
+} StatsTestLines;
+
+static void StatsTestLine(void *ctx, const char *line)
+{
+	StatsTestLines *l = (StatsTestLines *)ctx;
+	char name[STATS_NAME_LEN];
+	uint64_t total, delta;
+
+	if (sscanf(line, "%63s | %"SCNu64" | %"SCNu64, name, &total, &delta) == 3 &&
+		strcmp(name, l->name) == 0)
+	{
+		l->total = total;
+		l->delta = delta;
+		l->found = 1;
+	}
+}
+
+/**
+ * \test counters of the same name add up over threads, the totals keep
+ *       what freed contexts counted, deltas are since the last snapshot
+ */
+static int StatsTestAggregate(void)
+{
+	StatsThreadCtx *c1, *c2 = NULL;
+	StatsTestLines l;
+	int id1, id2, g;
+	uint64_t v;
+	int result = 0;
+
+	c1 = StatsThreadCtxNew("StatsTest1");
+	c2 = StatsThreadCtxNew("StatsTest2");
+	if (c1 == NULL || c2 == NULL)
+		goto end;
+
+	id1 = StatsRegisterCounter(c1, "stats.test.pkts", STATS_TYPE_COUNTER);
+	id2 = StatsRegisterCounter(c2, "stats.test.pkts", STATS_TYPE_COUNTER);
+	g = StatsRegisterCounter(c2, "stats.test.depth", STATS_TYPE_GAUGE);
+	if (id1 < 0 || id2 < 0 || g < 0)
+		goto end;
+	if (StatsRegisterCounter(c1, "stats.test.pkts", STATS_TYPE_COUNTER) != id1 ||
+		StatsRegisterCounter(c1, "stats.test.depth", STATS_TYPE_COUNTER) != -1)
+		goto end;
+
+	StatsIncr(c1, id1);
+	StatsIncr(c1, id1);
+	StatsIncr(c1, id1);
+	StatsAddUI64(c2, id2, 10);
+	StatsSetUI64(c2, g, 7);
+	StatsSnapshotTake();
+	if (StatsGetTotal("stats.test.pkts", &v) != 0 || v != 13)
+		goto end;
+	if (StatsGetTotal("stats.test.depth", &v) != 0 || v != 7)
+		goto end;
+	if (StatsGetTotal("stats.test.none", &v) != -1)
+		goto end;
+
+	StatsIncr(c1, id1);
+	StatsThreadCtxFree(c2);
+	c2 = NULL;
+	StatsSnapshotTake();
+	if (StatsGetTotal("stats.test.pkts", &v) != 0 || v != 14)
+		goto end;
+	if (StatsGetTotal("stats.test.depth", &v) != 0 || v != 0)
+		goto end;
+
+	memset(&l, 0, sizeof(l));
+	strlcpy(l.name, "stats.test.pkts", sizeof(l.name));
+	StatsPrint(StatsTestLine, &l);
+	if (!l.found || l.total != 14 || l.delta != 1)
+		goto end;
+
+	result = 1;
+end:
+	StatsThreadCtxFree(c1);
+	StatsThreadCtxFree(c2);
+	return result;
+}
+
+static void *StatsTestThread(void *arg)
+{
+	StatsThreadCtx *ctx = StatsThreadCtxNew("StatsTestMT");
+	uint32_t i;
+	int id;
+
+	if (ctx == NULL)
+		return NULL;
+	id = StatsRegisterCounter(ctx, "stats.test.mt", STATS_TYPE_COUNTER);
+	if (id >= 0)
+	{
+		for (i = 0; i < STATS_TEST_INCRS; i++) {
+			StatsIncr(ctx, id);
+			/* a store each time, as in a real packet loop */
+			cc_barrier();
+		}
+	}
+	StatsThreadCtxFree(ctx);
+	return NULL;
+}
+
+/**
+ * \test threads count while snapshots are taken, totals never go back
+ *       and end up exact
+ */
+static int StatsTestThreads(void)
+{
+	pthread_t tids[STATS_TEST_THREADS];
+	uint64_t v, last = 0, base = 0;
+	int started = 0, i;
+	int result = 1;
+
+	StatsSnapshotTake();
+	StatsGetTotal("stats.test.mt", &base);
+
+	for (i = 0; i < STATS_TEST_THREADS; i++) {
+		if (pthread_create(&tids[i], NULL, StatsTestThread, NULL) != 0)
+			break;
+		started++;
+	}
+	for (i = 0; i < 100; i++)
+	{
+		StatsSnapshotTake();
+		if (StatsGetTotal("stats.test.mt", &v) == 0) {
+			if (v < last)
+				result = 0;
+			last = v;
+		}
+		usleep(1000);
+	}
+	for (i = 0; i < started; i++) {
+		pthread_join(tids[i], NULL);
+	}
+
+	StatsSnapshotTake();
+	if (started != STATS_TEST_THREADS || StatsGetTotal("stats.test.mt", &v) != 0 ||
+		v - base != (uint64_t)STATS_TEST_INCRS * STATS_TEST_THREADS)
+		result = 0;
+	return result;
+}
+
+typedef struct StatsBench_ {
+    int type;                   /**< 0 one atomic counter, 1 sharded */
+    uint32_t n;
+    uint64_t *shared;
+} StatsBench;
+
+static void *StatsBenchThread(void *arg)
+{
+	StatsBench *b = (StatsBench *)arg;
+	StatsThreadCtx *ctx;
+	uint32_t i;
+	int id;
+
+	if (b->type == 0)
+	{
+		for (i = 0; i < b->n; i++) {
+			OBAtomicAddAndFetch(b->shared, 1);
+		}
+		return NULL;
+	}
+
+	if ((ctx = StatsThreadCtxNew("StatsBench")) == NULL)
+		return NULL;
+	if ((id = StatsRegisterCounter(ctx, "stats.bench.incr", STATS_TYPE_COUNTER)) >= 0)
+	{
+		for (i = 0; i < b->n; i++) {
+			StatsIncr(ctx, id);
+			cc_barrier();
+		}
+	}
+	StatsThreadCtxFree(ctx);
+	return NULL;
+}
+
+/**
+ * \brief ns per increment of one atomic counter shared by all threads
+ *        against a sharded counter, 1 to STATS_BENCH_THREADS threads
+ */
+static int StatsBenchIncr(void)
+{
+	static const char *names[] = { "atomic", "sharded" };
+	pthread_t tids[STATS_BENCH_THREADS];
+	uint64_t shared OB_CACHE_ALIGNED = 0;
+	struct timespec t0, t1;
+	int nthreads, type, i, started;
+	StatsBench b;
+
+	printf("\n");
+	for (nthreads = 1; nthreads <= STATS_BENCH_THREADS; nthreads <<= 1)
+	{
+		printf("    threads %d:", nthreads);
+		for (type = 0; type < 2; type++)
+		{
+			b.type = type;
+			b.n = STATS_BENCH_INCRS / nthreads;
+			b.shared = &shared;
+			started = 0;
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			for (i = 0; i < nthreads; i++) {
+				if (pthread_create(&tids[i], NULL, StatsBenchThread, &b) != 0)
+					break;
+				started++;
+			}
+			for (i = 0; i < started; i++) {
+				pthread_join(tids[i], NULL);
+			}
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			printf(" %s %5.2f ns/incr%s", names[type],
+					((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) /
+					((double)b.n * nthreads), type == 0 ? "," : "\n");
+		}
+	}
+	return 1;
+}
+
+void StatsRegisterTests(void)
+{
+	UtRegisterTest("StatsTestAggregate", StatsTestAggregate, 1);
+	UtRegisterTest("StatsTestThreads", StatsTestThreads, 1);
+	UtRegisterTest("StatsBenchIncr", StatsBenchIncr, 1);
+}
@@ -0,0 +1,65 @@
+#ifndef __UTIL_STATS_H__
+#define __UTIL_STATS_H__
+
+#include "util-threads.h"
+#include "util-mem.h"
+#include "util-atomic.h"
+
+/* Counters sharded per thread. A thread registers its counters in a
+ * StatsThreadCtx of its own and bumps them with relaxed atomic loads and
+ * stores, no locked instruction and no cache line shared with another
+ * writer. The management thread
+ * sums the counters of the same name over all threads into snapshots,
+ * logs them every stats.interval seconds with the delta and rate since
+ * the previous one, and the CLI shows the latest ("show counters"). */
+
+#define STATS_NAME_LEN              64
+#define STATS_COUNTERS_MAX          1024    /**< distinct names */
+#define STATS_THREAD_COUNTERS_MAX   128     /**< per thread */
+#define STATS_INTERVAL_DEFAULT      8       /**< seconds */
+#define STATS_FILENAME_DEFAULT      "stats.log"
+
+typedef enum {
+    STATS_TYPE_COUNTER,         /**< only goes up, has a delta and a rate */
+    STATS_TYPE_GAUGE,           /**< a level, StatsSetUI64() */
+} StatsType;
+
+typedef struct StatsThreadCtx_ {
+    char name[THREAD_NAME_LEN + 1];
+    uint32_t n;                 /**< counters registered */
+    uint16_t gid[STATS_THREAD_COUNTERS_MAX];    /**< of the name, per counter */
+    struct StatsThreadCtx_ *next;
+
+    /** only written by the owner thread, read by the snapshots */
+    uint64_t values[STATS_THREAD_COUNTERS_MAX] OB_CACHE_ALIGNED;
+} StatsThreadCtx;
+
+StatsThreadCtx *StatsThreadCtxNew(const char *name);
+void StatsThreadCtxFree(StatsThreadCtx *);
+int StatsRegisterCounter(StatsThreadCtx *, const char *name, StatsType type);
+
+void StatsSnapshotTake(void);
+int StatsGetTotal(const char *name, uint64_t *total);
+void StatsPrint(void (*Print)(void *, const char *), void *ctx);
+
+int StatsSetupFromConfig(void);
+int StatsSpawnThreads(void);
+
+void StatsRegisterTests(void);
+
+static inline void StatsIncr(StatsThreadCtx *ctx, int id)
+{
+    OBAtomicStoreRelaxed(&ctx->values[id], OBAtomicLoadRelaxed(&ctx->values[id]) + 1);
+}
+
+static inline void StatsAddUI64(StatsThreadCtx *ctx, int id, uint64_t x)
+{
+    OBAtomicStoreRelaxed(&ctx->values[id], OBAtomicLoadRelaxed(&ctx->values[id]) + x);
+}
+
+static inline void StatsSetUI64(StatsThreadCtx *ctx, int id, uint64_t x)
+{
+    OBAtomicStoreRelaxed(&ctx->values[id], x);
+}
+
+#endif
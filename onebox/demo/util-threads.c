@@ -1,38 +1,388 @@
 #include "onebox-common.h"
 #include "util-threads.h"
+#include "util-atomic.h"
+#include "util-cpu.h"
+#include "util-unittest.h"
+#include <linux/futex.h>
 
-#if 0
-void ob_spinlock(ngx_atomic_t *lock, ngx_atomic_int_t value, ngx_uint_t spin)
+#define OB_LOCK_SPIN_MAX    (OB_LOCK_SPIN * 16) /**< pauses before a queued waiter yields */
+#define OB_TICKET_PAUSE     16                  /**< pauses per ticket ahead of ours */
+
+/*********** vars ***********/
+/* spinning only helps when the holder runs on another cpu meanwhile */
+static int ob_lock_spin = -1;
+
+/*********** funcs ***********/
+static inline int OBLockCanSpin(void)
 {
-    ngx_uint_t  i, n;
+	int spin = OBAtomicLoadRelaxed(&ob_lock_spin);
 
-    for ( ;; ) {
+	/* racing threads all store the same */
+	if (spin == -1) {
+		spin = UtilCpuGetNumProcessorsOnline() > 1;
+		OBAtomicStoreRelaxed(&ob_lock_spin, spin);
+	}
+	return spin;
+}
 
-        if (*lock == 0 && ngx_atomic_cmp_set(lock, 0, value)) {
-            return;
-        }
+static inline void OBLockPause(uint32_t n)
+{
+	uint32_t i;
 
-        if (ngx_ncpu > 1) {
+	for (i = 0; i < n; i++) {
+		ob_cpu_pause();
+	}
+}
 
-            for (n = 1; n < spin; n <<= 1) {
+/**
+ *  \brief Back off for n pauses while queued behind other lock holders,
+ *         yield the cpu instead when spinning can't help or went on for
+ *         too long, the holder may be preempted
+ *
+ *  \retval the pauses spun since the last yield
+ */
+static uint32_t OBLockBackoff(uint32_t spun, uint32_t n)
+{
+	if (!OBLockCanSpin() || spun >= OB_LOCK_SPIN_MAX) {
+		sched_yield();
+		return 0;
+	}
+	OBLockPause(n);
+	return spun + n;
+}
 
-                for (i = 0; i < n; i++) {
-                    ngx_cpu_pause();
-                }
+/**
+ *  \brief Sleep while *addr is val, or until woken
+ */
+void OBFutexWait(uint32_t *addr, uint32_t val)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
 
-                if (*lock == 0 && ngx_atomic_cmp_set(lock, 0, value)) {
-                    return;
-                }
-            }
-        }
+/**
+ *  \brief Wake up to n threads sleeping on addr
+ */
+void OBFutexWake(uint32_t *addr, int n)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+/**
+ *  \brief Contended OBLockLock(): spin rounds of 1, 2, 4 .. OB_LOCK_SPIN
+ *         pauses trying the lock between them, then sleep on it
+ */
+void OBLockLockSlow(OBLock *l)
+{
+	uint32_t n;
 
-        ngx_sched_yield();
-    }
+	if (OBLockCanSpin()) {
+		for (n = 1; n <= OB_LOCK_SPIN; n <<= 1) {
+			OBLockPause(n);
+			if (OBAtomicLoadRelaxed(&l->state) == 0 &&
+				OBAtomicCompareAndSwap(&l->state, 0, 1))
+				return;
+		}
+	}
+
+	/* taken as 2 from here on, even when it turns out free, as other
+	 * sleepers may be left that the next unlock must wake */
+	while (OBAtomicExchange(&l->state, 2) != 0) {
+		OBFutexWait(&l->state, 2);
+	}
+}
+
+/**
+ *  \brief OBLockUnlock() found sleepers: release the lock and wake one
+ */
+void OBLockWake(OBLock *l)
+{
+	OBAtomicStoreRelease(&l->state, 0);
+	OBFutexWake(&l->state, 1);
+}
+
+/**
+ *  \brief Wait for our ticket to be served, backing off for as long as the
+ *         holders ahead of us should take
+ */
+void OBTicketLockWait(OBTicketLock *l, uint32_t ticket)
+{
+	uint32_t owner, spun = 0;
+
+	while ((owner = OBAtomicLoadAcquire(&l->owner)) != ticket) {
+		spun = OBLockBackoff(spun, (ticket - owner) * OB_TICKET_PAUSE);
+	}
+}
+
+/**
+ *  \brief Wait for the node ahead of ours to hand over the lock
+ */
+void OBMCSLockWait(OBMCSNode *me)
+{
+	uint32_t spun = 0;
+
+	while (OBAtomicLoadAcquire(&me->locked)) {
+		spun = OBLockBackoff(spun, 1);
+	}
+}
+
+/**
+ *  \brief Wait for the locker that queued up behind our node to link itself
+ *
+ *  \retval the next node
+ */
+OBMCSNode *OBMCSLockWaitNext(OBMCSNode *me)
+{
+	OBMCSNode *next;
+	uint32_t spun = 0;
+
+	while ((next = OBAtomicLoadAcquire(&me->next)) == NULL) {
+		spun = OBLockBackoff(spun, 1);
+	}
+	return next;
 }
-#endif
 
 int UtilThreadTest(void)
 {
 	printf("UtilThreadTest\r\n");
 	return 0;
 }
+
+/*********** unittests ***********/
+#define LOCK_TEST_THREADS       4
+#define LOCK_TEST_OPS           (1 << 16)   /**< per thread */
+#define LOCK_BENCH_OPS          (1 << 20)   /**< all threads together */
+#define LOCK_BENCH_THREADS_MAX  16
+
+enum {
+    LOCK_TYPE_MUTEX,
+    LOCK_TYPE_SPIN,
+    LOCK_TYPE_ADAPTIVE,
+    LOCK_TYPE_TICKET,
+    LOCK_TYPE_MCS,
+    LOCK_TYPE_MAX,
+};
+
+static const char *lock_type_names[LOCK_TYPE_MAX] = {
+    "mutex", "spin", "adaptive", "ticket", "mcs",
+};
+
+typedef struct LockTest_ {
+    int type;
+    uint32_t ops;               /**< per thread */
+
+    OBMutex mutex;
+    OBSpinlock spin;
+    OBLock lock;
+    OBTicketLock ticket;
+    OBMCSLock mcs;
+
+    uint64_t counter OB_CACHE_ALIGNED;  /**< only changed under the lock */
+} LockTest;
+
+static void LockTestLock(LockTest *t, OBMCSNode *node)
+{
+	switch (t->type) {
+		case LOCK_TYPE_MUTEX:
+			OBMutexLock(&t->mutex);
+			break;
+		case LOCK_TYPE_SPIN:
+			OBSpinLock(&t->spin);
+			break;
+		case LOCK_TYPE_ADAPTIVE:
+			OBLockLock(&t->lock);
+			break;
+		case LOCK_TYPE_TICKET:
+			OBTicketLockLock(&t->ticket);
+			break;
+		default:
+			OBMCSLockLock(&t->mcs, node);
+			break;
+	}
+}
+
+static void LockTestUnlock(LockTest *t, OBMCSNode *node)
+{
+	switch (t->type) {
+		case LOCK_TYPE_MUTEX:
+			OBMutexUnlock(&t->mutex);
+			break;
+		case LOCK_TYPE_SPIN:
+			OBSpinUnlock(&t->spin);
+			break;
+		case LOCK_TYPE_ADAPTIVE:
+			OBLockUnlock(&t->lock);
+			break;
+		case LOCK_TYPE_TICKET:
+			OBTicketLockUnlock(&t->ticket);
+			break;
+		default:
+			OBMCSLockUnlock(&t->mcs, node);
+			break;
+	}
+}
+
+static void *LockTestThread(void *arg)
+{
+	LockTest *t = (LockTest *)arg;
+	OBMCSNode node;
+	uint32_t i;
+
+	for (i = 0; i < t->ops; i++) {
+		LockTestLock(t, &node);
+		/* a read and a write the lock must keep apart from the others */
+		*(volatile uint64_t *)&t->counter = *(volatile uint64_t *)&t->counter + 1;
+		LockTestUnlock(t, &node);
+	}
+	return NULL;
+}
+
+static void LockTestInit(LockTest *t, int type, uint32_t ops)
+{
+	memset(t, 0, sizeof(LockTest));
+	t->type = type;
+	t->ops = ops;
+	OBMutexInit(&t->mutex, NULL);
+	OBSpinInit(&t->spin, 0);
+	OBLockInit(&t->lock);
+	OBTicketLockInit(&t->ticket);
+	OBMCSLockInit(&t->mcs);
+}
+
+static void LockTestDeinit(LockTest *t)
+{
+	OBMutexDestroy(&t->mutex);
+	OBSpinDestroy(&t->spin);
+}
+
+/**
+ *  \brief Run nthreads threads of LockTestThread()
+ *
+ *  \retval ns per lock/unlock pair, < 0 if not every thread could start
+ */
+static double LockTestRun(LockTest *t, int nthreads)
+{
+	pthread_t tids[LOCK_BENCH_THREADS_MAX];
+	struct timespec t0, t1;
+	int i, started = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&tids[i], NULL, LockTestThread, t) != 0)
+			break;
+		started++;
+	}
+	for (i = 0; i < started; i++) {
+		pthread_join(tids[i], NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	if (started != nthreads)
+		return -1;
+	return ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) /
+		((double)t->ops * nthreads);
+}
+
+/**
+ * \test trylock on a free and a held lock of every kind
+ */
+static int UtilThreadsTestTrylock(void)
+{
+	OBLock lock = OBLOCK_INITIALIZER;
+	OBTicketLock ticket = OBTICKETLOCK_INITIALIZER;
+	OBMCSLock mcs = OBMCSLOCK_INITIALIZER;
+	OBMCSNode n1, n2;
+
+	if (OBLockTrylock(&lock) != 0 || OBLockTrylock(&lock) != EBUSY)
+		return 0;
+	OBLockUnlock(&lock);
+	if (lock.state != 0 || OBLockTrylock(&lock) != 0)
+		return 0;
+	OBLockUnlock(&lock);
+
+	if (OBTicketLockTrylock(&ticket) != 0 || OBTicketLockTrylock(&ticket) != EBUSY)
+		return 0;
+	OBTicketLockUnlock(&ticket);
+	OBTicketLockLock(&ticket);
+	if (OBTicketLockTrylock(&ticket) != EBUSY)
+		return 0;
+	OBTicketLockUnlock(&ticket);
+	if (ticket.next != 2 || ticket.owner != 2)
+		return 0;
+
+	if (OBMCSLockTrylock(&mcs, &n1) != 0 || OBMCSLockTrylock(&mcs, &n2) != EBUSY)
+		return 0;
+	OBMCSLockUnlock(&mcs, &n1);
+	OBMCSLockLock(&mcs, &n2);
+	if (OBMCSLockTrylock(&mcs, &n1) != EBUSY)
+		return 0;
+	OBMCSLockUnlock(&mcs, &n2);
+	if (mcs.tail != NULL)
+		return 0;
+	return 1;
+}
+
+/**
+ * \test threads incrementing a counter under each kind of lock lose none
+ *       of the increments
+ */
+static int UtilThreadsTestLocks(void)
+{
+	LockTest t;
+	int type, result = 1;
+
+	for (type = 0; type < LOCK_TYPE_MAX; type++) {
+		LockTestInit(&t, type, LOCK_TEST_OPS);
+		if (LockTestRun(&t, LOCK_TEST_THREADS) < 0 ||
+			t.counter != (uint64_t)LOCK_TEST_OPS * LOCK_TEST_THREADS)
+		{
+			printf("%s: counter %"PRIu64" ", lock_type_names[type], t.counter);
+			result = 0;
+		}
+		/* the last unlock left no sleeper behind */
+		if (t.lock.state != 0 || t.mcs.tail != NULL || t.ticket.next != t.ticket.owner)
+			result = 0;
+		LockTestDeinit(&t);
+	}
+	return result;
+}
+
+/**
+ * \brief ns per lock/unlock pair of a short critical section, 1 thread up
+ *        to twice the cpus, mutex and spinlock against the adaptive,
+ *        ticket and MCS locks
+ */
+static int UtilThreadsBenchLocks(void)
+{
+	int nthreads, max, type;
+	LockTest t;
+
+	max = 2 * UtilCpuGetNumProcessorsOnline();
+	if (max < 4)
+		max = 4;
+	if (max > LOCK_BENCH_THREADS_MAX)
+		max = LOCK_BENCH_THREADS_MAX;
+
+	printf("\n    threads");
+	for (type = 0; type < LOCK_TYPE_MAX; type++) {
+		printf(" %9s", lock_type_names[type]);
+	}
+	printf("\n");
+	for (nthreads = 1; nthreads <= max; nthreads <<= 1)
+	{
+		printf("    %7d", nthreads);
+		for (type = 0; type < LOCK_TYPE_MAX; type++) {
+			LockTestInit(&t, type, LOCK_BENCH_OPS / nthreads);
+			printf(" %6.1f ns", LockTestRun(&t, nthreads));
+			LockTestDeinit(&t);
+		}
+		printf("\n");
+	}
+	return 1;
+}
+
+void UtilThreadsRegisterTests(void)
+{
+	UtRegisterTest("UtilThreadsTestTrylock", UtilThreadsTestTrylock, 1);
+	UtRegisterTest("UtilThreadsTestLocks", UtilThreadsTestLocks, 1);
+	UtRegisterTest("UtilThreadsBenchLocks", UtilThreadsBenchLocks, 1);
+}
@@ -3,6 +3,8 @@
 
 #include <sys/syscall.h>
 #include <sys/prctl.h>
+#include "util-atomic.h"
+#include "util-mem.h"
 #define THREAD_NAME_LEN 16
 
 enum {
@@ -64,6 +66,146 @@ enum {
 #define OBSpinInit(spin, spin_attr)  pthread_spin_init(spin, spin_attr)
 #define OBSpinDestroy(spin)          pthread_spin_destroy(spin)
 
+/* adaptive lock: spins with an exponential ob_cpu_pause() backoff of at
+ * most OB_LOCK_SPIN pauses a round, then parks on a futex. state is 0 when
+ * free, 1 when held and 2 when held with sleepers, only then does the
+ * unlock make the syscall to wake one. The spinning is skipped on a single
+ * cpu where the holder can't run meanwhile. */
+typedef struct OBLock_ {
+    uint32_t state;
+} OBLock;
+
+#define OBLOCK_INITIALIZER          { 0 }
+#define OB_LOCK_SPIN                1024
+
+/* ticket lock: fair, waiters get the lock in arrival order and back off in
+ * proportion to their place in line. All of them poll the same line. */
+typedef struct OBTicketLock_ {
+    uint32_t next;              /**< next ticket handed out */
+    uint32_t owner;             /**< ticket holding the lock */
+} OBTicketLock;
+
+#define OBTICKETLOCK_INITIALIZER    { 0, 0 }
+
+/* MCS queue lock: fair and every waiter spins on its own node, so a
+ * release only touches the cache line of the next in line. The node of a
+ * lock/unlock pair must be the same and live until the unlock returns. */
+typedef struct OBMCSNode_ {
+    struct OBMCSNode_ *next;
+    uint32_t locked;
+} OB_CACHE_ALIGNED OBMCSNode;
+
+typedef struct OBMCSLock_ {
+    OBMCSNode *tail;            /**< last in line, NULL when free */
+} OBMCSLock;
+
+#define OBMCSLOCK_INITIALIZER       { NULL }
+
+void OBFutexWait(uint32_t *addr, uint32_t val);
+void OBFutexWake(uint32_t *addr, int n);
+void OBLockLockSlow(OBLock *);
+void OBLockWake(OBLock *);
+void OBTicketLockWait(OBTicketLock *, uint32_t ticket);
+void OBMCSLockWait(OBMCSNode *);
+OBMCSNode *OBMCSLockWaitNext(OBMCSNode *);
+
+static inline void OBLockInit(OBLock *l)
+{
+    l->state = 0;
+}
+
+/**
+ *  \retval 0 when the lock was taken, EBUSY when it is held
+ */
+static inline int OBLockTrylock(OBLock *l)
+{
+    return OBAtomicCompareAndSwap(&l->state, 0, 1) ? 0 : EBUSY;
+}
+
+static inline void OBLockLock(OBLock *l)
+{
+    if (!OBAtomicCompareAndSwap(&l->state, 0, 1))
+        OBLockLockSlow(l);
+}
+
+static inline void OBLockUnlock(OBLock *l)
+{
+    if (OBAtomicFetchAndSub(&l->state, 1) != 1)
+        OBLockWake(l);
+}
+
+static inline void OBTicketLockInit(OBTicketLock *l)
+{
+    l->next = l->owner = 0;
+}
+
+/**
+ *  \retval 0 when the lock was taken, EBUSY when it is held
+ */
+static inline int OBTicketLockTrylock(OBTicketLock *l)
+{
+    uint32_t owner = OBAtomicLoadRelaxed(&l->owner);
+
+    return OBAtomicCompareAndSwap(&l->next, owner, owner + 1) ? 0 : EBUSY;
+}
+
+static inline void OBTicketLockLock(OBTicketLock *l)
+{
+    uint32_t ticket = OBAtomicFetchAndAdd(&l->next, 1);
+
+    if (OBAtomicLoadAcquire(&l->owner) != ticket)
+        OBTicketLockWait(l, ticket);
+}
+
+static inline void OBTicketLockUnlock(OBTicketLock *l)
+{
+    OBAtomicStoreRelease(&l->owner, l->owner + 1);
+}
+
+static inline void OBMCSLockInit(OBMCSLock *l)
+{
+    l->tail = NULL;
+}
+
+/**
+ *  \retval 0 when the lock was taken, EBUSY when it is held
+ */
+static inline int OBMCSLockTrylock(OBMCSLock *l, OBMCSNode *me)
+{
+    OBAtomicStoreRelaxed(&me->next, NULL);
+    OBAtomicStoreRelaxed(&me->locked, 0);
+    return OBAtomicCompareAndSwap(&l->tail, NULL, me) ? 0 : EBUSY;
+}
+
+static inline void OBMCSLockLock(OBMCSLock *l, OBMCSNode *me)
+{
+    OBMCSNode *prev;
+
+    /* atomic, our successor links itself through next */
+    OBAtomicStoreRelaxed(&me->next, NULL);
+    OBAtomicStoreRelaxed(&me->locked, 1);
+    /* release: the node is set up before a successor links to it */
+    prev = OBAtomicExchangeAcqRel(&l->tail, me);
+    if (prev != NULL) {
+        /* release: the node is set up before the holder can hand over */
+        OBAtomicStoreRelease(&prev->next, me);
+        OBMCSLockWait(me);
+    }
+}
+
+static inline void OBMCSLockUnlock(OBMCSLock *l, OBMCSNode *me)
+{
+    OBMCSNode *next = OBAtomicLoadAcquire(&me->next);
+
+    if (next == NULL) {
+        if (OBAtomicCompareAndSwap(&l->tail, me, NULL))
+            return;
+        /* a locker swapped tail but didn't link itself yet */
+        next = OBMCSLockWaitNext(me);
+    }
+    OBAtomicStoreRelease(&next->locked, 0);
+}
+
 /** Get the Current Thread Id */
 #define OBGetThreadIdLong(...) ({ \
    pid_t tmpthid; \
@@ -77,12 +219,14 @@ enum {
  */
 #define OBSetThreadName(n) ({ \
     char tname[THREAD_NAME_LEN + 1] = ""; \
-    if (strlen(n) > THREAD_NAME_LEN) \
+    if (strlen(n) > THREAD_NAME_LEN) { \
         OBLogDebug("Thread name is too long, truncating it..."); \
+    } \
     strlcpy(tname, n, THREAD_NAME_LEN); \
     int ret = 0; \
-    if ((ret = prctl(PR_SET_NAME, tname, 0, 0, 0)) < 0) \
+    if ((ret = prctl(PR_SET_NAME, tname, 0, 0, 0)) < 0) { \
         OBLogDebug("Error setting thread name \"%s\": %s", tname, strerror(errno)); \
+    } \
     ret; \
 })
 
@@ -90,4 +234,5 @@ enum {
 #define OBSchedYield() sched_yield(void)
 
 int UtilThreadTest(void);
+void UtilThreadsRegisterTests(void);
 #endif
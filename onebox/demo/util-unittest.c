@@ -70,6 +70,138 @@ void UtRegisterTest(char *name, int(*TestFn)(void), int evalue)
     UtAppendTest(&ut_list, ut);
 }
 
+/**
+ * \brief Run all registered unit tests
+ *
+ * \retval number of tests that failed
+ */
+
+int UtRunTests(void) 
+{
+    UtTest *ut;
+    uint32_t good = 0, bad = 0;
+
+    for (ut = ut_list; ut != NULL; ut = ut->next) {
+        printf("Test %-60.60s : ", ut->name);
+        fflush(stdout);
+
+        int ret = ut->TestFn();
+        if (ret == ut->evalue) {
+            printf("pass\n");
+            good++;
+        } else {
+            printf("FAILED\n");
+            bad++;
+        }
+    }
+
+    printf("==== TEST RESULTS ====\n");
+    printf("PASSED: %" PRIu32 "\n", good);
+    printf("FAILED: %" PRIu32 "\n", bad);
+    printf("======================\n");
+
+    return bad;
+}
+
+/**
+ * \brief Run a test once under the fault injection settings
+ *
+ * \retval number of allocations made to fail
+ */
+
+static uint64_t UtRunTestFaults(UtTest *ut, uint32_t every, uint32_t rate, uint32_t seed,
+        uint32_t *passed, uint32_t *leaks, int64_t *leaked)
+{
+    OBMemStats before, after;
+    uint64_t calls, injected;
+    int64_t bytes = 0;
+    int ret, i;
+
+    OBMemGetStats(&before);
+    OBMemFaultSet(every, rate, seed);
+    ret = ut->TestFn();
+    OBMemFaultGet(&calls, &injected);
+    OBMemFaultSet(0, 0, 0);
+    OBMemGetStats(&after);
+
+    if (ret == ut->evalue)
+        (*passed)++;
+
+    /* all zero unless built with OB_MEM_ACCOUNTING */
+    for (i = 0; i < OB_MEM_TAG_MAX; i++) {
+        bytes += after.bytes[i] - before.bytes[i];
+    }
+    if (bytes != 0) {
+        (*leaks)++;
+        *leaked += bytes;
+    }
+
+    return injected;
+}
+
+/**
+ * \brief Rerun the registered tests with allocations failing
+ *
+ * Each test runs with every allocation failing, then every 2nd, 3rd... up
+ * to every_max or until a run has nothing left to fail, then under seeds
+ * runs failing UT_FAULT_RATE of the allocations at random. Tests may fail
+ * but must not crash. Benchmarks, "Bench" in the name, are skipped. With
+ * OB_MEM_ACCOUNTING, memory left allocated by a run is reported as leaked.
+ *
+ * \retval number of tests that leaked, -1 when not built with
+ *         OB_MEM_FAULT_INJECTION
+ */
+
+int UtRunTestsFaults(uint32_t every_max, uint32_t seeds)
+{
+    UtTest *ut;
+    uint32_t every, seed, runs, passed, leaks, bad = 0;
+    uint64_t injected;
+    int64_t leaked;
+
+    if (OBMemFaultSet(0, 0, 0) != 0) {
+        printf("fault injection is disabled, build with -DOB_MEM_FAULT_INJECTION\n");
+        return -1;
+    }
+
+    for (ut = ut_list; ut != NULL; ut = ut->next) {
+        if (strstr(ut->name, "Bench") != NULL)
+            continue;
+
+        printf("Faults %-58.58s : ", ut->name);
+        fflush(stdout);
+
+        runs = passed = leaks = 0;
+        injected = 0;
+        leaked = 0;
+        for (every = 1; every <= every_max; every++) {
+            uint64_t n = UtRunTestFaults(ut, every, 0, 0, &passed, &leaks, &leaked);
+            runs++;
+            injected += n;
+            if (n == 0)
+                break;
+        }
+        for (seed = 1; seed <= seeds; seed++) {
+            injected += UtRunTestFaults(ut, 0, UT_FAULT_RATE, seed, &passed, &leaks, &leaked);
+            runs++;
+        }
+
+        printf("%" PRIu32 " runs, %" PRIu64 " faults, %" PRIu32 " passed", runs, injected, passed);
+        if (leaks) {
+            printf(", LEAKED %" PRId64 " bytes in %" PRIu32 " runs\n", leaked, leaks);
+            bad++;
+        } else {
+            printf("\n");
+        }
+    }
+
+    printf("==== FAULT INJECTION RESULTS ====\n");
+    printf("LEAKED: %" PRIu32 "\n", bad);
+    printf("=================================\n");
+
+    return bad;
+}
+
 /**
  * \brief Initialize unit test list
  */
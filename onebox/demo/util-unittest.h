@@ -9,4 +9,16 @@ typedef struct UtTest_ {
     struct UtTest_ *next;
 } UtTest;
 
+void UtRegisterTest(char *name, int(*TestFn)(void), int evalue);
+int UtRunTests(void);
+
+/* fault injection runs, see UtRunTestsFaults() */
+#define UT_FAULT_EVERY_MAX  64
+#define UT_FAULT_SEEDS      16
+#define UT_FAULT_RATE       100000      /**< 10% of the allocations */
+
+int UtRunTestsFaults(uint32_t every_max, uint32_t seeds);
+void UtInitialize(void);
+void UtCleanup(void);
+
 #endif